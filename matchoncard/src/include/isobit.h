@@ -80,6 +80,10 @@ typedef struct biometric_info_template BIT;
 int
 read_bit(FILE *fp, BIT *bit);
 
+/*
+ * scan_bit() decodes the BIT at the current position of the BDB in one
+ * pass, checking that the required data objects are present.
+ */
 int
 scan_bit(BDB *bdb, BIT *bit);
 
@@ -48,7 +48,18 @@
 int
 get_bit_from_tlv(BIT *bit, TLV *tlv);
 
-/* XXX Implement only when needed... */
+/******************************************************************************/
+/* Convert a Biometric Information Template to a Tag-Length-Value record, by  */
+/* encoding the BIT with push_bit() and scanning the encoded bytes.           */
+/*                                                                            */
+/* Parameters:                                                                */
+/*   tlv    Pointer to the output tlv structure, allocated with new_tlv().    */
+/*   bit    Pointer to the input bit structure.                               */
+/*                                                                            */
+/* Returns:                                                                   */
+/*        0     Success                                                       */
+/*        -1    Failure                                                       */
+/******************************************************************************/
 int
 get_tlv_from_bit(TLV *tlv, BIT *bit);
 
@@ -63,11 +74,31 @@ get_tlv_from_bit(TLV *tlv, BIT *bit);
 /*               BITs found in the BIT group. Valid values are 1 and 2.       */
 /*                                                                            */
 /* Returns:                                                                   */
-/*        0     Success                                                       */
-/*       -1     Failure                                                       */
+/*   READ_OK     Success                                                      */
+/*   READ_ERROR  Failure                                                      */
+/******************************************************************************/
+int
+get_bits_from_tlv(BIT **bits, TLV *bit_group, int *bit_count);
+
+/******************************************************************************/
+/* Decode the BITs of a BIT group straight from its encoded bytes, in one     */
+/* pass, without building a TLV. Each BIT must have the required data         */
+/* objects, none of them repeated, with values of the correct lengths.        */
+/*                                                                            */
+/* Parameters:                                                                */
+/*   bdb         Pointer to the biometric data block containing the encoded   */
+/*               BIT group, at its current position.                          */
+/*   bits        Pointer to an array of two BIT structures, supplied by the   */
+/*               caller; only the first is set when the group has one BIT.    */
+/*   bit_count   Pointer to an integer that will be set to the number of      */
+/*               BITs found in the BIT group. Valid values are 1 and 2.       */
+/*                                                                            */
+/* Returns:                                                                   */
+/*   READ_OK     Success                                                      */
+/*   READ_ERROR  Failure                                                      */
 /******************************************************************************/
 int
-get_bits_from_group(BIT **bits, TLV *bit_group, int *bit_count);
+scan_bit_group(BDB *bdb, BIT *bits, int *bit_count);
 
 /******************************************************************************/
 /* Print a Biometric Information Template, in human-readable form, to the     */
@@ -15,6 +15,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include <biomdimacro.h>
 #include <fmr.h>
@@ -136,12 +137,278 @@ eof_out:
 	return (-1);
 }
 
+/*
+ * The largest encoded BIT: all optional objects present, and every
+ * length in a single byte.
+ */
+#define BIT_MAX_LENGTH		31
+
 int
 get_tlv_from_bit(TLV *tlv, BIT *bit)
 {
+	uint8_t buf[BIT_MAX_LENGTH];
+	BDB bdb;
+
+	INIT_BDB(&bdb, buf, sizeof(buf));
+	if (push_bit(&bdb, bit) != WRITE_OK)
+		return (-1);
+	bdb.bdb_end = bdb.bdb_current;
+	REWIND_BDB(&bdb);
+	if (scan_tlv(&bdb, tlv) != READ_OK)
+		return (-1);
 	return (0);
 }
 
+/*
+ * Read the tag and length of the BER-TLV data object at the current
+ * position of a BDB, leaving the BDB at the start of the value, and
+ * set a BDB over the value. The value must lie within the BDB.
+ */
+static int
+scan_ber_object(BDB *bdb, uint32_t *tag, BDB *value)
+{
+	uint8_t cval;
+	uint16_t sval;
+	uint32_t len;
+
+	CSCAN(&cval, bdb);
+	*tag = cval;
+	if ((cval & BERTLV_SB_MB_TAGNUM_MASK) == BERTLV_MB_TAGNUM_INDICATOR) {
+		do {
+			if (*tag > 0xFFFF)
+				return (-1);
+			CSCAN(&cval, bdb);
+			*tag = (*tag << 8) | cval;
+		} while (cval & BERTLV_MB_TAGNUM_TERMINATOR_MASK);
+	}
+
+	CSCAN(&cval, bdb);
+	if (cval <= BERTLV_SB_MAX_VALUE) {
+		len = cval;
+	} else if (cval == BERTLV_SB_MB_LENGTH_MB_2) {
+		CSCAN(&cval, bdb);
+		len = cval;
+	} else if (cval == BERTLV_SB_MB_LENGTH_MB_3) {
+		SSCAN(&sval, bdb);
+		len = sval;
+	} else {
+		return (-1);
+	}
+	if (len > (uint32_t)(bdb->bdb_end - bdb->bdb_current))
+		return (-1);
+	INIT_BDB(value, bdb->bdb_current, len);
+	bdb->bdb_current += len;
+	return (0);
+
+eof_out:
+	return (-1);
+}
+
+/*
+ * The data objects of a BIT, as flags for those found so far.
+ */
+#define BIT_DO_BHT		0x0001
+#define BIT_DO_TYPE		0x0002
+#define BIT_DO_SUBTYPE		0x0004
+#define BIT_DO_OWNER		0x0008
+#define BIT_DO_FORMATTYPE	0x0010
+#define BIT_DO_ALGOPARAM	0x0020
+#define BIT_DO_MINMAX		0x0040
+#define BIT_DO_ORDER		0x0080
+#define BIT_DO_FEATURE		0x0100
+#define BIT_DO_REQUIRED							\
+	(BIT_DO_BHT | BIT_DO_OWNER | BIT_DO_FORMATTYPE |		\
+	BIT_DO_ALGOPARAM | BIT_DO_MINMAX | BIT_DO_ORDER)
+
+/*
+ * Note a data object as found, failing if it was found before or its
+ * value is not of the given length.
+ */
+#define CHECKDO(__found, __flag, __value, __len)			\
+do {									\
+	if (((__found) & (__flag)) ||					\
+	    ((__value).bdb_size != (__len)))				\
+		return (READ_ERROR);					\
+	(__found) |= (__flag);						\
+} while (0)
+
+/*
+ * Decode the BIT data objects straight from the encoded bytes, in one
+ * pass. The objects may be in any order; objects not part of the BIT,
+ * as described in get_bit_from_tlv(), are skipped.
+ */
+int
+scan_bit(BDB *bdb, BIT *bit)
+{
+	BDB bitdo, bht, bmap, value;
+	uint32_t tag;
+	int found = 0;
+
+	bzero(bit, sizeof(BIT));
+	if ((scan_ber_object(bdb, &tag, &bitdo) != 0) ||
+	    (tag != BERTLVTAG_BIT))
+		return (READ_ERROR);
+
+	while (bitdo.bdb_current < bitdo.bdb_end) {
+		if (scan_ber_object(&bitdo, &tag, &value) != 0)
+			return (READ_ERROR);
+		if (tag != BERTLVTAG_BHT)
+			continue;
+		CHECKDO(found, BIT_DO_BHT, value, value.bdb_size);
+		bht = value;
+	}
+	if (!(found & BIT_DO_BHT))
+		return (READ_ERROR);
+
+	while (bht.bdb_current < bht.bdb_end) {
+		if (scan_ber_object(&bht, &tag, &value) != 0)
+			return (READ_ERROR);
+		switch (tag) {
+		case SIMPLETLVTAG_BIOMETRIC_TYPE:
+			CHECKDO(found, BIT_DO_TYPE, value, 1);
+			bit->bit_biometric_type = value.bdb_start[0];
+			bit->bit_biometric_type_present = TRUE;
+			break;
+		case SIMPLETLVTAG_BIOMETRIC_SUBTYPE:
+			CHECKDO(found, BIT_DO_SUBTYPE, value, 1);
+			bit->bit_biometric_subtype = value.bdb_start[0];
+			bit->bit_biometric_subtype_present = TRUE;
+			break;
+		case SIMPLETLVTAG_FORMATOWNER:
+			CHECKDO(found, BIT_DO_OWNER, value, 2);
+			bit->bit_format_owner = (value.bdb_start[0] << 8) |
+			    value.bdb_start[1];
+			break;
+		case SIMPLETLVTAG_FORMATTYPE:
+			CHECKDO(found, BIT_DO_FORMATTYPE, value, 2);
+			bit->bit_format_type = (value.bdb_start[0] << 8) |
+			    value.bdb_start[1];
+			break;
+		case BERTLVTAG_ALGOPARAM:
+			CHECKDO(found, BIT_DO_ALGOPARAM, value, value.bdb_size);
+			bmap = value;
+			break;
+		default:
+			break;
+		}
+	}
+	if (!(found & BIT_DO_ALGOPARAM))
+		return (READ_ERROR);
+
+	while (bmap.bdb_current < bmap.bdb_end) {
+		if (scan_ber_object(&bmap, &tag, &value) != 0)
+			return (READ_ERROR);
+		switch (tag) {
+		case SIMPLETLVTAG_MINMAXMINUTIAE:
+			CHECKDO(found, BIT_DO_MINMAX, value, 2);
+			bit->bit_minutia_min = value.bdb_start[0];
+			bit->bit_minutia_max = value.bdb_start[1];
+			break;
+		case SIMPLETLVTAG_MINUTIAEORDER:
+			CHECKDO(found, BIT_DO_ORDER, value, 1);
+			bit->bit_minutia_order = value.bdb_start[0];
+			break;
+		case SIMPLETLVTAG_FEATUREHANDLING:
+			CHECKDO(found, BIT_DO_FEATURE, value, 1);
+			bit->bit_feature_handling = value.bdb_start[0];
+			bit->bit_feature_handling_present = TRUE;
+			break;
+		default:
+			break;
+		}
+	}
+	if ((found & BIT_DO_REQUIRED) != BIT_DO_REQUIRED)
+		return (READ_ERROR);
+	return (READ_OK);
+}
+
+int
+scan_bit_group(BDB *bdb, BIT *bits, int *bit_count)
+{
+	BDB group, value;
+	uint32_t tag;
+	int count, i;
+
+	if ((scan_ber_object(bdb, &tag, &group) != 0) ||
+	    (tag != BERTLVTAG_BITGROUP))
+		ERR_OUT("Invalid BIT group");
+
+	/* The first object in the group is the BIT count */
+	if ((scan_ber_object(&group, &tag, &value) != 0) ||
+	    (tag != SIMPLETLVTAG_NUMBITS) || (value.bdb_size != 1))
+		ERR_OUT("Could not get BIT count in group");
+	count = value.bdb_start[0];
+	if ((count != 1) && (count != 2))
+		ERR_OUT("Invalid number of BITs");
+	for (i = 0; i < count; i++)
+		if (scan_bit(&group, &bits[i]) != READ_OK)
+			ERR_OUT("Could not decode BIT %d in group", i + 1);
+
+	*bit_count = count;
+	return (READ_OK);
+err_out:
+	return (READ_ERROR);
+}
+
+/*
+ * Encode a BIT with all lengths in a single byte; the largest BIT is
+ * well under the single byte limit.
+ */
+int
+push_bit(BDB *bdb, BIT *bit)
+{
+	uint8_t bmaplen, bhtlen;
+
+	bmaplen = 4 + 3;
+	if (bit->bit_feature_handling_present == TRUE)
+		bmaplen += 3;
+	bhtlen = 4 + 4 + 2 + bmaplen;
+	if (bit->bit_biometric_type_present == TRUE)
+		bhtlen += 3;
+	if (bit->bit_biometric_subtype_present == TRUE)
+		bhtlen += 3;
+
+	SPUSH(BERTLVTAG_BIT, bdb);
+	CPUSH(2 + bhtlen, bdb);
+	CPUSH(BERTLVTAG_BHT, bdb);
+	CPUSH(bhtlen, bdb);
+	if (bit->bit_biometric_type_present == TRUE) {
+		CPUSH(SIMPLETLVTAG_BIOMETRIC_TYPE, bdb);
+		CPUSH(1, bdb);
+		CPUSH(bit->bit_biometric_type, bdb);
+	}
+	if (bit->bit_biometric_subtype_present == TRUE) {
+		CPUSH(SIMPLETLVTAG_BIOMETRIC_SUBTYPE, bdb);
+		CPUSH(1, bdb);
+		CPUSH(bit->bit_biometric_subtype, bdb);
+	}
+	CPUSH(SIMPLETLVTAG_FORMATOWNER, bdb);
+	CPUSH(2, bdb);
+	SPUSH(bit->bit_format_owner, bdb);
+	CPUSH(SIMPLETLVTAG_FORMATTYPE, bdb);
+	CPUSH(2, bdb);
+	SPUSH(bit->bit_format_type, bdb);
+
+	CPUSH(BERTLVTAG_ALGOPARAM, bdb);
+	CPUSH(bmaplen, bdb);
+	CPUSH(SIMPLETLVTAG_MINMAXMINUTIAE, bdb);
+	CPUSH(2, bdb);
+	CPUSH(bit->bit_minutia_min, bdb);
+	CPUSH(bit->bit_minutia_max, bdb);
+	CPUSH(SIMPLETLVTAG_MINUTIAEORDER, bdb);
+	CPUSH(1, bdb);
+	CPUSH(bit->bit_minutia_order, bdb);
+	if (bit->bit_feature_handling_present == TRUE) {
+		CPUSH(SIMPLETLVTAG_FEATUREHANDLING, bdb);
+		CPUSH(1, bdb);
+		CPUSH(bit->bit_feature_handling, bdb);
+	}
+	return (WRITE_OK);
+
+err_out:
+	return (WRITE_ERROR);
+}
+
 int
 get_bits_from_tlv(BIT **bits, TLV *bit_group, int *bit_count)
 {
@@ -66,8 +66,8 @@ int
 main(int argc, char *argv[])
 {
 	TLV *bit_group;
-	BIT *bit[2];
-	BDB cardresponse;
+	BIT bit[2];
+	BDB cardresponse, bitbdb;
 	void *respbuf = NULL;
 	uint8_t sw1, sw2;
 	char cardID[MAXIDSTRINGSIZE + 1], matcherID[MAXIDSTRINGSIZE + 1];
@@ -243,19 +243,20 @@ main(int argc, char *argv[])
 		} else {
 			printf("BIT file not created.\n");
 		}
+		sz = cardresponse.bdb_current - cardresponse.bdb_start;
+		INIT_BDB(&bitbdb, cardresponse.bdb_start, sz);
 		REWIND_BDB(&cardresponse);
 		if (scan_tlv(&cardresponse, bit_group) != READ_OK) {
 			ERRP("Scanning BIT group from card");
 		} else {
 			printf("BIT group TLV:\n");
 			print_tlv(stdout, bit_group);
-			if (get_bits_from_tlv(bit, bit_group, &bit_count)
-			    != READ_OK)
-				ERRP("Getting BITs from TLV group");
+			if (scan_bit_group(&bitbdb, bit, &bit_count) != READ_OK)
+				ERRP("Decoding BITs from BIT group");
 			else {
 				for (i = 0; i < bit_count; i++) {
 					printf("BIT %d:\n", i + 1);
-					print_bit(stdout, bit[i]);
+					print_bit(stdout, &bit[i]);
 				}
 			}
 		}
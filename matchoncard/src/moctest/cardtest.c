@@ -15,6 +15,7 @@
 #include <sys/types.h>
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -47,22 +48,46 @@
  * verify.file enroll.file
  *
  * The steps for testing are:
- * 1)  Read BIT group containing 1 or 2 BITs
- * 2)  Read the card and matcher IDs from the card
- * 2a) Create an output score file; name of the file is based on CBEFF ID
+ * 1)  Find the first reader with a MOC card, or optionally all of them
+ * 1a) Read BIT group containing 1 or 2 BITs
+ * 2)  Read the card and matcher IDs from the card; cards with the same IDs
+ *     and BITs are identical, and share the pairs of the input file
+ * 2a) Create an output score file for each set of identical cards; name
+ *     of the file is based on CBEFF ID
  * 3)  Open the input file
- * 4)  Loop:
- *     4a) read one pair from the template-pairs input file
- *     4b) prune/convert/sort the input templates, using the first finger view
- *     4e) conditionally VERIFY with identical templates to reset card
- *         retry counter
- *     4d) execute MOC VERIFY
- *     4e) record similarity score in output file
- *     4f) record timing values in output file
+ * 3a) Optionally, read all pairs and order them by enrollment template
+ * 4)  For each card, start a thread that runs step 5, and a thread
+ *     that prepares the templates for upcoming pairs:
+ *     4a) read one pair from the template-pairs input file, or take the
+ *         next pair not yet taken by an identical card, in input file or
+ *         enrollment template order
+ *     4b) prune/convert/sort the input templates, using the first finger view,
+ *         or convert them directly to MTDOs, or find the templates in the
+ *         precompiled template store
+ *     4c) place the minutiae template data objects in a bounded ring
+ * 5)  Loop, while the next pairs are prepared:
+ *     5a) take one prepared pair from the ring
+ *     5b) STORE TEMPLATE, unless the pairs are in enrollment template order
+ *         and the enrollment template is the one already on the card
+ *     5c) when the card's retry counter is low or unknown, VERIFY with
+ *         identical templates to reset it
+ *     5d) execute MOC VERIFY
+ *     5e) record similarity score in output file
+ *     5f) record timing values in output file
+ *     5g) sync the result line to disk and record it in the checkpoint file
+ * 6)  Print a summary of the times of each phase of the pairs: reading,
+ *     converting, and building each template, each APDU, and writing
+ *     the result line
  * 
- * The time to execute each card APDU will be recorded.
+ * A run stopped by an error leaves the checkpoint file, and the results
+ * of each card when the pairs were read up front, next to the output file;
+ * the run is resumed with -r, redoing only the pairs that were in flight.
+ *
+ * The time to execute each card APDU will be recorded, using a clock that
+ * is not adjusted while the test runs.
  * The output file will contain information retrieved from the card,
- * prefixed with the '#' comment delimiter. The testing information
+ * prefixed with the '#' comment delimiter. The testing information,
+ * always in the order of the pairs in the input file,
  * is written as a series of lines in this format:
  *
  * Column:	Value:
@@ -72,442 +97,1804 @@
  *    4		Enrollment template filename (full path)
  *    5		Enrollment template # minutiae pre-pruning
  *    6		Enrollment template # minutiae post-pruning
- *    7		Load Enrollment template time (seconds)
+ *    7		Load Enrollment template time (seconds; 0 when the
+ *		template was already stored on the card)
  *    8		Matching time (secondss)
  *    9		Exit Status from match_templates() (0 for card test)
  *    10	Matcher decision T/F
  *    11	Get match score time (seconds)
  *    12	Match Score
+ *
+ * With -b, a copy of each complete output file is also written in the
+ * binary results format, for mocstats, to the output file name with
+ * ".bin" appended.
  */ 
+
+/*
+ * The default and maximum number of template pairs prepared ahead of the
+ * pair being processed by the card.
+ */
+#define PAIR_RING_DEPTH		8
+#define PAIR_RING_DEPTH_MAX	1024
+
 static void
 usage()
 {
-	fprintf(stderr, "Usage: cardtest <filename> [-c] [-d]\n"
+	fprintf(stderr, "Usage: cardtest <filename> [-b] [-c] [-d] [-e] [-f] "
+	    "[-k depth] [-m] [-r] [-s storefile]\n"
 	    "\t<filename> is the input file containing minutiae file names\n"
+	    "\t-b also write the results in the binary results format\n"
 	    "\t-c dump the compact card minutiae records to files\n"
 	    "\t-d indicates a dry run, where enroll and verify are not done\n"
 	    "\t   and the ENROLL and VERIFY APDUs are dumped to stdout.\n"
+	    "\t-e process the pairs in enrollment template order, storing\n"
+	    "\t   each enrollment template on the card only once\n"
+	    "\t-f convert the templates directly to MTDOs, without\n"
+	    "\t   building FMRs; not used with -c\n"
+	    "\t-k number of template pairs prepared ahead of the card\n"
+	    "\t   (default %d)\n"
+	    "\t-m run on the MOC cards in all readers, sharing the pairs\n"
+	    "\t   among identical cards; not used with -c or -d\n"
+	    "\t-r resume a stopped run from its checkpoint, with the same\n"
+	    "\t   input file and options\n"
+	    "\t-s use the templates precompiled by mtdocomp into storefile\n",
+	    PAIR_RING_DEPTH
 	);
 	exit (EXIT_FAILURE);
 }
 
 /*
  * MOC_RETRY_MIN is the minimum value we will accept in the retry counter
- * from the card. MOC_RESET_RETRY_MAX is the maximum allowed VERIFY attempts,
- * assuming that all fail. Keep this max value at least two below the real
- * max to avoid potentially locking the card the next time this program is run.
+ * from the card; the counter is reset when it gets this low. Keep this value
+ * at least two to avoid potentially locking the card the next time this
+ * program is run. MOC_RESET_RETRY_MAX is the maximum allowed VERIFY attempts,
+ * assuming that all fail, between resets of a counter starting at its max.
  */
 #define MOC_RETRY_MIN		3
 #define MOC_RESET_RETRY_MAX	(RETRY_COUNTER_MAX - MOC_RETRY_MIN)
+#define MOC_RETRY_UNKNOWN	-1
 
+/*
+ * Track the card's retry counter from the status of a VERIFY: a match
+ * restores the counter, and a failed match reports the count remaining
+ * in SW2 as 0x63Cx. A card that does not report the count is assumed
+ * to have used one attempt.
+ */
 static void
+update_retry_counter(uint8_t sw1, uint8_t sw2, int *retries)
+{
+	if (sw1 == APDU_NORMAL_COMPLETE)
+		*retries = RETRY_COUNTER_MAX;
+	else if ((sw1 == APDU_WARN_NVM_CHANGED) &&
+	    ((sw2 & RETRY_COUNTER_INDICATOR_MASK) == RETRY_COUNTER_INDICATOR))
+		*retries = sw2 & RETRY_COUNTER_MASK;
+	else if (*retries > 0)
+		(*retries)--;
+}
+
+/*
+ * Create the minutiae template data object for the first finger view of
+ * an FMR.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+static int
 create_mtdo(FMR *fmr, BDB *mtdo, void *buf, int *len)
 {
-	int vcount;
-	FVMR **fvmrs;
+	FVMR *fvmr;
 
-	vcount = get_fvmr_count(fmr);
-	if (vcount == 0)
-		ERR_EXIT("FMR contains no views");
-	fvmrs = (FVMR **) malloc(vcount * sizeof(FVMR *));
-	if (get_fvmrs(fmr, fvmrs) != vcount)
-		ERR_EXIT("Could not get views from FMR");
+	fvmr = TAILQ_FIRST(&fmr->finger_views);
+	if (fvmr == NULL)
+		ERR_OUT("FMR contains no views");
 
 	INIT_BDB(mtdo, buf, RESPONSEBUFSIZE);
         
 	/* Convert only the first (and probably only) FVMR. */
-	if (fvmr_to_mtdo(fvmrs[0], mtdo) != WRITE_OK)
-		ERR_EXIT("Could not convert FVMR to MTDO");
+	if (fvmr_to_mtdo(fvmr, mtdo) != WRITE_OK)
+		ERR_OUT("Could not convert FVMR to MTDO");
 
-	free(fvmrs);
 	*len = mtdo->bdb_current - mtdo->bdb_start;
 	/* Reset the pointers in the BDB for the caller */
 	REWIND_BDB(mtdo);
+	return (0);
+
+err_out:
+	return (-1);
 }
 
 /* Indices of the verify and enroll templates */
 #define V	0
 #define E	1
 
-int
-main(int argc, char *argv[])
+/*
+ * A template pair read from the input file and made ready for the card:
+ * the minutiae template data objects and the values recorded in the
+ * output file.
+ */
+struct prepared_pair {
+	unsigned int	iteration;
+	char		fmrfn[2][MAXPATHLEN]; /* input FMR file names */
+	int		incount[2];	/* # minutiae pre-pruning */
+	int		cccount[2];	/* # minutiae post-pruning */
+	BDB		mtdo[2];	/* minutiae template data objects */
+	void		*mtdobuf[2];	/* buffer for the above */
+	int		mtdolen[2];	/* length of the above MTDOs */
+};
+
+/*
+ * The timed phases of each pair. The producer times the reading and
+ * preparing of each template; with -f, the MTDO is built as part of the
+ * conversion, and with -s, reading is finding the template in the store.
+ * The card's thread times each APDU and the writing of the result line.
+ */
+#define PHASE_READ		0
+#define PHASE_CONVERT		1
+#define PHASE_MTDO		2
+#define PHASE_STORE		3
+#define PHASE_RESET		4
+#define PHASE_VERIFY		5
+#define PHASE_SCORE		6
+#define PHASE_WRITE		7
+#define PHASE_COUNT		8
+
+static const char *phase_names[PHASE_COUNT] = {
+	"Read template", "Prune/convert", "Build MTDO", "STORE TEMPLATE",
+	"Reset VERIFY", "VERIFY", "GET SCORE", "Write result"
+};
+
+/*
+ * A template pair from the input file, kept when the pairs are processed
+ * in enrollment template order.
+ */
+struct pair_names {
+	unsigned int	iteration;	/* position in the input file */
+	char		*fmrfn[2];
+};
+
+/*
+ * The pairs read from the input file up front, and the next one to be
+ * prepared. When several cards share the pairs, their producers take
+ * pairs from the one cursor.
+ */
+struct pair_cursor {
+	pthread_mutex_t		lock;
+	struct pair_names	*schedule;
+	unsigned int		npairs;
+	unsigned int		next;
+	long			*done;	/* pairs done, when >= 0 */
+};
+
+/*
+ * A bounded ring of prepared pairs, filled by the producer thread while
+ * the card's thread sends the pairs to the card. Slots from head for count
+ * entries belong to the card's thread; the others to the producer.
+ */
+struct pair_ring {
+	struct prepared_pair	*slots;
+	int			size;
+	int			head;
+	int			count;
+	int			done;	/* producer has stopped */
+	int			error;	/* producer stopped on error */
+	int			cancel;	/* producer is to stop */
+	pthread_mutex_t		lock;
+	pthread_cond_t		notempty;
+	pthread_cond_t		notfull;
+
+	/* Producer parameters */
+	FILE			*infp;
+	unsigned int		first;	/* iteration of the first pair
+					 * read from infp */
+	BIT			**bit;
+	MTDOSTORE		*store;
+	int			dumpcc;
+	int			direct;	/* convert without FMRs */
+	FMRPOOL			pool;	/* records reused by the
+					 * producer */
+	FMR			*infmr[2];	/* input FMRs */
+	FMR			*ccfmr[2];	/* compact card form of the
+						 * input FMRs */
+	struct pair_cursor	*cursor;	/* pairs read up front */
+
+	/* Phase times of the producer and the card's thread */
+	PHASEHIST		*phases;
+};
+
+/*
+ * Order pairs by enrollment template; pairs with the same enrollment
+ * template stay in input file order.
+ */
+static int
+compare_pair_names(const void *a, const void *b)
 {
-	FILE *infp = NULL;
-	FILE *outfp = NULL;
-	FILE *fmrfp = NULL;
-	TLV *bit_group;
-	BIT *bit[2] = {NULL, NULL};
-	int bit_count;
-	BDB cardresponse;
-	APDU enrollapdu, verifyapdu;
+	const struct pair_names *pa = (const struct pair_names *)a;
+	const struct pair_names *pb = (const struct pair_names *)b;
+	int ret;
 
-	char fmrfn[2][MAXPATHLEN];	/* input FMR file names */
-	FMR *infmr[2];			/* input FMR data structures */
-	FMR *ccfmr[2];			/* compact card form of input FMRs */
-	uint16_t cx[2], cy[2];	/* Center of interest coordinate for each FMR */
-	int usecm[2];			/* Flag, use center of mass? */
-	BDB mtdo[2];			/* minutiae template data objects */
-	void *mtdobuf[2] = { NULL, NULL }; /* buffer for the above */
-	int mtdolen[2];			/* length of the above MTDOs */
+	ret = strcmp(pa->fmrfn[E], pb->fmrfn[E]);
+	if (ret != 0)
+		return (ret);
+	return (pa->iteration < pb->iteration ? -1 : 1);
+}
 
-	uint8_t sw1, sw2;
-	char cardID[MAXIDSTRINGSIZE + 1], matcherID[MAXIDSTRINGSIZE + 1];
-	uint16_t score;
-	void *respbuf = NULL;
-	int minutiae_count;
-	char outfn[MAXPATHLEN];
-	struct stat sb;
-	int exitcode;
-	int resetctr;
-	unsigned int iteration;
-	int dryrun = 0;
-	int dumpcc = 0;
-	int ch;
+/*
+ * Read all pairs from the input file, and optionally sort them by
+ * enrollment template.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+static int
+read_pair_schedule(FILE *infp, int byenroll, struct pair_names **schedule,
+    unsigned int *npairs)
+{
+	struct pair_names *pairs, *npairsbuf;
+	char fmrfn[2][MAXPATHLEN];
+	unsigned int count, size;
+	int t;
+
+	pairs = NULL;
+	count = size = 0;
+	while (fscanf(infp, "%s %s", fmrfn[V], fmrfn[E]) == 2) {
+		if (count == size) {
+			size = (size == 0) ? 1024 : size * 2;
+			npairsbuf = (struct pair_names *)realloc(pairs,
+			    size * sizeof(struct pair_names));
+			if (npairsbuf == NULL)
+				ALLOC_ERR_OUT("Pair schedule");
+			pairs = npairsbuf;
+		}
+		pairs[count].iteration = count + 1;
+		for (t = V; t <= E; t++) {
+			pairs[count].fmrfn[t] = malloc(strlen(fmrfn[t]) + 1);
+			if (pairs[count].fmrfn[t] == NULL) {
+				if (t == E)
+					free(pairs[count].fmrfn[V]);
+				ALLOC_ERR_OUT("Pair schedule");
+			}
+			strcpy(pairs[count].fmrfn[t], fmrfn[t]);
+		}
+		count++;
+	}
+	if (!feof(infp))
+		ERR_OUT("Reading input file");
+	if (byenroll && (count != 0))
+		qsort(pairs, count, sizeof(struct pair_names),
+		    compare_pair_names);
+	*schedule = pairs;
+	*npairs = count;
+	return (0);
+
+err_out:
+	while (count-- > 0) {
+		free(pairs[count].fmrfn[V]);
+		free(pairs[count].fmrfn[E]);
+	}
+	if (pairs != NULL)
+		free(pairs);
+	return (-1);
+}
+
+/*
+ * Get the names of the next pair, from the input file or the schedule.
+ */
+static int
+next_pair(struct pair_ring *ring, unsigned int iteration,
+    struct prepared_pair *pp)
+{
+	struct pair_cursor *cursor = ring->cursor;
+	struct pair_names *pn;
+
+	if (cursor == NULL) {
+		if (fscanf(ring->infp, "%s %s", pp->fmrfn[V], pp->fmrfn[E])
+		    != 2) {
+			if (feof(ring->infp))
+				return (READ_EOF);
+			ERRP("Reading input file");
+			return (READ_ERROR);
+		}
+		pp->iteration = iteration;
+		return (READ_OK);
+	}
+	/* Skip the pairs done before a resumed run was stopped. */
+	pthread_mutex_lock(&cursor->lock);
+	do {
+		if (cursor->next == cursor->npairs) {
+			pthread_mutex_unlock(&cursor->lock);
+			return (READ_EOF);
+		}
+		pn = &cursor->schedule[cursor->next++];
+	} while ((cursor->done != NULL) &&
+	    (cursor->done[pn->iteration - 1] >= 0));
+	pthread_mutex_unlock(&cursor->lock);
+	strcpy(pp->fmrfn[V], pn->fmrfn[V]);
+	strcpy(pp->fmrfn[E], pn->fmrfn[E]);
+	pp->iteration = pn->iteration;
+	return (READ_OK);
+}
+
+/*
+ * Where the result line of each pair was written, when results are
+ * written to a temporary file per card in processing order, and merged
+ * into the output file in input file order. Pairs not processed have an
+ * offset of -1.
+ */
+struct result_map {
+	long		*offset;	/* offset of the line */
+	int		*card;		/* card whose file has it */
+	unsigned int	npairs;
+};
+
+static int
+new_result_map(struct result_map *map, unsigned int npairs)
+{
+	unsigned int i;
+
+	map->npairs = npairs;
+	map->offset = (long *)malloc(npairs * sizeof(long));
+	map->card = (int *)malloc(npairs * sizeof(int));
+	if ((npairs != 0) && ((map->offset == NULL) || (map->card == NULL)))
+		return (-1);
+	for (i = 0; i < npairs; i++)
+		map->offset[i] = -1;
+	return (0);
+}
+
+static void
+free_result_map(struct result_map *map)
+{
+	if (map->offset != NULL)
+		free(map->offset);
+	if (map->card != NULL)
+		free(map->card);
+}
+
+/*
+ * Copy the result lines to the output file in input file order.
+ */
+static void
+merge_results(struct result_map *map, FILE **resfps, FILE *outfp)
+{
+	unsigned int i;
+	FILE *resfp;
+	int c;
+
+	for (i = 0; i < map->npairs; i++) {
+		if (map->offset[i] < 0)
+			continue;
+		resfp = resfps[map->card[i]];
+		if (fseek(resfp, map->offset[i], SEEK_SET) != 0)
+			break;
+		while (((c = getc(resfp)) != EOF) && (c != '\n'))
+			putc(c, outfp);
+		putc('\n', outfp);
+	}
+}
+
+/*
+ * Write a compact card record to the file for the iteration.
+ */
+static void
+dump_cc_record(char *prefix, unsigned int iteration, uint8_t *rec,
+    unsigned int len)
+{
 	char rawccfn[32];
 	FILE *rawccfp;
 
-	SCARDCONTEXT context;
-	SCARDHANDLE hCard;
+	sprintf(rawccfn, "%s_%d.CC", prefix, iteration - 1);
+	rawccfp = fopen(rawccfn, "wb");
+	fwrite(rec, 1, len, rawccfp);
+	fclose(rawccfp);
+}
 
-	char **readers;
-	int rdr, rdrcount;
-	DWORD rdrprot;
+/*
+ * Prepare a pair from the precompiled template store.
+ */
+static int
+prepare_stored_pair(struct pair_ring *ring, struct prepared_pair *pp)
+{
+	BIT **bit = ring->bit;
+	MTDOENTRY entry[2];
+	struct timespec starttm, finishtm;
+	int t, b;
 
-	time_t thetime;
-	struct timeval starttm, finishtm;
-	double delta_t;
+	/*
+	 * The first BIT is applied to the enrollment template, the
+	 * second to the verify template, as per the MINEX-II test spec.
+	 */
+	for (t = V; t <= E; t++) {
+		b = (t == V) ? 1 : 0;
+		PHASETIME(starttm);
+		if (find_mtdo_store_entry(ring->store, pp->fmrfn[t], bit[b],
+		    &entry[t]) != 0) {
+			ERRP("Template %s is not in the template store for "
+			    "minutiae min/max/order %u/%u/0x%02X",
+			    pp->fmrfn[t], bit[b]->bit_minutia_min,
+			    bit[b]->bit_minutia_max, bit[b]->bit_minutia_order);
+			return (READ_ERROR);
+		}
+		PHASETIME(finishtm);
+		record_phase_time(&ring->phases[PHASE_READ],
+		    PHASEINTERVAL(starttm, finishtm));
+		INIT_BDB(&pp->mtdo[t], entry[t].mtdo, entry[t].mtdolen);
+		pp->mtdolen[t] = entry[t].mtdolen;
+		pp->incount[t] = entry[t].incount;
+		pp->cccount[t] = entry[t].cccount;
+	}
+	if (ring->dumpcc) {
+		dump_cc_record("probe", pp->iteration, entry[V].ccfmr,
+		    entry[V].ccfmrlen);
+		dump_cc_record("gallery", pp->iteration, entry[E].ccfmr,
+		    entry[E].ccfmrlen);
+	}
+	return (READ_OK);
+}
 
-	if ((argc < 2) || (argc > 4))
-		usage();
+/*
+ * Prepare a pair by converting the template files directly to MTDOs.
+ */
+static int
+prepare_direct_pair(struct pair_ring *ring, struct prepared_pair *pp)
+{
+	BIT **bit = ring->bit;
+	size_t reclen, mtdolen;
+	struct timespec starttm, readtm, finishtm;
+	int t, b;
 
-	while ((ch = getopt(argc, argv, "cd")) != -1) {
-		switch (ch) {
-		case 'c':
-			dumpcc = 1;
-			break;
-		case 'd':
-			dryrun = 1;
-			break;
-		default :
-			usage();
-			break;
+	/*
+	 * The first BIT is applied to the enrollment template, the
+	 * second to the verify template, as per the MINEX-II test spec.
+	 */
+	for (t = V; t <= E; t++) {
+		b = (t == V) ? 1 : 0;
+		PHASETIME(starttm);
+		if (pool_read_file(&ring->pool, pp->fmrfn[t], &reclen) != 0)
+			return (READ_ERROR);
+		PHASETIME(readtm);
+		if (ansi_fmr_to_mtdo(ring->pool.filebuf, reclen, pp->fmrfn[t],
+		    bit[b]->bit_minutia_max, bit[b]->bit_minutia_order,
+		    pp->mtdobuf[t], RESPONSEBUFSIZE, &mtdolen,
+		    &pp->incount[t], &pp->cccount[t]) != 0) {
+			ERRP("Converting FMR file %s failed", pp->fmrfn[t]);
+			return (READ_ERROR);
 		}
+		PHASETIME(finishtm);
+		record_phase_time(&ring->phases[PHASE_READ],
+		    PHASEINTERVAL(starttm, readtm));
+		record_phase_time(&ring->phases[PHASE_CONVERT],
+		    PHASEINTERVAL(readtm, finishtm));
+		INIT_BDB(&pp->mtdo[t], pp->mtdobuf[t], mtdolen);
+		pp->mtdolen[t] = mtdolen;
 	}
-	exitcode = EXIT_FAILURE;
-	infp = fopen(argv[optind], "r");
-	if (infp == NULL)
-		ERR_EXIT("open of %s failed: %s", argv[optind],
-		    strerror(errno));
+	return (READ_OK);
+}
 
-	respbuf = malloc(RESPONSEBUFSIZE);
-	if (respbuf == NULL)
-		ALLOC_ERR_EXIT("Response BDB buffer");
-	INIT_BDB(&cardresponse, respbuf, RESPONSEBUFSIZE);
+/*
+ * Prepare the MTDOs for the card from the pair of templates named in pp.
+ * Returns:
+ *	READ_OK    Success
+ *	READ_ERROR Failure
+ */
+static int
+prepare_pair(struct pair_ring *ring, struct prepared_pair *pp)
+{
+	FMR **infmr = ring->infmr;	/* input FMR data structures */
+	FMR **ccfmr = ring->ccfmr;	/* compact card form of input FMRs */
+	BIT **bit = ring->bit;
+	uint16_t cx[2], cy[2];	/* Center of interest coordinate for each FMR */
+	int usecm[2];			/* Flag, use center of mass? */
+	char rawccfn[32];
+	FILE *rawccfp;
+	struct timespec starttm, convtm, finishtm;
+	int t, b;
+	int retval;
+
+	if (ring->store != NULL)
+		return (prepare_stored_pair(ring, pp));
+	if (ring->direct)
+		return (prepare_direct_pair(ring, pp));
+
+	retval = READ_ERROR;
+	for (t = V; t <= E; t++) {
+		PHASETIME(starttm);
+		if (pool_read_fmr(&ring->pool, pp->fmrfn[t], infmr[t]) != 0)
+			ERR_OUT("Could not read FMR file %s", pp->fmrfn[t]);
+		PHASETIME(finishtm);
+		record_phase_time(&ring->phases[PHASE_READ],
+		    PHASEINTERVAL(starttm, finishtm));
+		CHOOSEPRUNECENTER(pp->fmrfn[t], infmr[t], cx[t], cy[t],
+		    usecm[t]);
+	}
 
 	/*
-	 * Connect to the reader and card. Check readers in order, and use
-	 * the first one that contains a MOC card. In the future, we may
-	 * want to accept the reader ID as an input parameter.
+	 * The first BIT is applied to the enrollment template, the
+	 * second to the verify template, as per the MINEX-II test spec.
 	 */
-	if (SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &context) !=
-	     SCARD_S_SUCCESS)
-		ERR_EXIT("Could not establish contact with reader");
-	if (getReaders(context, &readers, &rdrcount) != 0)
-		ERR_EXIT("Could not get list of readers.");
-	if (rdrcount < 1)
-		ERR_EXIT("No readers found");
+	for (t = V; t <= E; t++) {
+		b = (t == V) ? 1 : 0;
+		pp->incount[t] =
+		    get_fmd_count(TAILQ_FIRST(&infmr[t]->finger_views));
+		PHASETIME(starttm);
+		if (pool_prune_convert_sort_fmr(&ring->pool, infmr[t],
+		    ccfmr[t], bit[b]->bit_minutia_min,
+		    bit[b]->bit_minutia_max, bit[b]->bit_minutia_order,
+		    cx[t], cy[t], usecm[t]) != 0)
+			ERR_OUT("Pruning/sorting %s FMR failed.",
+			    t == V ? "first" : "second");
+		PHASETIME(convtm);
+		/* create_mtdo() inits the mtdo BDB blocks... */
+		if (create_mtdo(ccfmr[t], &pp->mtdo[t], pp->mtdobuf[t],
+		    &pp->mtdolen[t]) != 0)
+			ERR_OUT("Could not create %s MTDO",
+			    t == V ? "first" : "second");
+		PHASETIME(finishtm);
+		record_phase_time(&ring->phases[PHASE_CONVERT],
+		    PHASEINTERVAL(starttm, convtm));
+		record_phase_time(&ring->phases[PHASE_MTDO],
+		    PHASEINTERVAL(convtm, finishtm));
+		pp->cccount[t] =
+		    get_fmd_count(TAILQ_FIRST(&ccfmr[t]->finger_views));
+	}
 
-	for (rdr = 0; rdr < rdrcount; rdr++) {
-		printf("\nTrying reader %s\n", readers[rdr]);
-		if (SCardConnect(context, readers[rdr], SCARD_SHARE_EXCLUSIVE,
-		    SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &hCard, &rdrprot)
-		    != 0) {
-			INFOP("Could not connect to card or no card in reader");
-			continue;
+	/*
+	 * Write the compact card records to separate files,
+	 * if the user asked for it.
+	 */
+	if (ring->dumpcc) {
+		sprintf(rawccfn, "probe_%d.CC", pp->iteration-1);
+		rawccfp = fopen(rawccfn, "wb");
+		write_fmr(rawccfp, ccfmr[V]);
+		fclose(rawccfp);
+		sprintf(rawccfn, "gallery_%d.CC", pp->iteration-1);
+		rawccfp = fopen(rawccfn, "wb");
+		write_fmr(rawccfp, ccfmr[E]);
+		fclose(rawccfp);
+	}
+	retval = READ_OK;
+
+err_out:
+	return (retval);
+}
+
+/*
+ * The producer thread: prepare pairs into the ring until the input file
+ * is exhausted or an error occurs.
+ */
+static void *
+pair_producer(void *arg)
+{
+	struct pair_ring *ring = (struct pair_ring *)arg;
+	struct prepared_pair *pp;
+	unsigned int iteration;
+	int ret;
+
+	iteration = ring->first;
+	for (;;) {
+		pthread_mutex_lock(&ring->lock);
+		while ((ring->count == ring->size) && !ring->cancel)
+			pthread_cond_wait(&ring->notfull, &ring->lock);
+		if (ring->cancel) {
+			ring->done = 1;
+			pthread_mutex_unlock(&ring->lock);
+			break;
 		}
-		/* Select the MOC application. */
-		if (sendAPDU(hCard, &MOCSELECTAPP, 0, &cardresponse, &sw1, &sw2)
-		    != 0)
-			ERR_OUT("Could not send MOC SELECT APDU");
-		if (sw1 != APDU_NORMAL_COMPLETE) {
-
-			/* Try using the alternate select APDU. */
-			if(sendAPDU(hCard, &ALTMOCSELECTAPP, 0, &cardresponse,
-			    &sw1, &sw2) != 0)
-				ERR_OUT("Could not send ALT SELECT APDU");
-			if (sw1 == APDU_NORMAL_COMPLETE)
-				break;
+		pp = &ring->slots[(ring->head + ring->count) % ring->size];
+		pthread_mutex_unlock(&ring->lock);
+
+		ret = next_pair(ring, iteration, pp);
+		if (ret == READ_OK)
+			ret = prepare_pair(ring, pp);
+
+		pthread_mutex_lock(&ring->lock);
+		if (ret == READ_OK) {
+			ring->count++;
 		} else {
-			break;
+			ring->done = 1;
+			ring->error = (ret != READ_EOF);
 		}
+		pthread_cond_signal(&ring->notempty);
+		pthread_mutex_unlock(&ring->lock);
+		if (ret != READ_OK)
+			break;
+		iteration++;
+	}
+	return (NULL);
+}
+
+/*
+ * Get the next prepared pair from the ring, waiting for the producer if
+ * needed. NULL is returned when the producer has stopped and all pairs
+ * have been taken.
+ */
+static struct prepared_pair *
+pair_ring_get(struct pair_ring *ring)
+{
+	struct prepared_pair *pp;
+
+	pthread_mutex_lock(&ring->lock);
+	while ((ring->count == 0) && !ring->done)
+		pthread_cond_wait(&ring->notempty, &ring->lock);
+	if (ring->count == 0)
+		pp = NULL;
+	else
+		pp = &ring->slots[ring->head];
+	pthread_mutex_unlock(&ring->lock);
+	return (pp);
+}
+
+/*
+ * Return the slot of the pair taken with pair_ring_get() to the producer.
+ */
+static void
+pair_ring_put(struct pair_ring *ring)
+{
+	pthread_mutex_lock(&ring->lock);
+	ring->head = (ring->head + 1) % ring->size;
+	ring->count--;
+	pthread_cond_signal(&ring->notfull);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+ * The checkpoint file of an output file records, as the result line of
+ * each pair is completed and synced to disk, where the line is and the
+ * card's retry counter as last reported. The lines are:
+ *	start <header end> <pairs read up front> <enrollment order> <# pairs>
+ *	card <card index> <reader name>
+ *	<iteration> <card index> <line offset> <line end> <retry counter>
+ * A run stopped by an error is resumed from the checkpoint file with -r;
+ * the pairs in flight when the run stopped are done again.
+ * A group of identical cards holds at most CARDS_MAX cards.
+ */
+#define CARDS_MAX	64
+
+struct checkpoint {
+	pthread_mutex_t	lock;
+	FILE		*fp;
+	char		fn[MAXPATHLEN];
+};
+
+/*
+ * The state of a stopped run, read from its checkpoint file.
+ */
+struct resume_state {
+	long		start;		/* end of output header */
+	int		scheduled;	/* pairs were read up front */
+	int		byenroll;
+	unsigned int	npairs;
+	unsigned int	count;		/* # pairs done */
+	long		good;		/* end of last complete line */
+	int		nfiles;		/* # card results files */
+	long		end[CARDS_MAX];	/* end of card's results */
+	int		retries[CARDS_MAX];
+	char		*reader[CARDS_MAX];
+};
+
+/*
+ * A MOC card found in one of the readers, and the thread that sends its
+ * share of the pairs to it. Cards with the same card and matcher IDs, and
+ * the same BITs, form a group that shares the pairs of the input file.
+ */
+struct moc_card {
+	char			*reader;
+	SCARDCONTEXT		context;
+	SCARDHANDLE		hCard;
+	char			cardID[MAXIDSTRINGSIZE + 1];
+	char			matcherID[MAXIDSTRINGSIZE + 1];
+	BIT			bits[2];	/* decoded from the card */
+	BIT			*bit[2];	/* the BIT for each
+						 * template */
+	int			bit_count;
+	int			group;		/* group index */
+	int			index;		/* index in group */
+	struct pair_ring	ring;		/* pairs prepared for the
+						 * card */
+	FILE			*resfp;		/* results */
+	struct result_map	*results;	/* where results are, when
+						 * merged at the end */
+	struct checkpoint	*ckpt;
+	int			retries;	/* initial retry counter */
+	unsigned int		resets;		/* # reset VERIFYs */
+	unsigned int		verifies;	/* # VERIFYs of pairs */
+	int			dryrun;
+	int			byenroll;
+	int			progress;	/* print the iteration */
+	unsigned int		pairs;		/* # pairs done */
+	unsigned int		storeskipped;
+	int			status;
+	pthread_t		thread;
+};
+
+/*
+ * Cards that share the pairs of the input file, and the output file
+ * their results are written to.
+ */
+struct card_group {
+	int			ncards;
+	char			outfn[MAXPATHLEN];
+	FILE			*outfp;
+	struct pair_cursor	cursor;
+	struct result_map	results;
+	/* Card results files; more than ncards if cards are gone */
+	int			nfiles;
+	FILE			**resfps;	/* indexed by card index */
+	struct checkpoint	ckpt;
+	unsigned int		resumed;	/* # pairs done before the
+						 * run was resumed */
+	int			failed;		/* a card failed */
+};
+
+/*
+ * Connect to the card in a reader, select the MOC application, and read
+ * the BIT group and the card and matcher IDs from the card.
+ * Returns:
+ *	 0     Success
+ *	 1     No card in the reader, or the card is not a MOC card
+ *	-1     Failure
+ */
+static int
+connect_moc_card(char *reader, int dryrun, struct moc_card *card)
+{
+	BDB cardresponse;
+	void *respbuf = NULL;
+	DWORD rdrprot;
+	uint8_t sw1, sw2;
+	int connected = 0;
+	int retval = -1;
+
+	card->reader = reader;
+	card->dryrun = dryrun;
+	card->retries = MOC_RETRY_UNKNOWN;	/* Force a reset */
+	respbuf = malloc(RESPONSEBUFSIZE);
+	if (respbuf == NULL)
+		ALLOC_ERR_OUT("Response BDB buffer");
+	INIT_BDB(&cardresponse, respbuf, RESPONSEBUFSIZE);
+
+	/* Each card has its own context, for use by its own thread. */
+	if (SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL,
+	    &card->context) != SCARD_S_SUCCESS)
+		ERR_OUT("Could not establish contact with reader");
+	if (SCardConnect(card->context, reader, SCARD_SHARE_EXCLUSIVE,
+	    SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &card->hCard, &rdrprot)
+	    != 0) {
+		INFOP("Could not connect to card or no card in reader");
+		retval = 1;
+		goto err_out;
+	}
+	connected = 1;
 
+	/* Select the MOC application, or try the alternate select APDU. */
+	if (sendAPDU(card->hCard, &MOCSELECTAPP, 0, &cardresponse, &sw1, &sw2)
+	    != 0)
+		ERR_OUT("Could not send MOC SELECT APDU");
+	if (sw1 != APDU_NORMAL_COMPLETE) {
+		REWIND_BDB(&cardresponse);
+		if (sendAPDU(card->hCard, &ALTMOCSELECTAPP, 0, &cardresponse,
+		    &sw1, &sw2) != 0)
+			ERR_OUT("Could not send ALT SELECT APDU");
+	}
+	if (sw1 != APDU_NORMAL_COMPLETE) {
 		INFOP("Card in reader is not MOC");
-		SCardDisconnect(hCard, SCARD_RESET_CARD);
+		retval = 1;
+		goto err_out;
 	}
-	if (sw1 != APDU_NORMAL_COMPLETE)
-		ERR_EXIT("Could not connect to card");
-	printf("\nMOC card found in %s\n", readers[rdr]);
-	
-	/*
-	 * Create a TLV object for the BIT group, and get the group
-	 * from the card.
-	 */
-	if (new_tlv(&bit_group, 0, 0) != 0)
-		ALLOC_ERR_EXIT("TLV structure");
-	if (get_bitgroup_from_card(hCard, bit_group) != READ_OK)
-		ERR_EXIT("Getting BIT group from card");
-	if (get_bits_from_tlv(bit, bit_group, &bit_count) != READ_OK)
-		ERR_EXIT("Getting BITs from TLV group");
-	
+
+	/* Get the BITs of the BIT group from the card. */
+	if (get_bits_from_card(card->hCard, card->bits, &card->bit_count)
+	    != READ_OK)
+		ERR_OUT("Getting BITs from card");
+
 	/* If there is only one BIT, we use it for both templates */
-	if (bit_count == 1)
-		bit[1] = bit[0];
-	free_tlv(bit_group);
+	card->bit[0] = &card->bits[0];
+	card->bit[1] = &card->bits[card->bit_count - 1];
 
 	/*
 	 * Get the card and matcher IDs from the card so we can use them
 	 * in the output file.
 	 */
+	strcpy(card->cardID, "dryrun");
+	strcpy(card->matcherID, "dryrun");
 	REWIND_BDB(&cardresponse);
-	if (sendAPDU(hCard, &MOCGETCARDID, dryrun, &cardresponse, &sw1, &sw2)
-	    != 0)
+	if (sendAPDU(card->hCard, &MOCGETCARDID, dryrun, &cardresponse,
+	    &sw1, &sw2) != 0)
 		ERR_OUT("Could not get card ID");
 	if (dryrun == 0) {
 		CHECKSTATUS("GET CARD ID", sw1, sw2);
 		REWIND_BDB(&cardresponse);
-		if (getIDinresponse(cardID, &cardresponse) != 0)
+		if (getIDinresponse(card->cardID, &cardresponse) != 0)
 			ERR_OUT("Could not get card ID");
 	}
 	REWIND_BDB(&cardresponse);
-	if (sendAPDU(hCard, &MOCGETMATCHERID, dryrun, &cardresponse, &sw1, &sw2)
-	    != 0)
+	if (sendAPDU(card->hCard, &MOCGETMATCHERID, dryrun, &cardresponse,
+	    &sw1, &sw2) != 0)
 		ERR_OUT("Could not get matcher ID");
 	if (dryrun == 0) {
 		CHECKSTATUS("GET MATCHER ID", sw1, sw2);
 		REWIND_BDB(&cardresponse);
-		if (getIDinresponse(matcherID, &cardresponse) != 0)
+		if (getIDinresponse(card->matcherID, &cardresponse) != 0)
 			ERR_OUT("Could not get matcher ID");
 	}
-	/* The output file name is a combination of card ID and date. */
-	if (dryrun)
-		STRGENTESTFN(outfn, "dryrun", "dryrun");
-	else
-		STRGENTESTFN(outfn, cardID, matcherID);
-	if (stat(outfn, &sb) == 0)
-		ERR_EXIT("File %s exists", outfn);
-	if ((outfp = fopen(outfn, "w")) == NULL)
-		OPEN_ERR_EXIT(outfn);
+	retval = 0;
+
+err_out:
+	if (respbuf != NULL)
+		free(respbuf);
+	if (retval != 0) {
+		card->bit[0] = card->bit[1] = NULL;
+		if (connected)
+			SCardDisconnect(card->hCard, SCARD_RESET_CARD);
+		SCardReleaseContext(card->context);
+	}
+	return (retval);
+}
+
+static void
+disconnect_moc_card(struct moc_card *card)
+{
+	card->bit[0] = card->bit[1] = NULL;
+	SCardDisconnect(card->hCard, SCARD_LEAVE_CARD);
+	SCardReleaseContext(card->context);
+}
+
+/*
+ * Cards are identical when they have the same card and matcher IDs,
+ * and their BITs ask for the same minutiae count and order.
+ */
+static int
+same_card_ids(struct moc_card *a, struct moc_card *b)
+{
+	return ((strcmp(a->cardID, b->cardID) == 0) &&
+	    (strcmp(a->matcherID, b->matcherID) == 0));
+}
+
+static int
+same_card_bits(struct moc_card *a, struct moc_card *b)
+{
+	BIT *ab, *bb;
+	int t;
+
+	if (a->bit_count != b->bit_count)
+		return (0);
+	for (t = V; t <= E; t++) {
+		ab = a->bit[t];
+		bb = b->bit[t];
+		if ((ab->bit_format_owner != bb->bit_format_owner) ||
+		    (ab->bit_format_type != bb->bit_format_type) ||
+		    (ab->bit_minutia_min != bb->bit_minutia_min) ||
+		    (ab->bit_minutia_max != bb->bit_minutia_max) ||
+		    (ab->bit_minutia_order != bb->bit_minutia_order))
+			return (0);
+	}
+	return (1);
+}
+
+/*
+ * Allocate the slots of a ring, and the records the producer reuses
+ * from one pair to the next. The producer parameters are set by the
+ * caller.
+ */
+static int
+new_pair_ring(struct pair_ring *ring, int depth)
+{
+	int slot, t;
+
+	ring->size = depth;
+	ring->slots = (struct prepared_pair *)calloc(ring->size,
+	    sizeof(struct prepared_pair));
+	if (ring->slots == NULL)
+		ALLOC_ERR_RETURN("Prepared pair ring");
+	for (slot = 0; slot < ring->size; slot++)
+		for (t = V; t <= E; t++) {
+			ring->slots[slot].mtdobuf[t] = malloc(RESPONSEBUFSIZE);
+			if (ring->slots[slot].mtdobuf[t] == NULL)
+				ALLOC_ERR_RETURN("MTDO BDB buffer");
+		}
+	ring->phases = (PHASEHIST *)malloc(PHASE_COUNT * sizeof(PHASEHIST));
+	if (ring->phases == NULL)
+		ALLOC_ERR_RETURN("Phase histograms");
+	for (t = 0; t < PHASE_COUNT; t++)
+		init_phase_histogram(&ring->phases[t]);
+	init_fmr_pool(&ring->pool);
+	for (t = V; t <= E; t++) {
+		if (new_fmr(FMR_STD_ANSI, &ring->infmr[t]) < 0)
+			ALLOC_ERR_RETURN("Input FMR");
+		if (new_fmr(FMR_STD_ISO_COMPACT_CARD, &ring->ccfmr[t]) < 0)
+			ALLOC_ERR_RETURN("Compact card FMR");
+	}
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->notempty, NULL);
+	pthread_cond_init(&ring->notfull, NULL);
+	return (0);
+}
+
+static void
+free_pair_ring(struct pair_ring *ring)
+{
+	int slot, t;
+
+	if (ring->slots != NULL) {
+		for (slot = 0; slot < ring->size; slot++)
+			for (t = V; t <= E; t++)
+				if (ring->slots[slot].mtdobuf[t] != NULL)
+					free(ring->slots[slot].mtdobuf[t]);
+		free(ring->slots);
+		ring->slots = NULL;
+	}
+	for (t = V; t <= E; t++) {
+		if (ring->infmr[t] != NULL)
+			free_fmr(ring->infmr[t]);
+		if (ring->ccfmr[t] != NULL)
+			free_fmr(ring->ccfmr[t]);
+		ring->infmr[t] = ring->ccfmr[t] = NULL;
+	}
+	if (ring->phases != NULL) {
+		free(ring->phases);
+		ring->phases = NULL;
+	}
+	free_fmr_pool(&ring->pool);
+}
+
+/*
+ * Write the information retrieved from the card, and the test settings,
+ * to the start of the output file. The readers of all cards in the group
+ * are listed.
+ */
+static void
+write_results_header(FILE *outfp, struct moc_card *cards, int ncards,
+    int group, int groupsize)
+{
+	struct moc_card *card = NULL;
+	char cwd[MAXPATHLEN];
+	time_t thetime;
+	int c;
+
+	for (c = 0; c < ncards; c++)
+		if (cards[c].group == group) {
+			card = &cards[c];
+			break;
+		}
 	fprintf(outfp, "# Card ID: 0x%s, Matcher ID: 0x%s\n",
-	    cardID, matcherID);
-	fprintf(outfp, "# There are %u BITs in the BIT group:\n", bit_count);
+	    card->cardID, card->matcherID);
+	fprintf(outfp, "# There are %u BITs in the BIT group:\n",
+	    card->bit_count);
 	fprintf(outfp, "# BIT 1 Info: CBEFF: 0x%04X:%04X :: Minutiae min/max/"
-	    "order: %u/%u/0x%02X\n", bit[0]->bit_format_owner,
-	    bit[0]->bit_format_type, bit[0]->bit_minutia_min,
-	    bit[0]->bit_minutia_max, bit[0]->bit_minutia_order);
-	if (bit_count != 1)
+	    "order: %u/%u/0x%02X\n", card->bit[0]->bit_format_owner,
+	    card->bit[0]->bit_format_type, card->bit[0]->bit_minutia_min,
+	    card->bit[0]->bit_minutia_max, card->bit[0]->bit_minutia_order);
+	if (card->bit_count != 1)
 		fprintf(outfp, "# BIT 2 Info: CBEFF: 0x%04X:%04X :: "
 		    "Minutiae min/max/order: %u/%u/0x%02X\n",
-		    bit[1]->bit_format_owner, bit[1]->bit_format_type,
-		    bit[1]->bit_minutia_min, bit[1]->bit_minutia_max,
-		    bit[1]->bit_minutia_order);
+		    card->bit[1]->bit_format_owner,
+		    card->bit[1]->bit_format_type,
+		    card->bit[1]->bit_minutia_min,
+		    card->bit[1]->bit_minutia_max,
+		    card->bit[1]->bit_minutia_order);
 	thetime = time(NULL);
 	fprintf(outfp, "# Local Time: %s", ctime(&thetime));
-	if (getcwd(outfn, MAXPATHLEN) == NULL)
-		ERR_EXIT("Could not get current working directory");
-	fprintf(outfp, "# Current working directory is %s\n#\n", outfn);
+	if (getcwd(cwd, MAXPATHLEN) != NULL)
+		fprintf(outfp, "# Current working directory is %s\n", cwd);
+	if (card->byenroll)
+		fprintf(outfp, "# Pairs processed in enrollment template "
+		    "order\n");
+	if (groupsize > 1) {
+		fprintf(outfp, "# Pairs shared by %d identical cards in "
+		    "readers:\n", groupsize);
+		for (c = 0; c < ncards; c++)
+			if (cards[c].group == group)
+				fprintf(outfp, "#   %s\n", cards[c].reader);
+	}
+	fprintf(outfp, "#\n");
+}
+
+/*
+ * The name of a card's results file, when the results are merged into
+ * the output file at the end, and of the checkpoint file.
+ */
+#define STRPARTFN(__fn, __outfn, __index)				\
+do {									\
+	snprintf(__fn, MAXPATHLEN, "%s.%d", __outfn, __index);		\
+} while (0)
+#define STRCKPTFN(__fn, __outfn)					\
+do {									\
+	snprintf(__fn, MAXPATHLEN, "%s.ckpt", __outfn);			\
+} while (0)
+
+static void
+free_resume_state(struct resume_state *rs)
+{
+	int i;
+
+	for (i = 0; i < CARDS_MAX; i++)
+		if (rs->reader[i] != NULL) {
+			free(rs->reader[i]);
+			rs->reader[i] = NULL;
+		}
+}
+
+/*
+ * Read the state of a stopped run from its checkpoint file. When the
+ * pairs were read up front, the locations of the results are placed in
+ * the result map. Reading stops at a line not completed when the run
+ * stopped.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+static int
+read_checkpoint(FILE *fp, struct resume_state *rs, struct result_map *map)
+{
+	char line[MAXPATHLEN + 64];
+	unsigned int iteration;
+	long offset, end;
+	int idx, ctr, n;
+	size_t len;
+
+	bzero(rs, sizeof(struct resume_state));
+	for (idx = 0; idx < CARDS_MAX; idx++)
+		rs->retries[idx] = MOC_RETRY_UNKNOWN;
+	if ((fgets(line, sizeof(line), fp) == NULL) ||
+	    (sscanf(line, "start %ld %d %d %u", &rs->start, &rs->scheduled,
+	    &rs->byenroll, &rs->npairs) != 4))
+		ERR_OUT("Invalid checkpoint file header");
+	if ((map != NULL) && (rs->npairs != map->npairs))
+		ERR_OUT("Checkpoint is for %u pairs, not %u", rs->npairs,
+		    map->npairs);
+	rs->good = ftell(fp);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		len = strlen(line);
+		if (line[len - 1] != '\n')
+			break;
+		line[len - 1] = '\0';
+		if (strncmp(line, "card ", 5) == 0) {
+			if ((sscanf(line + 5, "%d %n", &idx, &n) != 1) ||
+			    (idx < 0) || (idx >= CARDS_MAX))
+				break;
+			if (rs->reader[idx] != NULL)
+				free(rs->reader[idx]);
+			rs->reader[idx] = strdup(line + 5 + n);
+			if (rs->reader[idx] == NULL)
+				ALLOC_ERR_OUT("Reader name");
+			rs->retries[idx] = MOC_RETRY_UNKNOWN;
+		} else {
+			if ((sscanf(line, "%u %d %ld %ld %d", &iteration, &idx,
+			    &offset, &end, &ctr) != 5) ||
+			    (idx < 0) || (idx >= CARDS_MAX) || (iteration < 1))
+				break;
+			if (map != NULL) {
+				if (iteration > map->npairs)
+					break;
+				map->offset[iteration - 1] = offset;
+				map->card[iteration - 1] = idx;
+			} else if (iteration != rs->count + 1) {
+				break;
+			}
+			rs->end[idx] = end;
+			rs->retries[idx] = ctr;
+			rs->count++;
+		}
+		if (idx >= rs->nfiles)
+			rs->nfiles = idx + 1;
+		rs->good = ftell(fp);
+	}
+	return (0);
+
+err_out:
+	return (-1);
+}
+
+/*
+ * Record the result line of a pair as complete: sync the line to disk,
+ * then add it to the checkpoint file. The checkpoint file is shared by
+ * the cards of a group.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+static int
+commit_result(struct moc_card *card, unsigned int iteration, long offset,
+    int retries)
+{
+	struct checkpoint *ckpt = card->ckpt;
+	long end;
+	int retval = -1;
+
+	if (fflush(card->resfp) != 0)
+		return (-1);
+	end = ftell(card->resfp);
+	if (fsync(fileno(card->resfp)) != 0)
+		return (-1);
+
+	pthread_mutex_lock(&ckpt->lock);
+	if (card->results != NULL) {
+		card->results->offset[iteration - 1] = offset;
+		card->results->card[iteration - 1] = card->index;
+	}
+	fprintf(ckpt->fp, "%u %d %ld %ld %d\n", iteration, card->index,
+	    offset, end, retries);
+	if ((fflush(ckpt->fp) == 0) && (fsync(fileno(ckpt->fp)) == 0))
+		retval = 0;
+	pthread_mutex_unlock(&ckpt->lock);
+	return (retval);
+}
+
+/*
+ * Create the output file of a group, its checkpoint file, and the
+ * results files of its cards.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+static int
+create_group_results(struct card_group *grp, struct moc_card *cards,
+    int ncards, int group, int scheduled, int byenroll, unsigned int npairs)
+{
+	char fn[MAXPATHLEN];
+	struct stat sb;
+	int i;
+
+	if (stat(grp->outfn, &sb) == 0)
+		ERR_OUT("File %s exists; use -r to resume the run",
+		    grp->outfn);
+	if ((grp->outfp = fopen(grp->outfn, "w")) == NULL)
+		ERR_OUT("Could not open %s: %s", grp->outfn,
+		    strerror(errno));
+	write_results_header(grp->outfp, cards, ncards, group, grp->ncards);
+	if (fflush(grp->outfp) != 0)
+		ERR_OUT("Could not write %s", grp->outfn);
+
+	STRCKPTFN(grp->ckpt.fn, grp->outfn);
+	if ((grp->ckpt.fp = fopen(grp->ckpt.fn, "w")) == NULL)
+		ERR_OUT("Could not open %s: %s", grp->ckpt.fn,
+		    strerror(errno));
+	fprintf(grp->ckpt.fp, "start %ld %d %d %u\n", ftell(grp->outfp),
+	    scheduled, byenroll, npairs);
+
+	grp->nfiles = scheduled ? grp->ncards : 0;
+	if (grp->nfiles == 0)
+		return (0);
+	grp->resfps = (FILE **)calloc(grp->nfiles, sizeof(FILE *));
+	if (grp->resfps == NULL)
+		ALLOC_ERR_OUT("Results files");
+	for (i = 0; i < grp->nfiles; i++) {
+		STRPARTFN(fn, grp->outfn, i);
+		if ((grp->resfps[i] = fopen(fn, "w+")) == NULL)
+			ERR_OUT("Could not open %s: %s", fn,
+			    strerror(errno));
+	}
+	return (0);
+
+err_out:
+	return (-1);
+}
+
+/*
+ * Reopen the output, checkpoint, and results files of a group to resume
+ * a stopped run, dropping anything written after the last complete line.
+ * The cards in the readers of the stopped run keep their retry counters,
+ * less the attempt that may have been in flight.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+static int
+resume_group_results(struct card_group *grp, struct moc_card *cards,
+    int ncards, int group, int scheduled, int byenroll, unsigned int npairs,
+    struct resume_state *rs)
+{
+	char fn[MAXPATHLEN];
+	long end;
+	int c, i;
+
+	if ((grp->outfp = fopen(grp->outfn, "r+")) == NULL)
+		ERR_OUT("Could not open %s to resume: %s", grp->outfn,
+		    strerror(errno));
+	STRCKPTFN(grp->ckpt.fn, grp->outfn);
+	if ((grp->ckpt.fp = fopen(grp->ckpt.fn, "r+")) == NULL)
+		ERR_OUT("Could not open %s to resume: %s", grp->ckpt.fn,
+		    strerror(errno));
+	if (read_checkpoint(grp->ckpt.fp, rs,
+	    scheduled ? &grp->results : NULL) != 0)
+		ERR_OUT("Could not read %s", grp->ckpt.fn);
+	if ((rs->scheduled != scheduled) || (rs->byenroll != byenroll) ||
+	    (rs->npairs != npairs))
+		ERR_OUT("Options do not match the run in %s", grp->ckpt.fn);
+	if (ftruncate(fileno(grp->ckpt.fp), rs->good) != 0)
+		ERR_OUT("Could not truncate %s", grp->ckpt.fn);
+	fseek(grp->ckpt.fp, 0, SEEK_END);
+
+	end = rs->start;
+	if (!scheduled && (rs->count != 0))
+		end = rs->end[0];
+	if (ftruncate(fileno(grp->outfp), end) != 0)
+		ERR_OUT("Could not truncate %s", grp->outfn);
+	fseek(grp->outfp, 0, SEEK_END);
+	grp->resumed = rs->count;
+
+	for (c = 0; c < ncards; c++) {
+		if (cards[c].group != group)
+			continue;
+		i = cards[c].index;
+		if ((rs->retries[i] > 0) && (rs->reader[i] != NULL) &&
+		    (strcmp(rs->reader[i], cards[c].reader) == 0))
+			cards[c].retries = rs->retries[i] - 1;
+	}
+
+	/*
+	 * Results files of cards not present now are kept for the merge.
+	 */
+	grp->nfiles = 0;
+	if (scheduled)
+		grp->nfiles = MAX(grp->ncards, rs->nfiles);
+	if (grp->nfiles == 0)
+		return (0);
+	grp->resfps = (FILE **)calloc(grp->nfiles, sizeof(FILE *));
+	if (grp->resfps == NULL)
+		ALLOC_ERR_OUT("Results files");
+	for (i = 0; i < grp->nfiles; i++) {
+		STRPARTFN(fn, grp->outfn, i);
+		grp->resfps[i] = fopen(fn, "r+");
+		if ((grp->resfps[i] == NULL) && (i < grp->ncards))
+			grp->resfps[i] = fopen(fn, "w+");
+		if (grp->resfps[i] == NULL)
+			ERR_OUT("Could not open %s: %s", fn,
+			    strerror(errno));
+		if (ftruncate(fileno(grp->resfps[i]), rs->end[i]) != 0)
+			ERR_OUT("Could not truncate %s", fn);
+		fseek(grp->resfps[i], 0, SEEK_END);
+	}
+	return (0);
 
+err_out:
+	return (-1);
+}
+
+/*
+ * Remove the checkpoint and card results files of a group once its
+ * output file is complete.
+ */
+static void
+remove_group_checkpoint(struct card_group *grp)
+{
+	char fn[MAXPATHLEN];
+	int i;
+
+	for (i = 0; i < grp->nfiles; i++) {
+		STRPARTFN(fn, grp->outfn, i);
+		unlink(fn);
+	}
+	unlink(grp->ckpt.fn);
+}
+
+/*
+ * The card thread: start the producer for the card's ring, and send the
+ * pairs prepared into the ring to the card, writing the results to the
+ * card's results file.
+ */
+static void *
+run_card(void *arg)
+{
+	struct moc_card *card = (struct moc_card *)arg;
+	struct pair_ring *ring = &card->ring;
+	struct prepared_pair *pp;
+	pthread_t producer;
+	int producing = 0;
+	BDB cardresponse;
+	void *respbuf = NULL;
+	APDU enrollapdu, verifyapdu;
+	FILE *resfp = card->resfp;
+	char enrolledfn[MAXPATHLEN];	/* template stored on the card */
+	uint8_t sw1, sw2;
+	uint16_t score;
+	int retries;
+	unsigned int iteration;
+	long lineoff;
+	PHASEHIST *phases = ring->phases;
+	struct timespec starttm, finishtm;
+	uint64_t delta_t;
+
+	card->status = EXIT_FAILURE;
+	respbuf = malloc(RESPONSEBUFSIZE);
+	if (respbuf == NULL)
+		ALLOC_ERR_OUT("Response BDB buffer");
+	INIT_BDB(&cardresponse, respbuf, RESPONSEBUFSIZE);
+	enrolledfn[0] = '\0';
 	enrollapdu = MOCSTORETEMPLATE;
 	verifyapdu = MOCVERIFY;
-	mtdobuf[V] = malloc(RESPONSEBUFSIZE);
-	if (mtdobuf[V] == NULL)
-		ALLOC_ERR_EXIT("MTDO[V] BDB buffer");
-	mtdobuf[E] = malloc(RESPONSEBUFSIZE);
-	if (mtdobuf[E] == NULL)
-		ALLOC_ERR_EXIT("MTDO[E] BDB buffer");
-
-	resetctr = MOC_RESET_RETRY_MAX + 1;	/* Force a reset at the start */
-	iteration = 1;
-	while (1) {
-		if (fscanf(infp, "%s %s", &fmrfn[V], &fmrfn[E]) != 2)
-			if (feof(infp))
-				break;
-			else
-				ERR_OUT("Reading input file");
-
-		printf("\rIteration: %u", iteration); fflush(stdout);
-		new_fmr(FMR_STD_ANSI, &infmr[V]);
-		new_fmr(FMR_STD_ANSI, &infmr[E]);
-
-		/* Read verification minutiae file */
-		fmrfp = fopen(fmrfn[V], "rb");
-		if (fmrfp == NULL)
-			ERR_OUT("Could not open FMR file %s", fmrfn[V]);
-		if (read_fmr(fmrfp, infmr[V]) != READ_OK)
-			ERR_OUT("Could not read FMR file %s", fmrfn[V]);
-		fclose(fmrfp);
-		CHOOSEPRUNECENTER(fmrfn[V], infmr[V], cx[V], cy[V], usecm[V]);
-
-		/* Read enrollment minutiae file */
-		fmrfp = fopen(fmrfn[E], "rb");
-		if (fmrfp == NULL)
-			ERR_OUT("Could not open FMR file %s", fmrfn[E]);
-		if (read_fmr(fmrfp, infmr[E]) != READ_OK)
-			ERR_OUT("Could not read FMR file %s", fmrfn[E]);
-		fclose(fmrfp);
-		CHOOSEPRUNECENTER(fmrfn[E], infmr[E], cx[E], cy[E], usecm[E]);
 
-		/*
-		 * The first BIT is applied to the enrollment template, the
-		 * second to the verify template, as per the MINEX-II test spec.
-		 */
-		fprintf(outfp, "%s", fmrfn[V]);
-		minutiae_count =
-		    get_fmd_count(TAILQ_FIRST(&infmr[V]->finger_views));
-		fprintf(outfp, " %d", minutiae_count);
-		new_fmr(FMR_STD_ISO_COMPACT_CARD, &ccfmr[V]);
-		if (prune_convert_sort_fmr(infmr[V], ccfmr[V],
-		    bit[1]->bit_minutia_min, bit[1]->bit_minutia_max,
-		    bit[1]->bit_minutia_order, cx[V], cy[V], usecm[V]) != 0)
-			ERR_OUT("Pruning/sorting first FMR failed.");
-		/* create_mtdo() inits the mtdo BDB blocks... */
-		create_mtdo(ccfmr[V], &mtdo[V], mtdobuf[V], &mtdolen[V]);
-		minutiae_count =
-		    get_fmd_count(TAILQ_FIRST(&ccfmr[V]->finger_views));
-		fprintf(outfp, " %d", minutiae_count);
-
-		fprintf(outfp, " %s", fmrfn[E]);
-		minutiae_count =
-		    get_fmd_count(TAILQ_FIRST(&infmr[E]->finger_views));
-		fprintf(outfp, " %d", minutiae_count);
-		new_fmr(FMR_STD_ISO_COMPACT_CARD, &ccfmr[E]);
-		if (prune_convert_sort_fmr(infmr[E], ccfmr[E],
-		    bit[0]->bit_minutia_min, bit[0]->bit_minutia_max,
-		    bit[0]->bit_minutia_order, cx[E], cy[E], usecm[E]) != 0)
-			ERR_OUT("Pruning/sorting second FMR failed.");
-		create_mtdo(ccfmr[E], &mtdo[E], mtdobuf[E], &mtdolen[E]);
-		minutiae_count =
-		    get_fmd_count(TAILQ_FIRST(&ccfmr[E]->finger_views));
-		fprintf(outfp, " %d", minutiae_count);
+	/*
+	 * Start the producer thread, which prepares the templates for the
+	 * next pairs while the card is busy with the current one.
+	 */
+	if (pthread_create(&producer, NULL, pair_producer, ring) != 0)
+		ERR_OUT("Could not create template producer thread");
+	producing = 1;
+
+	retries = card->retries;
+	while ((pp = pair_ring_get(ring)) != NULL) {
+		iteration = pp->iteration;
+		if (card->progress) {
+			printf("\rIteration: %u", iteration);
+			fflush(stdout);
+		}
+		lineoff = ftell(resfp);
+		card->pairs++;
+
+		fprintf(resfp, "%s %d %d %s %d %d", pp->fmrfn[V],
+		    pp->incount[V], pp->cccount[V], pp->fmrfn[E],
+		    pp->incount[E], pp->cccount[E]);
 
 		/*
 		 * Build the APDUs to be sent to the card by adding the
 		 * minutiae template data object to the pre-defined APDU's
 		 * command data field.
 		 */
-		add_data_to_apdu((uint8_t *)mtdo[E].bdb_start, mtdolen[E],
-		    &enrollapdu);
-		REWIND_BDB(&cardresponse);
-		gettimeofday(&starttm, 0);
-		if (sendAPDU(hCard, &enrollapdu, dryrun, &cardresponse,
-		    &sw1, &sw2) != 0)
-			ERR_OUT("Could not enroll");
-		gettimeofday(&finishtm, 0);
-		delta_t = (double)(TIMEINTERVAL(starttm, finishtm)) / 1000000;
-		fprintf(outfp, " %f", delta_t);
-		if (dryrun == 0)
-			CHECKSTATUSWITHRETRY("ENROLL", sw1, sw2, 1, outfp,
-			    goto nextone);
+		if (card->byenroll && (strcmp(pp->fmrfn[E], enrolledfn) == 0)) {
+			/* The enrollment template is already on the card */
+			fprintf(resfp, " %f", 0.0);
+			card->storeskipped++;
+		} else {
+			enrolledfn[0] = '\0';
+			add_data_to_apdu((uint8_t *)pp->mtdo[E].bdb_start,
+			    pp->mtdolen[E], &enrollapdu);
+			REWIND_BDB(&cardresponse);
+			PHASETIME(starttm);
+			if (sendAPDU(card->hCard, &enrollapdu, card->dryrun,
+			    &cardresponse, &sw1, &sw2) != 0)
+				ERR_OUT("Could not enroll");
+			PHASETIME(finishtm);
+			delta_t = PHASEINTERVAL(starttm, finishtm);
+			record_phase_time(&phases[PHASE_STORE], delta_t);
+			fprintf(resfp, " %f", (double)delta_t / 1000000000);
+			if (card->dryrun == 0)
+				CHECKSTATUSWITHRETRY("ENROLL", sw1, sw2, 1,
+				    resfp, goto nextone);
+			strcpy(enrolledfn, pp->fmrfn[E]);
+		}
 
 		/*
-		 * Every so often, perform a guaranteed match to reset the
-		 * retry counter on the card. We do this by sending in the
-		 * enrolled template for verification.
+		 * When the retry counter on the card is unknown, or as low
+		 * as we accept, perform a guaranteed match to reset it. We
+		 * do this by sending in the enrolled template for
+		 * verification. In a dry run, the card's status is not
+		 * known, and a failed match is assumed for each VERIFY.
 		 */
-		if (resetctr > MOC_RESET_RETRY_MAX) {
-			add_data_to_apdu((uint8_t *)mtdo[E].bdb_start,
-			    mtdolen[E], &verifyapdu);
+		if (retries <= MOC_RETRY_MIN) {
+			add_data_to_apdu((uint8_t *)pp->mtdo[E].bdb_start,
+			    pp->mtdolen[E], &verifyapdu);
 			REWIND_BDB(&cardresponse);
-			if (sendAPDU(hCard, &verifyapdu, dryrun, &cardresponse,
-			    &sw1, &sw2) != 0)
+			PHASETIME(starttm);
+			if (sendAPDU(card->hCard, &verifyapdu, card->dryrun,
+			    &cardresponse, &sw1, &sw2) != 0)
 				ERR_OUT("Could not verify");
-			if (dryrun == 0)
+			PHASETIME(finishtm);
+			record_phase_time(&phases[PHASE_RESET],
+			    PHASEINTERVAL(starttm, finishtm));
+			card->resets++;
+			if (card->dryrun == 0) {
+				update_retry_counter(sw1, sw2, &retries);
 				CHECKSTATUSWITHRETRY("PERFECT VERIFY",
-				    sw1, sw2, 1, outfp, goto nextone);
-			resetctr = 0;
+				    sw1, sw2, 1, resfp, goto nextone);
+			} else {
+				retries = RETRY_COUNTER_MAX;
+			}
 		}
-		resetctr++;
+		card->verifies++;
 
-		add_data_to_apdu((uint8_t *)mtdo[V].bdb_start, mtdolen[V],
-		    &verifyapdu);
+		add_data_to_apdu((uint8_t *)pp->mtdo[V].bdb_start,
+		    pp->mtdolen[V], &verifyapdu);
 		REWIND_BDB(&cardresponse);
-		/*
-		 * Write the compact card records to separate files,
-		 * if the user asked for it.
-		 */
-		if (dumpcc) {
-			sprintf(rawccfn, "probe_%d.CC", iteration-1);
-			rawccfp = fopen(rawccfn, "wb");
-			write_fmr(rawccfp, ccfmr[V]);
-			fclose(rawccfp);
-			sprintf(rawccfn, "gallery_%d.CC", iteration-1);
-			rawccfp = fopen(rawccfn, "wb");
-			write_fmr(rawccfp, ccfmr[E]);
-			fclose(rawccfp);
-		}
-		gettimeofday(&starttm, 0);
-		if (sendAPDU(hCard, &verifyapdu, dryrun, &cardresponse,
-		    &sw1, &sw2) != 0)
+		PHASETIME(starttm);
+		if (sendAPDU(card->hCard, &verifyapdu, card->dryrun,
+		    &cardresponse, &sw1, &sw2) != 0)
 			ERR_OUT("Could not verify");
-		gettimeofday(&finishtm, 0);
-		delta_t = (double)(TIMEINTERVAL(starttm, finishtm)) / 1000000;
-		fprintf(outfp, " %f", delta_t);
-		if (dryrun == 0)
-			CHECKSTATUSWITHRETRY("VERIFY", sw1, sw2, 1, outfp,
+		PHASETIME(finishtm);
+		delta_t = PHASEINTERVAL(starttm, finishtm);
+		record_phase_time(&phases[PHASE_VERIFY], delta_t);
+		fprintf(resfp, " %f", (double)delta_t / 1000000000);
+		if (card->dryrun == 0) {
+			update_retry_counter(sw1, sw2, &retries);
+			CHECKSTATUSWITHRETRY("VERIFY", sw1, sw2, 1, resfp,
 			    goto nextone);
+		} else {
+			retries--;
+		}
 
-		/* Write a 0 to represent the exit status from the 
+		/* Write a 0 to represent the exit status from the
 		 * match_templates() call made in the SDK test.
 		 */
-		fprintf(outfp, " 0");
+		fprintf(resfp, " 0");
 
 		/* Set the true/false match indicator */
 		if (sw1 == APDU_NORMAL_COMPLETE)
-			fprintf(outfp, " T");
+			fprintf(resfp, " T");
 		else
-			fprintf(outfp, " F");
+			fprintf(resfp, " F");
 
 		/* Execute GET DATA APDU for similarity score */
 		REWIND_BDB(&cardresponse);
-		gettimeofday(&starttm, 0);
-		if (sendAPDU(hCard, &MOCGETSCORE, 0, &cardresponse, &sw1, &sw2)
-		    != 0)
+		PHASETIME(starttm);
+		if (sendAPDU(card->hCard, &MOCGETSCORE, 0, &cardresponse,
+		    &sw1, &sw2) != 0)
 			ERR_OUT("Could not get score");
-		gettimeofday(&finishtm, 0);
-		delta_t = (double)(TIMEINTERVAL(starttm, finishtm)) / 1000000;
-		fprintf(outfp, " %f", delta_t);
+		PHASETIME(finishtm);
+		delta_t = PHASEINTERVAL(starttm, finishtm);
+		record_phase_time(&phases[PHASE_SCORE], delta_t);
+		fprintf(resfp, " %f", (double)delta_t / 1000000000);
 		CHECKSTATUS("GET SCORE", sw1, sw2);
 		if (( ((uint8_t *)cardresponse.bdb_start)[0] != SCORETAG ) ||
 		    ( ((uint8_t *)cardresponse.bdb_start)[1] != SCORESIZE ))
 			ERR_OUT("Invalid score tag or length");
 		score = ntohs(*(uint16_t *)(cardresponse.bdb_start + 2));
-		fprintf(outfp, " %d\n", score);
+		fprintf(resfp, " %d\n", score);
 
 nextone:
-		free_fmr(ccfmr[V]);
-		free_fmr(ccfmr[E]);
-		free_fmr(infmr[V]);
-		free_fmr(infmr[E]);
-		iteration++;
+		PHASETIME(starttm);
+		if (commit_result(card, iteration, lineoff, retries) != 0)
+			ERR_OUT("Could not write checkpoint");
+		PHASETIME(finishtm);
+		record_phase_time(&phases[PHASE_WRITE],
+		    PHASEINTERVAL(starttm, finishtm));
+		pair_ring_put(ring);
 
-	} /* while not EOF */
-	printf("\n");
-	exitcode = EXIT_SUCCESS;
+	} /* while pairs remain */
+	pthread_join(producer, NULL);
+	producing = 0;
+	if (ring->error)
+		ERR_OUT("Preparing templates from the input file failed");
+	card->status = EXIT_SUCCESS;
 
 err_out:
+	/*
+	 * On failure, stop the producer; the pairs left in the ring are
+	 * not processed by any card.
+	 */
+	if (producing) {
+		pthread_mutex_lock(&ring->lock);
+		ring->cancel = 1;
+		pthread_cond_signal(&ring->notfull);
+		pthread_mutex_unlock(&ring->lock);
+		pthread_join(producer, NULL);
+	}
 	if (respbuf != NULL)
 		free(respbuf);
-	if (mtdobuf[V] != NULL)
-		free(mtdobuf[V]);
-	if (mtdobuf[E] != NULL)
-		free(mtdobuf[E]);
-	if (bit[0] != NULL)
-		free(bit[0]);
-	if ((bit_count != 1) && (bit[1] != NULL))
-		free(bit[1]);
+	return (NULL);
+}
+
+int
+main(int argc, char *argv[])
+{
+	FILE *infp = NULL;
+	struct moc_card *cards = NULL;
+	int ncards = 0;
+	struct card_group *groups = NULL;
+	int ngroups = 0;
+	struct pair_names *schedule = NULL;
+	unsigned int npairs = 0;
+	long depth = PAIR_RING_DEPTH;
+	char *endp;
+	char outfn[MAXPATHLEN], pairfn[MAXPATHLEN], binfn[MAXPATHLEN];
+	struct resume_state rs;
+	int exitcode;
+	int dryrun = 0;
+	int dumpcc = 0;
+	int binary = 0;
+	char *storefn = NULL;
+	MTDOSTORE store;
+	int byenroll = 0;
+	int direct = 0;
+	int multi = 0;
+	int resume = 0;
+	int running = 0;
+	unsigned int i, fixed;
+	int c, g, ret, ch;
+
+	SCARDCONTEXT context;
+	char **readers;
+	int rdr, rdrcount;
+
+	if ((argc < 2) || (argc > 13))
+		usage();
+
+	while ((ch = getopt(argc, argv, "bcdefk:mrs:")) != -1) {
+		switch (ch) {
+		case 'b':
+			binary = 1;
+			break;
+		case 'c':
+			dumpcc = 1;
+			break;
+		case 'd':
+			dryrun = 1;
+			break;
+		case 'e':
+			byenroll = 1;
+			break;
+		case 'f':
+			direct = 1;
+			break;
+		case 'k':
+			depth = strtol(optarg, &endp, 10);
+			if ((*endp != '\0') || (depth < 1) ||
+			    (depth > PAIR_RING_DEPTH_MAX))
+				usage();
+			break;
+		case 'm':
+			multi = 1;
+			break;
+		case 'r':
+			resume = 1;
+			break;
+		case 's':
+			storefn = optarg;
+			break;
+		default :
+			usage();
+			break;
+		}
+	}
+	if (direct && dumpcc)
+		usage();
+	if (multi && (dryrun || dumpcc))
+		usage();
+	exitcode = EXIT_FAILURE;
+	bzero(&rs, sizeof(rs));
+	infp = fopen(argv[optind], "r");
+	if (infp == NULL)
+		ERR_EXIT("open of %s failed: %s", argv[optind],
+		    strerror(errno));
+
+	if ((storefn != NULL) && (open_mtdo_store(storefn, &store) != 0))
+		ERR_EXIT("Could not open template store %s", storefn);
+
+	/*
+	 * Connect to the readers and cards. Check readers in order, and
+	 * use the first one that contains a MOC card, or, when running on
+	 * multiple cards, all of them. In the future, we may want to accept
+	 * the reader IDs as input parameters.
+	 */
+	if (SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &context) !=
+	     SCARD_S_SUCCESS)
+		ERR_EXIT("Could not establish contact with reader");
+	if (getReaders(context, &readers, &rdrcount) != 0)
+		ERR_EXIT("Could not get list of readers.");
+	if (rdrcount < 1)
+		ERR_EXIT("No readers found");
+	cards = (struct moc_card *)calloc(rdrcount, sizeof(struct moc_card));
+	groups = (struct card_group *)calloc(rdrcount,
+	    sizeof(struct card_group));
+	if ((cards == NULL) || (groups == NULL))
+		ALLOC_ERR_OUT("Card list");
+
+	for (rdr = 0; rdr < rdrcount; rdr++) {
+		printf("\nTrying reader %s\n", readers[rdr]);
+		ret = connect_moc_card(readers[rdr], dryrun, &cards[ncards]);
+		if (ret < 0)
+			ERR_OUT("Could not connect to card in %s",
+			    readers[rdr]);
+		if (ret != 0)
+			continue;
+		printf("\nMOC card found in %s\n", readers[rdr]);
+
+		/*
+		 * Group the card with an identical card found earlier.
+		 * A card with the IDs of another but different BITs
+		 * cannot share its pairs or output file, and is not used.
+		 */
+		for (c = 0; c < ncards; c++)
+			if (same_card_ids(&cards[c], &cards[ncards]))
+				break;
+		if (c < ncards) {
+			if (!same_card_bits(&cards[c], &cards[ncards])) {
+				INFOP("Card in %s has the IDs of the card in "
+				    "%s but different BITs; not used",
+				    readers[rdr], cards[c].reader);
+				disconnect_moc_card(&cards[ncards]);
+				bzero(&cards[ncards], sizeof(struct moc_card));
+				continue;
+			}
+			g = cards[c].group;
+			if (groups[g].ncards >= CARDS_MAX) {
+				INFOP("Card in %s is identical to %d cards "
+				    "already found; not used", readers[rdr],
+				    CARDS_MAX);
+				disconnect_moc_card(&cards[ncards]);
+				bzero(&cards[ncards], sizeof(struct moc_card));
+				continue;
+			}
+		} else {
+			g = ngroups++;
+		}
+		cards[ncards].group = g;
+		cards[ncards].index = groups[g].ncards++;
+		ncards++;
+		if (!multi)
+			break;
+	}
+	if (ncards == 0)
+		ERR_OUT("Could not connect to card");
+
+	/*
+	 * When processing the pairs in enrollment template order, or
+	 * sharing them among cards, all pairs are read up front. The
+	 * results are then written to a temporary file per card, and
+	 * copied to the output file in input file order at the end.
+	 */
+	if (byenroll || multi)
+		if (read_pair_schedule(infp, byenroll, &schedule, &npairs)
+		    != 0)
+			ERR_OUT("Could not read pairs from %s", argv[optind]);
+
+	/*
+	 * Create the output file of each group, or, when resuming, reopen
+	 * the files of the stopped run and skip the pairs already done.
+	 */
+	for (g = 0; g < ngroups; g++) {
+		for (c = 0; c < ncards; c++)
+			if (cards[c].group == g)
+				break;
+		/* The output file name is a combination of the IDs. */
+		STRGENTESTFN(groups[g].outfn, cards[c].cardID,
+		    cards[c].matcherID);
+		cards[c].byenroll = byenroll;
+		pthread_mutex_init(&groups[g].ckpt.lock, NULL);
+		if (schedule != NULL) {
+			pthread_mutex_init(&groups[g].cursor.lock, NULL);
+			groups[g].cursor.schedule = schedule;
+			groups[g].cursor.npairs = npairs;
+			if (new_result_map(&groups[g].results, npairs) != 0)
+				ALLOC_ERR_OUT("Result offsets");
+			groups[g].cursor.done = groups[g].results.offset;
+		}
+		if (resume) {
+			ret = resume_group_results(&groups[g], cards, ncards,
+			    g, schedule != NULL, byenroll, npairs, &rs);
+			free_resume_state(&rs);
+		} else {
+			ret = create_group_results(&groups[g], cards, ncards,
+			    g, schedule != NULL, byenroll, npairs);
+		}
+		if (ret != 0)
+			ERR_OUT("Could not set up the results for %s",
+			    groups[g].outfn);
+		if (resume)
+			printf("Resuming %s after %u pairs\n", groups[g].outfn,
+			    groups[g].resumed);
+		for (c = 0; c < ncards; c++)
+			if (cards[c].group == g)
+				fprintf(groups[g].ckpt.fp, "card %d %s\n",
+				    cards[c].index, cards[c].reader);
+		fflush(groups[g].ckpt.fp);
+	}
+	if (resume && (schedule == NULL))
+		for (i = 0; i < groups[0].resumed; i++)
+			if (fscanf(infp, "%s %s", outfn, pairfn) != 2)
+				ERR_OUT("%s has fewer pairs than were done",
+				    argv[optind]);
+
+	/* Set up each card's ring and results, then start the cards. */
+	for (c = 0; c < ncards; c++) {
+		g = cards[c].group;
+		if (new_pair_ring(&cards[c].ring, depth) != 0)
+			ERR_OUT("Could not create prepared pair ring");
+		cards[c].ring.infp = infp;
+		cards[c].ring.first = groups[g].resumed + 1;
+		cards[c].ring.bit = cards[c].bit;
+		cards[c].ring.store = (storefn != NULL) ? &store : NULL;
+		cards[c].ring.dumpcc = dumpcc;
+		cards[c].ring.direct = direct;
+		cards[c].byenroll = byenroll;
+		cards[c].progress = (ncards == 1);
+		cards[c].ckpt = &groups[g].ckpt;
+		if (schedule == NULL) {
+			cards[c].resfp = groups[g].outfp;
+			continue;
+		}
+		cards[c].ring.cursor = &groups[g].cursor;
+		cards[c].results = &groups[g].results;
+		cards[c].resfp = groups[g].resfps[cards[c].index];
+	}
+	for (c = 0; c < ncards; c++) {
+		if (pthread_create(&cards[c].thread, NULL, run_card,
+		    &cards[c]) != 0)
+			ERR_OUT("Could not create card thread");
+		running++;
+	}
+	exitcode = EXIT_SUCCESS;
+
+err_out:
+	for (c = 0; c < running; c++) {
+		pthread_join(cards[c].thread, NULL);
+		if (cards[c].status != EXIT_SUCCESS) {
+			ERRP("Testing with the card in %s failed",
+			    cards[c].reader);
+			groups[cards[c].group].failed = 1;
+			exitcode = EXIT_FAILURE;
+		}
+	}
+	if (running != 0)
+		printf("\n");
+	for (c = 0; c < running; c++) {
+		if (ncards > 1)
+			printf("%u pairs processed by the card in %s\n",
+			    cards[c].pairs, cards[c].reader);
+		if (byenroll)
+			printf("%u STORE TEMPLATE commands skipped\n",
+			    cards[c].storeskipped);
+		/*
+		 * Compare with a reset before the first VERIFY and then
+		 * after every MOC_RESET_RETRY_MAX VERIFYs.
+		 */
+		fixed = (cards[c].verifies + MOC_RESET_RETRY_MAX - 1) /
+		    MOC_RESET_RETRY_MAX;
+		printf("%u retry counter reset VERIFYs sent, %d saved over "
+		    "resetting every %d pairs\n", cards[c].resets,
+		    (int)fixed - (int)cards[c].resets, MOC_RESET_RETRY_MAX);
+	}
+
+	/* The phase times of all cards, summed into those of the first */
+	if (running != 0) {
+		for (c = 1; c < running; c++)
+			for (i = 0; i < PHASE_COUNT; i++)
+				add_phase_histogram(&cards[0].ring.phases[i],
+				    &cards[c].ring.phases[i]);
+		printf("\n");
+		print_phase_summary(stdout, phase_names, cards[0].ring.phases,
+		    PHASE_COUNT);
+	}
+
+	/*
+	 * A group's output file is complete when all of its cards finished;
+	 * otherwise its checkpoint and card results files are kept for -r.
+	 */
+	for (g = 0; g < ngroups; g++) {
+		if ((running == ncards) && !groups[g].failed) {
+			if (groups[g].resfps != NULL)
+				merge_results(&groups[g].results,
+				    groups[g].resfps, groups[g].outfp);
+			remove_group_checkpoint(&groups[g]);
+		} else if (groups[g].ckpt.fp != NULL) {
+			INFOP("Use -r to resume the run for %s",
+			    groups[g].outfn);
+		}
+		if (groups[g].resfps != NULL) {
+			for (c = 0; c < groups[g].nfiles; c++)
+				if (groups[g].resfps[c] != NULL)
+					fclose(groups[g].resfps[c]);
+			free(groups[g].resfps);
+		}
+		free_result_map(&groups[g].results);
+		if (groups[g].ckpt.fp != NULL)
+			fclose(groups[g].ckpt.fp);
+		if (groups[g].outfp != NULL)
+			fclose(groups[g].outfp);
+		if (binary && (running == ncards) && !groups[g].failed) {
+			GENBINRESFN(binfn, groups[g].outfn);
+			if (convert_results_file(groups[g].outfn, binfn) != 0) {
+				ERRP("Could not write %s", binfn);
+				exitcode = EXIT_FAILURE;
+			}
+		}
+	}
+	for (c = 0; c < ncards; c++) {
+		free_pair_ring(&cards[c].ring);
+		disconnect_moc_card(&cards[c]);
+	}
+	if (cards != NULL)
+		free(cards);
+	if (groups != NULL)
+		free(groups);
+	if (schedule != NULL) {
+		for (i = 0; i < npairs; i++) {
+			free(schedule[i].fmrfn[V]);
+			free(schedule[i].fmrfn[E]);
+		}
+		free(schedule);
+	}
+	if (storefn != NULL)
+		close_mtdo_store(&store);
 	if (infp != NULL)
 		fclose(infp);
-	if (outfp != NULL)
-		fclose(outfp);
 
 	exit (exitcode);
 }
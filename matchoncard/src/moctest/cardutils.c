@@ -29,7 +29,7 @@
 #include "cardutils.h"
 
 int
-get_bitgroup_from_card(SCARDHANDLE hCard, TLV *bitgroup_tlv)
+get_bits_from_card(SCARDHANDLE hCard, BIT *bits, int *bit_count)
 {
 	void *buf;
 	BDB cardresponse;
@@ -44,9 +44,10 @@ get_bitgroup_from_card(SCARDHANDLE hCard, TLV *bitgroup_tlv)
 		ERR_OUT("Could not read BIT group");
 	CHECKSTATUS("BIT group read", sw1, sw2);
 
+	cardresponse.bdb_end = cardresponse.bdb_current;
 	REWIND_BDB(&cardresponse);
-	if (scan_tlv(&cardresponse, bitgroup_tlv) != READ_OK)
-		ERR_OUT("Could not scan BIT group TLV");
+	if (scan_bit_group(&cardresponse, bits, bit_count) != READ_OK)
+		ERR_OUT("Could not decode BIT group");
 
 	free(buf);
 	return (READ_OK);
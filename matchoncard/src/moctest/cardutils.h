@@ -12,15 +12,16 @@
 					 * and any response from a card. */
 
 /*
- * Get the BIT group from a card.
+ * Get the BITs of the BIT group from a card, decoding the group as read.
  * Parameters:
  *	hCard        Handle to the opened card.
- *      bitgroup_tlv TLV representing the BIT group on return.
+ *	bits         Array of two BITs, set on return.
+ *	bit_count    Set to the number of BITs in the group, 1 or 2.
  * Returns:
  *	 READ_OK    Success
  *	 READ_ERROR Failure
  */
-int get_bitgroup_from_card(SCARDHANDLE hCard, TLV *bitgroup_tlv);
+int get_bits_from_card(SCARDHANDLE hCard, BIT *bits, int *bit_count);
 
 /*
  * Get the identifier present in the response from a card, represented as
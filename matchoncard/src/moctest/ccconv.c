@@ -0,0 +1,731 @@
+/*
+* This software was developed at the National Institute of Standards and
+* Technology (NIST) by employees of the Federal Government in the course
+* of their official duties. Pursuant to title 17 Section 105 of the
+* United States Code, this software is not subject to copyright protection
+* and is in the public domain. NIST assumes no responsibility whatsoever for
+* its use by other parties, and makes no guarantees, expressed or implied,
+* about its quality, reliability, or any other characteristic.
+*/
+
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <biomdimacro.h>
+#include <fmr.h>
+#include <isobit.h>
+#include <tlv.h>
+#include <moc.h>
+
+#include "genutils.h"
+
+#define CONV_WORKERS_MAX	256
+#define CONV_CHUNK		64	/* Templates taken by a worker at a
+					 * time */
+#define RECBUFSIZE		1024	/* Room for the MTDO or CC record of one
+					 * template */
+
+/* Output record formats, when writing individual files */
+#define FORMAT_CC		0
+#define FORMAT_MTDO		1
+#define CC_EXT			"CC"
+#define MTDO_EXT		"mtdo"
+
+/* Choice of the prune center */
+#define CENTER_NAME		0	/* From the file name */
+#define CENTER_MASS		1
+#define CENTER_FIXED		2
+
+/*
+ * This program converts a corpus of ANSI-378 templates into ISO compact
+ * card records or minutiae template data objects, without a card. The
+ * input is a directory, all of whose files are converted, or a manifest
+ * file naming the templates, separated by white space; a template-pairs
+ * file given to the test drivers may be used as the manifest.
+ *
+ * The BIT parameters are taken from a BIT group file, in which case each
+ * template is converted for each BIT of the group, or given with -m, -x
+ * and -r. The prune center is chosen from the template file name as the
+ * test drivers do, unless the center of mass (-C) or a fixed center (-c)
+ * is asked for. The templates are split among worker threads, each of
+ * which, for each of its templates:
+ * 1) reads the template and chooses the prune center
+ * 2) prunes/converts/sorts the template, using the first finger view
+ * 3) creates the ISO compact card record or the minutiae template data
+ *    object
+ * The records are written to individual files in a directory, named for
+ * the template file without its extension, or packed into a template
+ * store as built by mtdocomp, holding both records of each template.
+ */
+static void
+usage()
+{
+	fprintf(stderr, "Usage: ccconv [-b <bitfile> | -x <max> [-m <min>] "
+	    "[-r <order>] [-D]]\n"
+	    "\t[-C | -c <x>,<y>] [-f cc|mtdo] [-t <threads>] "
+	    "-d <outdir> | -o <storefile> <input>\n"
+	    "\t<bitfile> is the BIT group file saved from the card\n"
+	    "\t<min>, <max> are the BIT minimum and maximum minutiae counts\n"
+	    "\t<order> is the BIT minutiae order: none, xy, yx, angle or "
+	    "polar,\n"
+	    "\t   ascending, or descending with -D\n"
+	    "\t-C prunes around the center of mass, -c around <x>,<y>\n"
+	    "\t-f is the format of the individual files, default cc\n"
+	    "\t<threads> is the number of worker threads, default one per "
+	    "CPU\n"
+	    "\t<outdir> is the directory for the individual files\n"
+	    "\t<storefile> is the template store to create\n"
+	    "\t<input> is a directory of templates or a manifest file\n"
+	);
+	exit (EXIT_FAILURE);
+}
+
+/*
+ * One template to be converted for one BIT; the BIT number is used in
+ * the names of individual files when the BITs of the group differ.
+ */
+struct conv_item {
+	MTDOSTOREKEY	key;
+	int		bitno;
+	int		worker;		/* Holding the records in its data */
+	int		converted;
+};
+
+/* The templates to be converted, and how */
+struct conv_work {
+	struct conv_item *items;
+	uint32_t	count;
+	uint32_t	next;		/* Next item to be taken */
+	pthread_mutex_t	lock;
+	int		center;
+	uint16_t	cx, cy;
+	int		format;
+	char		*outdir;	/* NULL when building a store */
+	int		nbits;
+};
+
+/*
+ * A worker, with its own records, and the data area of the store for the
+ * templates it converts. When writing individual files, the data area
+ * holds only the records of the current template.
+ */
+struct conv_worker {
+	int		index;
+	struct conv_work *work;
+	FMRPOOL		pool;		/* records reused per template */
+	FMR		*infmr;
+	FMR		*ccfmr;
+	uint8_t		*data;
+	size_t		datalen;
+	size_t		datasize;
+	uint32_t	converted;
+	uint32_t	failed;
+	pthread_t	thread;
+};
+
+static int
+reserve_data(struct conv_worker *w, size_t len)
+{
+	uint8_t *ndata;
+	size_t nsize;
+
+	if (w->datalen + len <= w->datasize)
+		return (0);
+	nsize = (w->datasize == 0) ? 65536 : w->datasize;
+	while (nsize < w->datalen + len)
+		nsize *= 2;
+	ndata = (uint8_t *)realloc(w->data, nsize);
+	if (ndata == NULL)
+		return (-1);
+	w->data = ndata;
+	w->datasize = nsize;
+	return (0);
+}
+
+static int
+compare_items(const void *a, const void *b)
+{
+	const struct conv_item *ia = (const struct conv_item *)a;
+	const struct conv_item *ib = (const struct conv_item *)b;
+
+	return (compare_mtdo_store_keys(&ia->key, &ib->key));
+}
+
+/*
+ * Parse the name of a minutiae order into the BIT order value.
+ */
+static int
+parse_order(char *s, int descending, uint8_t *order)
+{
+	uint8_t dir;
+
+	dir = descending ? MINUTIA_ORDER_DESCENDING : MINUTIA_ORDER_ASCENDING;
+	if (strcasecmp(s, "none") == 0)
+		*order = MINUTIA_ORDER_NONE;
+	else if (strcasecmp(s, "xy") == 0)
+		*order = MINUTIA_ORDER_XY | dir;
+	else if (strcasecmp(s, "yx") == 0)
+		*order = MINUTIA_ORDER_YX | dir;
+	else if (strcasecmp(s, "angle") == 0)
+		*order = MINUTIA_ORDER_ANGLE | dir;
+	else if (strcasecmp(s, "polar") == 0)
+		*order = MINUTIA_ORDER_POLAR | dir;
+	else
+		return (-1);
+	return (0);
+}
+
+/*
+ * Write one record to its own file in the output directory. The file
+ * must not exist, so that two templates of the same name in different
+ * directories are not written over each other.
+ */
+static int
+write_record_file(struct conv_work *work, struct conv_item *item,
+    uint8_t *rec, size_t len)
+{
+	char fn[MAXPATHLEN];
+	char base[MAXPATHLEN];
+	char *p;
+	ssize_t n;
+	size_t off;
+	int fd;
+
+	p = strrchr(item->key.name, '/');
+	snprintf(base, sizeof(base), "%s", (p == NULL) ? item->key.name :
+	    p + 1);
+	p = strrchr(base, '.');
+	if ((p != NULL) && (p != base))
+		*p = '\0';
+	if (work->nbits > 1)
+		snprintf(fn, sizeof(fn), "%s/%s.bit%d.%s", work->outdir, base,
+		    item->bitno,
+		    (work->format == FORMAT_MTDO) ? MTDO_EXT : CC_EXT);
+	else
+		snprintf(fn, sizeof(fn), "%s/%s.%s", work->outdir, base,
+		    (work->format == FORMAT_MTDO) ? MTDO_EXT : CC_EXT);
+
+	fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (fd < 0)
+		ERR_OUT("Could not create %s: %s", fn, strerror(errno));
+	for (off = 0; off < len; off += n) {
+		n = write(fd, rec + off, len - off);
+		if (n <= 0) {
+			close(fd);
+			unlink(fn);
+			ERR_OUT("Could not write %s", fn);
+		}
+	}
+	if (close(fd) != 0) {
+		unlink(fn);
+		ERR_OUT("Could not write %s", fn);
+	}
+	return (0);
+
+err_out:
+	return (-1);
+}
+
+/*
+ * Read, prune, convert and sort one template for a BIT. For a store, its
+ * name, MTDO and compact card record are appended to the worker's data
+ * area; otherwise the record asked for is written to its file.
+ */
+static int
+convert_template(struct conv_worker *w, struct conv_item *item)
+{
+	struct conv_work *work = w->work;
+	MTDOSTOREKEY *key = &item->key;
+	FVMR *fvmr;
+	BDB bdb;
+	uint8_t *p;
+	size_t namelen;
+
+	if (work->outdir != NULL)
+		w->datalen = 0;
+	namelen = (work->outdir != NULL) ? 0 : strlen(key->name);
+	if (reserve_data(w, namelen + 2 * RECBUFSIZE) != 0)
+		ALLOC_ERR_OUT("Store data area");
+
+	if (pool_read_fmr(&w->pool, key->name, w->infmr) != 0)
+		ERR_OUT("Could not read FMR file %s", key->name);
+	switch (work->center) {
+	case CENTER_NAME:
+		CHOOSEPRUNECENTER(key->name, w->infmr, key->cx, key->cy,
+		    key->usecm);
+		break;
+	case CENTER_MASS:
+		key->cx = key->cy = 0;
+		key->usecm = TRUE;
+		break;
+	case CENTER_FIXED:
+		key->cx = work->cx;
+		key->cy = work->cy;
+		key->usecm = FALSE;
+		break;
+	}
+	fvmr = TAILQ_FIRST(&w->infmr->finger_views);
+	if (fvmr == NULL)
+		ERR_OUT("FMR %s contains no views", key->name);
+	key->incount = get_fmd_count(fvmr);
+
+	if (pool_prune_convert_sort_fmr(&w->pool, w->infmr, w->ccfmr,
+	    key->bit->bit_minutia_min, key->bit->bit_minutia_max,
+	    key->bit->bit_minutia_order, key->cx, key->cy, key->usecm) != 0)
+		ERR_OUT("Pruning/sorting FMR %s failed.", key->name);
+	fvmr = TAILQ_FIRST(&w->ccfmr->finger_views);
+	if (fvmr == NULL)
+		ERR_OUT("FMR %s contains no views", key->name);
+	key->cccount = get_fmd_count(fvmr);
+
+	key->nameoff = w->datalen;
+	memcpy(w->data + w->datalen, key->name, namelen);
+	w->datalen += namelen;
+
+	/* Convert only the first (and probably only) FVMR. */
+	p = w->data + w->datalen;
+	INIT_BDB(&bdb, p, RECBUFSIZE);
+	if (fvmr_to_mtdo(fvmr, &bdb) != WRITE_OK)
+		ERR_OUT("Could not convert FVMR to MTDO");
+	key->mtdooff = w->datalen;
+	key->mtdolen = bdb.bdb_current - bdb.bdb_start;
+	w->datalen += key->mtdolen;
+
+	p = w->data + w->datalen;
+	INIT_BDB(&bdb, p, RECBUFSIZE);
+	if (push_fmr(&bdb, w->ccfmr) != WRITE_OK)
+		ERR_OUT("Could not push CC FMR to buffer");
+	key->ccoff = w->datalen;
+	key->cclen = bdb.bdb_current - bdb.bdb_start;
+	w->datalen += key->cclen;
+
+	if (work->outdir != NULL) {
+		if (work->format == FORMAT_MTDO)
+			return (write_record_file(work, item,
+			    w->data + key->mtdooff, key->mtdolen));
+		else
+			return (write_record_file(work, item,
+			    w->data + key->ccoff, key->cclen));
+	}
+	return (0);
+
+err_out:
+	return (-1);
+}
+
+/*
+ * Take the templates in chunks until none are left. A template that
+ * cannot be converted is reported and counted, and the rest go on.
+ */
+static void *
+conv_thread(void *arg)
+{
+	struct conv_worker *w = (struct conv_worker *)arg;
+	struct conv_work *work = w->work;
+	uint32_t first, last, i;
+
+	while (1) {
+		pthread_mutex_lock(&work->lock);
+		first = work->next;
+		last = MIN(first + CONV_CHUNK, work->count);
+		work->next = last;
+		pthread_mutex_unlock(&work->lock);
+		if (first >= last)
+			break;
+		for (i = first; i < last; i++) {
+			if (convert_template(w, &work->items[i]) == 0) {
+				work->items[i].converted = 1;
+				work->items[i].worker = w->index;
+				w->converted++;
+			} else {
+				ERRP("Could not convert template %s",
+				    work->items[i].key.name);
+				w->failed++;
+			}
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Add one template to the list, once for each BIT.
+ */
+static int
+add_template(struct conv_work *work, uint32_t *size, char *name, BIT *bits)
+{
+	struct conv_item *nitems;
+	int b;
+
+	if (work->count + work->nbits > *size) {
+		*size = (*size == 0) ? 1024 : *size * 2;
+		nitems = (struct conv_item *)realloc(work->items,
+		    *size * sizeof(struct conv_item));
+		if (nitems == NULL)
+			ALLOC_ERR_OUT("Template list");
+		work->items = nitems;
+	}
+	for (b = 0; b < work->nbits; b++) {
+		bzero(&work->items[work->count], sizeof(struct conv_item));
+		work->items[work->count].key.name = strdup(name);
+		if (work->items[work->count].key.name == NULL)
+			ALLOC_ERR_OUT("Template name");
+		work->items[work->count].key.bit = &bits[b];
+		work->items[work->count].bitno = b;
+		work->count++;
+	}
+	return (0);
+
+err_out:
+	return (-1);
+}
+
+/*
+ * Collect the templates of a directory, leaving out hidden files and
+ * anything that is not a regular file, or those named in a manifest.
+ */
+static int
+collect_templates(struct conv_work *work, char *input, BIT *bits)
+{
+	char fn[MAXPATHLEN];
+	struct dirent *de;
+	struct stat sb;
+	uint32_t size;
+	FILE *fp;
+	DIR *dir;
+
+	size = 0;
+	if (stat(input, &sb) != 0)
+		ERR_OUT("Could not get stats on %s: %s", input,
+		    strerror(errno));
+	if (S_ISDIR(sb.st_mode)) {
+		dir = opendir(input);
+		if (dir == NULL)
+			ERR_OUT("Could not open directory %s: %s", input,
+			    strerror(errno));
+		while ((de = readdir(dir)) != NULL) {
+			if (de->d_name[0] == '.')
+				continue;
+			snprintf(fn, sizeof(fn), "%s/%s", input, de->d_name);
+			if ((stat(fn, &sb) != 0) || !S_ISREG(sb.st_mode))
+				continue;
+			if (add_template(work, &size, fn, bits) != 0) {
+				closedir(dir);
+				goto err_out;
+			}
+		}
+		closedir(dir);
+	} else {
+		fp = fopen(input, "r");
+		if (fp == NULL)
+			ERR_OUT("Could not open %s: %s", input,
+			    strerror(errno));
+		while (fscanf(fp, "%s", fn) == 1)
+			if (add_template(work, &size, fn, bits) != 0) {
+				fclose(fp);
+				goto err_out;
+			}
+		if (ferror(fp)) {
+			fclose(fp);
+			ERR_OUT("Reading manifest file %s", input);
+		}
+		fclose(fp);
+	}
+	if (work->count == 0)
+		ERR_OUT("No templates in %s", input);
+	return (0);
+
+err_out:
+	return (-1);
+}
+
+/*
+ * Write the store: the index of the converted templates, then the name
+ * and records of each in index order, copied from the data area of the
+ * worker that converted it, so that the store does not depend on how the
+ * templates were split among the workers.
+ */
+static int
+write_store(char *storefn, struct conv_work *work,
+    struct conv_worker *workers)
+{
+	FILE *fp;
+	MTDOSTOREKEY *keys;
+	struct conv_item *item;
+	uint8_t *data;
+	uint64_t off;
+	uint32_t count, i;
+	int retval, rv;
+
+	retval = -1;
+	keys = (MTDOSTOREKEY *)malloc(work->count * sizeof(MTDOSTOREKEY));
+	if (keys == NULL)
+		ALLOC_ERR_OUT("Store index");
+	off = 0;
+	count = 0;
+	for (i = 0; i < work->count; i++) {
+		item = &work->items[i];
+		if (!item->converted)
+			continue;
+		keys[count] = item->key;
+		keys[count].nameoff = off;
+		off += strlen(item->key.name);
+		keys[count].mtdooff = off;
+		off += item->key.mtdolen;
+		keys[count].ccoff = off;
+		off += item->key.cclen;
+		count++;
+	}
+	if (off > UINT32_MAX - MTDO_STORE_HDR_LEN -
+	    (uint64_t)count * MTDO_STORE_ENTRY_LEN)
+		ERR_OUT("Template store is too large");
+
+	if ((fp = fopen(storefn, "wb")) == NULL)
+		ERR_OUT("Could not open %s: %s", storefn, strerror(errno));
+	rv = write_mtdo_store_index(fp, keys, count);
+	for (i = 0; (rv == 0) && (i < work->count); i++) {
+		item = &work->items[i];
+		if (!item->converted)
+			continue;
+		data = workers[item->worker].data;
+		if ((fwrite(data + item->key.nameoff, 1,
+		    strlen(item->key.name), fp) != strlen(item->key.name)) ||
+		    (fwrite(data + item->key.mtdooff, 1, item->key.mtdolen,
+		    fp) != item->key.mtdolen) ||
+		    (fwrite(data + item->key.ccoff, 1, item->key.cclen,
+		    fp) != item->key.cclen))
+			rv = -1;
+	}
+	if (fclose(fp) != 0)
+		rv = -1;
+	if (rv != 0) {
+		remove(storefn);
+		ERR_OUT("Could not write template store %s", storefn);
+	}
+	printf("%u templates packed into %s\n", count, storefn);
+	retval = 0;
+
+err_out:
+	if (keys != NULL)
+		free(keys);
+	return (retval);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *bitfn, *storefn;
+	struct conv_work work;
+	struct conv_worker *workers = NULL;
+	long nworkers;
+	int started = 0;
+	BIT bits[2];
+	int bit_count;
+	char *minarg, *maxarg, *orderarg;
+	int descending;
+	unsigned long val;
+	uint32_t converted, failed, i, u;
+	struct stat sb;
+	char *endp;
+	int exitcode;
+	int ch, n;
+
+	bzero(&work, sizeof(work));
+	bzero(bits, sizeof(bits));
+	pthread_mutex_init(&work.lock, NULL);
+	work.center = CENTER_NAME;
+	work.format = FORMAT_CC;
+	bitfn = storefn = NULL;
+	minarg = maxarg = orderarg = NULL;
+	descending = 0;
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers < 1)
+		nworkers = 1;
+	if (nworkers > CONV_WORKERS_MAX)
+		nworkers = CONV_WORKERS_MAX;
+	while ((ch = getopt(argc, argv, "b:c:Cd:Df:m:o:r:t:x:")) != -1) {
+		switch (ch) {
+		case 'b':
+			bitfn = optarg;
+			break;
+		case 'c':
+			if (sscanf(optarg, "%hu,%hu", &work.cx, &work.cy) != 2)
+				usage();
+			work.center = CENTER_FIXED;
+			break;
+		case 'C':
+			work.center = CENTER_MASS;
+			break;
+		case 'd':
+			work.outdir = optarg;
+			break;
+		case 'D':
+			descending = 1;
+			break;
+		case 'f':
+			if (strcasecmp(optarg, "cc") == 0)
+				work.format = FORMAT_CC;
+			else if (strcasecmp(optarg, "mtdo") == 0)
+				work.format = FORMAT_MTDO;
+			else
+				usage();
+			break;
+		case 'm':
+			minarg = optarg;
+			break;
+		case 'o':
+			storefn = optarg;
+			break;
+		case 'r':
+			orderarg = optarg;
+			break;
+		case 't':
+			nworkers = strtol(optarg, &endp, 10);
+			if ((*endp != '\0') || (nworkers < 1) ||
+			    (nworkers > CONV_WORKERS_MAX))
+				usage();
+			break;
+		case 'x':
+			maxarg = optarg;
+			break;
+		default :
+			usage();
+			break;
+		}
+	}
+	if ((optind != argc - 1) || ((work.outdir == NULL) ==
+	    (storefn == NULL)))
+		usage();
+	if ((bitfn == NULL) == (maxarg == NULL))
+		usage();
+	if ((bitfn != NULL) &&
+	    ((minarg != NULL) || (orderarg != NULL) || descending))
+		usage();
+
+	exitcode = EXIT_FAILURE;
+	if (bitfn != NULL) {
+		if (read_bitgroup_file(bitfn, bits, &bit_count) != 0)
+			ERR_EXIT("Could not read BIT group file %s", bitfn);
+		work.nbits = bit_count;
+		if ((bit_count == 2) &&
+		    (bits[0].bit_minutia_min == bits[1].bit_minutia_min) &&
+		    (bits[0].bit_minutia_max == bits[1].bit_minutia_max) &&
+		    (bits[0].bit_minutia_order == bits[1].bit_minutia_order))
+			work.nbits = 1;
+	} else {
+		val = strtoul(maxarg, &endp, 10);
+		if ((*endp != '\0') || (val == 0) || (val > UINT8_MAX))
+			usage();
+		bits[0].bit_minutia_max = val;
+		if (minarg != NULL) {
+			val = strtoul(minarg, &endp, 10);
+			if ((*endp != '\0') || (val > bits[0].bit_minutia_max))
+				usage();
+			bits[0].bit_minutia_min = val;
+		}
+		if ((orderarg != NULL) && (parse_order(orderarg, descending,
+		    &bits[0].bit_minutia_order) != 0))
+			usage();
+		work.nbits = 1;
+	}
+
+	if (work.outdir != NULL) {
+		if ((stat(work.outdir, &sb) != 0) || !S_ISDIR(sb.st_mode))
+			ERR_OUT("%s is not a directory", work.outdir);
+	} else {
+		if (stat(storefn, &sb) == 0)
+			ERR_OUT("File %s exists", storefn);
+	}
+
+	/*
+	 * Sort the templates so that each is converted once per BIT, no
+	 * matter how many times it is named.
+	 */
+	if (collect_templates(&work, argv[optind], bits) != 0)
+		goto err_out;
+	qsort(work.items, work.count, sizeof(struct conv_item),
+	    compare_items);
+	u = 0;
+	for (i = 0; i < work.count; i++) {
+		if ((u != 0) &&
+		    (compare_items(&work.items[u - 1], &work.items[i]) == 0)) {
+			free(work.items[i].key.name);
+			continue;
+		}
+		work.items[u++] = work.items[i];
+	}
+	work.count = u;
+	if ((uint32_t)nworkers > (work.count + CONV_CHUNK - 1) / CONV_CHUNK)
+		nworkers = (work.count + CONV_CHUNK - 1) / CONV_CHUNK;
+
+	workers = (struct conv_worker *)calloc(nworkers,
+	    sizeof(struct conv_worker));
+	if (workers == NULL)
+		ALLOC_ERR_OUT("Workers");
+	for (n = 0; n < nworkers; n++) {
+		workers[n].index = n;
+		workers[n].work = &work;
+		init_fmr_pool(&workers[n].pool);
+		if ((new_fmr(FMR_STD_ANSI, &workers[n].infmr) < 0) ||
+		    (new_fmr(FMR_STD_ISO_COMPACT_CARD,
+		    &workers[n].ccfmr) < 0))
+			ALLOC_ERR_OUT("FMR");
+	}
+	for (started = 0; started < nworkers; started++)
+		if (pthread_create(&workers[started].thread, NULL,
+		    conv_thread, &workers[started]) != 0)
+			ERR_OUT("Could not create worker thread");
+	for (n = 0; n < started; n++)
+		pthread_join(workers[n].thread, NULL);
+	started = 0;
+
+	converted = failed = 0;
+	for (n = 0; n < nworkers; n++) {
+		converted += workers[n].converted;
+		failed += workers[n].failed;
+	}
+	printf("%u templates converted, %u failed\n", converted, failed);
+	if (storefn != NULL) {
+		if (converted == 0)
+			ERR_OUT("No templates to pack into %s", storefn);
+		if (write_store(storefn, &work, workers) != 0)
+			goto err_out;
+	}
+	if (failed == 0)
+		exitcode = EXIT_SUCCESS;
+
+err_out:
+	for (n = 0; n < started; n++)
+		pthread_join(workers[n].thread, NULL);
+	if (workers != NULL) {
+		for (n = 0; n < nworkers; n++) {
+			if (workers[n].ccfmr != NULL)
+				free_fmr(workers[n].ccfmr);
+			if (workers[n].infmr != NULL)
+				free_fmr(workers[n].infmr);
+			free_fmr_pool(&workers[n].pool);
+			if (workers[n].data != NULL)
+				free(workers[n].data);
+		}
+		free(workers);
+	}
+	if (work.items != NULL) {
+		for (i = 0; i < work.count; i++)
+			free(work.items[i].key.name);
+		free(work.items);
+	}
+	pthread_mutex_destroy(&work.lock);
+	exit (exitcode);
+}
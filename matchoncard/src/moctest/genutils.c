@@ -7,17 +7,24 @@
 * its use by other parties, and makes no guarantees, expressed or implied,
 * about its quality, reliability, or any other characteristic.
 */
+#include <sys/mman.h>
+#include <sys/param.h>
 #include <sys/queue.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <biomdimacro.h>
 #include <fmr.h>
-#include <fmrsort.h>
 #include <isobit.h>
 #include <tlv.h>
 #include <moc.h>
@@ -47,103 +54,555 @@ compare_by_index(const void *m1, const void *m2)
 		else
 			return (1);
 }
+/*
+ * Grow an array kept in the pool to hold at least __count entries.
+ */
+#define POOL_GROW(__arr, __size, __count)				\
+	do {								\
+		void *__narr;						\
+		if ((__count) > (__size)) {				\
+			__narr = realloc(__arr, (__count) * sizeof(*(__arr)));\
+			if (__narr == NULL)				\
+				ALLOC_ERR_OUT("Pool array");		\
+			__arr = __narr;					\
+			__size = (__count);				\
+		}							\
+	} while (0)
+
+/* The minutiae arrays in the pool */
+#define POOL_FMDS	0	/* All converted minutiae */
+#define POOL_LFMDS	1	/* Pruned minutiae */
+
+/*
+ * A minutia of the quality subset being pruned by polar distance, with
+ * its squared distance from the center.
+ */
+struct prune_minutia {
+	FMD		*fmd;
+	uint64_t	dist;
+	int		pos;		/* Position in the input array */
+};
+
+/* Order by distance, then by index, which is unique */
+#define PRUNE_LESS(__a, __b)						\
+	(((__a).dist < (__b).dist) ||					\
+	    (((__a).dist == (__b).dist) &&				\
+	    ((__a).fmd->index < (__b).fmd->index)))
+
+void
+init_fmr_pool(FMRPOOL *pool)
+{
+	memset(pool, 0, sizeof(FMRPOOL));
+}
+
+void
+free_fmr_pool(FMRPOOL *pool)
+{
+	int i;
+
+	while (pool->fvmrcount > 0)
+		free_fvmr(pool->fvmrs[--pool->fvmrcount]);
+	if (pool->views != NULL)
+		free(pool->views);
+	if (pool->prune != NULL)
+		free(pool->prune);
+	if (pool->keep != NULL)
+		free(pool->keep);
+	for (i = 0; i < FMR_POOL_FMD_ARRAYS; i++)
+		if (pool->fmds[i] != NULL)
+			free(pool->fmds[i]);
+	if (pool->filebuf != NULL)
+		free(pool->filebuf);
+	init_fmr_pool(pool);
+}
+
+/*
+ * Take a finger view record from the pool, reset to the state of a new
+ * record, or allocate one when the pool is empty.
+ */
+static int
+pool_new_fvmr(FMRPOOL *pool, unsigned int format_std, FVMR **fvmr)
+{
+	if (pool->fvmrcount == 0)
+		return (new_fvmr(format_std, fvmr));
+	*fvmr = pool->fvmrs[--pool->fvmrcount];
+	memset(*fvmr, 0, sizeof(FVMR));
+	(*fvmr)->format_std = format_std;
+	TAILQ_INIT(&(*fvmr)->minutiae_data);
+	return (0);
+}
+
+/*
+ * Return a finger view record, no longer part of an FMR, to the pool.
+ * Views with extended data are freed, as is any view beyond what the
+ * pool keeps.
+ */
+static void
+pool_free_fvmr(FMRPOOL *pool, FVMR *fvmr)
+{
+	FMD *fmd;
+
+	if ((fvmr->extended != NULL) ||
+	    (pool->fvmrcount == FMR_POOL_FVMR_MAX)) {
+		free_fvmr(fvmr);
+		return;
+	}
+	while ((fmd = TAILQ_FIRST(&fvmr->minutiae_data)) != NULL) {
+		TAILQ_REMOVE(&fvmr->minutiae_data, fmd, list);
+		free_fmd(fmd);
+	}
+	pool->fvmrs[pool->fvmrcount++] = fvmr;
+}
+
+void
+pool_reset_fmr(FMRPOOL *pool, FMR *fmr)
+{
+	FVMR *fvmr;
+
+	while ((fvmr = TAILQ_FIRST(&fmr->finger_views)) != NULL) {
+		TAILQ_REMOVE(&fmr->finger_views, fvmr, list);
+		pool_free_fvmr(pool, fvmr);
+	}
+}
+
+int
+pool_read_file(FMRPOOL *pool, char *fn, size_t *len)
+{
+	struct stat sb;
+	ssize_t n;
+	size_t off;
+	int fd;
+	int retval;
+
+	retval = -1;
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		ERR_OUT("Could not open FMR file %s: %s", fn, strerror(errno));
+	if (fstat(fd, &sb) < 0)
+		ERR_OUT("Could not get stats on FMR file %s", fn);
+	POOL_GROW(pool->filebuf, pool->filebufsize, (size_t)sb.st_size);
+	for (off = 0; off < (size_t)sb.st_size; off += n) {
+		n = read(fd, pool->filebuf + off, sb.st_size - off);
+		if (n <= 0)
+			ERR_OUT("Could not read FMR file %s", fn);
+	}
+	*len = sb.st_size;
+	retval = 0;
+
+err_out:
+	if (fd >= 0)
+		close(fd);
+	return (retval);
+}
+
+int
+pool_read_fmr(FMRPOOL *pool, char *fn, FMR *fmr)
+{
+	BDB fmrbdb;
+	size_t len;
+
+	pool_reset_fmr(pool, fmr);
+	if (pool_read_file(pool, fn, &len) != 0)
+		return (-1);
+	INIT_BDB(&fmrbdb, pool->filebuf, len);
+	if (scan_fmr(&fmrbdb, fmr) != READ_OK) {
+		ERRP("Could not scan FMR file %s", fn);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Partially order a set of minutiae so that the first k are the k
+ * closest to the center, in no particular order.
+ */
+static void
+select_nearest(struct prune_minutia *pm, int count, int k)
+{
+	struct prune_minutia pivot, tmp;
+	int lo, hi, i, j;
+
+	lo = 0;
+	hi = count - 1;
+	k--;				/* Position of the last one kept */
+	while (lo < hi) {
+		pivot = pm[lo + (hi - lo) / 2];
+		i = lo;
+		j = hi;
+		while (i <= j) {
+			while (PRUNE_LESS(pm[i], pivot))
+				i++;
+			while (PRUNE_LESS(pivot, pm[j]))
+				j--;
+			if (i <= j) {
+				tmp = pm[i];
+				pm[i] = pm[j];
+				pm[j] = tmp;
+				i++;
+				j--;
+			}
+		}
+		if (k <= j)
+			hi = j;
+		else if (k >= i)
+			lo = i;
+		else
+			break;
+	}
+}
+
 /*
  * Prune a set of minutiae by quality set, which means we find the set
  * of minutiae with lowest equivalent quality that must be included in
- * a final set of mcount size.
+ * a final set of mcount size. All minutiae of higher quality are kept,
+ * and the quality subset is pruned by distance from the center, the
+ * farthest being dropped. The pruned set is returned in one of the
+ * pool's arrays, in the order of the input set.
+ *
+ * The quality subset is found with a histogram of quality values, and
+ * the closest of the subset with a selection, so the set is never
+ * sorted.
  */
-static inline int prune_minutiae_into_quality_set(FMD **fmds, int mcount,
-    int max, FMD ***ofmds, uint16_t x, uint16_t y, int usecm)
-{
-	int remain, excess;
-	int lidx, cidx;
-	int m, lcount;
-	FMD **qfmds, **lfmds;
-
-	/* Minutiae are sorted ascending */
-	sort_fmd_by_quality(fmds, mcount);
-
-	/* First, we find the first quality subset that must be included. */
-	lidx = 0;
-	remain = mcount - max;
-	while (remain > 0) {
-		cidx = lidx;
-		while (fmds[lidx]->quality == fmds[lidx + 1]->quality) {
-			lidx++;
-			if (lidx >= (mcount - 1)) /* If we've reached the end,*/
-				break;      /* the entire set is included. */
-		}
-		/* At this point, cidx is the start of the quality subset,
-		 * and lidx is the end. */
-		lidx++;
-		lcount = lidx - cidx;	/* size of the subset */
-		excess = remain;
-		remain = remain - lcount;
-	}
-	/* Now we polar prune the quality subset if it is still too large,
-	 * meaning that it contains more members than the difference between
-	 * the max and what we've already dropped.
-	 */
-	qfmds = (FMD **)malloc(lcount * sizeof(FMD *));
-	if (qfmds == NULL)
-		ALLOC_ERR_RETURN("FMD array");
-	for (m = 0; m < lcount; m++)
-		qfmds[m] = fmds[cidx + m];
-	sort_fmd_by_polar(qfmds, lcount, x, y, usecm);
-
-	lfmds = (FMD **)malloc(max * sizeof(FMD *));
-		if (lfmds == NULL)
-			ALLOC_ERR_RETURN("FMD array");
-
-	/* qfmds is the polar-sorted quality subset, in ascending order,
-	 * which means the minutiae closest to the center are at the
-	 * beginning of the array. excess is the number of minutiae 
-	 * that are not needed in the quality subset; they are the
-	 * farthest distance from the center.
+static inline int prune_minutiae_into_quality_set(FMRPOOL *pool, FMD **fmds,
+    int mcount, int max, FMD ***ofmds, uint16_t x, uint16_t y, int usecm)
+{
+	int qhist[UINT8_MAX + 1];
+	struct prune_minutia *pm;
+	uint8_t *keep;
+	FMD **lfmds;
+	uint8_t quality;
+	int drop, below, excess, lcount;
+	int m, l, q;
+	uint64_t xsum, ysum;
+	int64_t dx, dy;
+	int sorted;
+
+	/*
+	 * First, we find the quality subset that must be partly included:
+	 * all minutiae of lower quality are dropped, and excess is the
+	 * number to be dropped from the subset.
 	 */
-	remain = lcount - excess;
+	memset(qhist, 0, sizeof(qhist));
+	for (m = 0; m < mcount; m++)
+		qhist[(uint8_t)fmds[m]->quality]++;
+	drop = mcount - max;
+	below = 0;
+	for (q = 0; below + qhist[q] < drop; q++)
+		below += qhist[q];
+	quality = q;
+	excess = drop - below;
+	lcount = qhist[q];
 
-	/* Copy the polar selected minutiae from the quality subset */
-	for (m = 0; m < remain; m++)
-		lfmds[m] = qfmds[m];
-	free(qfmds);
+	/*
+	 * Mark the minutiae of higher quality as kept, and gather the
+	 * quality subset with the distance of each from the center.
+	 */
+	POOL_GROW(pool->keep, pool->keepsize, mcount);
+	POOL_GROW(pool->prune, pool->prunesize, lcount);
+	keep = pool->keep;
+	pm = pool->prune;
+	xsum = ysum = 0;
+	l = 0;
+	for (m = 0; m < mcount; m++) {
+		keep[m] = ((uint8_t)fmds[m]->quality > quality);
+		if ((uint8_t)fmds[m]->quality == quality) {
+			pm[l].fmd = fmds[m];
+			pm[l].pos = m;
+			xsum += fmds[m]->x_coord;
+			ysum += fmds[m]->y_coord;
+			l++;
+		}
+	}
+	if (usecm) {
+		x = xsum / lcount;
+		y = ysum / lcount;
+	}
+	for (l = 0; l < lcount; l++) {
+		dx = (int64_t)pm[l].fmd->x_coord - x;
+		dy = (int64_t)pm[l].fmd->y_coord - y;
+		pm[l].dist = dx * dx + dy * dy;
+	}
 
-	/* Copy the remaining higher quality minutiae from the input set. */
-	for (; m < max; m++)
-		lfmds[m] = fmds[lidx++];
+	/* Keep the closest of the quality subset */
+	if (lcount - excess > 0) {
+		select_nearest(pm, lcount, lcount - excess);
+		for (l = 0; l < lcount - excess; l++)
+			keep[pm[l].pos] = 1;
+	}
 
-	/* Now we have to sort the pruned subset by index, which
-	 * tracks the minutiae order in the input FMR.
+	/*
+	 * The input set is in record order, which is the index order, so
+	 * one pass over it gives the pruned set in index order. Sort by
+	 * index only if the input wasn't in that order.
 	 */
-	qsort(lfmds, max, sizeof(FMD *), compare_by_index);
+	POOL_GROW(pool->fmds[POOL_LFMDS], pool->fmdsize[POOL_LFMDS], max);
+	lfmds = pool->fmds[POOL_LFMDS];
+	sorted = 1;
+	l = 0;
+	for (m = 0; m < mcount; m++) {
+		if (!keep[m])
+			continue;
+		if ((l != 0) && (fmds[m]->index < lfmds[l - 1]->index))
+			sorted = 0;
+		lfmds[l++] = fmds[m];
+	}
+	if (!sorted)
+		qsort(lfmds, max, sizeof(FMD *), compare_by_index);
 
 	*ofmds = lfmds;
 
 	return (0);
+
+err_out:
+	return (-1);
+}
+
+/*
+ * A minutia in the compact array used for sorting and direct conversion;
+ * key holds the value being ordered on, made unique by the position of
+ * the minutia in the array in its low bits.
+ */
+struct cc_minutia {
+	uint64_t	key;
+	uint16_t	x, y;
+	uint8_t		type;
+	uint8_t		angle;
+	uint8_t		quality;
+	uint8_t		index;
+};
+
+#define CC_KEY_POS_BITS		8
+#define CC_KEY_POS_MASK		((1 << CC_KEY_POS_BITS) - 1)
+#define CC_KEY(__value, __pos)						\
+	(((uint64_t)(__value) << CC_KEY_POS_BITS) | (__pos))
+
+/* The width in bits of the values ordered on */
+#define CC_XY_KEY_BITS		32
+#define CC_ANGLE_KEY_BITS	8
+#define CC_POLAR_KEY_BITS	33	/* Two squared 16-bit distances */
+
+#define RADIX_BITS		8
+#define RADIX			(1 << RADIX_BITS)
+#define RADIX_PASSES_MAX	(64 / RADIX_BITS)
+
+/*
+ * Partially order the compact array so that the first k entries have the
+ * smallest keys.
+ */
+static void
+select_cc_minutiae(struct cc_minutia *cm, int count, int k)
+{
+	struct cc_minutia tmp;
+	uint64_t pivot;
+	int lo, hi, i, j;
+
+	lo = 0;
+	hi = count - 1;
+	k--;
+	while (lo < hi) {
+		pivot = cm[lo + (hi - lo) / 2].key;
+		i = lo;
+		j = hi;
+		while (i <= j) {
+			while (cm[i].key < pivot)
+				i++;
+			while (pivot < cm[j].key)
+				j--;
+			if (i <= j) {
+				tmp = cm[i];
+				cm[i] = cm[j];
+				cm[j] = tmp;
+				i++;
+				j--;
+			}
+		}
+		if (k <= j)
+			hi = j;
+		else if (k >= i)
+			lo = i;
+		else
+			break;
+	}
+}
+
+/*
+ * Set the key of each minutia to its squared distance from the center,
+ * the center of mass of the set when usecm is TRUE.
+ */
+static void
+set_cc_polar_keys(struct cc_minutia *cm, int count, uint16_t x, uint16_t y,
+    int usecm)
+{
+	uint64_t xsum, ysum;
+	int64_t dx, dy;
+	int m;
+
+	if (usecm && (count > 0)) {
+		xsum = ysum = 0;
+		for (m = 0; m < count; m++) {
+			xsum += cm[m].x;
+			ysum += cm[m].y;
+		}
+		x = xsum / count;
+		y = ysum / count;
+	}
+	for (m = 0; m < count; m++) {
+		dx = (int64_t)cm[m].x - x;
+		dy = (int64_t)cm[m].y - y;
+		cm[m].key = CC_KEY(dx * dx + dy * dy, m);
+	}
+}
+
+/*
+ * Sort keys of the given width in bits with a least significant digit
+ * radix sort, a byte each pass; tmp must hold count keys. The counts of
+ * all passes are taken in one pass over the keys, and a pass is skipped
+ * when all keys have the same digit.
+ */
+static void
+radix_sort_keys(uint64_t *keys, uint64_t *tmp, int count, int bits)
+{
+	uint32_t hist[RADIX_PASSES_MAX][RADIX];
+	uint64_t *src, *dst, *swap;
+	uint32_t sum, n;
+	int passes, pass, shift, d, m;
+
+	if (count < 2)
+		return;
+	passes = (bits + RADIX_BITS - 1) / RADIX_BITS;
+	memset(hist, 0, passes * sizeof(hist[0]));
+	for (m = 0; m < count; m++)
+		for (pass = 0; pass < passes; pass++)
+			hist[pass][(keys[m] >> (pass * RADIX_BITS)) &
+			    (RADIX - 1)]++;
+
+	src = keys;
+	dst = tmp;
+	for (pass = 0; pass < passes; pass++) {
+		shift = pass * RADIX_BITS;
+		if (hist[pass][(src[0] >> shift) & (RADIX - 1)] == count)
+			continue;
+		sum = 0;
+		for (d = 0; d < RADIX; d++) {
+			n = hist[pass][d];
+			hist[pass][d] = sum;
+			sum += n;
+		}
+		for (m = 0; m < count; m++)
+			dst[hist[pass][(src[m] >> shift) & (RADIX - 1)]++] =
+			    src[m];
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != keys)
+		memcpy(keys, src, count * sizeof(keys[0]));
+}
+
+/*
+ * Order the compact array as requested. The key of each minutia is
+ * computed once, complemented for a descending order, which reverses
+ * the ascending order exactly, and the keys are radix sorted. On return,
+ * the positions of the minutiae in order are in the low bits of keys,
+ * taken with CC_KEY_POS_MASK; keys must hold count entries.
+ * Returns:
+ *	 0     Success
+ *	-1     Invalid order
+ */
+static int
+sort_cc_minutiae(struct cc_minutia *cm, int count, uint8_t order,
+    uint16_t x, uint16_t y, int usecm, uint64_t *keys)
+{
+	uint64_t tmp[UINT8_MAX + 1];
+	uint64_t mask;
+	int bits, m;
+
+	switch (order & MINUTIA_ORDER_METHOD_MASK) {
+		case MINUTIA_ORDER_NONE:
+			/* If no ordering criteria is given, keep the
+			 * order of the input, whatever the direction.
+			 */
+			for (m = 0; m < count; m++)
+				keys[m] = m;
+			return (0);
+		case MINUTIA_ORDER_XY:
+			for (m = 0; m < count; m++)
+				cm[m].key = CC_KEY(((uint32_t)cm[m].x << 16) |
+				    cm[m].y, m);
+			bits = CC_XY_KEY_BITS;
+			break;
+		case MINUTIA_ORDER_YX:
+			for (m = 0; m < count; m++)
+				cm[m].key = CC_KEY(((uint32_t)cm[m].y << 16) |
+				    cm[m].x, m);
+			bits = CC_XY_KEY_BITS;
+			break;
+		case MINUTIA_ORDER_ANGLE:
+			for (m = 0; m < count; m++)
+				cm[m].key = CC_KEY(cm[m].angle, m);
+			bits = CC_ANGLE_KEY_BITS;
+			break;
+		case MINUTIA_ORDER_POLAR:
+			set_cc_polar_keys(cm, count, x, y, usecm);
+			bits = CC_POLAR_KEY_BITS;
+			break;
+		default:
+			return (-1);
+	}
+	bits += CC_KEY_POS_BITS;
+	mask = 0;
+	if (order & MINUTIA_ORDER_DESCENDING)
+		mask = ((uint64_t)1 << bits) - 1;
+	for (m = 0; m < count; m++)
+		keys[m] = cm[m].key ^ mask;
+	radix_sort_keys(keys, tmp, count, bits);
+	if (mask != 0)
+		for (m = 0; m < count; m++)
+			keys[m] ^= mask;
+	return (0);
 }
 
-#define DUP_FMD								\
+/*
+ * Move a selected minutia from the converted view to the output view;
+ * the minutiae left in the converted view are dropped with it.
+ */
+#define MOVE_FMD							\
 	do {								\
-		if (new_fmd(FMR_STD_ISO_COMPACT_CARD, &ofmd, m) < 0)	\
-			ALLOC_ERR_EXIT("Output FMD");			\
-		COPY_FMD(ofmds[m], ofmd);				\
-		ofmd->index = ofmds[m]->index;				\
-		add_fmd_to_fvmr(ofmd, ofvmr);				\
+		TAILQ_REMOVE(&lfvmr->minutiae_data, fmd, list);		\
+		add_fmd_to_fvmr(fmd, ofvmr);				\
 		ofvmr->number_of_minutiae++;				\
 	} while (0)							\
 
 int
 prune_convert_sort_fmr(FMR *infmr, FMR *outfmr, uint8_t min, uint8_t max,
     uint8_t order, uint16_t x, uint16_t y, int usecm)
+{
+	FMRPOOL pool;
+	int retval;
+
+	init_fmr_pool(&pool);
+	retval = pool_prune_convert_sort_fmr(&pool, infmr, outfmr, min, max,
+	    order, x, y, usecm);
+	free_fmr_pool(&pool);
+	return (retval);
+}
+
+int
+pool_prune_convert_sort_fmr(FMRPOOL *pool, FMR *infmr, FMR *outfmr,
+    uint8_t min, uint8_t max, uint8_t order, uint16_t x, uint16_t y,
+    int usecm)
 {
 	int v, vcount, m, mcount;
 	unsigned int fmr_len, fvmr_len;
 	int rc, retval;
 	FVMR *ofvmr, *lfvmr;
-	FVMR **ifvmrs = NULL;
-	FMD **fmds, **ofmds, *ofmd;
+	FVMR **ifvmrs;
+	FMD **fmds, **ofmds, *fmd;
+	struct cc_minutia cm[UINT8_MAX + 1];
+	uint64_t keys[UINT8_MAX + 1];
 	int lmax;
 
+	pool_reset_fmr(pool, outfmr);
 	COPY_FMR(infmr, outfmr);/* We don't care about fixing up the rest
 				 * of the FMR header because the output FMR
 				 * isn't going anywhere, just its minutiae. */
@@ -157,25 +616,24 @@ prune_convert_sort_fmr(FMR *infmr, FMR *outfmr, uint8_t min, uint8_t max,
 	if (vcount < 0)
 		ERR_OUT("Could not retrieve FVMRs from input FMR");
 
-	ifvmrs = (FVMR **) malloc(vcount * sizeof(FVMR *));
-	if (ifvmrs == NULL)
-		ALLOC_ERR_OUT("FVMR Array");
+	POOL_GROW(pool->views, pool->viewsize, vcount);
+	ifvmrs = pool->views;
 	if (get_fvmrs(infmr, ifvmrs) != vcount)
 		ERR_OUT("Getting FVMRs from FMR");
 
 	for (v = 0; v < vcount; v++) {
 
-		/* Allocate a temporary FVMR to hold the minutiae that
+		/* Get a temporary FVMR to hold the minutiae that
 		 * are converted from ANSI to ISO-CC. We convert all
 		 * minutiae, then sort, then prune.
 		 */
-		if (new_fvmr(FMR_STD_ISO_COMPACT_CARD, &lfvmr) < 0)
+		if (pool_new_fvmr(pool, FMR_STD_ISO_COMPACT_CARD, &lfvmr) < 0)
                         ALLOC_ERR_RETURN("Temp FVMR");
 
 		/* The ofvmr record will contain the pruned set of
 		 * convert minutiae, sorted as requested.
 		 */
-		if (new_fvmr(FMR_STD_ISO_COMPACT_CARD, &ofvmr) < 0)
+		if (pool_new_fvmr(pool, FMR_STD_ISO_COMPACT_CARD, &ofvmr) < 0)
                         ALLOC_ERR_RETURN("Output FVMR");
 
 		/* Convert to compact card: The FMR library does the
@@ -191,14 +649,14 @@ prune_convert_sort_fmr(FMR *infmr, FMR *outfmr, uint8_t min, uint8_t max,
 		mcount = get_fmd_count(lfvmr);
 		if (mcount != 0) {
         
-			fmds = (FMD **)malloc(mcount * sizeof(FMD *));
-			if (fmds == NULL)
-				ALLOC_ERR_RETURN("FMD array");
+			POOL_GROW(pool->fmds[POOL_FMDS],
+			    pool->fmdsize[POOL_FMDS], mcount);
+			fmds = pool->fmds[POOL_FMDS];
 			if (get_fmds(lfvmr, fmds) != mcount)
 				ERR_OUT("getting FMDs from FVMR");
 
 			if (mcount > max) {
-				if (prune_minutiae_into_quality_set(
+				if (prune_minutiae_into_quality_set(pool,
 				   fmds, mcount, max, &ofmds, x, y, usecm) != 0)
 					ERR_OUT("Could not prune by quality");
 				lmax = max;
@@ -206,44 +664,23 @@ prune_convert_sort_fmr(FMR *infmr, FMR *outfmr, uint8_t min, uint8_t max,
 				ofmds = fmds;
 				lmax = mcount;
 			}
-			/* prune/sort the fmds */
-			switch (order & MINUTIA_ORDER_METHOD_MASK) {
-				case MINUTIA_ORDER_NONE:
-					/* If no ordering criteria is given,
-					 * protect against sorting the input
-					 * inadvertently.
-					 */
-					order = 0;
-					break;
-				case MINUTIA_ORDER_XY:
-					sort_fmd_by_xy(ofmds, lmax);
-					break;
-				case MINUTIA_ORDER_YX:
-					sort_fmd_by_yx(ofmds, lmax);
-					break;
-				case MINUTIA_ORDER_POLAR:
-					sort_fmd_by_polar(ofmds, lmax, x, y,
-					    usecm);
-					break;
-				default:
-					ERR_OUT("Invalid sort order");
-					break;		/* not reached */
+			/* Sort the fmds on keys taken from a compact array */
+			if (lmax > UINT8_MAX)
+				ERR_OUT("Too many minutiae to sort");
+			for (m = 0; m < lmax; m++) {
+				cm[m].x = ofmds[m]->x_coord;
+				cm[m].y = ofmds[m]->y_coord;
+				cm[m].angle = ofmds[m]->angle;
+			}
+			if (sort_cc_minutiae(cm, lmax, order, x, y, usecm,
+			    keys) != 0)
+				ERR_OUT("Invalid sort order");
+			for (m = 0; m < lmax; m++) {
+				fmd = ofmds[keys[m] & CC_KEY_POS_MASK];
+				MOVE_FMD;
 			}
-			if (order & MINUTIA_ORDER_DESCENDING)
-				for (m = lmax - 1; m >= 0; m--)
-					DUP_FMD;
-			else
-				for (m = 0; m < lmax; m++)
-					DUP_FMD;
-
-			free_fvmr(lfvmr);
-			free(fmds);
-
-			/* Free the array created by 
-			 * prune_minutiae_into_quality_set() */
-			if (mcount > max)
-				free(ofmds);
 		}
+		pool_free_fvmr(pool, lfvmr);
 		fmr_len += fvmr_len;
 		ofvmr->extended = NULL;
 		add_fvmr_to_fmr(ofvmr, outfmr);
@@ -252,7 +689,1013 @@ prune_convert_sort_fmr(FMR *infmr, FMR *outfmr, uint8_t min, uint8_t max,
 
 	retval = 0;
 err_out:
-	if (ifvmrs != NULL)
-		free (ifvmrs);
 	return (retval);
 }
+
+int
+read_bitgroup_file(char *fn, BIT *bits, int *bit_count)
+{
+	FILE *bitfp;
+	struct stat sb;
+	void *bitbuf;
+	BDB bitbdb;
+	int retval;
+
+	retval = -1;
+	bitbuf = NULL;
+	bitfp = fopen(fn, "rb");
+	if (bitfp == NULL)
+		ERR_OUT("Could not open BIT file %s: %s", fn, strerror(errno));
+	if (fstat(fileno(bitfp), &sb) < 0)
+		ERR_OUT("Could not get stats on BIT file %s", fn);
+
+	/* Read the BIT group from the file and decode its BITs. */
+	bitbuf = malloc(sb.st_size);
+	if (bitbuf == NULL)
+		ALLOC_ERR_OUT("BDB structure");
+	if (fread(bitbuf, 1, sb.st_size, bitfp) != sb.st_size)
+		ERR_OUT("Could not read BIT file %s", fn);
+	INIT_BDB(&bitbdb, bitbuf, sb.st_size);
+	if (scan_bit_group(&bitbdb, bits, bit_count) != READ_OK)
+		ERR_OUT("Could not decode BIT group in %s", fn);
+	retval = 0;
+
+err_out:
+	if (bitbuf != NULL)
+		free(bitbuf);
+	if (bitfp != NULL)
+		fclose(bitfp);
+	return (retval);
+}
+
+/*
+ * Big-endian field access for the template store.
+ */
+#define STORE16(p)	((uint16_t)(((p)[0] << 8) | (p)[1]))
+#define STORE32(p)	(((uint32_t)(p)[0] << 24) | ((p)[1] << 16) |	\
+	    ((p)[2] << 8) | (p)[3])
+
+/* Offsets of the fields within a template store index entry */
+#define ENTRY_NAME_OFFSET	0
+#define ENTRY_NAME_LEN		4
+#define ENTRY_MIN		6
+#define ENTRY_MAX		7
+#define ENTRY_ORDER		8
+#define ENTRY_USECM		9
+#define ENTRY_CX		10
+#define ENTRY_CY		12
+#define ENTRY_INCOUNT		14
+#define ENTRY_CCCOUNT		16
+#define ENTRY_MTDO_OFFSET	18
+#define ENTRY_MTDO_LEN		22
+#define ENTRY_CC_OFFSET		24
+#define ENTRY_CC_LEN		28
+
+static int
+check_store_region(MTDOSTORE *store, uint32_t offset, uint32_t len)
+{
+	if ((offset > store->len) || (len > store->len - offset))
+		return (-1);
+	return (0);
+}
+
+int
+open_mtdo_store(char *fn, MTDOSTORE *store)
+{
+	struct stat sb;
+	uint8_t *entry;
+	void *addr;
+	uint32_t e;
+	int fd;
+
+	store->addr = NULL;
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		ERR_OUT("Could not open template store %s: %s", fn,
+		    strerror(errno));
+	if (fstat(fd, &sb) != 0) {
+		close(fd);
+		ERR_OUT("Could not get stats on template store %s", fn);
+	}
+	if (sb.st_size < MTDO_STORE_HDR_LEN) {
+		close(fd);
+		ERR_OUT("Template store %s is too short", fn);
+	}
+	addr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		ERR_OUT("Could not map template store %s: %s", fn,
+		    strerror(errno));
+	store->addr = (uint8_t *)addr;
+	store->len = sb.st_size;
+
+	if ((memcmp(store->addr, MTDO_STORE_MAGIC,
+	    MTDO_STORE_MAGIC_LEN) != 0) ||
+	    (STORE32(store->addr + MTDO_STORE_MAGIC_LEN) !=
+	    MTDO_STORE_VERSION))
+		ERR_OUT("%s is not a template store", fn);
+	store->count = STORE32(store->addr + MTDO_STORE_MAGIC_LEN + 4);
+	/* Bound the count before using it so the index size can't wrap */
+	if (store->count >
+	    (store->len - MTDO_STORE_HDR_LEN) / MTDO_STORE_ENTRY_LEN)
+		ERR_OUT("Template store %s index is truncated", fn);
+	for (e = 0; e < store->count; e++) {
+		entry = store->addr + MTDO_STORE_HDR_LEN +
+		    (size_t)e * MTDO_STORE_ENTRY_LEN;
+		if ((check_store_region(store,
+		    STORE32(entry + ENTRY_NAME_OFFSET),
+		    STORE16(entry + ENTRY_NAME_LEN)) != 0) ||
+		    (check_store_region(store,
+		    STORE32(entry + ENTRY_MTDO_OFFSET),
+		    STORE16(entry + ENTRY_MTDO_LEN)) != 0) ||
+		    (check_store_region(store,
+		    STORE32(entry + ENTRY_CC_OFFSET),
+		    STORE16(entry + ENTRY_CC_LEN)) != 0))
+			ERR_OUT("Template store %s entry %u is invalid",
+			    fn, e);
+	}
+	return (0);
+
+err_out:
+	if (store->addr != NULL) {
+		munmap(store->addr, store->len);
+		store->addr = NULL;
+	}
+	return (-1);
+}
+
+void
+close_mtdo_store(MTDOSTORE *store)
+{
+	if (store->addr != NULL)
+		munmap(store->addr, store->len);
+	store->addr = NULL;
+}
+
+int
+compare_mtdo_store_keys(const void *a, const void *b)
+{
+	const MTDOSTOREKEY *ka = (const MTDOSTOREKEY *)a;
+	const MTDOSTOREKEY *kb = (const MTDOSTOREKEY *)b;
+	int ret;
+
+	ret = strcmp(ka->name, kb->name);
+	if (ret != 0)
+		return (ret);
+	if (ka->bit->bit_minutia_min != kb->bit->bit_minutia_min)
+		return (ka->bit->bit_minutia_min - kb->bit->bit_minutia_min);
+	if (ka->bit->bit_minutia_max != kb->bit->bit_minutia_max)
+		return (ka->bit->bit_minutia_max - kb->bit->bit_minutia_max);
+	return (ka->bit->bit_minutia_order - kb->bit->bit_minutia_order);
+}
+
+int
+write_mtdo_store_index(FILE *fp, MTDOSTOREKEY *keys, uint32_t count)
+{
+	uint8_t hdr[MTDO_STORE_HDR_LEN];
+	uint8_t entry[MTDO_STORE_ENTRY_LEN];
+	uint32_t base, k;
+	BDB bdb;
+
+	base = MTDO_STORE_HDR_LEN + count * MTDO_STORE_ENTRY_LEN;
+	INIT_BDB(&bdb, hdr, MTDO_STORE_HDR_LEN);
+	OPUSH(MTDO_STORE_MAGIC, MTDO_STORE_MAGIC_LEN, &bdb);
+	LPUSH(MTDO_STORE_VERSION, &bdb);
+	LPUSH(count, &bdb);
+	if (fwrite(hdr, 1, MTDO_STORE_HDR_LEN, fp) != MTDO_STORE_HDR_LEN)
+		goto err_out;
+	for (k = 0; k < count; k++) {
+		INIT_BDB(&bdb, entry, MTDO_STORE_ENTRY_LEN);
+		LPUSH(base + keys[k].nameoff, &bdb);
+		SPUSH(strlen(keys[k].name), &bdb);
+		CPUSH(keys[k].bit->bit_minutia_min, &bdb);
+		CPUSH(keys[k].bit->bit_minutia_max, &bdb);
+		CPUSH(keys[k].bit->bit_minutia_order, &bdb);
+		CPUSH(keys[k].usecm ? 1 : 0, &bdb);
+		SPUSH(keys[k].cx, &bdb);
+		SPUSH(keys[k].cy, &bdb);
+		SPUSH(keys[k].incount, &bdb);
+		SPUSH(keys[k].cccount, &bdb);
+		LPUSH(base + keys[k].mtdooff, &bdb);
+		SPUSH(keys[k].mtdolen, &bdb);
+		LPUSH(base + keys[k].ccoff, &bdb);
+		SPUSH(keys[k].cclen, &bdb);
+		SPUSH(0, &bdb);
+		if (fwrite(entry, 1, MTDO_STORE_ENTRY_LEN, fp) !=
+		    MTDO_STORE_ENTRY_LEN)
+			goto err_out;
+	}
+	return (0);
+
+err_out:
+	return (-1);
+}
+
+/*
+ * Compare a key to a store entry, in the store's sort order: by name as
+ * strcmp() would order them, then by BIT min, max and order.
+ */
+static int
+compare_store_entry(MTDOSTORE *store, char *fmrfn, size_t fnlen, BIT *bit,
+    uint8_t *entry)
+{
+	uint8_t *name;
+	size_t namelen;
+	int ret;
+
+	name = store->addr + STORE32(entry + ENTRY_NAME_OFFSET);
+	namelen = STORE16(entry + ENTRY_NAME_LEN);
+	ret = memcmp(fmrfn, name, fnlen < namelen ? fnlen : namelen);
+	if (ret != 0)
+		return (ret);
+	if (fnlen != namelen)
+		return (fnlen < namelen ? -1 : 1);
+	if (bit->bit_minutia_min != entry[ENTRY_MIN])
+		return (bit->bit_minutia_min < entry[ENTRY_MIN] ? -1 : 1);
+	if (bit->bit_minutia_max != entry[ENTRY_MAX])
+		return (bit->bit_minutia_max < entry[ENTRY_MAX] ? -1 : 1);
+	if (bit->bit_minutia_order != entry[ENTRY_ORDER])
+		return (bit->bit_minutia_order < entry[ENTRY_ORDER] ? -1 : 1);
+	return (0);
+}
+
+int
+find_mtdo_store_entry(MTDOSTORE *store, char *fmrfn, BIT *bit,
+    MTDOENTRY *mentry)
+{
+	uint32_t lo, hi, mid;
+	uint8_t *entry;
+	size_t fnlen;
+	int ret;
+
+	fnlen = strlen(fmrfn);
+	lo = 0;
+	hi = store->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		entry = store->addr + MTDO_STORE_HDR_LEN +
+		    mid * MTDO_STORE_ENTRY_LEN;
+		ret = compare_store_entry(store, fmrfn, fnlen, bit, entry);
+		if (ret == 0) {
+			mentry->bit_minutia_min = entry[ENTRY_MIN];
+			mentry->bit_minutia_max = entry[ENTRY_MAX];
+			mentry->bit_minutia_order = entry[ENTRY_ORDER];
+			mentry->usecm = entry[ENTRY_USECM];
+			mentry->cx = STORE16(entry + ENTRY_CX);
+			mentry->cy = STORE16(entry + ENTRY_CY);
+			mentry->incount = STORE16(entry + ENTRY_INCOUNT);
+			mentry->cccount = STORE16(entry + ENTRY_CCCOUNT);
+			mentry->mtdo = store->addr +
+			    STORE32(entry + ENTRY_MTDO_OFFSET);
+			mentry->mtdolen = STORE16(entry + ENTRY_MTDO_LEN);
+			mentry->ccfmr = store->addr +
+			    STORE32(entry + ENTRY_CC_OFFSET);
+			mentry->ccfmrlen = STORE16(entry + ENTRY_CC_LEN);
+			return (0);
+		}
+		if (ret < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return (-1);
+}
+
+/*
+ * Offsets and sizes within an ANSI 378 record. A record length of 0 in
+ * the short length field means the 4-byte length field follows it.
+ */
+#define ANSI_FORMAT_ID_LEN	4
+#define ANSI_LENGTH_OFFSET	8
+#define ANSI_SHORT_LENGTH_LEN	2
+#define ANSI_LONG_LENGTH_LEN	6
+#define ANSI_X_IMAGE_SIZE	6	/* Offsets from the end of the */
+#define ANSI_Y_IMAGE_SIZE	8	/* record length field */
+#define ANSI_X_RESOLUTION	10
+#define ANSI_Y_RESOLUTION	12
+#define ANSI_NUM_VIEWS		14
+#define ANSI_HDR_REST_LEN	16
+#define ANSI_VIEW_HDR_LEN	4
+#define ANSI_VIEW_NUM_MINUTIAE	3
+#define ANSI_FMD_LEN		6
+#define ANSI_FMD_TYPE_SHIFT	6
+#define ANSI_FMD_COORD_MASK	0x3FFF
+
+/*
+ * Compact card units: coordinates in 0.1 mm, to be compared with the
+ * ANSI resolution in pixels per cm, and angles in 360/64 degrees, to
+ * be compared with ANSI angles in 2 degree units.
+ */
+#define CC_COORD_PER_CM		100
+#define CC_COORD_MAX		UINT8_MAX
+#define CC_ANGLE_STEPS		64
+#define ANSI_ANGLE_STEPS	180
+
+/*
+ * Prune the compact array in place to max minutiae, in the same way as
+ * prune_minutiae_into_quality_set(), leaving it in index order.
+ */
+static int
+prune_cc_minutiae(struct cc_minutia *cm, int mcount, int max, uint16_t x,
+    uint16_t y, int usecm)
+{
+	struct cc_minutia qcm[UINT8_MAX + 1];
+	uint8_t keep[UINT8_MAX + 1];
+	int qhist[UINT8_MAX + 1];
+	int drop, below, excess, lcount;
+	int m, l, q;
+
+	memset(qhist, 0, sizeof(qhist));
+	for (m = 0; m < mcount; m++)
+		qhist[cm[m].quality]++;
+	drop = mcount - max;
+	below = 0;
+	for (q = 0; below + qhist[q] < drop; q++)
+		below += qhist[q];
+	excess = drop - below;
+	lcount = qhist[q];
+
+	l = 0;
+	for (m = 0; m < mcount; m++) {
+		keep[m] = (cm[m].quality > q);
+		if (cm[m].quality == q)
+			qcm[l++] = cm[m];
+	}
+	if (lcount - excess > 0) {
+		set_cc_polar_keys(qcm, lcount, x, y, usecm);
+		select_cc_minutiae(qcm, lcount, lcount - excess);
+		for (l = 0; l < lcount - excess; l++)
+			keep[qcm[l].index] = 1;
+	}
+	l = 0;
+	for (m = 0; m < mcount; m++)
+		if (keep[m])
+			cm[l++] = cm[m];
+	return (l);
+}
+
+/*
+ * Put a BER-TLV length.
+ */
+static uint8_t *
+put_ber_length(uint8_t *p, uint32_t len)
+{
+	if (len <= BERTLV_SB_MAX_VALUE) {
+		*p++ = len;
+	} else if (len <= BERTLV_MB_2_MAX_VALUE) {
+		*p++ = BERTLV_SB_MB_LENGTH_MB_2;
+		*p++ = len;
+	} else {
+		*p++ = BERTLV_SB_MB_LENGTH_MB_3;
+		*p++ = len >> 8;
+		*p++ = len;
+	}
+	return (p);
+}
+
+static int
+ber_length_size(uint32_t len)
+{
+	if (len <= BERTLV_SB_MAX_VALUE)
+		return (1);
+	if (len <= BERTLV_MB_2_MAX_VALUE)
+		return (2);
+	return (3);
+}
+
+int
+choose_prune_center(char *fmrfn, uint16_t x_image_size, uint16_t *cx,
+    uint16_t *cy)
+{
+	int i, x, y, dashes;
+
+	*cx = 0;
+	*cy = 0;
+	dashes = 0;
+	for (i = 0; fmrfn[i] != '\0'; i++) {
+		if (fmrfn[i] == '-') {
+			dashes++;
+			if (dashes > 1)
+				break;
+		}
+	}
+	if (dashes != 2)
+		return (TRUE);
+	if (sscanf(&fmrfn[i], "-%d_%d.", &x, &y) == 2) {
+		*cx = x;
+		*cy = y;
+	}
+	if (*cx < x_image_size)
+		return (FALSE);
+	return (TRUE);
+}
+
+int
+ansi_fmr_to_mtdo(uint8_t *rec, size_t reclen, char *fmrfn, uint8_t max,
+    uint8_t order, uint8_t *buf, size_t bufsize, size_t *mtdolen,
+    int *incount, int *cccount)
+{
+	struct cc_minutia cm[UINT8_MAX + 1];
+	uint64_t keys[UINT8_MAX + 1];
+	uint16_t ximagesize;
+	uint16_t cx, cy;
+	int usecm;
+	uint16_t xres, yres;
+	uint8_t *p, *end;
+	uint32_t val, msize, l1size;
+	int m, mcount, lmax;
+
+	/* Decode the record header and the first finger view */
+	end = rec + reclen;
+	if ((reclen < FMR_ANSI_SMALL_HEADER_LENGTH) ||
+	    (memcmp(rec, FMR_FORMAT_ID, ANSI_FORMAT_ID_LEN) != 0))
+		ERR_OUT("%s is not an ANSI 378 record", fmrfn);
+	p = rec + ANSI_LENGTH_OFFSET;
+	if ((p[0] == 0) && (p[1] == 0))
+		p += ANSI_LONG_LENGTH_LEN;
+	else
+		p += ANSI_SHORT_LENGTH_LEN;
+	if (p + ANSI_HDR_REST_LEN + ANSI_VIEW_HDR_LEN > end)
+		ERR_OUT("Record %s is too short", fmrfn);
+	ximagesize = (p[ANSI_X_IMAGE_SIZE] << 8) |
+	    p[ANSI_X_IMAGE_SIZE + 1];
+	xres = (p[ANSI_X_RESOLUTION] << 8) | p[ANSI_X_RESOLUTION + 1];
+	yres = (p[ANSI_Y_RESOLUTION] << 8) | p[ANSI_Y_RESOLUTION + 1];
+	if ((p[ANSI_NUM_VIEWS] == 0) || (xres == 0) || (yres == 0))
+		ERR_OUT("Record %s has no views or resolution", fmrfn);
+	p += ANSI_HDR_REST_LEN;
+	mcount = p[ANSI_VIEW_NUM_MINUTIAE];
+	p += ANSI_VIEW_HDR_LEN;
+	if (p + mcount * ANSI_FMD_LEN > end)
+		ERR_OUT("Record %s is too short", fmrfn);
+
+	/* Quantize to compact card units */
+	for (m = 0; m < mcount; m++, p += ANSI_FMD_LEN) {
+		cm[m].type = p[0] >> ANSI_FMD_TYPE_SHIFT;
+		val = ((p[0] << 8) | p[1]) & ANSI_FMD_COORD_MASK;
+		val = (val * CC_COORD_PER_CM + xres / 2) / xres;
+		cm[m].x = (val > CC_COORD_MAX) ? CC_COORD_MAX : val;
+		val = ((p[2] << 8) | p[3]) & ANSI_FMD_COORD_MASK;
+		val = (val * CC_COORD_PER_CM + yres / 2) / yres;
+		cm[m].y = (val > CC_COORD_MAX) ? CC_COORD_MAX : val;
+		cm[m].angle = ((p[4] * CC_ANGLE_STEPS + ANSI_ANGLE_STEPS / 2) /
+		    ANSI_ANGLE_STEPS) & FMD_ISO_COMPACT_MINUTIA_ANGLE_MASK;
+		cm[m].quality = p[5];
+		cm[m].index = m;
+	}
+
+	/* Prune and sort */
+	usecm = choose_prune_center(fmrfn, ximagesize, &cx, &cy);
+	if (mcount > max)
+		lmax = prune_cc_minutiae(cm, mcount, max, cx, cy, usecm);
+	else
+		lmax = mcount;
+	if (sort_cc_minutiae(cm, lmax, order, cx, cy, usecm, keys) != 0)
+		ERR_OUT("Invalid sort order");
+
+	/* Write the MTDO */
+	msize = lmax * 3;
+	l1size = MTDOTAGSIZE_FINGER_MINUTIAE_DATA + ber_length_size(msize) +
+	    msize;
+	*mtdolen = MTDOTAGSIZE_BIOMETRIC_DATA_TEMPLATE +
+	    ber_length_size(l1size) + l1size;
+	if (*mtdolen > bufsize)
+		ERR_OUT("MTDO buffer is too small");
+	p = buf;
+	*p++ = MTDOTAG_BIOMETRIC_DATA_TEMPLATE >> 8;
+	*p++ = MTDOTAG_BIOMETRIC_DATA_TEMPLATE & 0xFF;
+	p = put_ber_length(p, l1size);
+	*p++ = MTDOTAG_FINGER_MINUTIAE_DATA;
+	p = put_ber_length(p, msize);
+	for (m = 0; m < lmax; m++) {
+		struct cc_minutia *lm;
+
+		lm = &cm[keys[m] & CC_KEY_POS_MASK];
+		*p++ = lm->x;
+		*p++ = lm->y;
+		*p++ = (lm->type << FMD_ISO_COMPACT_MINUTIA_TYPE_SHIFT) |
+		    lm->angle;
+	}
+	*incount = mcount;
+	*cccount = lmax;
+	return (0);
+
+err_out:
+	return (-1);
+}
+
+/*
+ * Convert a time in seconds, as written by cardtest, to microseconds.
+ */
+static int
+parse_seconds(char *s, uint32_t *us)
+{
+	double d;
+	char *endp;
+
+	d = strtod(s, &endp);
+	if ((*endp != '\0') || (d < 0) || (d >= RESULT_NOTIME / 1000000.0))
+		return (-1);
+	*us = (uint32_t)(d * 1000000 + 0.5);
+	return (0);
+}
+
+static int
+parse_number(char *s, unsigned long max, unsigned long *val)
+{
+	char *endp;
+
+	*val = strtoul(s, &endp, 10);
+	if ((*endp != '\0') || (*val > max))
+		return (-1);
+	return (0);
+}
+
+/*
+ * The columns of a cardtest results line; an error status ends the line
+ * early with a comment, after at least the minutiae counts.
+ */
+#define CARD_RESULT_FIELDS	12
+#define CARD_RESULT_MIN_FIELDS	6
+#define SDK_RESULT_FIELDS	4
+#define RESULT_FIELDS_MAX	12
+
+int
+parse_result_line(char *line, RESULTREC *rec)
+{
+	char *field[RESULT_FIELDS_MAX];
+	char *p, *last;
+	unsigned long val[4], score;
+	int error, nf;
+
+	nf = 0;
+	error = 0;
+	for (p = strtok_r(line, " \t\r\n", &last); p != NULL;
+	    p = strtok_r(NULL, " \t\r\n", &last)) {
+		if (p[0] == '#') {
+			error = 1;
+			break;
+		}
+		if (nf == RESULT_FIELDS_MAX)
+			return (1);
+		field[nf++] = p;
+	}
+	rec->storetime = rec->matchtime = rec->scoretime = RESULT_NOTIME;
+	rec->incount[0] = rec->incount[1] = RESULT_NOCOUNT;
+	rec->cccount[0] = rec->cccount[1] = RESULT_NOCOUNT;
+	rec->score = 0;
+	rec->decision = 0;
+	rec->flags = 0;
+
+	/* sdktest: verify and enroll names, match time, score */
+	if ((nf == SDK_RESULT_FIELDS) && !error) {
+		if ((parse_number(field[2], RESULT_NOTIME - 1, &val[0]) != 0) ||
+		    (parse_number(field[3], UINT16_MAX, &score) != 0))
+			return (1);
+		rec->fmrfn[0] = field[0];
+		rec->fmrfn[1] = field[1];
+		rec->matchtime = val[0];
+		rec->score = score;
+		rec->flags = RESULT_FLAG_SDK;
+		return (0);
+	}
+
+	/* cardtest: see the columns in cardtest.c */
+	if ((nf < CARD_RESULT_MIN_FIELDS) ||
+	    ((nf != CARD_RESULT_FIELDS) && !error))
+		return (1);
+	if ((parse_number(field[1], RESULT_NOCOUNT - 1, &val[0]) != 0) ||
+	    (parse_number(field[2], RESULT_NOCOUNT - 1, &val[1]) != 0) ||
+	    (parse_number(field[4], RESULT_NOCOUNT - 1, &val[2]) != 0) ||
+	    (parse_number(field[5], RESULT_NOCOUNT - 1, &val[3]) != 0))
+		return (1);
+	rec->fmrfn[0] = field[0];
+	rec->fmrfn[1] = field[3];
+	rec->incount[0] = val[0];
+	rec->cccount[0] = val[1];
+	rec->incount[1] = val[2];
+	rec->cccount[1] = val[3];
+	if (error) {
+		/* Keep the times of the commands that completed */
+		rec->flags = RESULT_FLAG_ERROR;
+		if ((nf > 6) && (parse_seconds(field[6], &rec->storetime) != 0))
+			rec->storetime = RESULT_NOTIME;
+		if ((nf > 7) && (parse_seconds(field[7], &rec->matchtime) != 0))
+			rec->matchtime = RESULT_NOTIME;
+		return (0);
+	}
+	if ((parse_seconds(field[6], &rec->storetime) != 0) ||
+	    (parse_seconds(field[7], &rec->matchtime) != 0) ||
+	    ((strcmp(field[9], "T") != 0) && (strcmp(field[9], "F") != 0)) ||
+	    (parse_seconds(field[10], &rec->scoretime) != 0) ||
+	    (parse_number(field[11], UINT16_MAX, &score) != 0))
+		return (1);
+	rec->decision = field[9][0];
+	rec->score = score;
+	return (0);
+}
+
+/*
+ * The template names written to a binary results file, each with its
+ * index, found through an open addressing hash table.
+ */
+struct name_table {
+	char		**names;	/* In index order */
+	uint32_t	count;
+	uint32_t	size;
+	uint32_t	*slots;		/* Index + 1, or 0 when free */
+	uint32_t	nslots;		/* A power of 2 */
+};
+
+static uint32_t
+hash_name(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name != '\0') {
+		h ^= (uint8_t)*name++;
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+static void
+free_name_table(struct name_table *nt)
+{
+	while (nt->count > 0)
+		free(nt->names[--nt->count]);
+	if (nt->names != NULL)
+		free(nt->names);
+	if (nt->slots != NULL)
+		free(nt->slots);
+	bzero(nt, sizeof(struct name_table));
+}
+
+/*
+ * Get the index of a name, adding it to the table if it is new.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+static int
+intern_name(struct name_table *nt, char *name, uint32_t *index)
+{
+	uint32_t *slots, nslots, h, i, n;
+	char **names;
+
+	/* Keep the table at most half full. */
+	if ((nt->count + 1) * 2 > nt->nslots) {
+		nslots = (nt->nslots == 0) ? 1024 : nt->nslots * 2;
+		slots = (uint32_t *)calloc(nslots, sizeof(uint32_t));
+		if (slots == NULL)
+			ALLOC_ERR_RETURN("Name hash table");
+		for (n = 0; n < nt->count; n++) {
+			h = hash_name(nt->names[n]) & (nslots - 1);
+			while (slots[h] != 0)
+				h = (h + 1) & (nslots - 1);
+			slots[h] = n + 1;
+		}
+		if (nt->slots != NULL)
+			free(nt->slots);
+		nt->slots = slots;
+		nt->nslots = nslots;
+	}
+	h = hash_name(name) & (nt->nslots - 1);
+	while ((i = nt->slots[h]) != 0) {
+		if (strcmp(nt->names[i - 1], name) == 0) {
+			*index = i - 1;
+			return (0);
+		}
+		h = (h + 1) & (nt->nslots - 1);
+	}
+	if (nt->count == nt->size) {
+		n = (nt->size == 0) ? 1024 : nt->size * 2;
+		names = (char **)realloc(nt->names, n * sizeof(char *));
+		if (names == NULL)
+			ALLOC_ERR_RETURN("Name table");
+		nt->names = names;
+		nt->size = n;
+	}
+	nt->names[nt->count] = strdup(name);
+	if (nt->names[nt->count] == NULL)
+		ALLOC_ERR_RETURN("Template name");
+	nt->slots[h] = nt->count + 1;
+	*index = nt->count++;
+	return (0);
+}
+
+static int
+write_binary_results_header(FILE *fp, uint32_t count, uint32_t namecount,
+    uint64_t nameoff)
+{
+	uint8_t hdr[RESULTS_HDR_LEN];
+	BDB bdb;
+
+	INIT_BDB(&bdb, hdr, RESULTS_HDR_LEN);
+	OPUSH(RESULTS_MAGIC, RESULTS_MAGIC_LEN, &bdb);
+	LPUSH(RESULTS_VERSION, &bdb);
+	LPUSH(count, &bdb);
+	LPUSH(namecount, &bdb);
+	LPUSH(0, &bdb);
+	LPUSH((uint32_t)(nameoff >> 32), &bdb);
+	LPUSH((uint32_t)nameoff, &bdb);
+	if ((fseek(fp, 0, SEEK_SET) != 0) ||
+	    (fwrite(hdr, 1, RESULTS_HDR_LEN, fp) != RESULTS_HDR_LEN))
+		goto err_out;
+	return (0);
+
+err_out:
+	return (-1);
+}
+
+int
+convert_results_file(char *txtfn, char *binfn)
+{
+	struct name_table nt;
+	uint8_t record[RESULTS_RECORD_LEN];
+	char line[2 * MAXPATHLEN + 256];
+	uint32_t name[2], count, n;
+	uint64_t nameoff;
+	FILE *txtfp = NULL;
+	FILE *binfp = NULL;
+	RESULTREC rec;
+	BDB bdb;
+	int retval = -1;
+	int t;
+
+	bzero(&nt, sizeof(nt));
+	if ((txtfp = fopen(txtfn, "r")) == NULL)
+		ERR_OUT("Could not open %s: %s", txtfn, strerror(errno));
+	if ((binfp = fopen(binfn, "w")) == NULL)
+		ERR_OUT("Could not open %s: %s", binfn, strerror(errno));
+
+	/* The header is written again when the counts are known. */
+	if (write_binary_results_header(binfp, 0, 0, 0) != 0)
+		ERR_OUT("Could not write %s", binfn);
+	count = 0;
+	while (fgets(line, sizeof(line), txtfp) != NULL) {
+		if (parse_result_line(line, &rec) != 0)
+			continue;
+		for (t = 0; t < 2; t++)
+			if (intern_name(&nt, rec.fmrfn[t], &name[t]) != 0)
+				goto err_out;
+		INIT_BDB(&bdb, record, RESULTS_RECORD_LEN);
+		LPUSH(name[0], &bdb);
+		LPUSH(name[1], &bdb);
+		for (t = 0; t < 2; t++) {
+			SPUSH(rec.incount[t], &bdb);
+			SPUSH(rec.cccount[t], &bdb);
+		}
+		LPUSH(rec.storetime, &bdb);
+		LPUSH(rec.matchtime, &bdb);
+		LPUSH(rec.scoretime, &bdb);
+		SPUSH(rec.score, &bdb);
+		CPUSH(rec.decision, &bdb);
+		CPUSH(rec.flags, &bdb);
+		if (fwrite(record, 1, RESULTS_RECORD_LEN, binfp) !=
+		    RESULTS_RECORD_LEN)
+			ERR_OUT("Could not write %s", binfn);
+		count++;
+	}
+	if (ferror(txtfp))
+		ERR_OUT("Could not read %s", txtfn);
+
+	nameoff = RESULTS_HDR_LEN + (uint64_t)count * RESULTS_RECORD_LEN;
+	for (n = 0; n < nt.count; n++)
+		if (fwrite(nt.names[n], 1, strlen(nt.names[n]) + 1, binfp) !=
+		    strlen(nt.names[n]) + 1)
+			ERR_OUT("Could not write %s", binfn);
+	if (write_binary_results_header(binfp, count, nt.count, nameoff) != 0)
+		ERR_OUT("Could not write %s", binfn);
+	retval = 0;
+
+err_out:
+	free_name_table(&nt);
+	if (txtfp != NULL)
+		fclose(txtfp);
+	if ((binfp != NULL) && (fclose(binfp) != 0))
+		retval = -1;
+	return (retval);
+}
+
+/* Offsets of the fields within a binary results record */
+#define RESULTS_V_NAME		0
+#define RESULTS_E_NAME		4
+#define RESULTS_COUNTS		8
+#define RESULTS_STORETIME	16
+#define RESULTS_MATCHTIME	20
+#define RESULTS_SCORETIME	24
+#define RESULTS_SCORE		28
+#define RESULTS_DECISION	30
+#define RESULTS_FLAGS		31
+
+int
+open_results_file(char *fn, RESULTSFILE *rf)
+{
+	struct stat sb;
+	uint8_t *p, *end, *rec;
+	uint64_t nameoff;
+	uint32_t n, r;
+	void *addr;
+	int fd;
+
+	bzero(rf, sizeof(RESULTSFILE));
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		ERR_OUT("Could not open results file %s: %s", fn,
+		    strerror(errno));
+	if (fstat(fd, &sb) != 0) {
+		close(fd);
+		ERR_OUT("Could not get stats on results file %s", fn);
+	}
+	if (sb.st_size == 0) {
+		close(fd);
+		return (0);
+	}
+	addr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		ERR_OUT("Could not map results file %s: %s", fn,
+		    strerror(errno));
+	rf->addr = (uint8_t *)addr;
+	rf->len = sb.st_size;
+	if ((rf->len < RESULTS_HDR_LEN) ||
+	    (memcmp(rf->addr, RESULTS_MAGIC, RESULTS_MAGIC_LEN) != 0))
+		return (0);
+
+	rf->binary = 1;
+	p = rf->addr + RESULTS_MAGIC_LEN;
+	if (STORE32(p) != RESULTS_VERSION)
+		ERR_OUT("Results file %s has an unknown version", fn);
+	rf->count = STORE32(p + 4);
+	rf->namecount = STORE32(p + 8);
+	nameoff = ((uint64_t)STORE32(p + 16) << 32) | STORE32(p + 20);
+	if ((nameoff != RESULTS_HDR_LEN +
+	    (uint64_t)rf->count * RESULTS_RECORD_LEN) || (nameoff > rf->len))
+		ERR_OUT("Results file %s is truncated", fn);
+
+	rf->names = (char **)malloc(rf->namecount * sizeof(char *));
+	if ((rf->namecount != 0) && (rf->names == NULL))
+		ALLOC_ERR_OUT("Results name table");
+	p = rf->addr + nameoff;
+	end = rf->addr + rf->len;
+	for (n = 0; n < rf->namecount; n++) {
+		rf->names[n] = (char *)p;
+		while ((p < end) && (*p != '\0'))
+			p++;
+		if (p == end)
+			ERR_OUT("Results file %s name table is truncated", fn);
+		p++;
+	}
+	for (r = 0; r < rf->count; r++) {
+		rec = rf->addr + RESULTS_HDR_LEN + r * RESULTS_RECORD_LEN;
+		if ((STORE32(rec + RESULTS_V_NAME) >= rf->namecount) ||
+		    (STORE32(rec + RESULTS_E_NAME) >= rf->namecount))
+			ERR_OUT("Results file %s record %u is invalid", fn, r);
+	}
+	return (0);
+
+err_out:
+	close_results_file(rf);
+	return (-1);
+}
+
+void
+close_results_file(RESULTSFILE *rf)
+{
+	if (rf->names != NULL)
+		free(rf->names);
+	if (rf->addr != NULL)
+		munmap(rf->addr, rf->len);
+	bzero(rf, sizeof(RESULTSFILE));
+}
+
+void
+get_result_record(RESULTSFILE *rf, uint32_t r, RESULTREC *rec)
+{
+	uint8_t *p;
+	int t;
+
+	p = rf->addr + RESULTS_HDR_LEN + (size_t)r * RESULTS_RECORD_LEN;
+	rec->fmrfn[0] = rf->names[STORE32(p + RESULTS_V_NAME)];
+	rec->fmrfn[1] = rf->names[STORE32(p + RESULTS_E_NAME)];
+	for (t = 0; t < 2; t++) {
+		rec->incount[t] = STORE16(p + RESULTS_COUNTS + t * 4);
+		rec->cccount[t] = STORE16(p + RESULTS_COUNTS + t * 4 + 2);
+	}
+	rec->storetime = STORE32(p + RESULTS_STORETIME);
+	rec->matchtime = STORE32(p + RESULTS_MATCHTIME);
+	rec->scoretime = STORE32(p + RESULTS_SCORETIME);
+	rec->score = STORE16(p + RESULTS_SCORE);
+	rec->decision = p[RESULTS_DECISION];
+	rec->flags = p[RESULTS_FLAGS];
+}
+
+void
+init_phase_histogram(PHASEHIST *h)
+{
+	bzero(h, sizeof(PHASEHIST));
+	h->min = UINT64_MAX;
+}
+
+/*
+ * The bucket of a time: the time itself below 128 ns; above that, the
+ * time shifted right until it is below 128, placed in the range of 64
+ * buckets for that shift.
+ */
+static int
+phase_bucket(uint64_t ns)
+{
+	int shift;
+
+	for (shift = 0; (ns >> shift) >= (2 << PHASE_SUB_BUCKET_BITS);
+	    shift++)
+		;
+	return ((shift << PHASE_SUB_BUCKET_BITS) + (int)(ns >> shift));
+}
+
+static uint64_t
+phase_bucket_highest(int bucket)
+{
+	uint64_t sub;
+	int shift;
+
+	if (bucket < (2 << PHASE_SUB_BUCKET_BITS))
+		return ((uint64_t)bucket);
+	shift = (bucket >> PHASE_SUB_BUCKET_BITS) - 1;
+	sub = (uint64_t)(bucket - (shift << PHASE_SUB_BUCKET_BITS));
+	return (((sub + 1) << shift) - 1);
+}
+
+void
+record_phase_time(PHASEHIST *h, uint64_t ns)
+{
+	h->bucket[phase_bucket(ns)]++;
+	h->count++;
+	h->total += ns;
+	if (ns < h->min)
+		h->min = ns;
+	if (ns > h->max)
+		h->max = ns;
+}
+
+void
+add_phase_histogram(PHASEHIST *dst, PHASEHIST *src)
+{
+	int i;
+
+	if (src->count == 0)
+		return;
+	for (i = 0; i < PHASE_BUCKET_COUNT; i++)
+		dst->bucket[i] += src->bucket[i];
+	dst->count += src->count;
+	dst->total += src->total;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+uint64_t
+phase_time_at_percentile(PHASEHIST *h, double percentile)
+{
+	uint64_t rank, n;
+	double r;
+	int i;
+
+	if (h->count == 0)
+		return (0);
+	r = percentile / 100.0 * h->count;
+	rank = (uint64_t)r;
+	if ((rank < r) || (rank < 1))
+		rank++;
+	n = 0;
+	for (i = 0; i < PHASE_BUCKET_COUNT; i++) {
+		n += h->bucket[i];
+		if (n >= rank)
+			break;
+	}
+	return (MIN(phase_bucket_highest(i), h->max));
+}
+
+void
+print_phase_summary(FILE *fp, const char **names, PHASEHIST *h, int count)
+{
+	static const double pct[] = {50.0, 90.0, 99.0, 99.9};
+	int i, p;
+
+	fprintf(fp, "%-16s %9s %9s %9s %9s %9s %9s %9s\n",
+	    "Phase (usec)", "Count", "Mean", "p50", "p90", "p99", "p99.9",
+	    "Max");
+	for (i = 0; i < count; i++) {
+		if (h[i].count == 0)
+			continue;
+		fprintf(fp, "%-16s %9llu %9.1f", names[i],
+		    (unsigned long long)h[i].count,
+		    (double)h[i].total / h[i].count / 1000.0);
+		for (p = 0; p < sizeof(pct) / sizeof(pct[0]); p++)
+			fprintf(fp, " %9.1f",
+			    phase_time_at_percentile(&h[i], pct[p]) / 1000.0);
+		fprintf(fp, " %9.1f\n", h[i].max / 1000.0);
+	}
+}
@@ -10,14 +10,17 @@
 
 /*
  * Prune a set of minutiae down, then convert from ANSI 378 to ISO
- * compact card, then sort based on the requested order.
+ * compact card, then sort based on the requested order. The sort packs
+ * one key per minutia and radix sorts the keys, so no comparisons are
+ * made between minutiae.
  * Parameters:
  *	infmr  Pointer to the finger minutiae record to be converted,
  *	       in ANSI 378 format.
  *	outfmr Pointer to the output FMR
  *	min    Minimum number of minutiae to include in the output.
  *	max    Maximum number of minutiae to include in the output.
- *	order  The minutiae sorting order, one of: X-Y, Y-X, POLAR, NONE.
+ *	order  The minutiae sorting order, one of: X-Y, Y-X, ANGLE, POLAR,
+ *	       NONE, ascending or descending.
  *      x, y   The coenter-of-interest for pruning. If the usecm parameter
  *             is FALSE, this coordinate is used for the center when doing
  *             the polar prune.
@@ -29,6 +32,106 @@
 int prune_convert_sort_fmr(FMR *infmr, FMR *outfmr, uint8_t min, uint8_t max,
     uint8_t order, uint16_t x, uint16_t y, int usecm);
 
+/*
+ * A pool of the records and arrays used to prepare templates, so that
+ * each template reuses the memory of the one before it instead of
+ * freeing and allocating it again. Finger view records are reset in
+ * place when taken from the pool, and the arrays only grow. The FMRs
+ * themselves are kept by the caller, and reset in place by the pool
+ * functions before they are filled.
+ */
+#define FMR_POOL_FVMR_MAX	16	/* Views kept for reuse */
+#define FMR_POOL_FMD_ARRAYS	2
+
+struct prune_minutia;
+
+struct fmr_pool {
+	FVMR		*fvmrs[FMR_POOL_FVMR_MAX];
+	int		fvmrcount;
+	FVMR		**views;	/* The views of the input FMR */
+	int		viewsize;
+	FMD		**fmds[FMR_POOL_FMD_ARRAYS]; /* For pruning */
+	int		fmdsize[FMR_POOL_FMD_ARRAYS];
+	struct prune_minutia *prune;	/* Quality subset being pruned */
+	int		prunesize;
+	uint8_t		*keep;		/* Minutiae kept */
+	int		keepsize;
+	uint8_t		*filebuf;	/* A template file */
+	size_t		filebufsize;
+};
+typedef struct fmr_pool FMRPOOL;
+
+void init_fmr_pool(FMRPOOL *pool);
+void free_fmr_pool(FMRPOOL *pool);
+
+/*
+ * Return the finger views of an FMR to the pool, leaving the FMR empty.
+ */
+void pool_reset_fmr(FMRPOOL *pool, FMR *fmr);
+
+/*
+ * Reset an FMR and read it from a file, using the pool's file buffer.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+int pool_read_fmr(FMRPOOL *pool, char *fn, FMR *fmr);
+
+/*
+ * Read a file into the pool's file buffer, returning its length.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+int pool_read_file(FMRPOOL *pool, char *fn, size_t *len);
+
+/*
+ * The same as prune_convert_sort_fmr(), with the output FMR reset first
+ * and the views and arrays taken from the pool. prune_convert_sort_fmr()
+ * uses a pool of its own for the one call.
+ */
+int pool_prune_convert_sort_fmr(FMRPOOL *pool, FMR *infmr, FMR *outfmr,
+    uint8_t min, uint8_t max, uint8_t order, uint16_t x, uint16_t y,
+    int usecm);
+
+/*
+ * Set cx and cy to the x,y "center" coordinates parsed from a template
+ * file name, in the format described for CHOOSEPRUNECENTER, or to 0,0
+ * when the name has none.
+ * Returns:
+ *	FALSE  The center is in the file name and within x_image_size
+ *	TRUE   The center of mass is to be used instead
+ */
+int choose_prune_center(char *fmrfn, uint16_t x_image_size, uint16_t *cx,
+    uint16_t *cy);
+
+/*
+ * Convert the first finger view of an ANSI 378 record directly into the
+ * minutiae template data object sent to a card, without building FMRs:
+ * the view is decoded into a compact array, quantized to compact card
+ * units (0.1 mm coordinates, 360/64 degree angles, rounded to nearest),
+ * pruned and sorted as prune_convert_sort_fmr() does, and written with
+ * its BER-TLV wrapper in one pass. The prune center is chosen from the
+ * record's file name with choose_prune_center().
+ * Parameters:
+ *	rec      The ANSI 378 record.
+ *	reclen   Length of the record.
+ *	fmrfn    Name of the record's file.
+ *	max      Maximum number of minutiae to include in the output.
+ *	order    The minutiae sorting order, as for prune_convert_sort_fmr().
+ *	buf      Buffer for the MTDO.
+ *	bufsize  Size of the buffer.
+ *	mtdolen  Set to the length of the MTDO.
+ *	incount  Set to the number of minutiae in the view.
+ *	cccount  Set to the number of minutiae in the MTDO.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+int ansi_fmr_to_mtdo(uint8_t *rec, size_t reclen, char *fmrfn, uint8_t max,
+    uint8_t order, uint8_t *buf, size_t bufsize, size_t *mtdolen,
+    int *incount, int *cccount);
+
 /*
  * Macros to create the test output file names, test results and BIT.
  * Two versions: One that takes the IDs as integers, and one that takes
@@ -75,24 +178,8 @@ do {									\
  */
 #define CHOOSEPRUNECENTER(__fmrfn, __fmr, __cx, __cy, __usecm)		\
 do {									\
-        int i,x,y,dashes=0;                                             \
-	__cx = 0;							\
-	__cy = 0;							\
-	__usecm = TRUE;							\
-        for (i=0;i<strlen(__fmrfn);i++) {                               \
-          if (__fmrfn[i] == '-') {                                      \
-	    dashes++;                                                   \
-	    if (dashes > 1) break;                                      \
-	  }                                                             \
-        }                                                               \
-        if (dashes == 2) {                                              \
-           if (sscanf(&__fmrfn[i],"-%d_%d.",&x,&y) == 2) {              \
-             __cx=x;                                                    \
-             __cy=y;                                                    \
-           }                                                            \
-           if (__cx < __fmr->x_image_size)                              \
-             __usecm=FALSE;                                             \
-        }                                                               \
+	__usecm = choose_prune_center(__fmrfn, __fmr->x_image_size,	\
+	    &__cx, &__cy);						\
 } while (0)
 
 /*
@@ -103,7 +190,272 @@ do {									\
 #define TIMEINTERVAL(__s, __f)						\
 	(__f.tv_sec - __s.tv_sec)*1000000+(__f.tv_usec - __s.tv_usec)
 
+/*
+ * The phases of a test are timed with a clock that is not stepped or
+ * slewed while the test runs, and the times are kept in histograms.
+ * PHASETIME() reads the clock into a struct timespec, and PHASEINTERVAL()
+ * gives the nanoseconds between two such times.
+ */
+#ifdef CLOCK_MONOTONIC_RAW
+#define PHASE_CLOCK	CLOCK_MONOTONIC_RAW
+#else
+#define PHASE_CLOCK	CLOCK_MONOTONIC
+#endif
+
+#define PHASETIME(__t)							\
+	clock_gettime(PHASE_CLOCK, &(__t))
+#define PHASEINTERVAL(__s, __f)						\
+	((uint64_t)(((int64_t)(__f).tv_sec - (__s).tv_sec) * 1000000000	\
+	    + ((__f).tv_nsec - (__s).tv_nsec)))
+
+/*
+ * A histogram of phase times, in nanoseconds, with buckets in the manner
+ * of an HDR histogram: one bucket per nanosecond below 128 ns, and above
+ * that 64 buckets for each power of two, so that a time is known to
+ * within 1/64 of its value at any magnitude.
+ */
+#define PHASE_SUB_BUCKET_BITS	6
+#define PHASE_BUCKET_COUNT						\
+	((64 - PHASE_SUB_BUCKET_BITS + 1) << PHASE_SUB_BUCKET_BITS)
+
+struct phase_histogram {
+	uint64_t	count;
+	uint64_t	total;
+	uint64_t	min;
+	uint64_t	max;
+	uint64_t	bucket[PHASE_BUCKET_COUNT];
+};
+typedef struct phase_histogram PHASEHIST;
+
+void init_phase_histogram(PHASEHIST *h);
+
+/*
+ * Add one time, in nanoseconds, to a histogram.
+ */
+void record_phase_time(PHASEHIST *h, uint64_t ns);
+
+/*
+ * Add the times of one histogram to another.
+ */
+void add_phase_histogram(PHASEHIST *dst, PHASEHIST *src);
 
+/*
+ * Find the time at a percentile of a histogram: the highest time in
+ * the bucket holding the time at that rank.
+ */
+uint64_t phase_time_at_percentile(PHASEHIST *h, double percentile);
 
+/*
+ * Print a table of the count, mean, and percentiles of the times of
+ * each phase in microseconds. Phases with no times are left out.
+ */
+void print_phase_summary(FILE *fp, const char **names, PHASEHIST *h,
+    int count);
 
+/*
+ * Read a BIT group from a file, as saved by cardinfo, and get the BITs
+ * from the group.
+ * Parameters:
+ *	fn        Name of the BIT group file.
+ *	bits      Array of two BITs, set on return.
+ *	bit_count Set to the number of BITs in the group, 1 or 2.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+int read_bitgroup_file(char *fn, BIT *bits, int *bit_count);
 
+/*
+ * A store of precompiled templates, built by mtdocomp. For each input
+ * template and set of BIT minutiae min/max/order, the store holds the
+ * minutiae template data object to be sent to a card and the ISO compact
+ * card record to be passed to an SDK, so the test drivers can skip the
+ * reading, pruning, conversion and sorting of the input template. The
+ * prune center is determined by the template, and is recorded with it.
+ *
+ * The store file is a header, an index of fixed-size entries sorted by
+ * template name, then BIT min, max and order, followed by the names and
+ * records; all values are big-endian:
+ *   Header: 8-byte magic "MTDOSTOR", 4-byte version, 4-byte entry count
+ *   Entry:  4-byte name offset, 2-byte name length, 1-byte BIT min, max
+ *           and order, 1-byte center-of-mass flag, 2-byte prune center
+ *           X and Y, 2-byte minutiae count before and after pruning,
+ *           4-byte MTDO offset, 2-byte MTDO length, 4-byte CC record
+ *           offset, 2-byte CC record length, 2 reserved bytes
+ * Offsets are from the start of the file.
+ */
+#define MTDO_STORE_MAGIC		"MTDOSTOR"
+#define MTDO_STORE_MAGIC_LEN		8
+#define MTDO_STORE_VERSION		1
+#define MTDO_STORE_HDR_LEN		16
+#define MTDO_STORE_ENTRY_LEN		32
+
+struct mtdo_store {
+	uint8_t		*addr;		/* The mapped store file */
+	size_t		len;
+	uint32_t	count;		/* Number of entries */
+};
+typedef struct mtdo_store MTDOSTORE;
+
+struct mtdo_store_entry {
+	uint8_t		bit_minutia_min;
+	uint8_t		bit_minutia_max;
+	uint8_t		bit_minutia_order;
+	int		usecm;
+	uint16_t	cx, cy;
+	int		incount;	/* # minutiae pre-pruning */
+	int		cccount;	/* # minutiae post-pruning */
+	uint8_t		*mtdo;		/* Points into the store */
+	unsigned int	mtdolen;
+	uint8_t		*ccfmr;		/* Also in the store */
+	unsigned int	ccfmrlen;
+};
+typedef struct mtdo_store_entry MTDOENTRY;
+
+/*
+ * Map a template store into memory, checking the header and that all
+ * entries lie within the file.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+int open_mtdo_store(char *fn, MTDOSTORE *store);
+
+void close_mtdo_store(MTDOSTORE *store);
+
+/*
+ * Find the precompiled form of a template for a BIT. The data pointers
+ * in the entry are valid until the store is closed.
+ * Returns:
+ *	 0     Success
+ *	-1     The template is not in the store for the BIT's parameters
+ */
+int find_mtdo_store_entry(MTDOSTORE *store, char *fmrfn, BIT *bit,
+    MTDOENTRY *entry);
+
+/*
+ * One template compiled for one BIT, as kept while building a store. The
+ * offsets of the name and records are from the start of the data area
+ * that follows the index.
+ */
+struct mtdo_store_key {
+	char		*name;
+	BIT		*bit;
+	int		usecm;
+	uint16_t	cx, cy;
+	int		incount;
+	int		cccount;
+	uint32_t	nameoff;
+	uint32_t	mtdooff;
+	uint32_t	mtdolen;
+	uint32_t	ccoff;
+	uint32_t	cclen;
+};
+typedef struct mtdo_store_key MTDOSTOREKEY;
+
+/*
+ * Compare two store keys in the order of the store index, for qsort():
+ * by template name, then BIT min, max and order.
+ */
+int compare_mtdo_store_keys(const void *a, const void *b);
+
+/*
+ * Write the header and index of a store for count keys, sorted with
+ * compare_mtdo_store_keys(). The caller writes the data area next.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+int write_mtdo_store_index(FILE *fp, MTDOSTOREKEY *keys, uint32_t count);
+
+/*
+ * The results of one pair, parsed from a line of a cardtest or sdktest
+ * results file, or read from a binary results file. Counts and times not
+ * in the results are RESULT_NOCOUNT and RESULT_NOTIME; times are in
+ * microseconds.
+ */
+#define RESULT_NOCOUNT		0xFFFF
+#define RESULT_NOTIME		0xFFFFFFFF
+#define RESULT_FLAG_ERROR	0x01	/* Not matched; error status */
+#define RESULT_FLAG_SDK		0x02	/* From sdktest */
+
+struct result_record {
+	char		*fmrfn[2];	/* Verify and enroll template names */
+	uint16_t	incount[2];	/* # minutiae pre-pruning */
+	uint16_t	cccount[2];	/* # minutiae post-pruning */
+	uint32_t	storetime;	/* STORE TEMPLATE time */
+	uint32_t	matchtime;	/* VERIFY or match_templates() time */
+	uint32_t	scoretime;	/* GET SCORE time */
+	uint16_t	score;
+	uint8_t		decision;	/* 'T', 'F', or 0 if not known */
+	uint8_t		flags;
+};
+typedef struct result_record RESULTREC;
+
+/*
+ * Parse a line of a text results file. The template names in the record
+ * point into the line, which is modified.
+ * Returns:
+ *	 0     The line has the results of a pair
+ *	 1     The line is a comment or header line
+ */
+int parse_result_line(char *line, RESULTREC *rec);
+
+/*
+ * The binary results file holds the records of a text results file, in
+ * the same order, with each template name stored once; all values are
+ * big-endian:
+ *   Header: 8-byte magic "MOCRSLTS", 4-byte version, 4-byte record
+ *           count, 4-byte name count, 4 reserved bytes, 8-byte offset
+ *           of the name table
+ *   Record: 4-byte verify and enroll name indices, 2-byte verify and
+ *           enroll minutiae counts pre- and post-pruning, 4-byte store,
+ *           match and score times, 2-byte score, 1-byte decision,
+ *           1-byte flags
+ *   Names:  NUL-terminated template names, in index order
+ */
+#define RESULTS_MAGIC			"MOCRSLTS"
+#define RESULTS_MAGIC_LEN		8
+#define RESULTS_VERSION			1
+#define RESULTS_HDR_LEN			32
+#define RESULTS_RECORD_LEN		32
+
+#define GENBINRESFN(__fn, __resultsfn)					\
+do {									\
+	sprintf(__fn, "%s.bin", __resultsfn);				\
+} while (0)
+
+/*
+ * Convert a text results file to a binary results file.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+int convert_results_file(char *txtfn, char *binfn);
+
+struct results_file {
+	uint8_t		*addr;		/* The mapped results file */
+	size_t		len;
+	int		binary;
+	uint32_t	count;		/* Number of records, when binary */
+	char		**names;	/* Template names, when binary */
+	uint32_t	namecount;
+};
+typedef struct results_file RESULTSFILE;
+
+/*
+ * Map a text or binary results file into memory. A binary file is
+ * checked for records and names that lie outside the file.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+int open_results_file(char *fn, RESULTSFILE *rf);
+
+void close_results_file(RESULTSFILE *rf);
+
+/*
+ * Get a record of a binary results file. The template names are valid
+ * until the file is closed.
+ */
+void get_result_record(RESULTSFILE *rf, uint32_t r, RESULTREC *rec);
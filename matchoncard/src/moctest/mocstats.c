@@ -0,0 +1,529 @@
+/*
+* This software was developed at the National Institute of Standards and
+* Technology (NIST) by employees of the Federal Government in the course
+* of their official duties. Pursuant to title 17 Section 105 of the
+* United States Code, this software is not subject to copyright protection
+* and is in the public domain. NIST assumes no responsibility whatsoever for
+* its use by other parties, and makes no guarantees, expressed or implied,
+* about its quality, reliability, or any other characteristic.
+*/
+
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <biomdimacro.h>
+#include <fmr.h>
+#include <isobit.h>
+#include <tlv.h>
+#include <moc.h>
+
+#include "genutils.h"
+
+#define DEFAULT_DELIMITER	'_'
+#define DEFAULT_FMRS		"0.01,0.001,0.0001"
+#define FMR_TARGETS_MAX		16
+#define STATS_WORKERS_MAX	256
+
+/*
+ * This program computes the accuracy and timing statistics of a MOC test
+ * from the results file written by cardtest or sdktest, in the text or
+ * binary format. The file is split among worker threads, each of which
+ * collects score histograms and command times for its part:
+ * 1) a pair is genuine when both templates have the same identity: the
+ *    template file name without its directory and extension, and without
+ *    the field after the last delimiter (the impression number); for
+ *    example, 00012_03_1.ansi and 00012_03_2.ansi are of finger 00012_03
+ * 2) a pair is accepted at a threshold when its score is at least the
+ *    threshold; pairs not matched because of an error status are counted
+ *    but not used
+ * 3) the false non-match rate is given at each false match rate asked
+ *    for, along with the lowest threshold that reaches that rate
+ * 4) the rates of the card's own match decisions are given, if present
+ * 5) percentiles are given for each command time in the results
+ * Optionally, the false match and false non-match rates at each threshold
+ * where they change are written to a DET file.
+ */
+static void
+usage()
+{
+	fprintf(stderr, "Usage: mocstats [-d delimiter] [-f fmr[,fmr...]] "
+	    "[-o detfile] [-t threads] <filename>\n"
+	    "\t<filename> is the text or binary results file\n"
+	    "\t-d the delimiter before the impression number in template\n"
+	    "\t   file names (default '%c')\n"
+	    "\t-f the false match rates at which to give the false non-match\n"
+	    "\t   rate (default %s)\n"
+	    "\t-o write the DET points to detfile\n"
+	    "\t-t number of worker threads (default: the number of CPUs)\n",
+	    DEFAULT_DELIMITER, DEFAULT_FMRS
+	);
+	exit (EXIT_FAILURE);
+}
+
+/* Scores are 16 bits; one more threshold rejects all scores. */
+#define SCORE_COUNT		(UINT16_MAX + 1)
+
+/* The command times in the results */
+#define STORE_TIME		0
+#define MATCH_TIME		1
+#define SCORE_TIME		2
+#define TIME_KINDS		3
+
+static const char *time_names[TIME_KINDS] = {
+	"STORE TEMPLATE", "Match", "GET SCORE"
+};
+
+static const double percentiles[] = {50.0, 90.0, 95.0, 99.0, 99.9, 100.0};
+#define PERCENTILE_COUNT	(sizeof(percentiles) / sizeof(percentiles[0]))
+
+/*
+ * The times of one kind of command collected by a worker, sorted by the
+ * worker when done.
+ */
+struct time_list {
+	uint32_t	*times;
+	size_t		count;
+	size_t		size;
+};
+
+/*
+ * A worker and the statistics it collects for its part of the file: a
+ * range of records of a binary file, or of bytes of a text file.
+ */
+struct stats_worker {
+	RESULTSFILE		*rf;
+	char			delimiter;
+	size_t			start, end;
+	uint64_t		*genuine;	/* score histograms */
+	uint64_t		*impostor;
+	uint64_t		pairs;
+	uint64_t		errors;
+	uint64_t		decisions[2][2]; /* [genuine][T] */
+	struct time_list	times[TIME_KINDS];
+	int			status;
+	pthread_t		thread;
+};
+
+/*
+ * Find the identity part of a template file name.
+ */
+static void
+template_identity(const char *fn, char delimiter, const char **id,
+    size_t *len)
+{
+	const char *p, *end;
+
+	p = strrchr(fn, '/');
+	p = (p == NULL) ? fn : p + 1;
+	end = strrchr(p, '.');
+	if (end == NULL)
+		end = p + strlen(p);
+	*id = p;
+	*len = end - p;
+	for (end--; end > p; end--)
+		if (*end == delimiter) {
+			*len = end - p;
+			break;
+		}
+}
+
+static int
+add_time(struct time_list *tl, uint32_t t)
+{
+	uint32_t *times;
+	size_t size;
+
+	if (t == RESULT_NOTIME)
+		return (0);
+	if (tl->count == tl->size) {
+		size = (tl->size == 0) ? 4096 : tl->size * 2;
+		times = (uint32_t *)realloc(tl->times,
+		    size * sizeof(uint32_t));
+		if (times == NULL)
+			ALLOC_ERR_RETURN("Time list");
+		tl->times = times;
+		tl->size = size;
+	}
+	tl->times[tl->count++] = t;
+	return (0);
+}
+
+static int
+add_record(struct stats_worker *w, RESULTREC *rec)
+{
+	const char *id[2];
+	size_t len[2];
+	int genuine;
+
+	w->pairs++;
+	if (add_time(&w->times[STORE_TIME], rec->storetime) != 0 ||
+	    add_time(&w->times[MATCH_TIME], rec->matchtime) != 0 ||
+	    add_time(&w->times[SCORE_TIME], rec->scoretime) != 0)
+		return (-1);
+	if (rec->flags & RESULT_FLAG_ERROR) {
+		w->errors++;
+		return (0);
+	}
+	template_identity(rec->fmrfn[0], w->delimiter, &id[0], &len[0]);
+	template_identity(rec->fmrfn[1], w->delimiter, &id[1], &len[1]);
+	genuine = (len[0] == len[1]) && (memcmp(id[0], id[1], len[0]) == 0);
+	if (genuine)
+		w->genuine[rec->score]++;
+	else
+		w->impostor[rec->score]++;
+	if (rec->decision != 0)
+		w->decisions[genuine][rec->decision == 'T']++;
+	return (0);
+}
+
+static int
+compare_times(const void *a, const void *b)
+{
+	uint32_t ta = *(const uint32_t *)a;
+	uint32_t tb = *(const uint32_t *)b;
+
+	return ((ta > tb) - (ta < tb));
+}
+
+/*
+ * Collect the statistics of the worker's part of the file. The lines of
+ * a text file that start within the range are the worker's.
+ */
+static int
+collect_stats(struct stats_worker *w)
+{
+	char line[2 * MAXPATHLEN + 256];
+	RESULTREC rec;
+	uint8_t *p, *end, *eol;
+	size_t r, len;
+	int k;
+
+	if (w->rf->binary) {
+		for (r = w->start; r < w->end; r++) {
+			get_result_record(w->rf, r, &rec);
+			if (add_record(w, &rec) != 0)
+				return (-1);
+		}
+	} else {
+		p = w->rf->addr + w->start;
+		end = w->rf->addr + w->rf->len;
+		if ((w->start != 0) && (p[-1] != '\n')) {
+			while ((p < end) && (*p != '\n'))
+				p++;
+			p++;
+		}
+		while (p < w->rf->addr + w->end) {
+			eol = memchr(p, '\n', end - p);
+			if (eol == NULL)
+				eol = end;
+			len = eol - p;
+			if (len < sizeof(line)) {
+				memcpy(line, p, len);
+				line[len] = '\0';
+				if ((parse_result_line(line, &rec) == 0) &&
+				    (add_record(w, &rec) != 0))
+					return (-1);
+			}
+			p = eol + 1;
+		}
+	}
+	for (k = 0; k < TIME_KINDS; k++)
+		qsort(w->times[k].times, w->times[k].count, sizeof(uint32_t),
+		    compare_times);
+	return (0);
+}
+
+static void *
+stats_thread(void *arg)
+{
+	struct stats_worker *w = (struct stats_worker *)arg;
+
+	w->status = (collect_stats(w) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+	return (NULL);
+}
+
+/*
+ * Find the time at a rank across the sorted time lists of the workers:
+ * the smallest time t for which at least rank times are <= t.
+ */
+static uint32_t
+time_at_rank(struct stats_worker *workers, int nworkers, int kind,
+    uint64_t rank)
+{
+	uint32_t lo, hi, mid;
+	uint64_t n;
+	size_t a, b, m;
+	struct time_list *tl;
+	int i;
+
+	lo = 0;
+	hi = RESULT_NOTIME - 1;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		n = 0;
+		for (i = 0; i < nworkers; i++) {
+			/* Count the times <= mid in this sorted list */
+			tl = &workers[i].times[kind];
+			a = 0;
+			b = tl->count;
+			while (a < b) {
+				m = a + (b - a) / 2;
+				if (tl->times[m] <= mid)
+					a = m + 1;
+				else
+					b = m;
+			}
+			n += a;
+		}
+		if (n >= rank)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return (lo);
+}
+
+static int
+parse_fmr_targets(char *arg, double *fmrs, int *count)
+{
+	char *p, *last, *endp;
+
+	*count = 0;
+	for (p = strtok_r(arg, ",", &last); p != NULL;
+	    p = strtok_r(NULL, ",", &last)) {
+		if (*count == FMR_TARGETS_MAX)
+			return (-1);
+		fmrs[*count] = strtod(p, &endp);
+		if ((*endp != '\0') || (fmrs[*count] < 0) ||
+		    (fmrs[*count] > 1))
+			return (-1);
+		(*count)++;
+	}
+	return ((*count == 0) ? -1 : 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char fmrarg[] = DEFAULT_FMRS;
+	char *fmrlist = fmrarg;
+	double fmrs[FMR_TARGETS_MAX];
+	int nfmrs;
+	char delimiter = DEFAULT_DELIMITER;
+	char *detfn = NULL;
+	FILE *detfp = NULL;
+	RESULTSFILE rf;
+	struct stats_worker *workers = NULL;
+	long nworkers;
+	int started = 0;
+	uint64_t *genuine = NULL;
+	uint64_t *impostor = NULL;
+	uint64_t ngen, nimp, pairs, errors, decisions[2][2];
+	uint64_t fa, fr, total, rank;
+	size_t units;
+	char *endp;
+	int exitcode;
+	int ch, i, k, f;
+	uint32_t t, s;
+
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers < 1)
+		nworkers = 1;
+	if (nworkers > STATS_WORKERS_MAX)
+		nworkers = STATS_WORKERS_MAX;
+	while ((ch = getopt(argc, argv, "d:f:o:t:")) != -1) {
+		switch (ch) {
+		case 'd':
+			if (strlen(optarg) != 1)
+				usage();
+			delimiter = optarg[0];
+			break;
+		case 'f':
+			fmrlist = optarg;
+			break;
+		case 'o':
+			detfn = optarg;
+			break;
+		case 't':
+			nworkers = strtol(optarg, &endp, 10);
+			if ((*endp != '\0') || (nworkers < 1) ||
+			    (nworkers > STATS_WORKERS_MAX))
+				usage();
+			break;
+		default :
+			usage();
+			break;
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+	if (parse_fmr_targets(fmrlist, fmrs, &nfmrs) != 0)
+		usage();
+
+	exitcode = EXIT_FAILURE;
+	if (open_results_file(argv[optind], &rf) != 0)
+		ERR_EXIT("Could not open results file %s", argv[optind]);
+
+	/* Split the records, or the bytes of a text file, among workers. */
+	workers = (struct stats_worker *)calloc(nworkers,
+	    sizeof(struct stats_worker));
+	if (workers == NULL)
+		ALLOC_ERR_OUT("Workers");
+	units = rf.binary ? rf.count : rf.len;
+	for (i = 0; i < nworkers; i++) {
+		workers[i].rf = &rf;
+		workers[i].delimiter = delimiter;
+		workers[i].start = units / nworkers * i;
+		workers[i].end = (i == nworkers - 1) ? units :
+		    units / nworkers * (i + 1);
+		workers[i].genuine = (uint64_t *)calloc(SCORE_COUNT,
+		    sizeof(uint64_t));
+		workers[i].impostor = (uint64_t *)calloc(SCORE_COUNT,
+		    sizeof(uint64_t));
+		if ((workers[i].genuine == NULL) ||
+		    (workers[i].impostor == NULL))
+			ALLOC_ERR_OUT("Score histograms");
+	}
+	for (started = 0; started < nworkers; started++)
+		if (pthread_create(&workers[started].thread, NULL,
+		    stats_thread, &workers[started]) != 0)
+			ERR_OUT("Could not create worker thread");
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+	started = 0;
+	for (i = 0; i < nworkers; i++)
+		if (workers[i].status != EXIT_SUCCESS)
+			ERR_OUT("Collecting statistics failed");
+
+	/* Combine the histograms and counts into those of the first. */
+	genuine = workers[0].genuine;
+	impostor = workers[0].impostor;
+	pairs = errors = 0;
+	bzero(decisions, sizeof(decisions));
+	for (i = 0; i < nworkers; i++) {
+		if (i != 0)
+			for (s = 0; s < SCORE_COUNT; s++) {
+				genuine[s] += workers[i].genuine[s];
+				impostor[s] += workers[i].impostor[s];
+			}
+		pairs += workers[i].pairs;
+		errors += workers[i].errors;
+		for (k = 0; k < 4; k++)
+			decisions[k / 2][k % 2] +=
+			    workers[i].decisions[k / 2][k % 2];
+	}
+	ngen = nimp = 0;
+	for (s = 0; s < SCORE_COUNT; s++) {
+		ngen += genuine[s];
+		nimp += impostor[s];
+	}
+
+	printf("Results file: %s (%s)\n", argv[optind],
+	    rf.binary ? "binary" : "text");
+	printf("Pairs: %llu, genuine: %llu, impostor: %llu, not matched: "
+	    "%llu\n", (unsigned long long)pairs, (unsigned long long)ngen,
+	    (unsigned long long)nimp, (unsigned long long)errors);
+
+	/*
+	 * At threshold t, the false matches are the impostor scores >= t,
+	 * and the false non-matches are the genuine scores < t. For each
+	 * target, find the lowest threshold with an FMR at or below it.
+	 */
+	if ((ngen != 0) && (nimp != 0)) {
+		printf("%12s %10s %12s %12s\n", "FMR target", "Threshold",
+		    "FMR", "FNMR");
+		for (f = 0; f < nfmrs; f++) {
+			fa = nimp;
+			fr = 0;
+			for (t = 0; t < SCORE_COUNT; t++) {
+				if ((double)fa / nimp <= fmrs[f])
+					break;
+				fa -= impostor[t];
+				fr += genuine[t];
+			}
+			printf("%12g %10u %12.6g %12.6g\n", fmrs[f], t,
+			    (double)fa / nimp, (double)fr / ngen);
+		}
+	}
+	if ((decisions[1][0] + decisions[1][1] != 0) &&
+	    (decisions[0][0] + decisions[0][1] != 0))
+		printf("Card decisions: FMR %.6g, FNMR %.6g\n",
+		    (double)decisions[0][1] /
+		    (decisions[0][0] + decisions[0][1]),
+		    (double)decisions[1][0] /
+		    (decisions[1][0] + decisions[1][1]));
+
+	/* Nearest-rank percentiles of each command time */
+	for (k = 0; k < TIME_KINDS; k++) {
+		total = 0;
+		for (i = 0; i < nworkers; i++)
+			total += workers[i].times[k].count;
+		if (total == 0)
+			continue;
+		printf("%s time (microseconds):", time_names[k]);
+		for (f = 0; f < PERCENTILE_COUNT; f++) {
+			rank = (uint64_t)ceil(percentiles[f] / 100.0 * total);
+			if (rank < 1)
+				rank = 1;
+			if (rank > total)
+				rank = total;
+			printf(" p%g %u", percentiles[f],
+			    time_at_rank(workers, nworkers, k, rank));
+		}
+		printf("\n");
+	}
+
+	/* The DET points, at each threshold where a rate changes */
+	if (detfn != NULL) {
+		if ((detfp = fopen(detfn, "w")) == NULL)
+			OPEN_ERR_EXIT(detfn);
+		fprintf(detfp, "# Threshold FMR FNMR\n");
+		fa = nimp;
+		fr = 0;
+		for (t = 0; t <= SCORE_COUNT; t++) {
+			if ((t == 0) || (t == SCORE_COUNT) ||
+			    (impostor[t - 1] != 0) || (genuine[t - 1] != 0))
+				fprintf(detfp, "%u %.6e %.6e\n", t,
+				    nimp ? (double)fa / nimp : 0.0,
+				    ngen ? (double)fr / ngen : 0.0);
+			if (t < SCORE_COUNT) {
+				fa -= impostor[t];
+				fr += genuine[t];
+			}
+		}
+		if (fclose(detfp) != 0)
+			ERR_OUT("Could not write %s", detfn);
+	}
+	exitcode = EXIT_SUCCESS;
+
+err_out:
+	if (workers != NULL) {
+		for (i = 0; i < started; i++)
+			pthread_join(workers[i].thread, NULL);
+		for (i = 0; i < nworkers; i++) {
+			if (workers[i].genuine != NULL)
+				free(workers[i].genuine);
+			if (workers[i].impostor != NULL)
+				free(workers[i].impostor);
+			for (k = 0; k < TIME_KINDS; k++)
+				if (workers[i].times[k].times != NULL)
+					free(workers[i].times[k].times);
+		}
+		free(workers);
+	}
+	close_results_file(&rf);
+
+	exit (exitcode);
+}
@@ -0,0 +1,303 @@
+/*
+* This software was developed at the National Institute of Standards and
+* Technology (NIST) by employees of the Federal Government in the course
+* of their official duties. Pursuant to title 17 Section 105 of the
+* United States Code, this software is not subject to copyright protection
+* and is in the public domain. NIST assumes no responsibility whatsoever for
+* its use by other parties, and makes no guarantees, expressed or implied,
+* about its quality, reliability, or any other characteristic.
+*/
+
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <biomdimacro.h>
+#include <fmr.h>
+#include <isobit.h>
+#include <tlv.h>
+#include <moc.h>
+
+#include "genutils.h"
+
+/*
+ * This program compiles the templates used in a MOC test into a template
+ * store, which is used by cardtest and sdktest in place of the ANSI-378
+ * template files. The input file is the same template-pairs file given to
+ * the test drivers:
+ * verify.file enroll.file
+ *
+ * As in the test drivers, the first BIT of the group is applied to the
+ * enrollment templates, and the second BIT to the verify templates. Each
+ * template is compiled once for each BIT it is used with, no matter how
+ * many pairs it appears in:
+ * 1) read the template and choose the prune center
+ * 2) prune/convert/sort the template, using the first finger view
+ * 3) create the minutiae template data object and the ISO compact card
+ *    record
+ * The index of the store is sorted for lookup by template name and BIT.
+ */
+static void
+usage()
+{
+	fprintf(stderr, "Usage: mtdocomp -b <bitfile> -o <storefile> "
+	    "<filename>\n"
+	    "\t<bitfile> is the BIT group file saved from the card\n"
+	    "\t<storefile> is the template store to create\n"
+	    "\t<filename> is the input file containing minutiae file names\n"
+	);
+	exit (EXIT_FAILURE);
+}
+
+/* Indices of the verify and enroll templates */
+#define V	0
+#define E	1
+
+#define RECBUFSIZE	1024	/* Room for the MTDO or CC record of one
+				 * template */
+
+/* The data area of the store, following the index */
+static uint8_t *data = NULL;
+static size_t datalen = 0;
+static size_t datasize = 0;
+
+static int
+reserve_data(size_t len)
+{
+	uint8_t *ndata;
+	size_t nsize;
+
+	if (datalen + len <= datasize)
+		return (0);
+	nsize = (datasize == 0) ? 65536 : datasize;
+	while (nsize < datalen + len)
+		nsize *= 2;
+	ndata = (uint8_t *)realloc(data, nsize);
+	if (ndata == NULL)
+		return (-1);
+	data = ndata;
+	datasize = nsize;
+	return (0);
+}
+
+/*
+ * Read, prune, convert and sort one template for a BIT, appending its
+ * name, MTDO and compact card record to the data area.
+ */
+static int
+compile_template(MTDOSTOREKEY *key)
+{
+	FILE *fmrfp;
+	FMR *infmr, *ccfmr;
+	FVMR *fvmr;
+	BDB bdb;
+	size_t namelen;
+	int retval;
+
+	retval = -1;
+	infmr = ccfmr = NULL;
+	namelen = strlen(key->name);
+	if (reserve_data(namelen + 2 * RECBUFSIZE) != 0)
+		ALLOC_ERR_OUT("Store data area");
+
+	new_fmr(FMR_STD_ANSI, &infmr);
+	fmrfp = fopen(key->name, "rb");
+	if (fmrfp == NULL)
+		ERR_OUT("Could not open FMR file %s", key->name);
+	if (read_fmr(fmrfp, infmr) != READ_OK) {
+		fclose(fmrfp);
+		ERR_OUT("Could not read FMR file %s", key->name);
+	}
+	fclose(fmrfp);
+	CHOOSEPRUNECENTER(key->name, infmr, key->cx, key->cy, key->usecm);
+	key->incount = get_fmd_count(TAILQ_FIRST(&infmr->finger_views));
+
+	new_fmr(FMR_STD_ISO_COMPACT_CARD, &ccfmr);
+	if (prune_convert_sort_fmr(infmr, ccfmr, key->bit->bit_minutia_min,
+	    key->bit->bit_minutia_max, key->bit->bit_minutia_order,
+	    key->cx, key->cy, key->usecm) != 0)
+		ERR_OUT("Pruning/sorting FMR %s failed.", key->name);
+	fvmr = TAILQ_FIRST(&ccfmr->finger_views);
+	if (fvmr == NULL)
+		ERR_OUT("FMR %s contains no views", key->name);
+	key->cccount = get_fmd_count(fvmr);
+
+	key->nameoff = datalen;
+	memcpy(data + datalen, key->name, namelen);
+	datalen += namelen;
+
+	/* Convert only the first (and probably only) FVMR. */
+	INIT_BDB(&bdb, data + datalen, RECBUFSIZE);
+	if (fvmr_to_mtdo(fvmr, &bdb) != WRITE_OK)
+		ERR_OUT("Could not convert FVMR to MTDO");
+	key->mtdooff = datalen;
+	key->mtdolen = bdb.bdb_current - bdb.bdb_start;
+	datalen += key->mtdolen;
+
+	INIT_BDB(&bdb, data + datalen, RECBUFSIZE);
+	if (push_fmr(&bdb, ccfmr) != WRITE_OK)
+		ERR_OUT("Could not push CC FMR to buffer");
+	key->ccoff = datalen;
+	key->cclen = bdb.bdb_current - bdb.bdb_start;
+	datalen += key->cclen;
+	retval = 0;
+
+err_out:
+	if (ccfmr != NULL)
+		free_fmr(ccfmr);
+	if (infmr != NULL)
+		free_fmr(infmr);
+	return (retval);
+}
+
+int
+main(int argc, char *argv[])
+{
+	FILE *infp = NULL;
+	FILE *outfp = NULL;
+	char *bitfn, *storefn;
+	BIT bits[2];
+	BIT *bit[2];
+	int bit_count;
+	char fmrfn[2][MAXPATHLEN];
+	MTDOSTOREKEY *keys = NULL;
+	MTDOSTOREKEY *nkeys;
+	uint32_t kcount, ksize, k, u;
+	struct stat sb;
+	int exitcode;
+	int ch, t;
+
+	bit_count = 0;
+
+	bitfn = storefn = NULL;
+	while ((ch = getopt(argc, argv, "b:o:")) != -1) {
+		switch (ch) {
+		case 'b':
+			bitfn = optarg;
+			break;
+		case 'o':
+			storefn = optarg;
+			break;
+		default :
+			usage();
+			break;
+		}
+	}
+	if ((bitfn == NULL) || (storefn == NULL) || (optind != argc - 1))
+		usage();
+
+	exitcode = EXIT_FAILURE;
+	if (read_bitgroup_file(bitfn, bits, &bit_count) != 0)
+		ERR_EXIT("Could not read BIT group file %s", bitfn);
+	/* If there is only one BIT, we use it for both templates */
+	bit[0] = &bits[0];
+	bit[1] = &bits[bit_count - 1];
+
+	infp = fopen(argv[optind], "r");
+	if (infp == NULL)
+		OPEN_ERR_EXIT(argv[optind]);
+
+	/*
+	 * Collect the template and BIT of each use of a template, then
+	 * sort them so that each template is compiled once per BIT.
+	 */
+	kcount = ksize = 0;
+	while (1) {
+		if (fscanf(infp, "%s %s", fmrfn[V], fmrfn[E]) != 2) {
+			if (feof(infp))
+				break;
+			else
+				ERR_OUT("Reading input file");
+		}
+		if (kcount + 2 > ksize) {
+			ksize = (ksize == 0) ? 1024 : ksize * 2;
+			nkeys = (MTDOSTOREKEY *)realloc(keys,
+			    ksize * sizeof(MTDOSTOREKEY));
+			if (nkeys == NULL)
+				ALLOC_ERR_OUT("Template keys");
+			keys = nkeys;
+		}
+		for (t = V; t <= E; t++) {
+			keys[kcount].name = malloc(strlen(fmrfn[t]) + 1);
+			if (keys[kcount].name == NULL)
+				ALLOC_ERR_OUT("Template name");
+			strcpy(keys[kcount].name, fmrfn[t]);
+			/*
+			 * The first BIT is applied to the enrollment template,
+			 * the second to the verify template, as per the
+			 * MINEX-II test spec.
+			 */
+			keys[kcount].bit = (t == V) ? bit[1] : bit[0];
+			kcount++;
+		}
+	}
+	if (kcount == 0)
+		ERR_OUT("No template pairs in %s", argv[optind]);
+	qsort(keys, kcount, sizeof(MTDOSTOREKEY), compare_mtdo_store_keys);
+
+	/* Compile the unique keys, compacting the array */
+	u = 0;
+	for (k = 0; k < kcount; k++) {
+		if ((u != 0) &&
+		    (compare_mtdo_store_keys(&keys[u - 1], &keys[k]) == 0)) {
+			free(keys[k].name);
+			keys[k].name = NULL;
+			continue;
+		}
+		if (u != k) {
+			keys[u] = keys[k];
+			keys[k].name = NULL;
+		}
+		printf("\rTemplate: %u", u + 1); fflush(stdout);
+		if (compile_template(&keys[u]) != 0)
+			ERR_OUT("Could not compile template %s", keys[u].name);
+		if (datalen > UINT32_MAX - MTDO_STORE_HDR_LEN -
+		    (uint64_t)kcount * MTDO_STORE_ENTRY_LEN)
+			ERR_OUT("Template store is too large");
+		u++;
+	}
+	printf("\n");
+
+	if (stat(storefn, &sb) == 0)
+		ERR_OUT("File %s exists", storefn);
+	if ((outfp = fopen(storefn, "wb")) == NULL)
+		OPEN_ERR_EXIT(storefn);
+	if ((write_mtdo_store_index(outfp, keys, u) != 0) ||
+	    (fwrite(data, 1, datalen, outfp) != datalen)) {
+		fclose(outfp);
+		outfp = NULL;
+		remove(storefn);
+		ERR_OUT("Could not write template store %s", storefn);
+	}
+	if (fclose(outfp) != 0) {
+		outfp = NULL;
+		remove(storefn);
+		ERR_OUT("Could not write template store %s", storefn);
+	}
+	outfp = NULL;
+	printf("%u templates compiled into %s\n", u, storefn);
+	exitcode = EXIT_SUCCESS;
+
+err_out:
+	if (infp != NULL)
+		fclose(infp);
+	if (outfp != NULL)
+		fclose(outfp);
+	if (keys != NULL) {
+		for (k = 0; k < kcount; k++)
+			free(keys[k].name);
+		free(keys);
+	}
+	if (data != NULL)
+		free(data);
+	exit (exitcode);
+}
@@ -9,11 +9,14 @@
 */
 
 #include <sys/param.h>
+#include <sys/mman.h>
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -51,15 +54,37 @@
  * 3)  Open the input file
  * 4)  Loop:
  *     4a) read one pair from the template-pairs input file
- *     4b) prune/convert/sort the input templates
+ *     4b) prune/convert/sort the input templates, or find them in the
+ *         precompiled template store
  *     4c) call the SDK's match_templates() interface
  *     4d) record similarity score in output file
  *
+ * Optionally, the pairs are matched in parallel by worker threads, or by
+ * worker processes for an SDK that is not thread-safe. The input file is
+ * read into memory, and the workers take chunks of pairs in turn, each
+ * with its own records and buffers for steps 4b-4d, writing the results
+ * to its own file. The results are then copied to the output file in
+ * input file order.
+ *
+ * The reading and preparing of each template, the SDK call, and the
+ * writing of each result line are timed, and a summary of the times of
+ * each phase is printed at the end.
+ *
+ * With -b, the output file is also written in the binary results format,
+ * for mocstats, to the output file name with ".bin" appended.
  */ 
 static void
 usage()
 {
-	fprintf(stderr, "Usage: sdktest <filename>\n");
+	fprintf(stderr, "Usage: sdktest [-b] [-p processes | -t threads] "
+	    "[-s storefile] <filename>\n"
+	    "\t<filename> is the input file containing minutiae file names\n"
+	    "\t-b also write the results in the binary results format\n"
+	    "\t-p match the pairs in that many processes, for SDKs that\n"
+	    "\t   are not thread-safe\n"
+	    "\t-t match the pairs in that many threads\n"
+	    "\t-s use the templates precompiled by mtdocomp into storefile\n"
+	);
 	exit (EXIT_FAILURE);
 }
 
@@ -68,43 +93,551 @@ usage()
 #define E	1
 
 #define BDBBUFSIZE	1024	/* Buffer for the CC FMRs that go to the SDK */
+
+/*
+ * The maximum number of worker threads or processes, and the number of
+ * pairs a worker takes at a time.
+ */
+#define SDK_WORKERS_MAX		256
+#define PAIR_CHUNK		256
+
+/*
+ * The timed phases of each pair. With a template store, reading is
+ * finding the template in the store.
+ */
+#define PHASE_READ		0
+#define PHASE_CONVERT		1
+#define PHASE_CCREC		2
+#define PHASE_MATCH		3
+#define PHASE_WRITE		4
+#define PHASE_COUNT		5
+
+static const char *phase_names[PHASE_COUNT] = {
+	"Read template", "Prune/convert", "Build CC record", "SDK match",
+	"Write result"
+};
+
+/*
+ * Where the results of each chunk of pairs were written: the worker, and
+ * the offset and length in the worker's results file.
+ */
+struct chunk_result {
+	int		worker;
+	long		offset;
+	long		len;
+};
+
+/*
+ * The state shared by the workers. It is in shared memory, so that it
+ * can be used by worker processes as well as threads.
+ */
+struct pair_share {
+	pthread_mutex_t		lock;
+	unsigned int		next;		/* next chunk */
+	int			stop;		/* a worker failed */
+	struct chunk_result	chunk[];
+};
+
+/*
+ * The pairs of the input file, read into memory when matched in parallel.
+ */
+struct pair_list {
+	char			*text;		/* the input file */
+	char			**fmrfn;	/* verify and enroll file
+						 * names of each pair */
+	unsigned int		npairs;
+	unsigned int		nchunks;
+	struct pair_share	*share;
+	size_t			sharesize;
+};
+
+/*
+ * A worker, with its own records and buffers to prepare and match one
+ * pair at a time.
+ */
+struct sdk_worker {
+	int		index;
+	BIT		**bit;
+	MTDOSTORE	*store;		/* NULL without a store */
+	struct pair_list *pairs;
+	FMRPOOL		pool;		/* records reused per pair */
+	FMR		*infmr[2];	/* input FMR data structures */
+	FMR		*ccfmr[2];	/* compact card form of above */
+	BDB		ccbdb[2];	/* wrapper for CC templates */
+	void		*ccbdbbuf[2];	/* memory for above wrapper */
+	FILE		*resfp;		/* results in parallel */
+	PHASEHIST	*phases;	/* in shared memory */
+	int		status;
+	pthread_t	thread;
+	pid_t		pid;
+};
+
+static int
+init_sdk_worker(struct sdk_worker *w)
+{
+	int t;
+
+	init_fmr_pool(&w->pool);
+	/* Allocated the data block buffers for stroing the FMR
+	 * in memory so it can be passed into the SDK.
+	 */
+	for (t = V; t <= E; t++) {
+		w->ccbdbbuf[t] = malloc(BDBBUFSIZE);
+		if (w->ccbdbbuf[t] == NULL)
+			ALLOC_ERR_RETURN("BDB buffer");
+		INIT_BDB(&w->ccbdb[t], w->ccbdbbuf[t], BDBBUFSIZE);
+	}
+
+	/*
+	 * The FMRs are reset and filled again for each pair, reusing
+	 * their records from the pool.
+	 */
+	for (t = V; t <= E; t++)
+		if ((new_fmr(FMR_STD_ANSI, &w->infmr[t]) < 0) ||
+		    (new_fmr(FMR_STD_ISO_COMPACT_CARD, &w->ccfmr[t]) < 0))
+			ALLOC_ERR_RETURN("FMR");
+	return (0);
+}
+
+static void
+free_sdk_worker(struct sdk_worker *w)
+{
+	int t;
+
+	for (t = V; t <= E; t++) {
+		if (w->ccfmr[t] != NULL)
+			free_fmr(w->ccfmr[t]);
+		if (w->infmr[t] != NULL)
+			free_fmr(w->infmr[t]);
+		if (w->ccbdbbuf[t] != NULL)
+			free(w->ccbdbbuf[t]);
+	}
+	free_fmr_pool(&w->pool);
+	if (w->resfp != NULL)
+		fclose(w->resfp);
+}
+
+/*
+ * Prepare one pair of templates, call the SDK to match them, and record
+ * the result line in the output file.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+static int
+match_pair(struct sdk_worker *w, char *vfn, char *efn, FILE *outfp)
+{
+	char *fmrfn[2];
+	uint16_t cx[2], cy[2];	/* Center of interest coordinate for each FMR */
+	int usecm[2];			/* Flag, use center of mass? */
+	uint8_t *ccrec[2];		/* CC templates passed to the SDK */
+	unsigned int cclen[2];		/* length of the above */
+	MTDOENTRY entry[2];
+	BIT **bit = w->bit;
+	PHASEHIST *phases = w->phases;
+	uint16_t score = 0;
+	int32_t rv = 0;
+	struct timespec starttm, finishtm;
+	uint64_t delta_t;
+	int t;
+
+	fmrfn[V] = vfn;
+	fmrfn[E] = efn;
+
+	/*
+	 * With a template store, the CC templates were made by
+	 * mtdocomp using the same BIT assignment as below.
+	 */
+	if (w->store != NULL) {
+		for (t = V; t <= E; t++) {
+			PHASETIME(starttm);
+			if (find_mtdo_store_entry(w->store, fmrfn[t],
+			    bit[(t == V) ? 1 : 0], &entry[t]) != 0)
+				ERR_OUT("Template %s is not in the store",
+				    fmrfn[t]);
+			PHASETIME(finishtm);
+			record_phase_time(&phases[PHASE_READ],
+			    PHASEINTERVAL(starttm, finishtm));
+			ccrec[t] = entry[t].ccfmr;
+			cclen[t] = entry[t].ccfmrlen;
+		}
+		goto match;
+	}
+
+	/* Read verification and enrollment minutiae files */
+	for (t = V; t <= E; t++) {
+		PHASETIME(starttm);
+		if (pool_read_fmr(&w->pool, fmrfn[t], w->infmr[t]) != 0)
+			ERR_OUT("Could not read FMR file %s", fmrfn[t]);
+		PHASETIME(finishtm);
+		record_phase_time(&phases[PHASE_READ],
+		    PHASEINTERVAL(starttm, finishtm));
+		CHOOSEPRUNECENTER(fmrfn[t], w->infmr[t], cx[t], cy[t],
+		    usecm[t]);
+	}
+
+	/*
+	 * The first BIT is applied to the enrollment template, the
+	 * second to the verify template, as per the MINEX-II test spec.
+	 */
+	PHASETIME(starttm);
+	if (pool_prune_convert_sort_fmr(&w->pool, w->infmr[V], w->ccfmr[V],
+	    bit[1]->bit_minutia_min, bit[1]->bit_minutia_max,
+	    bit[1]->bit_minutia_order, cx[V], cy[V], usecm[V]) != 0)
+		ERR_OUT("Pruning/sorting first FMR failed.");
+	PHASETIME(finishtm);
+	record_phase_time(&phases[PHASE_CONVERT],
+	    PHASEINTERVAL(starttm, finishtm));
+	PHASETIME(starttm);
+	if (pool_prune_convert_sort_fmr(&w->pool, w->infmr[E], w->ccfmr[E],
+	    bit[0]->bit_minutia_min, bit[0]->bit_minutia_max,
+	    bit[0]->bit_minutia_order, cx[E], cy[E], usecm[E]) != 0)
+		ERR_OUT("Pruning/sorting second FMR failed.");
+	PHASETIME(finishtm);
+	record_phase_time(&phases[PHASE_CONVERT],
+	    PHASEINTERVAL(starttm, finishtm));
+
+	/*
+	 * The CC FMR needs to be passed into the SDK as a simple
+	 * byte array, so convert the FMR into a buffer allocated
+	 * for the worker.
+	 */
+	for (t = V; t <= E; t++) {
+		PHASETIME(starttm);
+		REWIND_BDB(&w->ccbdb[t]);
+		if (push_fmr(&w->ccbdb[t], w->ccfmr[t]) != WRITE_OK)
+			ERR_OUT("Could not push CC FMR to buffer");
+		PHASETIME(finishtm);
+		record_phase_time(&phases[PHASE_CCREC],
+		    PHASEINTERVAL(starttm, finishtm));
+		ccrec[t] = (uint8_t *)w->ccbdb[t].bdb_start;
+		cclen[t] = w->ccbdb[t].bdb_current - w->ccbdb[t].bdb_start;
+	}
+
+match:
+	PHASETIME(starttm);
+	//rv = match_templates(ccrec[V], cclen[V], ccrec[E], cclen[E],
+	//    &score);
+	(void)ccrec;	/* Until the SDK call above is enabled */
+	(void)cclen;
+	if (rv != 0)
+		ERR_OUT("Could not get score: Return value is %d", rv);
+	PHASETIME(finishtm);
+	delta_t = PHASEINTERVAL(starttm, finishtm);
+	record_phase_time(&phases[PHASE_MATCH], delta_t);
+
+	PHASETIME(starttm);
+	fprintf(outfp, "%s %s %u %d\n", fmrfn[V], fmrfn[E],
+	    (unsigned int)(delta_t / 1000), score);
+	PHASETIME(finishtm);
+	record_phase_time(&phases[PHASE_WRITE],
+	    PHASEINTERVAL(starttm, finishtm));
+	return (0);
+
+err_out:
+	return (-1);
+}
+
+/*
+ * Read all pairs of the input file into memory, and create the state
+ * shared by the workers, with one entry per chunk of pairs.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+static int
+read_pair_list(FILE *infp, struct pair_list *pairs)
+{
+	pthread_mutexattr_t attr;
+	unsigned int nnames, size;
+	size_t textlen;
+	long len;
+	char **names;
+	char *p;
+
+	if ((fseek(infp, 0, SEEK_END) != 0) || ((len = ftell(infp)) < 0))
+		ERR_OUT("Could not get input file size");
+	rewind(infp);
+	textlen = (size_t)len;
+	pairs->text = (char *)malloc(textlen + 1);
+	if (pairs->text == NULL)
+		ALLOC_ERR_OUT("Input file buffer");
+	if (fread(pairs->text, 1, textlen, infp) != textlen)
+		ERR_OUT("Could not read input file");
+	pairs->text[textlen] = '\0';
+
+	/* Split the text into file names, in place. */
+	nnames = 0;
+	size = 0;
+	p = strtok(pairs->text, " \t\r\n");
+	while (p != NULL) {
+		if (nnames == size) {
+			size = (size == 0) ? 1024 : size * 2;
+			names = (char **)realloc(pairs->fmrfn,
+			    size * sizeof(char *));
+			if (names == NULL)
+				ALLOC_ERR_OUT("Pair list");
+			pairs->fmrfn = names;
+		}
+		pairs->fmrfn[nnames++] = p;
+		p = strtok(NULL, " \t\r\n");
+	}
+	if (nnames % 2 != 0)
+		ERR_OUT("Input file has a template without a pair");
+	pairs->npairs = nnames / 2;
+	pairs->nchunks = (pairs->npairs + PAIR_CHUNK - 1) / PAIR_CHUNK;
+
+	pairs->sharesize = sizeof(struct pair_share) +
+	    pairs->nchunks * sizeof(struct chunk_result);
+	pairs->share = (struct pair_share *)mmap(NULL, pairs->sharesize,
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if (pairs->share == MAP_FAILED) {
+		pairs->share = NULL;
+		ALLOC_ERR_OUT("Shared worker state");
+	}
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&pairs->share->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	return (0);
+
+err_out:
+	return (-1);
+}
+
+static void
+free_pair_list(struct pair_list *pairs)
+{
+	if (pairs->share != NULL) {
+		pthread_mutex_destroy(&pairs->share->lock);
+		munmap(pairs->share, pairs->sharesize);
+	}
+	if (pairs->fmrfn != NULL)
+		free(pairs->fmrfn);
+	if (pairs->text != NULL)
+		free(pairs->text);
+}
+
+/*
+ * Take chunks of pairs, in turn with the other workers, and match them,
+ * until no chunks are left or a worker fails. The results of each chunk
+ * are written to the worker's results file.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+static int
+match_chunks(struct sdk_worker *w)
+{
+	struct pair_list *pairs = w->pairs;
+	struct pair_share *share = pairs->share;
+	unsigned int chunk, i, last;
+	long offset;
+
+	for (;;) {
+		pthread_mutex_lock(&share->lock);
+		if (share->stop || (share->next == pairs->nchunks)) {
+			pthread_mutex_unlock(&share->lock);
+			break;
+		}
+		chunk = share->next++;
+		pthread_mutex_unlock(&share->lock);
+
+		offset = ftell(w->resfp);
+		last = MIN((chunk + 1) * PAIR_CHUNK, pairs->npairs);
+		for (i = chunk * PAIR_CHUNK; i < last; i++)
+			if (match_pair(w, pairs->fmrfn[2 * i + V],
+			    pairs->fmrfn[2 * i + E], w->resfp) != 0) {
+				pthread_mutex_lock(&share->lock);
+				share->stop = 1;
+				pthread_mutex_unlock(&share->lock);
+				return (-1);
+			}
+		share->chunk[chunk].worker = w->index;
+		share->chunk[chunk].offset = offset;
+		share->chunk[chunk].len = ftell(w->resfp) - offset;
+	}
+	if (fflush(w->resfp) != 0)
+		return (-1);
+	return (0);
+}
+
+static void *
+match_thread(void *arg)
+{
+	struct sdk_worker *w = (struct sdk_worker *)arg;
+
+	w->status = (match_chunks(w) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+	return (NULL);
+}
+
+/*
+ * Copy the results of the chunks to the output file in input file order.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+static int
+merge_chunks(struct pair_list *pairs, struct sdk_worker *workers,
+    FILE *outfp)
+{
+	struct chunk_result *cr;
+	char buf[BUFSIZ];
+	unsigned int chunk;
+	size_t n;
+	long left;
+	FILE *resfp;
+
+	for (chunk = 0; chunk < pairs->nchunks; chunk++) {
+		cr = &pairs->share->chunk[chunk];
+		resfp = workers[cr->worker].resfp;
+		if (fseek(resfp, cr->offset, SEEK_SET) != 0)
+			ERR_OUT("Could not seek in results file");
+		for (left = cr->len; left > 0; left -= n) {
+			n = fread(buf, 1, MIN((long)sizeof(buf), left), resfp);
+			if (n == 0)
+				ERR_OUT("Could not read results file");
+			if (fwrite(buf, 1, n, outfp) != n)
+				ERR_OUT("Could not write output file");
+		}
+	}
+	return (0);
+
+err_out:
+	return (-1);
+}
+
+/*
+ * Match the pairs in worker threads or processes. The workers' results
+ * files are created here, before any process is forked, so that the
+ * parent can merge them when the workers are done.
+ * Returns:
+ *	 0     Success
+ *	-1     Failure
+ */
+static int
+match_parallel(struct pair_list *pairs, struct sdk_worker *workers,
+    int nworkers, int useprocs, FILE *outfp)
+{
+	int started = 0;
+	int status, i;
+	int retval = -1;
+
+	for (i = 0; i < nworkers; i++) {
+		workers[i].resfp = tmpfile();
+		if (workers[i].resfp == NULL)
+			ERR_OUT("Could not create temporary results file");
+	}
+	/* Nothing buffered may be written twice by a forked process. */
+	fflush(stdout);
+	fflush(outfp);
+
+	for (started = 0; started < nworkers; started++) {
+		if (!useprocs) {
+			if (pthread_create(&workers[started].thread, NULL,
+			    match_thread, &workers[started]) != 0)
+				ERR_OUT("Could not create worker thread");
+			continue;
+		}
+		workers[started].pid = fork();
+		if (workers[started].pid < 0)
+			ERR_OUT("Could not create worker process: %s",
+			    strerror(errno));
+		if (workers[started].pid == 0) {
+			status = match_chunks(&workers[started]);
+			_exit((status == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	retval = 0;
+
+err_out:
+	/* When a worker could not be started, stop the others. */
+	if (retval != 0) {
+		pthread_mutex_lock(&pairs->share->lock);
+		pairs->share->stop = 1;
+		pthread_mutex_unlock(&pairs->share->lock);
+	}
+	for (i = 0; i < started; i++) {
+		if (useprocs) {
+			if ((waitpid(workers[i].pid, &status, 0) < 0) ||
+			    !WIFEXITED(status))
+				workers[i].status = EXIT_FAILURE;
+			else
+				workers[i].status = WEXITSTATUS(status);
+		} else {
+			pthread_join(workers[i].thread, NULL);
+		}
+		if (workers[i].status != EXIT_SUCCESS)
+			retval = -1;
+	}
+	if (retval == 0)
+		retval = merge_chunks(pairs, workers, outfp);
+	return (retval);
+}
+
 int
 main(int argc, char *argv[])
 {
 	FILE *infp = NULL;
-	FILE *bitfp = NULL;
 	FILE *outfp = NULL;
-	FILE *fmrfp = NULL;
 
-	void * bitbuf;
 	char bitfn[MAXPATHLEN];
-	TLV *bit_group;
+	BIT bits[2];
 	BIT *bit[2];
-	BDB bitbdb;
-	int bit_count;
+	int bit_count = 0;
 
 	char fmrfn[2][MAXPATHLEN];	/* input FMR file names */
-	FMR *infmr[2];			/* input FMR data structures */
-	FMR *ccfmr[2];			/* compact card form of input FMRs */
-	BDB ccbdb[2];			/* buffer wrapper for CC templates */
-	void * ccbdbbuf[2] = {NULL, NULL}; /* memory for above wrapper */
-	uint16_t cx[2], cy[2];	/* Center of interest coordinate for each FMR */
-	int usecm[2];			/* Flag, use center of mass? */
+	struct sdk_worker *workers = NULL;
+	int nworkers = 1;
+	int parallel = 0;
+	int useprocs = 0;
+	struct pair_list pairs;
+	PHASEHIST *phases = NULL;
+	size_t phasesize = 0;
+	char *endp;
+
+	char *storefn = NULL;
+	MTDOSTORE store;		/* precompiled templates */
 
 	uint32_t genID, matcherID;
-	uint16_t score;
-	char outfn[MAXPATHLEN];
+	char outfn[MAXPATHLEN], binfn[MAXPATHLEN];
+	int binary = 0;
 	struct stat sb;
 	int32_t rv;
 	int exitcode;
+	int ch, i, p;
 
 	time_t thetime;
-	struct timeval starttm, finishtm;
 
-	if (argc != 2)
+	while ((ch = getopt(argc, argv, "bp:s:t:")) != -1) {
+		switch (ch) {
+		case 'b':
+			binary = 1;
+			break;
+		case 'p':
+		case 't':
+			if (parallel)
+				usage();
+			nworkers = strtol(optarg, &endp, 10);
+			if ((*endp != '\0') || (nworkers < 1) ||
+			    (nworkers > SDK_WORKERS_MAX))
+				usage();
+			parallel = 1;
+			useprocs = (ch == 'p');
+			break;
+		case 's':
+			storefn = optarg;
+			break;
+		default :
+			usage();
+			break;
+		}
+	}
+	if (optind != argc - 1)
 		usage();
 
 	exitcode = EXIT_FAILURE;
+	bzero(&pairs, sizeof(pairs));
 	infp = fopen(argv[optind], "r");
 	if (infp == NULL)
 		OPEN_ERR_EXIT(argv[optind]);
@@ -118,34 +651,15 @@ main(int argc, char *argv[])
 		ERR_OUT("Could not get IDs: Return value is %d", rv);
 
 	GENBITFN(bitfn, genID, matcherID);
-	bitfp = fopen(bitfn, "rb");
-	if (bitfp == NULL)
-		OPEN_ERR_EXIT(bitfn);
-	if (fstat(fileno(bitfp), &sb) < 0)
-		ERR_EXIT("Could not get stats on BIT file %s", bitfn);
+	if (read_bitgroup_file(bitfn, bits, &bit_count) != 0)
+		ERR_EXIT("Could not get BITs from file %s", bitfn);
 
-	/*
-	 * Create a TLV object for the BIT group, and get the group
-	 * from the file.
-	 */
-	if (new_tlv(&bit_group, 0, 0) != 0)
-		ALLOC_ERR_EXIT("TLV structure");
-	bitbuf = malloc(sb.st_size);
-	if (bitbuf == NULL)
-		ALLOC_ERR_EXIT("BDB structure");
-	if (fread(bitbuf, 1, sb.st_size, bitfp) != sb.st_size)
-		ERR_EXIT("Could not read BIT file %s", bitfn);
-	INIT_BDB(&bitbdb, bitbuf, sb.st_size);
-	if (scan_tlv(&bitbdb, bit_group) != READ_OK)
-		ERR_EXIT("Could not scan BIT TLV");
-	if (get_bits_from_tlv(bit, bit_group, &bit_count) != READ_OK)
-		ERR_EXIT("Getting BITs from TLV group");
-	free(bitbuf);
-	
 	/* If there is only one BIT, we use it for both templates */
-	if (bit_count == 1)
-		bit[1] = bit[0];
-	free_tlv(bit_group);
+	bit[0] = &bits[0];
+	bit[1] = &bits[bit_count - 1];
+
+	if ((storefn != NULL) && (open_mtdo_store(storefn, &store) != 0))
+		ERR_EXIT("Could not open template store %s", storefn);
 
 	/* The output file name is a combination of SDK and matcher IDs. */
 	GENTESTFN(outfn, genID, matcherID);
@@ -169,93 +683,68 @@ main(int argc, char *argv[])
 	thetime = time(NULL);
 	fprintf(outfp, "Local Time: %s", ctime(&thetime));
 
-	/* Allocated the data block buffers for stroing the FMR
-	 * in memory so it can be passed into the SDK.
+	/*
+	 * Each worker has its own records and buffers, and phase times in
+	 * memory shared with worker processes.
 	 */
-	ccbdbbuf[V] = malloc(BDBBUFSIZE);
-	if (ccbdbbuf[V] == NULL)
-		ALLOC_ERR_OUT("BDB buffer");
-	INIT_BDB(&ccbdb[V], ccbdbbuf[V], BDBBUFSIZE);
-	ccbdbbuf[E] = malloc(BDBBUFSIZE);
-	if (ccbdbbuf[E] == NULL)
-		ALLOC_ERR_OUT("BDB buffer");
-	INIT_BDB(&ccbdb[E], ccbdbbuf[E], BDBBUFSIZE);
-
-	while (1) {
-		if (fscanf(infp, "%s %s", &fmrfn[V], &fmrfn[E]) != 2)
-			if (feof(infp))
-				break;
-			else
-				ERR_OUT("Reading input file");
-		fprintf(outfp, "%s %s", fmrfn[V], fmrfn[E]);
-
-		new_fmr(FMR_STD_ANSI, &infmr[V]);
-		new_fmr(FMR_STD_ANSI, &infmr[E]);
-
-		/* Read verification minutiae file */
-		fmrfp = fopen(fmrfn[V], "rb");
-		if (fmrfp == NULL)
-			ERR_OUT("Could not open FMR file %s", fmrfn[V]);
-		if (read_fmr(fmrfp, infmr[V]) != READ_OK)
-			ERR_OUT("Could not read FMR file %s", fmrfn[V]);
-		fclose(fmrfp);
-		CHOOSEPRUNECENTER(fmrfn[V], infmr[V], cx[V], cy[V], usecm[V]);
-
-		/* Read enrollment minutiae file */
-		fmrfp = fopen(fmrfn[E], "rb");
-		if (fmrfp == NULL)
-			ERR_OUT("Could not open FMR file %s", fmrfn[E]);
-		if (read_fmr(fmrfp, infmr[E]) != READ_OK)
-			ERR_OUT("Could not read FMR file %s", fmrfn[E]);
-		fclose(fmrfp);
-		CHOOSEPRUNECENTER(fmrfn[E], infmr[E], cx[E], cy[E], usecm[E]);
-
-		/*
-		 * The first BIT is applied to the enrollment template, the
-		 * second to the verify template, as per the MINEX-II test spec.
-		 */
-		new_fmr(FMR_STD_ISO_COMPACT_CARD, &ccfmr[V]);
-		if (prune_convert_sort_fmr(infmr[V], ccfmr[V],
-		    bit[1]->bit_minutia_min, bit[1]->bit_minutia_max,
-		    bit[1]->bit_minutia_order, cx[V], cy[V], usecm[V]) != 0)
-			ERR_OUT("Pruning/sorting first FMR failed.");
-		new_fmr(FMR_STD_ISO_COMPACT_CARD, &ccfmr[E]);
-		if (prune_convert_sort_fmr(infmr[E], ccfmr[E],
-		    bit[0]->bit_minutia_min, bit[0]->bit_minutia_max,
-		    bit[0]->bit_minutia_order, cx[E], cy[E], usecm[E]) != 0)
-			ERR_OUT("Pruning/sorting second FMR failed.");
-	
-		/*
-		 * The CC FMR needs to be passed into the SDK as a simple
-		 * byte array, so convert the FMR into a buffer allocated
-		 * above.
-		 */
-		REWIND_BDB(&ccbdb[V]);
-		if (push_fmr(&ccbdb[V], ccfmr[V]) != WRITE_OK)
-			ERR_OUT("Could not push CC FMR to buffer");
-		REWIND_BDB(&ccbdb[E]);
-		if (push_fmr(&ccbdb[E], ccfmr[E]) != WRITE_OK)
-			ERR_OUT("Could not push CC FMR to buffer");
+	workers = (struct sdk_worker *)calloc(nworkers,
+	    sizeof(struct sdk_worker));
+	if (workers == NULL)
+		ALLOC_ERR_OUT("Workers");
+	phasesize = nworkers * PHASE_COUNT * sizeof(PHASEHIST);
+	phases = (PHASEHIST *)mmap(NULL, phasesize, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANON, -1, 0);
+	if (phases == MAP_FAILED) {
+		phases = NULL;
+		ALLOC_ERR_OUT("Phase histograms");
+	}
+	for (i = 0; i < nworkers * PHASE_COUNT; i++)
+		init_phase_histogram(&phases[i]);
+	for (i = 0; i < nworkers; i++) {
+		workers[i].index = i;
+		workers[i].phases = &phases[i * PHASE_COUNT];
+		workers[i].bit = bit;
+		workers[i].store = (storefn != NULL) ? &store : NULL;
+		workers[i].pairs = &pairs;
+		if (init_sdk_worker(&workers[i]) != 0)
+			ERR_OUT("Could not set up worker");
+	}
 
-		gettimeofday(&starttm, 0);
-		//rv = match_templates(
-		//    (uint8_t *)ccbdb[V].bdb_start,
-		//    ccbdb[V].bdb_current - ccbdb[V].bdb_start,
-		//    (uint8_t *)ccbdb[E].bdb_start,
-                //    ccbdb[E].bdb_current - ccbdb[E].bdb_start,
-		//    &score);
-		if (rv != 0)
-			ERR_OUT("Could not get score: Return value is %d", rv);
-		gettimeofday(&finishtm, 0);
-		fprintf(outfp, " %u", TIMEINTERVAL(starttm, finishtm));
-		fprintf(outfp, " %d\n", score);
+	if (parallel) {
+		if (read_pair_list(infp, &pairs) != 0)
+			ERR_OUT("Could not read pairs from %s", argv[optind]);
+		if (match_parallel(&pairs, workers, nworkers, useprocs,
+		    outfp) != 0)
+			ERR_OUT("Matching in parallel failed");
+	} else {
+		while (1) {
+			if (fscanf(infp, "%s %s", &fmrfn[V], &fmrfn[E]) != 2)
+				if (feof(infp))
+					break;
+				else
+					ERR_OUT("Reading input file");
+			if (match_pair(&workers[0], fmrfn[V], fmrfn[E],
+			    outfp) != 0)
+				goto err_out;
+		} /* while not EOF */
+	}
 
-		free_fmr(ccfmr[V]);
-		free_fmr(ccfmr[E]);
-		free_fmr(infmr[V]);
-		free_fmr(infmr[E]);
+	/* The phase times of all workers, summed into those of the first */
+	for (i = 1; i < nworkers; i++)
+		for (p = 0; p < PHASE_COUNT; p++)
+			add_phase_histogram(&phases[p],
+			    &phases[i * PHASE_COUNT + p]);
+	print_phase_summary(stdout, phase_names, phases, PHASE_COUNT);
 
-	} /* while not EOF */
+	if (binary) {
+		rv = fclose(outfp);
+		outfp = NULL;
+		if (rv != 0)
+			ERR_OUT("Could not write %s", outfn);
+		GENBINRESFN(binfn, outfn);
+		if (convert_results_file(outfn, binfn) != 0)
+			ERR_OUT("Could not write %s", binfn);
+	}
 	exitcode = EXIT_SUCCESS;
 
 err_out:
@@ -263,16 +752,16 @@ err_out:
 		fclose(infp);
 	if (outfp != NULL)
 		fclose(outfp);
-	if (bitfp != NULL)
-		fclose(bitfp);
-	if (ccbdbbuf[V] != NULL)
-		free(ccbdbbuf[V]);
-	if (ccbdbbuf[E] != NULL)
-		free(ccbdbbuf[E]);
-	if (bit[0] != NULL)
-		free(bit[0]);
-	if (bit[1] != NULL)
-		free(bit[1]);
+	if (storefn != NULL)
+		close_mtdo_store(&store);
+	if (workers != NULL) {
+		for (i = 0; i < nworkers; i++)
+			free_sdk_worker(&workers[i]);
+		free(workers);
+	}
+	free_pair_list(&pairs);
+	if (phases != NULL)
+		munmap(phases, phasesize);
 
 	exit (exitcode);
 }
@@ -40,12 +40,12 @@ int main(int argc, char *argv[])
 {
 	FILE *fp;
 	TLV *parent;
-	TLV *child;
 	BDB *bdb;
-	BIT *bit;
+	BDB bitbdb;
+	BIT bit[2];
 	void *buf;
 	struct stat sb;
-	uint8_t count;
+	int bit_count;
 	int i;
 
 	if (argc != 2)
@@ -70,6 +70,7 @@ int main(int argc, char *argv[])
 	if (fread(buf, 1, sb.st_size, fp) != sb.st_size)
 		ERR_EXIT("Could not read input file");
 	INIT_BDB(bdb, buf, sb.st_size);
+	INIT_BDB(&bitbdb, buf, sb.st_size);
 
 	if (scan_tlv(bdb, parent) != READ_OK) {
 		printf("Partial read of TLV:\n");
@@ -78,26 +79,15 @@ int main(int argc, char *argv[])
 	}
 	print_tlv(stdout, parent);
 
-	bit = (BIT *)malloc(sizeof(BIT));
-	if (bit == NULL)
-		ALLOC_ERR_EXIT("BIT structure");
-
-	/* The first child TLV in the group is the BIT count */
-	child = TAILQ_FIRST(&parent->tlv_value.tlv_children);
-	if (child == NULL)
-		ERR_EXIT("Could not get first TLV in group");
-	count = *child->tlv_value.tlv_primitive;
+	/* Decode the BITs from the file bytes, not from the TLV tree */
+	if (scan_bit_group(&bitbdb, bit, &bit_count) != READ_OK)
+		ERR_EXIT("Could not decode BITs from BIT group");
 	printf("-------------------------------\n");
-	printf("%u BITs in the group:\n", count);
+	printf("%d BITs in the group:\n", bit_count);
 
-	for (i = 1; i <= count; i++) {
-		child = TAILQ_NEXT(child, tlv_list);
-		if (child == NULL)
-			ERR_EXIT("Could not get TLV %d in group", i);
-		if (get_bit_from_tlv(bit, child) != 0)
-			ERR_EXIT("Could not convert BIT %d from TLV", i);
-		printf("BIT %d:\n", i);
-		print_bit(stdout, bit);
+	for (i = 0; i < bit_count; i++) {
+		printf("BIT %d:\n", i + 1);
+		print_bit(stdout, &bit[i]);
 	}
 
 	free_tlv(parent);
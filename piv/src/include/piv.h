@@ -13,8 +13,13 @@
 #include <biomdimacro.h>
 #include <stdint.h>
 
+/*
+ * A buffer size large enough for the data objects on most cards, the facial
+ * image being the largest. The library sizes its own object buffers from
+ * the BER-TLV header returned by the card, so objects larger than this can
+ * be read; callers passing their own buffers may need more room.
+ */
 #define PIV_MAX_OBJECT_SIZE		16386	
-					/* Facial image is largest object */
 #define PIV_NOCARD		1
 #define PIV_CARDERR		2	/* Error accessing the card */
 #define PIV_BUFSZ		3	/* user-supplied buffer too small */
@@ -96,4 +101,65 @@ piv_print_pcr(FILE *fp, struct piv_cbeff_record *pcr);
 int
 piv_verify_pcr(struct piv_cbeff_record *pcr, int bdb_len, int type);
 
+/*
+ * An index of the CBEFF headers in a store of concatenated PIV records,
+ * each record being a CBEFF header followed by the biometric data block
+ * and the signature block. The header fields are kept in separate arrays,
+ * one entry per record, so that all records can be checked in one pass.
+ */
+struct piv_pcr_index {
+	unsigned int	count;
+	unsigned int	size;		/* Allocated entries */
+	uint64_t	*offset;	/* Offset of the header in the store */
+	uint8_t		*patron_header_version;
+	uint8_t		*sbh_security_options;
+	uint32_t	*bdb_length;
+	uint16_t	*sb_length;
+	uint16_t	*bdb_format_owner;
+	uint16_t	*bdb_format_type;
+	uint32_t	*biometric_type;
+	uint8_t		*biometric_data_type;
+	int8_t		*biometric_data_quality;
+	uint32_t	*reserved;
+	uint8_t		(*fascn)[FASCN_LEN];
+	uint32_t	*errors;	/* PIV_PCR_ERR_ flags, set by verify */
+};
+
+/*
+ * The checks that a record in the index can fail.
+ */
+#define PIV_PCR_ERR_VERSION		0x0001
+#define PIV_PCR_ERR_SECURITY		0x0002
+#define PIV_PCR_ERR_SB_LENGTH		0x0004
+#define PIV_PCR_ERR_FORMAT_OWNER	0x0008
+#define PIV_PCR_ERR_FORMAT_TYPE		0x0010
+#define PIV_PCR_ERR_BIO_TYPE		0x0020
+#define PIV_PCR_ERR_DATA_TYPE		0x0040
+#define PIV_PCR_ERR_QUALITY		0x0080
+#define PIV_PCR_ERR_RESERVED		0x0100
+
+/*
+ * Index the CBEFF headers of all the records in a buffer containing a
+ * store of concatenated PIV records, appending to the index. The headers
+ * are decoded in place, and the biometric data blocks are not examined.
+ * The index must be zeroed before the first call, and freed with
+ * piv_free_pcr_index(). READ_ERROR is returned if the last record is
+ * truncated, or memory cannot be allocated; the index holds the records
+ * that precede it.
+ */
+int
+piv_index_pcrs(uint8_t *buf, uint64_t buflen, struct piv_pcr_index *pix);
+
+/*
+ * Verify all the records in the index according to 800-76 requirements,
+ * setting the PIV_PCR_ERR_ flags of each record, and returning the number
+ * of invalid records. The record type is taken from the BDB format type.
+ * The BDB length is not checked, as the data blocks are not parsed.
+ */
+unsigned int
+piv_verify_pcr_index(struct piv_pcr_index *pix);
+
+void
+piv_free_pcr_index(struct piv_pcr_index *pix);
+
 #endif	/* _PIV_H */
@@ -13,13 +13,19 @@
 #ifndef _PIVCARD_H
 #define _PIVCARD_H
 #include <stdint.h>
+#include <time.h>
+#include <pivdata.h>
 
 /*
- * Structure used to represent a PIV card.
+ * Structure used to represent a PIV card. The card is either a physical
+ * card connected in a reader, or a snapshot of a card's data objects that
+ * was saved to a file; see pivCardOpenSnapshot().
  */
+struct pivsnapshot;
 struct pivcard {
 	SCARDCONTEXT _pivCardContext;
 	SCARDHANDLE _pivCardHandle;
+	struct pivsnapshot *_pivCardSnapshot;
 };
 typedef struct pivcard PIVCARD;
 
@@ -54,6 +60,10 @@ typedef struct pivcard PIVCARD;
 
 /*
  * pivCardConnect() connects to the first PIV card found in a reader.
+ * The reader that held the card on the last successful connection is
+ * tried first; if it no longer has a PIV card, all the other readers are
+ * probed concurrently, and the card in the first reader in the list is
+ * used.
  * Parameters:
  *   card    - (out) Object representing the card that is connected; set
  *             on success.
@@ -65,7 +75,8 @@ int
 pivCardConnect(PIVCARD *card);
 
 /*
- * pivCardDisconnect() disconnects from the PIV card.
+ * pivCardDisconnect() disconnects from the PIV card, or closes the card
+ * snapshot.
  * Parameters:
  *   card    - (in) The card that is currently connected.
  * Returns:
@@ -90,6 +101,70 @@ pivCardDisconnect(PIVCARD card);
 int
 pivCardSaveContainer(PIVCARD card, uint32_t objtag, char *filename);
 
+/*
+ * pivCardSaveSnapshot() reads every PIV data object from a card and saves
+ * them to a single snapshot file. Each object is saved as the raw BER-TLV
+ * returned by the card, along with its tag and the time it was read.
+ * Objects that are not present on the card, or cannot be read, are not
+ * saved; a successful call to pivCardPINAuth() must be made before this
+ * function in order to save the PIN-protected objects.
+ *
+ * The snapshot file contains a header, an index with one entry per data
+ * object, and the object data; all values are in network byte order:
+ *   Header:      8-byte magic "PIVSNAP", 4-byte version, 4-byte object count
+ *   Index entry: 4-byte tag, 4-byte offset of the object from the start of
+ *                the file, 4-byte object length, 4-byte read time in seconds
+ *                since the Epoch
+ *
+ * Parameters:
+ *   card     - (in) Object representing the PIV card.
+ *   filename - (in) The name of the file to write to.
+ * Returns:
+ *   0           on success
+ *   PIV_MEMERR  - Failed to allocate memory.
+ *   PIV_CARDERR - No objects could be read from the card, or the file
+ *                 could not be written.
+ */
+int
+pivCardSaveSnapshot(PIVCARD card, char *filename);
+
+/*
+ * pivCardOpenSnapshot() opens a snapshot file saved by pivCardSaveSnapshot()
+ * and returns a card object that serves the data objects from the snapshot.
+ * All of the pivCardGet...() and pivCardBorrow...() functions can be used
+ * with the card object, returning the same data as the physical card did
+ * when the snapshot was made. pivCardPINAuth() only checks the format of
+ * the PIN for a snapshot. The snapshot is closed with pivCardDisconnect().
+ *
+ * Parameters:
+ *   filename - (in) The name of the snapshot file.
+ *   card     - (out) Object representing the card in the snapshot; set
+ *              on success.
+ * Returns:
+ *   0           on success
+ *   PIV_MEMERR  - Failed to allocate memory.
+ *   PIV_DATAERR - The file is not a valid snapshot.
+ *   PIV_CARDERR - The file could not be read.
+ */
+int
+pivCardOpenSnapshot(char *filename, PIVCARD *card);
+
+/*
+ * pivCardGetObjectTime() returns the time a data object was read from the
+ * card that was saved in a snapshot.
+ *
+ * Parameters:
+ *   card     - (in) Object representing the card in the snapshot.
+ *   objtag   - (in) The BER-TLV tag of the data object.
+ *   readtime - (out) The time the object was read from the card.
+ * Returns:
+ *   0           on success
+ *   PIV_PARMERR - The card object is not a snapshot.
+ *   PIV_CARDERR - The data object is not in the snapshot.
+ */
+int
+pivCardGetObjectTime(PIVCARD card, uint32_t objtag, time_t *readtime);
+
 /*
  * pivCardInserted() detects whether a PIV card is inserted in any smartcard
  * reader attached to the system.
@@ -170,6 +245,42 @@ pivCardGetFaceImageRec(PIVCARD card, uint8_t *buffer, unsigned int *bufsz);
 int
 pivCardGetFaceImage(PIVCARD card, uint8_t *buffer, unsigned int *bufsz);
 
+/*
+ * pivCardBorrowFingerMinutiaeRec(), pivCardBorrowFaceImageRec() and
+ * pivCardBorrowFaceImage() read the same data as their pivCardGet...()
+ * counterparts, but return a pointer into the data object read from the card
+ * instead of copying the data into a caller's buffer. The data object is
+ * returned in a reference-counted container, and the data pointer is valid
+ * until the container is released with pivObjectRelease(). Applications
+ * passing the data to another component can take an additional reference
+ * with pivObjectRetain().
+ * A call to pivCardPINAuth() must be successfully made prior to a call to
+ * these functions.
+ * 
+ * Parameters:
+ *   card    - (in) Object representing the PIV card.
+ *   obj     - (out) The container holding the data object; the caller owns
+ *             one reference on success.
+ *   data    - (out) Pointer to the record or image data within the container.
+ *   datasz  - (out) The size of the record or image data.
+ *
+ * Returns: 
+ *   0           - Success.
+ *   PIV_NOCARD  - No PIV card is inserted.
+ *   PIV_MEMERR  - Failed to allocate memory.
+ *   PIV_DATAERR - Data from the card could not be processed.
+ *   PIV_CARDERR - Some other error occurred when reading the card.
+ */
+int
+pivCardBorrowFingerMinutiaeRec(PIVCARD card, PIVOBJECT **obj, uint8_t **data,
+    unsigned int *datasz);
+int
+pivCardBorrowFaceImageRec(PIVCARD card, PIVOBJECT **obj, uint8_t **data,
+    unsigned int *datasz);
+int
+pivCardBorrowFaceImage(PIVCARD card, PIVOBJECT **obj, uint8_t **data,
+    unsigned int *datasz);
+
 /*
  * pivCardPINAuth() authenticates to the PIV card using the PIN.
  *
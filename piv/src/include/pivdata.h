@@ -26,6 +26,50 @@ struct piv_fmd {
 	unsigned short		quality;
 };
 
+/*
+ * A reference-counted container holding a data object read from a PIV card.
+ * The borrow functions return pointers into the container's buffer instead
+ * of copying the data into a caller's buffer; those pointers remain valid
+ * until the last reference to the container is released. The reference
+ * count is not locked, so a container that is shared between threads must
+ * be retained and released under the application's own synchronization.
+ */
+struct pivobject {
+	uint8_t		*_pivObjBuffer;
+	unsigned int	_pivObjLength;
+	unsigned int	_pivObjRefCount;
+};
+typedef struct pivobject PIVOBJECT;
+
+/*
+ * pivObjectCreate() creates a container that takes ownership of a buffer.
+ * The container holds one reference on return.
+ *
+ * Parameters:
+ *   buffer - (in) Buffer allocated with malloc(); it will be free'd when
+ *            the last reference to the container is released.
+ *   length - (in) Length of the data in the buffer.
+ *   obj    - (out) The new container.
+ * Returns:
+ *   0          - Success.
+ *   PIV_MEMERR - Could not allocate the container.
+ */
+int
+pivObjectCreate(uint8_t *buffer, unsigned int length, PIVOBJECT **obj);
+
+/*
+ * pivObjectRetain() adds a reference to a container, and pivObjectRelease()
+ * drops one. When the last reference is dropped, the container and its
+ * buffer are free'd, and any pointers borrowed from it become invalid.
+ *
+ * Parameters:
+ *   obj    - (in) The container.
+ */
+void
+pivObjectRetain(PIVOBJECT *obj);
+void
+pivObjectRelease(PIVOBJECT *obj);
+
 /*
  * pivValidatePIN() checks the given character array for validity
  * with respect to the PIV PIN format.
@@ -63,6 +107,27 @@ int
 pivGetFaceImage(uint8_t *rec, unsigned int reclen, uint8_t *buffer,
     unsigned int *bufsz);
 
+/*
+ * pivBorrowFaceImage() locates the facial image data within a buffer
+ * containing an INCITS-385 face recognition record, as pivGetFaceImage()
+ * does, but returns a pointer into the record instead of copying the image.
+ * Only the record header and the first facial data block header are read;
+ * the image data, JPEG or JPEG 2000, is not examined.
+ * 
+ * Parameters:
+ *   rec      - (in) Buffer containing the INCITS-385 data record.
+ *   reclen   - (in) Length of the rec buffer.
+ *   image    - (out) Pointer to the image data within rec.
+ *   imagelen - (out) The size of the image data.
+ *
+ * Returns: 
+ *   0           - Success.
+ *   PIV_DATAERR - Data from the record could not be processed.
+ */
+int
+pivBorrowFaceImage(uint8_t *rec, unsigned int reclen, uint8_t **image,
+    unsigned int *imagelen);
+
 /*
  * pivGetFingerMinutiae() returns the minutiae data from a buffer containing
  * an INCITS-378 finger minutiae record. Presumably this record was read
@@ -153,4 +218,73 @@ int
 pivGetFingerPosition(unsigned int view, uint8_t *rec, unsigned int reclen,
     int *pos);
 
+/*
+ * A handle to a parsed INCITS-378 finger minutiae record. The record is
+ * parsed once by pivFMROpen(), and any number of queries can then be made
+ * against the parsed form without parsing the record again. The functions
+ * above that take a raw record each parse the record on every call.
+ */
+typedef struct pivfmr PIVFMRHANDLE;
+
+/*
+ * pivFMROpen() parses an INCITS-378 finger minutiae record and returns
+ * a handle to the parsed record. The input buffer is not referenced after
+ * this function returns.
+ *
+ * Parameters:
+ *   rec       - (in) Buffer containing the INCITS-378 data record.
+ *   reclen    - (in) Length of the rec buffer.
+ *   pfmr      - (out) The handle to the parsed record.
+ *
+ * Returns: 
+ *   0           - Success.
+ *   PIV_MEMERR  - Internal memory allocation error.
+ *   PIV_DATAERR - Data from the record could not be processed.
+ */
+int
+pivFMROpen(uint8_t *rec, unsigned int reclen, PIVFMRHANDLE **pfmr);
+
+/*
+ * pivFMRClose() frees a parsed record handle.
+ *
+ * Parameters:
+ *   pfmr      - (in) The handle to the parsed record.
+ */
+void
+pivFMRClose(PIVFMRHANDLE *pfmr);
+
+/*
+ * pivFMRGetViewCount() returns the number of finger views in a parsed
+ * record.
+ *
+ * Parameters:
+ *   pfmr      - (in) The handle to the parsed record.
+ */
+unsigned int
+pivFMRGetViewCount(PIVFMRHANDLE *pfmr);
+
+/*
+ * pivFMRGetFingerPosition(), pivFMRGetMinutiae() and pivFMRSubsetRec()
+ * behave as pivGetFingerPosition(), pivGetFingerMinutiae() and
+ * pivSubsetFingerMinutiaeRec(), respectively, using a parsed record. The
+ * view number can be any view present in the record, 1 through the number
+ * returned by pivFMRGetViewCount().
+ *
+ * Returns: 
+ *   0           - Success.
+ *   PIV_BUFSZ   - Insufficient memory in the caller's buffer.
+ *   PIV_MEMERR  - Internal memory allocation error.
+ *   PIV_PARMERR - Incorrect parameter, most likely incorrect view.
+ *   PIV_DATAERR - Data from the record could not be processed.
+ */
+int
+pivFMRGetFingerPosition(PIVFMRHANDLE *pfmr, unsigned int view,
+    int *pos);
+int
+pivFMRGetMinutiae(PIVFMRHANDLE *pfmr, unsigned int view,
+    uint8_t *buffer, unsigned int *bufsz, unsigned int *count);
+int
+pivFMRSubsetRec(PIVFMRHANDLE *pfmr, unsigned int view, uint8_t *newrec,
+    unsigned int *newrecsz);
+
 #endif	/* _PIVDATA_H */
@@ -26,6 +26,28 @@
 #include <biomdimacro.h>
 #include <piv.h>
 
+/*
+ * Offsets of the fields within the CBEFF header, used to decode headers
+ * in place when indexing a store of records.
+ */
+#define PCR_VERSION_OFFSET		0
+#define PCR_SECURITY_OFFSET		1
+#define PCR_BDB_LENGTH_OFFSET		2
+#define PCR_SB_LENGTH_OFFSET		6
+#define PCR_FORMAT_OWNER_OFFSET		8
+#define PCR_FORMAT_TYPE_OFFSET		10
+#define PCR_BIO_TYPE_OFFSET		36
+#define PCR_DATA_TYPE_OFFSET		39
+#define PCR_QUALITY_OFFSET		40
+#define PCR_FASCN_OFFSET		59
+#define PCR_RESERVED_OFFSET		84
+#define PCR_INDEX_INITIAL_SIZE		1024
+
+#define BE16(p)	((uint16_t)(((p)[0] << 8) | (p)[1]))
+#define BE24(p)	(((uint32_t)(p)[0] << 16) | ((p)[1] << 8) | (p)[2])
+#define BE32(p)	(((uint32_t)(p)[0] << 24) | ((p)[1] << 16) |		\
+	    ((p)[2] << 8) | (p)[3])
+
 static void
 print_encoded_date(FILE *fp, uint8_t date[])
 {
@@ -279,3 +301,159 @@ piv_verify_pcr(struct piv_cbeff_record *pcr, int bdb_len, int type)
 	CSR(res, 0, "Reserved field");
 	return (ret);
 }
+
+/*
+ * Grow the index arrays to hold at least one more record.
+ */
+#define GROW_INDEX_ARRAY(field, size)					\
+do {									\
+	void *__p = realloc(pix->field, (size) * sizeof(*pix->field));	\
+	if (__p == NULL)						\
+		goto err_out;						\
+	pix->field = __p;						\
+} while (0)
+
+static int
+grow_pcr_index(struct piv_pcr_index *pix)
+{
+	unsigned int size;
+
+	size = (pix->size == 0) ? PCR_INDEX_INITIAL_SIZE : pix->size * 2;
+	GROW_INDEX_ARRAY(offset, size);
+	GROW_INDEX_ARRAY(patron_header_version, size);
+	GROW_INDEX_ARRAY(sbh_security_options, size);
+	GROW_INDEX_ARRAY(bdb_length, size);
+	GROW_INDEX_ARRAY(sb_length, size);
+	GROW_INDEX_ARRAY(bdb_format_owner, size);
+	GROW_INDEX_ARRAY(bdb_format_type, size);
+	GROW_INDEX_ARRAY(biometric_type, size);
+	GROW_INDEX_ARRAY(biometric_data_type, size);
+	GROW_INDEX_ARRAY(biometric_data_quality, size);
+	GROW_INDEX_ARRAY(reserved, size);
+	GROW_INDEX_ARRAY(fascn, size);
+	GROW_INDEX_ARRAY(errors, size);
+	pix->size = size;
+	return (0);
+
+err_out:
+	return (-1);
+}
+
+/*
+ * 
+ */
+int
+piv_index_pcrs(uint8_t *buf, uint64_t buflen, struct piv_pcr_index *pix)
+{
+	uint64_t pos;
+	uint8_t *hdr;
+	unsigned int i;
+
+	pos = 0;
+	while (pos < buflen) {
+		if (buflen - pos < CBEFF_HDR_LEN)
+			ERR_OUT("Truncated CBEFF header at offset %" PRIu64,
+			    pos);
+		if (pix->count == pix->size)
+			if (grow_pcr_index(pix) != 0)
+				ALLOC_ERR_OUT("CBEFF header index");
+		hdr = buf + pos;
+		i = pix->count;
+		pix->offset[i] = pos;
+		pix->patron_header_version[i] = hdr[PCR_VERSION_OFFSET];
+		pix->sbh_security_options[i] = hdr[PCR_SECURITY_OFFSET];
+		pix->bdb_length[i] = BE32(hdr + PCR_BDB_LENGTH_OFFSET);
+		pix->sb_length[i] = BE16(hdr + PCR_SB_LENGTH_OFFSET);
+		pix->bdb_format_owner[i] = BE16(hdr + PCR_FORMAT_OWNER_OFFSET);
+		pix->bdb_format_type[i] = BE16(hdr + PCR_FORMAT_TYPE_OFFSET);
+		pix->biometric_type[i] = BE24(hdr + PCR_BIO_TYPE_OFFSET);
+		pix->biometric_data_type[i] = hdr[PCR_DATA_TYPE_OFFSET];
+		pix->biometric_data_quality[i] =
+		    (int8_t)hdr[PCR_QUALITY_OFFSET];
+		pix->reserved[i] = BE32(hdr + PCR_RESERVED_OFFSET);
+		memcpy(pix->fascn[i], hdr + PCR_FASCN_OFFSET, FASCN_LEN);
+		pix->errors[i] = 0;
+
+		/* Step over the header, data block and signature block */
+		pos += CBEFF_HDR_LEN;
+		if ((uint64_t)pix->bdb_length[i] + pix->sb_length[i] >
+		    buflen - pos)
+			ERR_OUT("Truncated PIV record at offset %" PRIu64,
+			    pix->offset[i]);
+		pos += (uint64_t)pix->bdb_length[i] + pix->sb_length[i];
+		pix->count++;
+	}
+	return (READ_OK);
+
+err_out:
+	return (READ_ERROR);
+}
+
+/*
+ * The checks are written without branches so that the loop over the
+ * index arrays can be vectorized by the compiler.
+ */
+unsigned int
+piv_verify_pcr_index(struct piv_pcr_index *pix)
+{
+	unsigned int i, invalid;
+	uint32_t err, isfmr, isfir, isfrf, fingerq, faceq;
+	uint16_t ftype;
+	uint32_t btype;
+	uint8_t dtype, sec;
+	int8_t q;
+
+	invalid = 0;
+	for (i = 0; i < pix->count; i++) {
+		ftype = pix->bdb_format_type[i];
+		isfmr = (ftype == PIV_FORMAT_TYPE_FINGER_MINUTIAE);
+		isfir = (ftype == PIV_FORMAT_TYPE_FINGER_IMAGE);
+		isfrf = (ftype == PIV_FORMAT_TYPE_FACE_IMAGE);
+		btype = pix->biometric_type[i];
+		dtype = pix->biometric_data_type[i] & PIV_BIO_DATA_TYPE_MASK;
+		sec = pix->sbh_security_options[i];
+		q = pix->biometric_data_quality[i];
+		fingerq = (q == -2) | (q == -1) | (q == 20) | (q == 40) |
+		    (q == 60) | (q == 80) | (q == 100);
+		faceq = (q >= -2) & (q <= 100);
+
+		err = 0;
+		err |= (pix->patron_header_version[i] != 0x03) *
+		    PIV_PCR_ERR_VERSION;
+		err |= ((sec != PIV_SECURITY_NON_ENCRYPTED) &
+		    (isfmr | (sec != PIV_SECURITY_ENCRYPTED))) *
+		    PIV_PCR_ERR_SECURITY;
+		err |= (pix->sb_length[i] == 0) * PIV_PCR_ERR_SB_LENGTH;
+		err |= (pix->bdb_format_owner[i] != PIV_BDB_FORMAT_OWNER) *
+		    PIV_PCR_ERR_FORMAT_OWNER;
+		err |= !(isfmr | isfir | isfrf) * PIV_PCR_ERR_FORMAT_TYPE;
+		err |= (btype != (isfrf ? PIV_BIO_TYPE_FACE :
+		    PIV_BIO_TYPE_FINGER)) * PIV_PCR_ERR_BIO_TYPE;
+		err |= (dtype != (isfmr ? PIV_BIO_DATA_TYPE_PROCESSED :
+		    PIV_BIO_DATA_TYPE_RAW)) * PIV_PCR_ERR_DATA_TYPE;
+		err |= !(isfrf ? faceq : fingerq) * PIV_PCR_ERR_QUALITY;
+		err |= (pix->reserved[i] != 0) * PIV_PCR_ERR_RESERVED;
+		pix->errors[i] = err;
+		invalid += (err != 0);
+	}
+	return (invalid);
+}
+
+void
+piv_free_pcr_index(struct piv_pcr_index *pix)
+{
+	free(pix->offset);
+	free(pix->patron_header_version);
+	free(pix->sbh_security_options);
+	free(pix->bdb_length);
+	free(pix->sb_length);
+	free(pix->bdb_format_owner);
+	free(pix->bdb_format_type);
+	free(pix->biometric_type);
+	free(pix->biometric_data_type);
+	free(pix->biometric_data_quality);
+	free(pix->reserved);
+	free(pix->fascn);
+	free(pix->errors);
+	memset(pix, 0, sizeof(struct piv_pcr_index));
+}
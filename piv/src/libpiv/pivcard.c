@@ -9,9 +9,12 @@
 */
 
 #include <sys/queue.h> 
+#include <arpa/inet.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <PCSC/winscard.h>
 #include <PCSC/wintypes.h>
 #include <nistapdu.h>
@@ -22,7 +25,50 @@
 #include <pivcard.h>
 #include <pivdata.h>
 #include <tlv.h>
-#include <frf.h>	/* From BIOMDI, INCITS-385 Face Recognition */
+
+/*
+ * Layout of the card snapshot file; see pivCardSaveSnapshot() in pivcard.h.
+ */
+#define PIV_SNAPSHOT_MAGIC		"PIVSNAP"
+#define PIV_SNAPSHOT_MAGIC_LEN		8
+#define PIV_SNAPSHOT_VERSION		1
+#define PIV_SNAPSHOT_HDR_LEN		16
+#define PIV_SNAPSHOT_INDEX_ENTRY_LEN	16
+
+/*
+ * The data objects saved in a card snapshot.
+ */
+static const uint32_t pivSnapshotTags[] = {
+	PIVCCCTAG_DO,
+	PIVCHUIDTAG_DO,
+	PIVPIVAUTHCERTTAG_DO,
+	PIVSECURITYOBJECTTAG_DO,
+	PIVCARDAUTHCERTTAG_DO,
+	PIVDIGITALSIGCERTTAG_DO,
+	PIVKEYMGMTCERTTAG_DO,
+	PIVFINGERPRINTSTAG_DO,
+	PIVFACETAG_DO,
+	PIVPRINTEDINFOTAG_DO
+};
+#define PIV_SNAPSHOT_MAX_OBJECTS					\
+	(sizeof(pivSnapshotTags) / sizeof(pivSnapshotTags[0]))
+
+/*
+ * An opened card snapshot: the contents of the snapshot file, and the
+ * index of the data objects within it.
+ */
+struct pivsnapobject {
+	uint32_t tag;
+	uint32_t offset;
+	uint32_t length;
+	uint32_t readtime;
+};
+struct pivsnapshot {
+	uint8_t *_pivSnapBuffer;
+	unsigned int _pivSnapLength;
+	unsigned int _pivSnapCount;
+	struct pivsnapobject _pivSnapIndex[PIV_SNAPSHOT_MAX_OBJECTS];
+};
 
 static uint8_t mapElemTagFromObjTag(uint32_t objtag)
 {
@@ -82,68 +128,187 @@ mapAPDUFromObjTag(uint32_t objtag)
 	return (apdu);
 }
 
+/*
+ * The state of probing one reader for a PIV card. Each probe uses its own
+ * PC/SC context so that readers can be probed from separate threads.
+ */
+struct pivreaderprobe {
+	char *reader;
+	SCARDCONTEXT context;
+	SCARDHANDLE handle;
+	int status;
+	int threaded;
+	pthread_t thread;
+};
+
+/*
+ * The name of the last reader that had a PIV card, checked before
+ * probing all of the readers.
+ */
+static char *pivLastReader = NULL;
+static pthread_mutex_t pivLastReaderMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Connect to the card in a reader and select the PIV application. On
+ * failure, the card handle and context are released.
+ */
+static int
+pivProbeReader(struct pivreaderprobe *probe)
+{
+	LONG ret;
+	uint8_t sw1, sw2;
+	DWORD rdrprot;
+
+	probe->status = PIV_NOCARD;
+	ret = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL,
+	    &probe->context);
+	if (ret != SCARD_S_SUCCESS)
+		return (probe->status);
+	if (SCardConnect(probe->context, probe->reader, SCARD_SHARE_EXCLUSIVE,
+	    SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &probe->handle, &rdrprot)
+	    != SCARD_S_SUCCESS) {
+		SCardReleaseContext(probe->context);
+		return (probe->status);
+	}
+
+	/* Select the PIV application; the response data is not used. */
+	ret = sendAPDU(probe->handle, &PIVSELECTAPP, 0, NULL, &sw1, &sw2);
+	if ((ret == 0) && (sw1 == APDU_NORMAL_COMPLETE)) {
+		probe->status = 0;
+	} else {
+		SCardDisconnect(probe->handle, SCARD_LEAVE_CARD);
+		SCardReleaseContext(probe->context);
+	}
+	return (probe->status);
+}
+
+static void *
+pivProbeReaderThread(void *arg)
+{
+	(void)pivProbeReader((struct pivreaderprobe *)arg);
+	return (NULL);
+}
+
+/*
+ * Record the reader that had the PIV card.
+ */
+static void
+pivSetLastReader(char *reader)
+{
+	char *name;
+
+	name = malloc(strlen(reader) + 1);
+	if (name != NULL)
+		strcpy(name, reader);
+	pthread_mutex_lock(&pivLastReaderMutex);
+	if (pivLastReader != NULL)
+		free(pivLastReader);
+	pivLastReader = name;
+	pthread_mutex_unlock(&pivLastReaderMutex);
+}
+
 int
 pivCardConnect(PIVCARD *card)
 {
 	LONG ret;
-	uint8_t sw1, sw2;
 	char **readers;
-	int rdrcount, r;
-	DWORD rdrprot;
-	BDB cardresponse;
-	void *respbuf;
+	int rdrcount, r, hint, winner;
 	int status;
 	SCARDCONTEXT context;
-	SCARDHANDLE handle;
+	struct pivreaderprobe *probes;
 
 	status = PIV_NOCARD;
+	readers = NULL;
+	rdrcount = 0;
+	probes = NULL;
 
 	/*
-         * Connect to the reader and card.
-         */
-	readers = NULL;
-	respbuf = NULL;
+	 * Get the list of readers; the context is only used for the list.
+	 */
 	ret = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &context);
-	if (ret != SCARD_S_SUCCESS)
-		ERR_OUT("Could not establish contact with reader: %s",
+	if (ret != SCARD_S_SUCCESS) {
+		ERRP("Could not establish contact with reader: %s",
 		    pcsc_stringify_error(ret));
+		return (status);
+	}
 	if (getReaders(context, &readers, &rdrcount) != 0)
 		ERR_OUT("Could not get list of readers.");
 	if (rdrcount < 1)
 		ERR_OUT("No readers found");
-
-	respbuf = malloc(PIV_MAX_OBJECT_SIZE);
-	if (respbuf == NULL)
-		ALLOC_ERR_OUT("Response BDB buffer");
-	INIT_BDB(&cardresponse, respbuf, PIV_MAX_OBJECT_SIZE);
+	probes = (struct pivreaderprobe *)calloc(rdrcount,
+	    sizeof(struct pivreaderprobe));
+	if (probes == NULL)
+		ALLOC_ERR_OUT("Reader probes");
 	for (r = 0; r < rdrcount; r++) {
-		if (SCardConnect(context, readers[r], SCARD_SHARE_EXCLUSIVE,
-		    SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &handle, &rdrprot)
-		    != 0)
-			continue;
+		probes[r].reader = readers[r];
+		probes[r].status = PIV_NOCARD;
+	}
 
-		/* Select the PIV application. */
-		ret = sendAPDU(handle, &PIVSELECTAPP, 0, &cardresponse,
-		    &sw1, &sw2);
-		if (ret != 0)
-			ERR_OUT("Could not send '%s' APDU",
-			    PIVSELECTAPP.apdu_descr);
-		if (sw1 == APDU_NORMAL_COMPLETE) {
-			card->_pivCardContext = context;
-			card->_pivCardHandle = handle;
-			status = 0;
-			break;
-		} else {
-			continue;
+	/*
+	 * Try the reader that had the card last time first; in the common
+	 * case of reconnecting to the same card, no other reader is touched.
+	 */
+	hint = -1;
+	pthread_mutex_lock(&pivLastReaderMutex);
+	if (pivLastReader != NULL)
+		for (r = 0; r < rdrcount; r++)
+			if (strcmp(readers[r], pivLastReader) == 0) {
+				hint = r;
+				break;
+			}
+	pthread_mutex_unlock(&pivLastReaderMutex);
+	winner = -1;
+	if ((hint != -1) && (pivProbeReader(&probes[hint]) == 0))
+		winner = hint;
+
+	/*
+	 * Probe all the other readers at once, each in its own thread. When
+	 * more than one reader has a PIV card, the first in the reader list
+	 * is used, as when the readers were probed one at a time.
+	 */
+	if (winner == -1) {
+		for (r = 0; r < rdrcount; r++) {
+			if (r == hint)
+				continue;
+			if (pthread_create(&probes[r].thread, NULL,
+			    pivProbeReaderThread, &probes[r]) == 0)
+				probes[r].threaded = 1;
+			else
+				(void)pivProbeReader(&probes[r]);
+		}
+		for (r = 0; r < rdrcount; r++)
+			if (probes[r].threaded)
+				pthread_join(probes[r].thread, NULL);
+		for (r = 0; r < rdrcount; r++) {
+			if ((r == hint) || (probes[r].status != 0))
+				continue;
+			if (winner == -1) {
+				winner = r;
+			} else {
+				/* Release the cards that weren't chosen */
+				SCardDisconnect(probes[r].handle,
+				    SCARD_LEAVE_CARD);
+				SCardReleaseContext(probes[r].context);
+			}
 		}
 	}
+
+	if (winner != -1) {
+		card->_pivCardContext = probes[winner].context;
+		card->_pivCardHandle = probes[winner].handle;
+		card->_pivCardSnapshot = NULL;
+		pivSetLastReader(readers[winner]);
+		status = 0;
+	}
 err_out:
-	if (status != 0)
-		SCardReleaseContext(context);
-	if (readers != NULL)
+	SCardReleaseContext(context);
+	if (probes != NULL)
+		free(probes);
+	if (readers != NULL) {
+		for (r = 0; r < rdrcount; r++)
+			free(readers[r]);
 		free(readers);
-	if (respbuf != NULL)
-		free(respbuf);
+	}
 	return (status);
 }
 
@@ -152,6 +317,11 @@ pivCardDisconnect(PIVCARD card)
 {
 	PCSC_API LONG ret;
 
+	if (card._pivCardSnapshot != NULL) {
+		free(card._pivCardSnapshot->_pivSnapBuffer);
+		free(card._pivCardSnapshot);
+		return (0);
+	}
 	ret = SCardDisconnect(card._pivCardHandle, SCARD_UNPOWER_CARD);
 	if (ret != 0) {
 		ERRP("Could not disconnect: %s (0x%lX)\n",
@@ -168,6 +338,47 @@ pivCardDisconnect(PIVCARD card)
 }
 
 /*
+ * Find a data object in a card snapshot.
+ */
+static struct pivsnapobject *
+pivSnapshotFindObject(struct pivsnapshot *snap, uint32_t objtag)
+{
+	unsigned int i;
+
+	for (i = 0; i < snap->_pivSnapCount; i++)
+		if (snap->_pivSnapIndex[i].tag == objtag)
+			return (&snap->_pivSnapIndex[i]);
+	return (NULL);
+}
+
+/*
+ * Read a data object from a card snapshot into a new buffer, as if the
+ * object was read from the card.
+ */
+static int
+pivSnapshotReadObject(struct pivsnapshot *snap, uint32_t objtag,
+    BDB *cardobject)
+{
+	struct pivsnapobject *sobj;
+	uint8_t *buf;
+
+	INIT_BDB(cardobject, NULL, 0);
+	sobj = pivSnapshotFindObject(snap, objtag);
+	if (sobj == NULL)
+		return (PIV_CARDERR);
+	buf = malloc(sobj->length);
+	if (buf == NULL)
+		return (PIV_MEMERR);
+	memcpy(buf, snap->_pivSnapBuffer + sobj->offset, sobj->length);
+	INIT_BDB(cardobject, buf, sobj->length);
+	return (0);
+}
+
+/*
+ * Read a data object from the card. The object buffer is allocated by the
+ * smartcard library, sized from the BER-TLV header at the start of the
+ * card's response, so objects of any size can be read. On success, the
+ * caller must free cardobject->bdb_start.
  */
 static int
 pivReadDataObject(PIVCARD card, uint32_t objtag, BDB *cardobject)
@@ -180,12 +391,18 @@ pivReadDataObject(PIVCARD card, uint32_t objtag, BDB *cardobject)
 	apdu = mapAPDUFromObjTag(objtag);
 	if (apdu == NULL)
 		return (PIV_PARMERR);
+	if (card._pivCardSnapshot != NULL)
+		return (pivSnapshotReadObject(card._pivCardSnapshot, objtag,
+		    cardobject));
 
+	INIT_BDB(cardobject, NULL, 0);
 	ret = sendAPDU(card._pivCardHandle, apdu, dryrun, cardobject,
 	    &sw1, &sw2);
 	if (ret != 0)
 		ERR_OUT("APDU '%s' failed", apdu->apdu_descr);
 	CHECKSTATUS(apdu->apdu_descr, sw1, sw2);
+	if (cardobject->bdb_start == NULL)
+		ERR_OUT("No data returned for '%s'", apdu->apdu_descr);
 	REWIND_BDB(cardobject);
 #if DEBUG_OUTPUT
 	printf("[%s] \n", apdu->apdu_descr);
@@ -197,6 +414,10 @@ pivReadDataObject(PIVCARD card, uint32_t objtag, BDB *cardobject)
 
 	return (0);
 err_out:
+	if (cardobject->bdb_start != NULL) {
+		free(cardobject->bdb_start);
+		INIT_BDB(cardobject, NULL, 0);
+	}
 	return (PIV_CARDERR);
 }
 
@@ -206,7 +427,6 @@ int
 pivCardSaveContainer(PIVCARD card, uint32_t objtag, char *filename)
 {
 	BDB carddata;
-	uint8_t *databuf;
 	TLV *tlv;
 	LONG ret;
 	FILE *fp;
@@ -215,11 +435,8 @@ pivCardSaveContainer(PIVCARD card, uint32_t objtag, char *filename)
 	status = PIV_CARDERR;
 	fp = NULL;
 	tlv = NULL;
-	
-	databuf = malloc(PIV_MAX_OBJECT_SIZE);
-	if (databuf == NULL)
-		return (PIV_MEMERR);
-	INIT_BDB(&carddata, databuf, PIV_MAX_OBJECT_SIZE);
+	INIT_BDB(&carddata, NULL, 0);
+
 	ret = pivReadDataObject(card, objtag, &carddata);
 	if (ret != 0)
 		ERR_OUT("Could not read card data");
@@ -246,11 +463,190 @@ err_out:
 		fclose(fp);
 	if (tlv != NULL)
 		free_tlv(tlv);
-	if (databuf != NULL)
-		free(databuf);
+	if (carddata.bdb_start != NULL)
+		free(carddata.bdb_start);
+	return (status);
+}
+
+/*
+ */
+int
+pivCardSaveSnapshot(PIVCARD card, char *filename)
+{
+	BDB objs[PIV_SNAPSHOT_MAX_OBJECTS];
+	uint32_t tags[PIV_SNAPSHOT_MAX_OBJECTS];
+	uint32_t readtimes[PIV_SNAPSHOT_MAX_OBJECTS];
+	uint8_t hdrbuf[PIV_SNAPSHOT_HDR_LEN +
+	    PIV_SNAPSHOT_MAX_OBJECTS * PIV_SNAPSHOT_INDEX_ENTRY_LEN];
+	BDB hdr;
+	FILE *fp;
+	uint32_t count, offset, length;
+	unsigned int i;
+	int created;
+	int status;
+
+	status = PIV_CARDERR;
+	fp = NULL;
+	created = 0;
+	count = 0;
+	for (i = 0; i < PIV_SNAPSHOT_MAX_OBJECTS; i++) {
+		if (pivReadDataObject(card, pivSnapshotTags[i],
+		    &objs[count]) != 0)
+			continue;
+		tags[count] = pivSnapshotTags[i];
+		readtimes[count] = (uint32_t)time(NULL);
+		count++;
+	}
+	if (count == 0)
+		ERR_OUT("No data objects could be read from the card");
+
+	INIT_BDB(&hdr, hdrbuf, sizeof(hdrbuf));
+	OPUSH(PIV_SNAPSHOT_MAGIC, PIV_SNAPSHOT_MAGIC_LEN, &hdr);
+	LPUSH(PIV_SNAPSHOT_VERSION, &hdr);
+	LPUSH(count, &hdr);
+	offset = PIV_SNAPSHOT_HDR_LEN + count * PIV_SNAPSHOT_INDEX_ENTRY_LEN;
+	for (i = 0; i < count; i++) {
+		length = objs[i].bdb_end - objs[i].bdb_start;
+		LPUSH(tags[i], &hdr);
+		LPUSH(offset, &hdr);
+		LPUSH(length, &hdr);
+		LPUSH(readtimes[i], &hdr);
+		offset += length;
+	}
+
+	fp = fopen(filename, "wb");
+	if (fp == NULL)
+		ERR_OUT("Could not open file '%s'", filename);
+	created = 1;
+	length = hdr.bdb_current - hdr.bdb_start;
+	if (fwrite(hdrbuf, 1, length, fp) != length)
+		ERR_OUT("Could not write file '%s'", filename);
+	for (i = 0; i < count; i++) {
+		length = objs[i].bdb_end - objs[i].bdb_start;
+		if (fwrite(objs[i].bdb_start, 1, length, fp) != length)
+			ERR_OUT("Could not write file '%s'", filename);
+	}
+	if (fclose(fp) != 0) {
+		fp = NULL;
+		ERR_OUT("Could not close file '%s'", filename);
+	}
+	fp = NULL;
+
+	status = 0;
+err_out:
+	if (fp != NULL)
+		fclose(fp);
+	if ((status != 0) && created)
+		remove(filename);
+	for (i = 0; i < count; i++)
+		free(objs[i].bdb_start);
+	return (status);
+}
+
+/*
+ */
+int
+pivCardOpenSnapshot(char *filename, PIVCARD *card)
+{
+	struct pivsnapshot *snap;
+	struct pivsnapobject *sobj;
+	uint8_t magic[PIV_SNAPSHOT_MAGIC_LEN];
+	uint32_t version, count;
+	BDB hdr;
+	FILE *fp;
+	long filelen;
+	unsigned int i, dataoff;
+	int status;
+
+	status = PIV_CARDERR;
+	snap = NULL;
+	fp = fopen(filename, "rb");
+	if (fp == NULL)
+		ERR_OUT("Could not open file '%s'", filename);
+	if ((fseek(fp, 0, SEEK_END) != 0) || ((filelen = ftell(fp)) < 0) ||
+	    (fseek(fp, 0, SEEK_SET) != 0))
+		ERR_OUT("Could not get size of file '%s'", filename);
+
+	status = PIV_MEMERR;
+	snap = (struct pivsnapshot *)malloc(sizeof(struct pivsnapshot));
+	if (snap == NULL)
+		ALLOC_ERR_OUT("Snapshot");
+	snap->_pivSnapBuffer = NULL;
+	if (filelen > 0) {
+		snap->_pivSnapBuffer = malloc(filelen);
+		if (snap->_pivSnapBuffer == NULL)
+			ALLOC_ERR_OUT("Snapshot buffer");
+	}
+	snap->_pivSnapLength = filelen;
+	status = PIV_CARDERR;
+	if (fread(snap->_pivSnapBuffer, 1, filelen, fp) != (size_t)filelen)
+		ERR_OUT("Could not read file '%s'", filename);
+
+	/* Scan the header and index, checking each object lies in the file */
+	status = PIV_DATAERR;
+	INIT_BDB(&hdr, snap->_pivSnapBuffer, snap->_pivSnapLength);
+	OSCAN(magic, PIV_SNAPSHOT_MAGIC_LEN, &hdr);
+	if (memcmp(magic, PIV_SNAPSHOT_MAGIC, PIV_SNAPSHOT_MAGIC_LEN) != 0)
+		ERR_OUT("File '%s' is not a PIV card snapshot", filename);
+	LSCAN(&version, &hdr);
+	if (version != PIV_SNAPSHOT_VERSION)
+		ERR_OUT("Unsupported snapshot version %u", version);
+	LSCAN(&count, &hdr);
+	if (count > PIV_SNAPSHOT_MAX_OBJECTS)
+		ERR_OUT("Invalid snapshot object count %u", count);
+	snap->_pivSnapCount = count;
+	dataoff = PIV_SNAPSHOT_HDR_LEN + count * PIV_SNAPSHOT_INDEX_ENTRY_LEN;
+	for (i = 0; i < count; i++) {
+		sobj = &snap->_pivSnapIndex[i];
+		LSCAN(&sobj->tag, &hdr);
+		LSCAN(&sobj->offset, &hdr);
+		LSCAN(&sobj->length, &hdr);
+		LSCAN(&sobj->readtime, &hdr);
+		if (mapAPDUFromObjTag(sobj->tag) == NULL)
+			ERR_OUT("Invalid snapshot object tag 0x%06X",
+			    sobj->tag);
+		if ((sobj->offset < dataoff) ||
+		    (sobj->offset > snap->_pivSnapLength) ||
+		    (sobj->length > snap->_pivSnapLength - sobj->offset))
+			ERR_OUT("Snapshot object 0x%06X is out of bounds",
+			    sobj->tag);
+	}
+
+	fclose(fp);
+	card->_pivCardContext = 0;
+	card->_pivCardHandle = 0;
+	card->_pivCardSnapshot = snap;
+	return (0);
+
+eof_out:
+	ERRP("Snapshot file '%s' is truncated", filename);
+err_out:
+	if (fp != NULL)
+		fclose(fp);
+	if (snap != NULL) {
+		if (snap->_pivSnapBuffer != NULL)
+			free(snap->_pivSnapBuffer);
+		free(snap);
+	}
 	return (status);
 }
 
+/*
+ */
+int
+pivCardGetObjectTime(PIVCARD card, uint32_t objtag, time_t *readtime)
+{
+	struct pivsnapobject *sobj;
+
+	if (card._pivCardSnapshot == NULL)
+		return (PIV_PARMERR);
+	sobj = pivSnapshotFindObject(card._pivCardSnapshot, objtag);
+	if (sobj == NULL)
+		return (PIV_CARDERR);
+	*readtime = (time_t)sobj->readtime;
+	return (0);
+}
+
 /*
  */
 int
@@ -268,100 +664,158 @@ pivCardInserted()
 }
 
 /*
- * Get some card data, extracted from the card object. This function works
- * for data that is contained within a CBEFF wrapper, fingerprint minutiae
- * and facial image, for example.
+ * Scan the tag and length fields of a TLV at the start of a buffer,
+ * returning the size of those fields and the length of the value.
  */
 static int
-pivCardGetCardData(PIVCARD card, uint32_t objtag, uint8_t *buffer,
-    unsigned int *bufsz)
+pivScanTLVHeader(uint8_t *buf, unsigned int buflen, unsigned int *hdrlen,
+    unsigned int *vallen)
+{
+	unsigned int idx;
+	unsigned int len;
+	int lcount;
+
+	if (buflen < 2)
+		return (PIV_DATAERR);
+	idx = 1;
+	if ((buf[0] & BERTLV_SB_MB_TAGNUM_MASK) == BERTLV_MB_TAGNUM_INDICATOR) {
+		while ((idx < buflen) &&
+		    (buf[idx] & BERTLV_MB_TAGNUM_TERMINATOR_MASK))
+			idx++;
+		idx++;
+	}
+	if (idx >= buflen)
+		return (PIV_DATAERR);
+	if (buf[idx] <= BERTLV_SB_MAX_VALUE) {
+		len = buf[idx++];
+	} else {
+		/* Lengths of 2^24 octets or more are not supported */
+		lcount = buf[idx++] & BERTLV_SB_MAX_VALUE;
+		if ((lcount < 1) || (lcount > 3) || (idx + lcount > buflen))
+			return (PIV_DATAERR);
+		for (len = 0; lcount > 0; lcount--)
+			len = (len << 8) | buf[idx++];
+	}
+	if (len > buflen - idx)
+		return (PIV_DATAERR);
+	*hdrlen = idx;
+	*vallen = len;
+	return (0);
+}
+
+/*
+ * Locate the biometric data block within a data object read from the card.
+ * This function works for data that is contained within a CBEFF wrapper,
+ * fingerprint minutiae and facial image, for example. No data is copied;
+ * the data pointer refers to storage within the object buffer.
+ */
+static int
+pivFindCardData(uint8_t *objbuf, unsigned int objlen, uint8_t elem_tag,
+    uint8_t **data, unsigned int *datasz)
 {
-	BDB carddata;
-	void *databuf;
 	BDB pcrdb;
 	struct piv_cbeff_record pcr;
-	uint8_t sw1, sw2;
-	int ret;
-	int status;
-	unsigned int datasz;
-	TLV *tlv = NULL;
+	unsigned int hdrlen, vallen;
 	uint8_t *dptr;
+
+	/*
+	 * The minutiae and face image on a PIV card are contained within a 
+	 * CBEFF wrapper, contained within a TLV which is within a TLV. The
+	 * top-level TLV is a proper BER_TLV. However, the second-level TLV
+	 * is not a BER-TLV, contrary to claims made in the PIV spec.
+	 * (Fingerprints have a tag of 0xBC, which because bit 6 is on, the
+	 * value field of this TLV should also be a TLV ('constructed'), but
+	 * it isn't; we have the length field immediately, so we really have
+	 * a primitive encoding of the value field). PIV treats the length
+	 * field as if this was a BER-TLV, however, so both headers are
+	 * scanned the same way, in place.
+	 */
+	if (pivScanTLVHeader(objbuf, objlen, &hdrlen, &vallen) != 0)
+		return (PIV_DATAERR);
+	dptr = objbuf + hdrlen;
+	if ((vallen < 1) || (dptr[0] != elem_tag))
+		return (PIV_DATAERR);
+	if (pivScanTLVHeader(dptr, vallen, &hdrlen, &vallen) != 0)
+		return (PIV_DATAERR);
+	dptr += hdrlen;
+
+	/* Now, scan off the CBEFF info; we need the biometric data block
+	 * length.
+	 */
+	if (vallen < CBEFF_HDR_LEN)
+		return (PIV_DATAERR);
+	INIT_BDB(&pcrdb, dptr, CBEFF_HDR_LEN);
+	if (piv_scan_pcr(&pcrdb, &pcr) != READ_OK)
+		return (PIV_DATAERR);
+	if (pcr.bdb_length > vallen - CBEFF_HDR_LEN)
+		return (PIV_DATAERR);
+	*data = dptr + CBEFF_HDR_LEN;
+	*datasz = pcr.bdb_length;
+	return (0);
+}
+
+/*
+ * Read a data object from the card into a new container and locate the
+ * biometric data block within it.
+ */
+static int
+pivCardReadCardData(PIVCARD card, uint32_t objtag, PIVOBJECT **obj,
+    uint8_t **data, unsigned int *datasz)
+{
+	BDB carddata;
+	PIVOBJECT *lobj;
+	int ret;
 	uint8_t elem_tag;
 
 	elem_tag = mapElemTagFromObjTag(objtag);
 	if (elem_tag == PIVCARDINVALIDTAG_ELEM)
 		return(PIV_PARMERR);
 
-	databuf = malloc(PIV_MAX_OBJECT_SIZE);
-	if (databuf == NULL) {
-		status = PIV_MEMERR;
-		goto err_out;
-	}
-	INIT_BDB(&carddata, databuf, PIV_MAX_OBJECT_SIZE);
 	ret = pivReadDataObject(card, objtag, &carddata);
+	if (ret != 0)
+		return (ret);
+	ret = pivObjectCreate(carddata.bdb_start,
+	    carddata.bdb_end - carddata.bdb_start, &lobj);
+	if (ret != 0) {
+		free(carddata.bdb_start);
+		return (ret);
+	}
+	ret = pivFindCardData(lobj->_pivObjBuffer, lobj->_pivObjLength,
+	    elem_tag, data, datasz);
 	if (ret != 0) {
-		status = ret;
-		goto err_out;
+		pivObjectRelease(lobj);
+		return (ret);
 	}
+	*obj = lobj;
+	return (0);
+}
 
-	/*
-	 * The minutiae and face image on a PIV card are contained within a 
-	 * CBEFF wrapper, contained within a TLV which is within a TLV. The
-	 * top-level TLV is a proper BER_TLV, so we can scan that. However,
-	 * the second-level TLV is not a BER-TLV, contrary to claims made in
-	 * the PIV spec. (Fingerprints have a tag of 0xBC, which because bit 6
-	 * is on, the value field of this TLV should also be a TLV
-	 * ('constructed'), but it isn't; we have the length field immediately,
-	 * so we really have a primitive encoding of the value field).
-	 * We handle the second TLV directly here, and not with the TLV lib.
-	 */
+/*
+ * Get some card data, extracted from the card object, copying it into
+ * the caller's buffer.
+ */
+static int
+pivCardGetCardData(PIVCARD card, uint32_t objtag, uint8_t *buffer,
+    unsigned int *bufsz)
+{
+	int ret;
+	unsigned int datasz;
+	PIVOBJECT *obj;
+	uint8_t *dptr;
 
-	/* Scan the first TLV, whose value field contains the second TLV */
-	new_tlv(&tlv, 0, 0);
-	REWIND_BDB(&carddata);
-	if (scan_tlv(&carddata, tlv) != READ_OK) {
-		status = PIV_DATAERR;
-		goto err_out;
-	}
-	/* The second TLV is scanned as primitive data */
-	if (tlv->tlv_value.tlv_primitive[0] != elem_tag) {
-		status = PIV_DATAERR;
-		goto err_out;
-	}
-	/* PIV treats the length field as if this was a BER-TLV, so check for
-	 * the special codes. We only support a 3-byte length field now.
-	 */
-	if (tlv->tlv_value.tlv_primitive[1] != BERTLV_SB_MB_LENGTH_MB_3) {
-		status = PIV_DATAERR;
-		goto err_out;
-	}
-	/* 4 octets: 1 for the element tag, 3 for the length field */
-	dptr = tlv->tlv_value.tlv_primitive + 4;
+	ret = pivCardReadCardData(card, objtag, &obj, &dptr, &datasz);
+	if (ret != 0)
+		return (ret);
 
-	/* Now, scan off the CBEFF info; we need the biometric data block
-	 * length.
-	 */
-	INIT_BDB(&pcrdb, dptr, tlv->tlv_length);
-	if (piv_scan_pcr(&pcrdb, &pcr) != READ_OK) {
-		status = PIV_DATAERR;
-		goto err_out;
-	}
-	dptr += CBEFF_HDR_LEN;
-	datasz = pcr.bdb_length;
 	/* Make sure there's enough room in the output buffer */
 	if (*bufsz < datasz) {
-		status = PIV_BUFSZ;
-		goto err_out;
+		pivObjectRelease(obj);
+		return (PIV_BUFSZ);
 	}
 	memcpy(buffer, dptr, datasz);
 	*bufsz = datasz;
-	status = 0;
-err_out:
-	if (tlv != NULL)
-		free_tlv(tlv);
-	if (databuf != NULL)
-		free(databuf);
-	return (status);
+	pivObjectRelease(obj);
+	return (0);
 }
 
 /*
@@ -383,54 +837,68 @@ pivCardGetFaceImageRec(PIVCARD card, uint8_t *buffer, unsigned int *bufsz)
 /*
  */
 int
-pivCardGetFaceImage(PIVCARD card, uint8_t *buffer, unsigned int *bufsz)
+pivCardBorrowFingerMinutiaeRec(PIVCARD card, PIVOBJECT **obj, uint8_t **data,
+    unsigned int *datasz)
+{
+	return (pivCardReadCardData(card, PIVFINGERPRINTSTAG_DO, obj, data,
+	    datasz));
+}
+
+/*
+ */
+int
+pivCardBorrowFaceImageRec(PIVCARD card, PIVOBJECT **obj, uint8_t **data,
+    unsigned int *datasz)
+{
+	return (pivCardReadCardData(card, PIVFACETAG_DO, obj, data, datasz));
+}
+
+/*
+ */
+int
+pivCardBorrowFaceImage(PIVCARD card, PIVOBJECT **obj, uint8_t **data,
+    unsigned int *datasz)
 {
 	int ret;
-	int status;
-	uint8_t *lbuf;
-	unsigned int lbufsz;
-	FB *fb;
-	FDB *fdb;
-	BDB bdb;
-
-	lbuf = malloc(PIV_MAX_OBJECT_SIZE);
-	if (lbuf == NULL)
-		return (PIV_MEMERR);
+	PIVOBJECT *lobj;
+	uint8_t *rec;
+	unsigned int reclen;
 
-	status = PIV_CARDERR;
-	lbufsz = PIV_MAX_OBJECT_SIZE;
-	INIT_BDB(&bdb, lbuf, PIV_MAX_OBJECT_SIZE);
-	ret = pivCardGetCardData(card, PIVFACETAG_DO, lbuf, &lbufsz);
-
-	fb = NULL;
-	if (new_fb(&fb) < 0) {
-		status = PIV_MEMERR;
-		goto err_out;
-	}
-	ret = scan_fb(&bdb, fb);
-	if (ret != READ_OK) {
-		status = PIV_CARDERR;
-		goto err_out;
-	}
-	/* Pull the first (and only) facial data block from the parent */
-	fdb = TAILQ_FIRST(&fb->facial_data);
-	if (fdb == NULL) {
-		status = PIV_CARDERR;
-		goto err_out;
+	ret = pivCardReadCardData(card, PIVFACETAG_DO, &lobj, &rec, &reclen);
+	if (ret != 0)
+		return (ret);
+	ret = pivBorrowFaceImage(rec, reclen, data, datasz);
+	if (ret != 0) {
+		pivObjectRelease(lobj);
+		return (ret);
 	}
+	*obj = lobj;
+	return (0);
+}
+
+/*
+ */
+int
+pivCardGetFaceImage(PIVCARD card, uint8_t *buffer, unsigned int *bufsz)
+{
+	int ret;
+	PIVOBJECT *obj;
+	uint8_t *image;
+	unsigned int imagelen;
+
+	ret = pivCardBorrowFaceImage(card, &obj, &image, &imagelen);
+	if (ret != 0)
+		return (ret);
+
 	/* Check the input buffer for room */
-	if (*bufsz < fdb->image_len) {
-		status = PIV_BUFSZ;
-		goto err_out;
+	if (*bufsz < imagelen) {
+		pivObjectRelease(obj);
+		return (PIV_BUFSZ);
 	}
-	memcpy(buffer, fdb->image_data, fdb->image_len);
-	*bufsz = fdb->image_len;
-
-	status = 0;
-err_out:
-	if (lbuf != NULL)
-		free(lbuf);
-	return (status);
+	memcpy(buffer, image, imagelen);
+	*bufsz = imagelen;
+	pivObjectRelease(obj);
+	return (0);
 }
 
 int
@@ -438,24 +906,20 @@ pivCardPINAuth(PIVCARD card, unsigned char pin[PIV_PIN_LENGTH])
 {
 	int ret;
 	uint8_t sw1, sw2;
-	BDB cardresponse;
-	void *respbuf;
 	APDU apdu;
 
 	ret = pivValidatePIN(pin);
 	if (ret != 0)
 		return (PIV_PINERR);
 
-	respbuf = malloc(PIV_MAX_OBJECT_SIZE);
-	if (respbuf == NULL)
-		return (PIV_MEMERR);
+	/* The protected objects in a snapshot were read with the PIN */
+	if (card._pivCardSnapshot != NULL)
+		return (0);
 
-	INIT_BDB(&cardresponse, respbuf, PIV_MAX_OBJECT_SIZE);
+	/* VERIFY returns no data, only the status words */
 	apdu = PIVVERIFYPIN;
 	add_data_to_apdu(pin, PIV_PIN_LENGTH, &apdu);
-	ret = sendAPDU(card._pivCardHandle, &apdu, 0,
-		    &cardresponse, &sw1, &sw2);
-	free(respbuf);
+	ret = sendAPDU(card._pivCardHandle, &apdu, 0, NULL, &sw1, &sw2);
 	if (ret != 0)
 		return (PIV_CARDERR);
 
@@ -18,7 +18,6 @@
 #include <piv.h>
 #include <pivdata.h>
 #include <fmr.h>	/* From BIOMDI, INCITS-378 Finger Minutiae */
-#include <frf.h>	/* From BIOMDI, INCITS-385 Face Recognition */
 
 /*
  */
@@ -43,198 +42,330 @@ pivValidatePIN(unsigned char pin[PIV_PIN_LENGTH])
 	return (0);
 }
 
+/*
+ * Layout of the parts of an INCITS-385 record used to locate the facial
+ * image: the sizes of the facial record header, facial information block,
+ * feature point block and image information block, the offset of the
+ * number of facial images within the header, and the offsets of the block
+ * length and number of feature points within the facial information block.
+ */
+#define PIV_FRF_FORMAT_ID		"FAC"
+#define PIV_FRF_FORMAT_ID_LEN		4
+#define PIV_FRF_HEADER_LEN		14
+#define PIV_FRF_FIB_LEN			20
+#define PIV_FRF_FPB_LEN			8
+#define PIV_FRF_IIB_LEN			12
+#define PIV_FRF_NUM_FACES_OFFSET	12
+#define PIV_FRF_BLOCK_LENGTH_OFFSET	0
+#define PIV_FRF_NUM_FEATURE_POINTS_OFFSET	4
+
 /*
  */
 int
-pivGetFaceImage(uint8_t *rec, unsigned int reclen, uint8_t *buffer,
-    unsigned int *bufsz)
+pivObjectCreate(uint8_t *buffer, unsigned int length, PIVOBJECT **obj)
 {
-	int status;
-	int ret;
-	FB *fb;
-	FDB *fdb;
-	BDB bdb;
+	PIVOBJECT *lobj;
 
-	fb = NULL;
-	ret = new_fb(&fb);
-	if (ret != 0) 
+	lobj = (PIVOBJECT *)malloc(sizeof(PIVOBJECT));
+	if (lobj == NULL)
 		return (PIV_MEMERR);
+	lobj->_pivObjBuffer = buffer;
+	lobj->_pivObjLength = length;
+	lobj->_pivObjRefCount = 1;
+	*obj = lobj;
+	return (0);
+}
 
-	INIT_BDB(&bdb, rec, reclen);
-	ret = scan_fb(&bdb, fb);
-	if (ret != READ_OK) {
-		status = PIV_DATAERR;
-		goto err_out;
-	}
+/*
+ */
+void
+pivObjectRetain(PIVOBJECT *obj)
+{
+	obj->_pivObjRefCount++;
+}
 
-	/* Pull the first (and only) facial data block from the parent */
-	fdb = TAILQ_FIRST(&fb->facial_data);
-	if (fdb == NULL) {
-		status = PIV_DATAERR;
-		goto err_out;
-	}
+/*
+ */
+void
+pivObjectRelease(PIVOBJECT *obj)
+{
+	if (obj == NULL)
+		return;
+	if (--obj->_pivObjRefCount > 0)
+		return;
+	free(obj->_pivObjBuffer);
+	free(obj);
+}
+
+/*
+ */
+int
+pivBorrowFaceImage(uint8_t *rec, unsigned int reclen, uint8_t **image,
+    unsigned int *imagelen)
+{
+	uint8_t *fib;
+	uint32_t blocklen;
+	uint16_t numfaces, numfp;
+	unsigned int hdrlen;
+
+	/*
+	 * Only the record header and the header of the first facial data
+	 * block are read; the image data follows the fixed-length blocks and
+	 * feature points of the first facial data block, and its length is
+	 * the remainder of that block.
+	 */
+	if (reclen < PIV_FRF_HEADER_LEN + PIV_FRF_FIB_LEN)
+		return (PIV_DATAERR);
+	if (memcmp(rec, PIV_FRF_FORMAT_ID, PIV_FRF_FORMAT_ID_LEN) != 0)
+		return (PIV_DATAERR);
+	numfaces = (rec[PIV_FRF_NUM_FACES_OFFSET] << 8) |
+	    rec[PIV_FRF_NUM_FACES_OFFSET + 1];
+	if (numfaces < 1)
+		return (PIV_DATAERR);
+
+	fib = rec + PIV_FRF_HEADER_LEN;
+	blocklen = ((uint32_t)fib[PIV_FRF_BLOCK_LENGTH_OFFSET] << 24) |
+	    (fib[PIV_FRF_BLOCK_LENGTH_OFFSET + 1] << 16) |
+	    (fib[PIV_FRF_BLOCK_LENGTH_OFFSET + 2] << 8) |
+	    fib[PIV_FRF_BLOCK_LENGTH_OFFSET + 3];
+	numfp = (fib[PIV_FRF_NUM_FEATURE_POINTS_OFFSET] << 8) |
+	    fib[PIV_FRF_NUM_FEATURE_POINTS_OFFSET + 1];
+	hdrlen = PIV_FRF_FIB_LEN + (numfp * PIV_FRF_FPB_LEN) + PIV_FRF_IIB_LEN;
+	if ((blocklen < hdrlen) ||
+	    (blocklen > reclen - PIV_FRF_HEADER_LEN))
+		return (PIV_DATAERR);
+
+	*image = fib + hdrlen;
+	*imagelen = blocklen - hdrlen;
+	return (0);
+}
+
+/*
+ */
+int
+pivGetFaceImage(uint8_t *rec, unsigned int reclen, uint8_t *buffer,
+    unsigned int *bufsz)
+{
+	int ret;
+	uint8_t *image;
+	unsigned int imagelen;
+
+	ret = pivBorrowFaceImage(rec, reclen, &image, &imagelen);
+	if (ret != 0)
+		return (ret);
 
 	/* Check the input buffer for room */
-	if (*bufsz < fdb->image_len)
+	if (*bufsz < imagelen)
 		return (PIV_BUFSZ);
 
-	memcpy(buffer, fdb->image_data, fdb->image_len);
-	*bufsz = fdb->image_len;
-	status = 0;
-err_out:
-	if (fb != NULL)
-		free_fb(fb);
-	return (status);
+	memcpy(buffer, image, imagelen);
+	*bufsz = imagelen;
+	return (0);
 }
 
 /*
- * Helper function that either subsets an FMR and returns a new FMR with the
- * single view, or retrieves the minutiae from a single view and returns
- * them in a buffer.
+ * The parsed form of a finger minutiae record, with the finger views and
+ * the minutiae of each view indexed for direct access.
  */
-static int
-subsetFMR(unsigned int view, uint8_t *rec, unsigned int reclen,
-    uint8_t *buffer, unsigned int *bufsz, unsigned int *count, FMR **newfmr)
+struct pivfmr {
+	FMR		*fmr;
+	unsigned int	vcount;
+	FVMR		**fvmrs;
+	int		*mcounts;
+	FMD		***fmds;
+};
+
+/*
+ */
+int
+pivFMROpen(uint8_t *rec, unsigned int reclen, PIVFMRHANDLE **pfmr)
 {
 	int status;
 	int ret;
-	FMR *fmr, *lnewfmr;
-	FVMR **fvmrs, *newfvmr;
-	FMD **fmds, *newfmd;
+	PIVFMRHANDLE *lpfmr;
 	BDB bdb;
-	struct piv_fmd *pfmd;
-	int vcount, mcount;
-	int i;
-
-	if ((view != 1) && (view != 2))
-		return (PIV_PARMERR);
+	unsigned int v;
 
-	fmr = NULL;
-	lnewfmr = NULL;
-	fvmrs = NULL;
-	fmds = NULL;
-	ret = new_fmr(FMR_STD_ANSI, &fmr);
-	if (ret != 0) 
+	lpfmr = (PIVFMRHANDLE *)calloc(1, sizeof(PIVFMRHANDLE));
+	if (lpfmr == NULL)
 		return (PIV_MEMERR);
+	ret = new_fmr(FMR_STD_ANSI, &lpfmr->fmr);
+	if (ret != 0) {
+		lpfmr->fmr = NULL;
+		status = PIV_MEMERR;
+		goto err_out;
+	}
 
 	INIT_BDB(&bdb, rec, reclen);
-	ret = scan_fmr(&bdb, fmr);
+	ret = scan_fmr(&bdb, lpfmr->fmr);
 	if (ret != READ_OK) {
 		status = PIV_DATAERR;
 		goto err_out;
 	}
-	vcount = get_fvmr_count(fmr);
-	if (vcount == 0) {
-		status = PIV_DATAERR;
-		goto err_out;
-	}
-	fvmrs = (FVMR **)malloc(vcount * sizeof(FVMR *));
-	if (fvmrs == NULL) {
-		status = PIV_MEMERR;
-		goto err_out;
-	}
-	ret = get_fvmrs(fmr, fvmrs);
-	if (ret != vcount) {
+	ret = get_fvmr_count(lpfmr->fmr);
+	if (ret <= 0) {
 		status = PIV_DATAERR;
 		goto err_out;
 	}
-	view = view - 1;
-
-	mcount = get_fmd_count(fvmrs[view]);
-	fmds = (FMD **)malloc(mcount * sizeof(FMD **));
-	if (fmds == NULL) {
+	lpfmr->vcount = ret;
+	lpfmr->fvmrs = (FVMR **)malloc(lpfmr->vcount * sizeof(FVMR *));
+	lpfmr->mcounts = (int *)malloc(lpfmr->vcount * sizeof(int));
+	lpfmr->fmds = (FMD ***)calloc(lpfmr->vcount, sizeof(FMD **));
+	if ((lpfmr->fvmrs == NULL) || (lpfmr->mcounts == NULL) ||
+	    (lpfmr->fmds == NULL)) {
 		status = PIV_MEMERR;
 		goto err_out;
 	}
-	ret = get_fmds(fvmrs[view], fmds);
-	if (ret != mcount) {
+	ret = get_fvmrs(lpfmr->fmr, lpfmr->fvmrs);
+	if (ret != lpfmr->vcount) {
 		status = PIV_DATAERR;
 		goto err_out;
 	}
-	if (buffer != NULL) {
-		*count = mcount;
-		if (*bufsz < (mcount * sizeof(struct piv_fmd))) {
-			status = PIV_BUFSZ;
-			goto err_out;
-		}
-		*bufsz = mcount * sizeof(struct piv_fmd);
-		pfmd = (struct piv_fmd *)buffer;
-		for (i = 0; i < mcount; i++) {
-			pfmd->type = fmds[i]->type;
-			pfmd->x_coord = fmds[i]->x_coord;
-			pfmd->y_coord = fmds[i]->y_coord;
-			pfmd->angle = fmds[i]->angle;
-			pfmd->quality = fmds[i]->quality;
-			pfmd++;
-		}
-	}
-
-	if (newfmr != NULL) {
-		ret = new_fmr(FMR_STD_ANSI, &lnewfmr);
-		if (ret != 0) {
+	for (v = 0; v < lpfmr->vcount; v++) {
+		lpfmr->mcounts[v] = get_fmd_count(lpfmr->fvmrs[v]);
+		if (lpfmr->mcounts[v] == 0)
+			continue;
+		lpfmr->fmds[v] =
+		    (FMD **)malloc(lpfmr->mcounts[v] * sizeof(FMD *));
+		if (lpfmr->fmds[v] == NULL) {
 			status = PIV_MEMERR;
 			goto err_out;
 		}
-		COPY_FMR(fmr, lnewfmr);
-		lnewfmr->record_length = FMR_ANSI_SMALL_HEADER_LENGTH +
-		    FEDB_HEADER_LENGTH;
-		lnewfmr->num_views = 1;
-		ret = new_fvmr(FMR_STD_ANSI, &newfvmr);
-		if (ret != 0) {
-			status = PIV_MEMERR;
+		ret = get_fmds(lpfmr->fvmrs[v], lpfmr->fmds[v]);
+		if (ret != lpfmr->mcounts[v]) {
+			status = PIV_DATAERR;
 			goto err_out;
 		}
-		COPY_FVMR(fvmrs[view], newfvmr);
-		for (i = 0; i < mcount; i++) {
-			ret = new_fmd(FMR_STD_ANSI, &newfmd, i);
-			if (ret != 0) {
-				status = PIV_MEMERR;
-				goto err_out;
-			}
-			COPY_FMD(fmds[i], newfmd);
-			add_fmd_to_fvmr(newfmd, newfvmr);
-			lnewfmr->record_length += FMD_DATA_LENGTH;
-		}
-		add_fvmr_to_fmr(newfvmr, lnewfmr);
-		lnewfmr->record_length += FVMR_HEADER_LENGTH;
-		*newfmr = lnewfmr;
 	}
-	status = 0;
+	*pfmr = lpfmr;
+	return (0);
+
 err_out:
-	if (fmr != NULL)
-		free_fmr(fmr);
-	if (fvmrs != NULL)
-		free(fvmrs);
-	if (fmds != NULL)
-		free(fmds);
-	if (status != 0)
-		if (lnewfmr != NULL)
-			free_fmr(lnewfmr);
+	pivFMRClose(lpfmr);
 	return (status);
 }
 
+/*
+ */
+void
+pivFMRClose(PIVFMRHANDLE *pfmr)
+{
+	unsigned int v;
+
+	if (pfmr == NULL)
+		return;
+	if (pfmr->fmds != NULL) {
+		for (v = 0; v < pfmr->vcount; v++)
+			if (pfmr->fmds[v] != NULL)
+				free(pfmr->fmds[v]);
+		free(pfmr->fmds);
+	}
+	if (pfmr->mcounts != NULL)
+		free(pfmr->mcounts);
+	if (pfmr->fvmrs != NULL)
+		free(pfmr->fvmrs);
+	if (pfmr->fmr != NULL)
+		free_fmr(pfmr->fmr);
+	free(pfmr);
+}
+
+/*
+ */
+unsigned int
+pivFMRGetViewCount(PIVFMRHANDLE *pfmr)
+{
+	return (pfmr->vcount);
+}
+
 /*
  */
 int
-pivGetFingerMinutiae(unsigned int view, uint8_t *rec, unsigned int reclen,
+pivFMRGetFingerPosition(PIVFMRHANDLE *pfmr, unsigned int view,
+    int *pos)
+{
+	if ((view < 1) || (view > pfmr->vcount))
+		return (PIV_PARMERR);
+	*pos = pfmr->fvmrs[view - 1]->finger_number;
+	return (0);
+}
+
+/*
+ */
+int
+pivFMRGetMinutiae(PIVFMRHANDLE *pfmr, unsigned int view,
     uint8_t *buffer, unsigned int *bufsz, unsigned int *count)
 {
-	return (subsetFMR(view, rec, reclen, buffer, bufsz, count, NULL));
+	struct piv_fmd *pfmd;
+	FMD **fmds;
+	int mcount;
+	int i;
+
+	if ((view < 1) || (view > pfmr->vcount))
+		return (PIV_PARMERR);
+	view = view - 1;
+	mcount = pfmr->mcounts[view];
+	fmds = pfmr->fmds[view];
+
+	*count = mcount;
+	if (*bufsz < (mcount * sizeof(struct piv_fmd)))
+		return (PIV_BUFSZ);
+	*bufsz = mcount * sizeof(struct piv_fmd);
+	pfmd = (struct piv_fmd *)buffer;
+	for (i = 0; i < mcount; i++) {
+		pfmd->type = fmds[i]->type;
+		pfmd->x_coord = fmds[i]->x_coord;
+		pfmd->y_coord = fmds[i]->y_coord;
+		pfmd->angle = fmds[i]->angle;
+		pfmd->quality = fmds[i]->quality;
+		pfmd++;
+	}
+	return (0);
 }
 
 /*
  */
 int
-pivSubsetFingerMinutiaeRec(unsigned int view, uint8_t *rec, unsigned int reclen,
-    uint8_t *newrec, unsigned int *newrecsz)
+pivFMRSubsetRec(PIVFMRHANDLE *pfmr, unsigned int view, uint8_t *newrec,
+    unsigned int *newrecsz)
 {
-	int status, ret;
+	int status;
+	int ret;
 	FMR *newfmr;
+	FVMR *newfvmr;
+	FMD *newfmd;
 	BDB bdb;
+	int i;
+
+	if ((view < 1) || (view > pfmr->vcount))
+		return (PIV_PARMERR);
+	view = view - 1;
 
-	ret = subsetFMR(view, rec, reclen, NULL, NULL, NULL, &newfmr);
+	ret = new_fmr(FMR_STD_ANSI, &newfmr);
 	if (ret != 0)
-		return (ret);
+		return (PIV_MEMERR);
+	COPY_FMR(pfmr->fmr, newfmr);
+	newfmr->record_length = FMR_ANSI_SMALL_HEADER_LENGTH +
+	    FEDB_HEADER_LENGTH;
+	newfmr->num_views = 1;
+	ret = new_fvmr(FMR_STD_ANSI, &newfvmr);
+	if (ret != 0) {
+		status = PIV_MEMERR;
+		goto err_out;
+	}
+	COPY_FVMR(pfmr->fvmrs[view], newfvmr);
+	add_fvmr_to_fmr(newfvmr, newfmr);
+	newfmr->record_length += FVMR_HEADER_LENGTH;
+	for (i = 0; i < pfmr->mcounts[view]; i++) {
+		ret = new_fmd(FMR_STD_ANSI, &newfmd, i);
+		if (ret != 0) {
+			status = PIV_MEMERR;
+			goto err_out;
+		}
+		COPY_FMD(pfmr->fmds[view][i], newfmd);
+		add_fmd_to_fvmr(newfmd, newfvmr);
+		newfmr->record_length += FMD_DATA_LENGTH;
+	}
+
 	if (*newrecsz < newfmr->record_length) {
 		status = PIV_BUFSZ;
 		goto err_out;
@@ -246,7 +377,6 @@ pivSubsetFingerMinutiaeRec(unsigned int view, uint8_t *rec, unsigned int reclen,
 		goto err_out;
 	}
 	*newrecsz = newfmr->record_length;
-
 	status = 0;
 err_out:
 	free_fmr(newfmr);
@@ -254,53 +384,128 @@ err_out:
 }
 
 /*
+ * Layout of the raw INCITS-378 record, used to decode the minutiae of a
+ * single view directly from the record buffer.
  */
-int pivGetFingerPosition(unsigned int view, uint8_t *rec, unsigned int reclen,
-    int *pos)
+#define PIV_FMR_FORMAT_ID_LEN		4
+#define PIV_FMR_SPEC_VERSION_LEN	4
+#define PIV_FMR_NUM_VIEWS_OFFSET	14	/* from end of length field */
+#define PIV_FMR_MINUTIA_TYPE_SHIFT	14
+#define PIV_FMR_MINUTIA_COORD_MASK	0x3FFF
+
+/*
+ */
+int
+pivGetFingerMinutiae(unsigned int view, uint8_t *rec, unsigned int reclen,
+    uint8_t *buffer, unsigned int *bufsz, unsigned int *count)
 {
-	int status, ret, vcount;
-	FMR *fmr;
-	FVMR **fvmrs;
-	BDB bdb;
+	struct piv_fmd *pfmd;
+	unsigned int idx, end, hdrlen, extlen;
+	unsigned int vcount, mcount;
+	unsigned int v, m;
+	uint32_t reclength;
+	uint8_t *mptr;
 
 	if ((view != 1) && (view != 2))
-		return(PIV_PARMERR);
-
-	fmr = NULL;
-	fvmrs = NULL;
-	ret = new_fmr(FMR_STD_ANSI, &fmr);
-	if(ret != 0)
-		return (PIV_MEMERR);
+		return (PIV_PARMERR);
 
-	INIT_BDB(&bdb, rec, reclen);
-	ret = scan_fmr(&bdb, fmr);
-	if (ret != READ_OK) {
-		status = PIV_DATAERR;
-		goto err_out;
-	}
-	vcount = get_fvmr_count(fmr);
-	if (vcount == 0) {
-		status = PIV_DATAERR;
-		goto err_out;
+	/*
+	 * Walk the raw record: skip the record header, then the header,
+	 * minutiae and extended data of each preceding view, and decode
+	 * the minutiae of the requested view straight into the output.
+	 */
+	if (reclen < FMR_ANSI_SMALL_HEADER_LENGTH)
+		return (PIV_DATAERR);
+	if (memcmp(rec, FMR_FORMAT_ID, PIV_FMR_FORMAT_ID_LEN) != 0)
+		return (PIV_DATAERR);
+	idx = PIV_FMR_FORMAT_ID_LEN + PIV_FMR_SPEC_VERSION_LEN;
+	reclength = ((uint32_t)rec[idx] << 8) | rec[idx + 1];
+	hdrlen = FMR_ANSI_SMALL_HEADER_LENGTH;
+	idx += 2;
+	if (reclength == 0) {
+		if (reclen < FMR_ANSI_LARGE_HEADER_LENGTH)
+			return (PIV_DATAERR);
+		reclength = ((uint32_t)rec[idx] << 24) |
+		    ((uint32_t)rec[idx + 1] << 16) |
+		    ((uint32_t)rec[idx + 2] << 8) | rec[idx + 3];
+		hdrlen = FMR_ANSI_LARGE_HEADER_LENGTH;
+		idx += 4;
 	}
-	fvmrs = (FVMR **)malloc(vcount * sizeof(FVMR *));
-	if (fvmrs == NULL) {
-		status = PIV_MEMERR;
-		goto err_out;
+	end = (reclength < reclen) ? reclength : reclen;
+	vcount = rec[idx + PIV_FMR_NUM_VIEWS_OFFSET];
+	if (view > vcount)
+		return (PIV_PARMERR);
+
+	idx = hdrlen;
+	for (v = 1; ; v++) {
+		if (idx + FVMR_HEADER_LENGTH > end)
+			return (PIV_DATAERR);
+		mcount = rec[idx + FVMR_HEADER_LENGTH - 1];
+		idx += FVMR_HEADER_LENGTH;
+		if (idx + (mcount * FMD_DATA_LENGTH) > end)
+			return (PIV_DATAERR);
+		if (v == view)
+			break;
+		idx += mcount * FMD_DATA_LENGTH;
+		if (idx + FEDB_HEADER_LENGTH > end)
+			return (PIV_DATAERR);
+		extlen = ((unsigned int)rec[idx] << 8) | rec[idx + 1];
+		idx += FEDB_HEADER_LENGTH + extlen;
 	}
-	ret = get_fvmrs(fmr, fvmrs);
-	if (ret != vcount) {
-		status = PIV_DATAERR;
-		goto err_out;
+
+	*count = mcount;
+	if (*bufsz < (mcount * sizeof(struct piv_fmd)))
+		return (PIV_BUFSZ);
+	*bufsz = mcount * sizeof(struct piv_fmd);
+	pfmd = (struct piv_fmd *)buffer;
+	mptr = rec + idx;
+	for (m = 0; m < mcount; m++) {
+		pfmd->type = mptr[0] >> (PIV_FMR_MINUTIA_TYPE_SHIFT - 8);
+		pfmd->x_coord = (((unsigned short)mptr[0] << 8) | mptr[1]) &
+		    PIV_FMR_MINUTIA_COORD_MASK;
+		pfmd->y_coord = (((unsigned short)mptr[2] << 8) | mptr[3]) &
+		    PIV_FMR_MINUTIA_COORD_MASK;
+		pfmd->angle = mptr[4];
+		pfmd->quality = mptr[5];
+		mptr += FMD_DATA_LENGTH;
+		pfmd++;
 	}
-	view = view - 1;
-	*pos = fvmrs[view]->finger_number;
+	return (0);
+}
 
-	status = 0;
-err_out:
-	if (fmr != NULL)
-		free_fmr(fmr);
-	if (fvmrs != NULL)
-		free(fvmrs);
-	return (status);
+/*
+ */
+int
+pivSubsetFingerMinutiaeRec(unsigned int view, uint8_t *rec, unsigned int reclen,
+    uint8_t *newrec, unsigned int *newrecsz)
+{
+	PIVFMRHANDLE *pfmr;
+	int ret;
+
+	if ((view != 1) && (view != 2))
+		return (PIV_PARMERR);
+	ret = pivFMROpen(rec, reclen, &pfmr);
+	if (ret != 0)
+		return (ret);
+	ret = pivFMRSubsetRec(pfmr, view, newrec, newrecsz);
+	pivFMRClose(pfmr);
+	return (ret);
+}
+
+/*
+ */
+int pivGetFingerPosition(unsigned int view, uint8_t *rec, unsigned int reclen,
+    int *pos)
+{
+	PIVFMRHANDLE *pfmr;
+	int ret;
+
+	if ((view != 1) && (view != 2))
+		return(PIV_PARMERR);
+	ret = pivFMROpen(rec, reclen, &pfmr);
+	if (ret != 0)
+		return (ret);
+	ret = pivFMRGetFingerPosition(pfmr, view, pos);
+	pivFMRClose(pfmr);
+	return (ret);
 }
@@ -11,6 +11,10 @@
 /* This program will combine several Finger Minutiae Records or a set of
 /* Finger Image Records into a PIV compliant record, stored in a file.        */
 /*                                                                            */
+/* In manifest mode, many PIV records are generated in one run, one for each  */
+/* row of the manifest. Each row names the header file, the list of FMR or    */
+/* FIR files, and the output file for one record.                             */
+/*                                                                            */
 /* XXX It would be desirable to create the signature block.                   */
 /******************************************************************************/
 
@@ -21,6 +25,7 @@
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <ctype.h>
 #include <errno.h>
@@ -42,11 +47,24 @@ struct fmrelem {
 	TAILQ_ENTRY(fmrelem)			list;
 };
 
+/*
+ * A CBEFF header read from a header file, kept so that manifest rows
+ * naming the same header file don't read and parse it again.
+ */
+struct hdrelem {
+	char					name[MAXPATHLEN + 1];
+	struct piv_cbeff_record			pcr;
+	TAILQ_ENTRY(hdrelem)			list;
+};
+TAILQ_HEAD(hdrlist, hdrelem);
+
 static void
 usage(char *name)
 {
 	printf("usage: %s -h <hdrfile> -f <listfile> -o <outfile>"
 	    " [-s <sigfile>] -t [FMR | FIR]\n", name);
+	printf("       %s -m <manifest> [-s <sigfile>] -t [FMR | FIR]\n",
+	    name);
 	exit (EXIT_FAILURE);
 }
 
@@ -134,7 +152,7 @@ readin_fmrs(FILE *infp, FILE *outfp, struct finger_minutiae_record **fmrp)
 	struct fmrelem *fmrelem;
 	TAILQ_HEAD(, fmrelem) fmrlist;
 	char fmr_filename[MAXPATHLEN + 1];
-	struct finger_minutiae_record *fmr;
+	struct finger_minutiae_record *fmr = NULL;
 	struct finger_view_minutiae_record *fvmr;
 	int ret;
 
@@ -156,14 +174,19 @@ readin_fmrs(FILE *infp, FILE *outfp, struct finger_minutiae_record **fmrp)
 		if (read_fmr(fmrfp, fmr) != READ_OK)
 			READ_ERR_OUT(fmr_filename);
 		fclose(fmrfp);
+		fmrfp = NULL;
 
 		fmrelem = (struct fmrelem *)malloc(sizeof(struct fmrelem));
 		if (fmrelem == NULL)
 			ALLOC_ERR_OUT("finger minutiae record list");
 		fmrelem->fmr = fmr;
+		fmr = NULL;
 		TAILQ_INSERT_TAIL(&fmrlist, fmrelem, list);
 	}
-	// Use the first FMR as the master, and add all the finger view
+	if (TAILQ_EMPTY(&fmrlist))
+		ERR_OUT("FMR list file is empty");
+
+	// Use the first FMR as the master, and move all the finger view
 	// minutiae records to it.
 	fmrelem = TAILQ_FIRST(&fmrlist);
 	TAILQ_REMOVE(&fmrlist, fmrelem, list);
@@ -191,12 +214,20 @@ readin_fmrs(FILE *infp, FILE *outfp, struct finger_minutiae_record **fmrp)
 			fmr->num_views++;
 		}
 		free_fmr(fmrelem->fmr);
+		free(fmrelem);
 	}
 	*fmrp = fmr;
 	return (READ_OK);
 
 err_out:
-	free_fmr(fmr);
+	if (fmr != NULL)
+		free_fmr(fmr);
+	while (!TAILQ_EMPTY(&fmrlist)) {
+		fmrelem = TAILQ_FIRST(&fmrlist);
+		TAILQ_REMOVE(&fmrlist, fmrelem, list);
+		free_fmr(fmrelem->fmr);
+		free(fmrelem);
+	}
 	if (fmrfp != NULL)
 		fclose(fmrfp);
 	return (READ_ERROR);
@@ -209,11 +240,8 @@ readin_firs(FILE *infp, FILE *outfp, struct finger_image_record **firp)
 	char fir_filename[MAXPATHLEN + 1];
 	struct finger_image_record *headfir = NULL;
 	struct finger_image_record *fir = NULL;
-	struct finger_image_view_record **fivrs;
 	struct finger_image_view_record *fivr;
 	int ret;
-	int rcount;
-	int i;
 
 	// Read in the first finger image record 
 	ret = fscanf(infp, "%s", fir_filename);
@@ -227,9 +255,10 @@ readin_firs(FILE *infp, FILE *outfp, struct finger_image_record **firp)
 	if (read_fir(firfp, headfir) != READ_OK)
 		READ_ERR_OUT(fir_filename);
 	fclose(firfp);
+	firfp = NULL;
 
-	// Read in the remaining FIRs and add their view records to the 
-	// first FIR
+	// Read in the remaining FIRs and move their view records to the 
+	// first FIR; the image data is not copied.
 	for (;;) {
 		ret = fscanf(infp, "%s", fir_filename);
 		if (ret == EOF)
@@ -245,20 +274,11 @@ readin_firs(FILE *infp, FILE *outfp, struct finger_image_record **firp)
 		if (read_fir(firfp, fir) != READ_OK)
 			READ_ERR_OUT(fir_filename);
 		fclose(firfp);
+		firfp = NULL;
 
-		// Pull off the FIVRs
-		rcount = get_fivr_count(fir);
-		fivrs = (struct finger_image_view_record **) malloc(
-		    rcount * sizeof(struct finger_image_view_record *));
-		if (fivrs == NULL)
-			ALLOC_ERR_EXIT("FIVR Array");
-		if (get_fivrs(fir, fivrs) != rcount)
-			ERR_OUT("getting FIVRs from FIR");
-
-		for (i = 0; i < rcount; i++) {
-			if (new_fivr(&fivr) < 0)
-				ALLOC_ERR_OUT("finger image view record copy");
-			copy_fivr(fivrs[i], fivr);
+		while (!TAILQ_EMPTY(&fir->finger_views)) {
+			fivr = TAILQ_FIRST(&fir->finger_views);
+			TAILQ_REMOVE(&fir->finger_views, fivr, list);
 			add_fivr_to_fir(fivr, headfir);
 		}
 		free_fir(fir);
@@ -269,7 +289,8 @@ readin_firs(FILE *infp, FILE *outfp, struct finger_image_record **firp)
 	return (READ_OK);
 
 err_out:
-	free_fir(headfir);
+	if (headfir != NULL)
+		free_fir(headfir);
 	if (fir != NULL)
 		free_fir(fir);
 	if (firfp != NULL)
@@ -277,6 +298,194 @@ err_out:
 	return (READ_ERROR);
 }
 
+/*
+ * Look up a CBEFF header by file name, reading and parsing the header file
+ * only the first time it is named.
+ */
+static int
+get_pcr(char *hdrfile, struct hdrlist *hdrlist,
+    struct piv_cbeff_record *pcr)
+{
+	struct hdrelem *hdrelem;
+	FILE *h_fp;
+	int ret;
+
+	TAILQ_FOREACH(hdrelem, hdrlist, list) {
+		if (strcmp(hdrelem->name, hdrfile) == 0) {
+			*pcr = hdrelem->pcr;
+			return (READ_OK);
+		}
+	}
+	hdrelem = (struct hdrelem *)malloc(sizeof(struct hdrelem));
+	if (hdrelem == NULL)
+		ALLOC_ERR_RETURN("CBEFF header list");
+	if ((h_fp = fopen(hdrfile, "r")) == NULL) {
+		free(hdrelem);
+		ERR_OUT("Could not open %s", hdrfile);
+	}
+	ret = readin_pcr(h_fp, &hdrelem->pcr);
+	fclose(h_fp);
+	if (ret != READ_OK) {
+		free(hdrelem);
+		READ_ERR_OUT("PIV CBEFF header %s", hdrfile);
+	}
+	strncpy(hdrelem->name, hdrfile, MAXPATHLEN);
+	hdrelem->name[MAXPATHLEN] = '\0';
+	TAILQ_INSERT_TAIL(hdrlist, hdrelem, list);
+	*pcr = hdrelem->pcr;
+	return (READ_OK);
+err_out:
+	return (READ_ERROR);
+}
+
+/*
+ * Make sure the output buffer can hold a record of the given size.
+ */
+static int
+grow_outbuf(uint8_t **outbuf, uint32_t *outbufsz, uint32_t size)
+{
+	uint8_t *newbuf;
+
+	if (size <= *outbufsz)
+		return (0);
+	newbuf = (uint8_t *)realloc(*outbuf, size);
+	if (newbuf == NULL)
+		ALLOC_ERR_RETURN("Output buffer");
+	*outbuf = newbuf;
+	*outbufsz = size;
+	return (0);
+}
+
+/*
+ * Generate one PIV record for each row of a manifest. Each row has the
+ * name of the header file, the name of the FMR/FIR list file, and the
+ * name of the output file. The CBEFF header and biometric record are
+ * pushed into a memory buffer, and written with the signature block in
+ * a single vectored write.
+ */
+static int
+process_manifest(FILE *m_fp, int type, char *s_buf, int s_size)
+{
+	struct hdrlist hdrlist;
+	struct hdrelem *hdrelem;
+	struct piv_cbeff_record pcr;
+	struct finger_minutiae_record *fmr = NULL;
+	struct finger_image_record *fir = NULL;
+	char hdrfile[MAXPATHLEN + 1];
+	char listfile[MAXPATHLEN + 1];
+	char outfile[MAXPATHLEN + 1];
+	char fmt[32];
+	FILE *f_fp = NULL;
+	struct iovec iov[2];
+	uint8_t *outbuf = NULL;
+	uint32_t outbufsz = 0;
+	uint32_t reclen;
+	BDB bdb;
+	ssize_t wlen;
+	int o_fd = -1;
+	int iovcnt;
+	int count;
+	int ret;
+	int status = -1;
+
+	TAILQ_INIT(&hdrlist);
+	snprintf(fmt, sizeof(fmt), "%%%ds %%%ds %%%ds", MAXPATHLEN,
+	    MAXPATHLEN, MAXPATHLEN);
+	for (count = 0; ; count++) {
+		ret = fscanf(m_fp, fmt, hdrfile, listfile, outfile);
+		if (ret == EOF)
+			break;
+		if (ret != 3)
+			ERR_OUT("Manifest row %d is incomplete", count + 1);
+
+		if (get_pcr(hdrfile, &hdrlist, &pcr) != READ_OK)
+			goto err_out;
+		if ((f_fp = fopen(listfile, "r")) == NULL)
+			ERR_OUT("Could not open %s", listfile);
+		switch (type) {
+			case PIVFMR:
+				if (readin_fmrs(f_fp, NULL, &fmr) != READ_OK)
+					READ_ERR_OUT("FMRs in %s", listfile);
+				pcr.bdb_length = fmr->record_length;
+				break;
+			case PIVFIR:
+				if (readin_firs(f_fp, NULL, &fir) != READ_OK)
+					READ_ERR_OUT("FIRs in %s", listfile);
+				pcr.bdb_length = fir->record_length;
+				break;
+		}
+		fclose(f_fp);
+		f_fp = NULL;
+
+		reclen = CBEFF_HDR_LEN + pcr.bdb_length;
+		if (grow_outbuf(&outbuf, &outbufsz, reclen) != 0)
+			goto err_out;
+		INIT_BDB(&bdb, outbuf, outbufsz);
+		if (piv_push_pcr(&bdb, &pcr) != WRITE_OK)
+			ERR_OUT("Could not push CBEFF header for %s", outfile);
+		switch (type) {
+			case PIVFMR:
+				ret = push_fmr(&bdb, fmr);
+				free_fmr(fmr);
+				fmr = NULL;
+				break;
+			case PIVFIR:
+				ret = push_fir(&bdb, fir);
+				free_fir(fir);
+				fir = NULL;
+				break;
+		}
+		if (ret != WRITE_OK)
+			ERR_OUT("Could not push record for %s", outfile);
+
+		o_fd = open(outfile, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (o_fd < 0)
+			ERR_OUT("Could not create '%s': %s", outfile,
+			    strerror(errno));
+		iov[0].iov_base = outbuf;
+		iov[0].iov_len = bdb.bdb_current - bdb.bdb_start;
+		iovcnt = 1;
+		if (s_buf != NULL) {
+			iov[1].iov_base = s_buf;
+			iov[1].iov_len = s_size;
+			iovcnt = 2;
+		}
+		wlen = writev(o_fd, iov, iovcnt);
+		if (wlen != (ssize_t)(iov[0].iov_len +
+		    ((iovcnt == 2) ? iov[1].iov_len : 0)))
+			WRITE_ERR_OUT("PIV record %s", outfile);
+		if (close(o_fd) != 0) {
+			o_fd = -1;
+			WRITE_ERR_OUT("PIV record %s", outfile);
+		}
+		o_fd = -1;
+	}
+	printf("%d PIV records written.\n", count);
+	status = 0;
+
+err_out:
+	if (status != 0)
+		ERRP("Stopped at manifest row %d", count + 1);
+	if (o_fd >= 0) {
+		close(o_fd);
+		remove(outfile);
+	}
+	if (f_fp != NULL)
+		fclose(f_fp);
+	if (fmr != NULL)
+		free_fmr(fmr);
+	if (fir != NULL)
+		free_fir(fir);
+	if (outbuf != NULL)
+		free(outbuf);
+	while (!TAILQ_EMPTY(&hdrlist)) {
+		hdrelem = TAILQ_FIRST(&hdrlist);
+		TAILQ_REMOVE(&hdrlist, hdrelem, list);
+		free(hdrelem);
+	}
+	return (status);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -285,17 +494,17 @@ main(int argc, char *argv[])
 	struct finger_image_record *fir = NULL;
 	int ch;
 	int exit_code = EXIT_FAILURE;
-	int hflag, fflag, oflag, sflag, tflag;
-	FILE *h_fp, *f_fp, *o_fp, *s_fp;
+	int hflag, fflag, oflag, sflag, tflag, mflag;
+	FILE *h_fp, *f_fp, *o_fp, *s_fp, *m_fp;
 	struct stat sb;
 	char f_opt_filename[MAXPATHLEN + 1];
 	int type;
 	int s_size;
 	char *s_buf;
 
-	hflag = oflag = fflag = tflag = sflag = 0;
+	hflag = oflag = fflag = tflag = sflag = mflag = 0;
 	s_buf = NULL;
-	while ((ch = getopt(argc, argv, "h:f:o:s:t:")) != -1) {
+	while ((ch = getopt(argc, argv, "h:f:m:o:s:t:")) != -1) {
 		switch (ch) {
 			case 'h' :
 				if ((h_fp = fopen(optarg, "r")) == NULL)
@@ -308,6 +517,11 @@ main(int argc, char *argv[])
 				strncpy(f_opt_filename, optarg, MAXPATHLEN);
 				fflag = 1;
 				break;
+			case 'm' :
+				if ((m_fp = fopen(optarg, "r")) == NULL)
+					OPEN_ERR_EXIT(optarg);
+				mflag = 1;
+				break;
 			case 'o' :
 				if (stat(optarg, &sb) == 0)
 					ERR_EXIT("File '%s' exists, remove it first", optarg);
@@ -346,6 +560,17 @@ main(int argc, char *argv[])
 		}
 	}
 
+	if (mflag) {
+		if (hflag || fflag || oflag || !tflag)
+			usage(argv[0]);
+		if (process_manifest(m_fp, type, s_buf, s_size) == 0)
+			exit_code = EXIT_SUCCESS;
+		fclose(m_fp);
+		if (s_buf != NULL)
+			free(s_buf);
+		exit(exit_code);
+	}
+
 	if (!hflag || !fflag || !oflag || !tflag)
 		usage(argv[0]);
 
@@ -0,0 +1,270 @@
+/*
+* This software was developed at the National Institute of Standards and
+* Technology (NIST) by employees of the Federal Government in the course
+* of their official duties. Pursuant to title 17 Section 105 of the
+* United States Code, this software is not subject to copyright protection
+* and is in the public domain. NIST assumes no responsibility  whatsoever for
+* its use by other parties, and makes no guarantees, expressed or implied,
+* about its quality, reliability, or any other characteristic.
+*/
+/******************************************************************************/
+/* This program indexes and verifies the CBEFF headers of stores of           */
+/* concatenated PIV records. Each store is mapped into memory, all headers    */
+/* are decoded in place, and all records are then checked in one pass against */
+/* the NIST SP 800-76 requirements for the CBEFF header. An index of the      */
+/* records, giving the offset, types and FASC-N of each, is written for fast  */
+/* lookup of records within the stores.                                       */
+/*                                                                            */
+/******************************************************************************/
+
+/* Needed by the GNU C libraries for Posix and other extensions */
+#define _XOPEN_SOURCE	1
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <biomdimacro.h>
+#include <piv.h>
+
+/*
+ * The names of the CBEFF header checks, in PIV_PCR_ERR_ flag order.
+ */
+static const char *check_names[] = {
+	"Patron Header Version",
+	"SBH Security Options",
+	"SB Length",
+	"BDB Format Owner",
+	"BDB Format Type",
+	"Biometric Type",
+	"Biometric Data Type",
+	"Biometric Data Quality",
+	"Reserved Field"
+};
+#define NUM_CHECKS	(sizeof(check_names) / sizeof(check_names[0]))
+
+/*
+ * A record in the index, identified by its store and position in the
+ * store's header index, used to sort the index by FASC-N.
+ */
+struct index_ref {
+	struct piv_pcr_index	*pix;
+	int			store;
+	unsigned int		rec;
+};
+
+static int
+compare_fascn(const void *a, const void *b)
+{
+	const struct index_ref *ra = (const struct index_ref *)a;
+	const struct index_ref *rb = (const struct index_ref *)b;
+	int ret;
+
+	ret = memcmp(ra->pix->fascn[ra->rec], rb->pix->fascn[rb->rec],
+	    FASCN_LEN);
+	if (ret != 0)
+		return (ret);
+	if (ra->store != rb->store)
+		return (ra->store - rb->store);
+	return ((ra->rec > rb->rec) - (ra->rec < rb->rec));
+}
+
+/*
+ * Map a store into memory and index the headers of its records.
+ */
+static int
+index_store(char *fn, struct piv_pcr_index *pix)
+{
+	struct stat sb;
+	void *addr;
+	int fd;
+	int ret;
+
+	fd = open(fn, O_RDONLY);
+	if (fd < 0) {
+		ERRP("Open of %s failed: %s", fn, strerror(errno));
+		return (-1);
+	}
+	if (fstat(fd, &sb) != 0) {
+		ERRP("Stat of %s failed: %s", fn, strerror(errno));
+		close(fd);
+		return (-1);
+	}
+	if (sb.st_size == 0) {
+		close(fd);
+		return (0);
+	}
+	addr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		ERRP("Map of %s failed: %s", fn, strerror(errno));
+		return (-1);
+	}
+	ret = piv_index_pcrs((uint8_t *)addr, sb.st_size, pix);
+	munmap(addr, sb.st_size);
+	if (ret != READ_OK) {
+		ERRP("Could not index all records in %s", fn);
+		return (-1);
+	}
+	return (0);
+}
+
+static void
+print_index_entry(FILE *fp, char *fn, struct piv_pcr_index *pix,
+    unsigned int rec)
+{
+	int i;
+
+	for (i = 0; i < FASCN_LEN; i++)
+		fprintf(fp, "%02x", pix->fascn[rec][i]);
+	fprintf(fp, " %s %" PRIu64 " 0x%04x 0x%06x %u %hu 0x%04x\n", fn,
+	    pix->offset[rec], pix->bdb_format_type[rec],
+	    pix->biometric_type[rec], pix->bdb_length[rec],
+	    pix->sb_length[rec], pix->errors[rec]);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *usage = "usage: pivindex [-v] [-s] [-o indexfile] "
+	    "<storefile> ...\n"
+	    "\t -v List the failed checks of each invalid record\n"
+	    "\t -s Sort the index by FASC-N\n"
+	    "\t -o Write an index of all records to indexfile\n";
+	struct piv_pcr_index *pixs;
+	struct index_ref *refs;
+	unsigned int checkfails[NUM_CHECKS];
+	unsigned int total, invalid, sinvalid, r, c;
+	int nstores, s;
+	int ch;
+	int vflag, sflag;
+	char *indexfn;
+	FILE *ifp;
+	int exit_code;
+
+	vflag = sflag = 0;
+	indexfn = NULL;
+	while ((ch = getopt(argc, argv, "vso:")) != -1) {
+		switch (ch) {
+			case 'v' :
+				vflag = 1;
+				break;
+			case 's' :
+				sflag = 1;
+				break;
+			case 'o' :
+				indexfn = optarg;
+				break;
+			default :
+				fprintf(stderr, "%s\n", usage);
+				exit (EXIT_FAILURE);
+				break;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "%s\n", usage);
+		exit (EXIT_FAILURE);
+	}
+
+	exit_code = EXIT_SUCCESS;
+	nstores = argc - optind;
+	pixs = (struct piv_pcr_index *)calloc(nstores,
+	    sizeof(struct piv_pcr_index));
+	if (pixs == NULL)
+		ALLOC_ERR_EXIT("Store indexes");
+
+	/*
+	 * Index and verify each store.
+	 */
+	memset(checkfails, 0, sizeof(checkfails));
+	total = invalid = 0;
+	for (s = 0; s < nstores; s++) {
+		if (index_store(argv[optind + s], &pixs[s]) != 0)
+			exit_code = EXIT_FAILURE;
+		sinvalid = piv_verify_pcr_index(&pixs[s]);
+		for (r = 0; r < pixs[s].count; r++) {
+			if (pixs[s].errors[r] == 0)
+				continue;
+			for (c = 0; c < NUM_CHECKS; c++)
+				if (pixs[s].errors[r] & (1 << c))
+					checkfails[c]++;
+			if (vflag) {
+				fprintf(stdout, "%s: record at offset %"
+				    PRIu64 " is invalid:", argv[optind + s],
+				    pixs[s].offset[r]);
+				for (c = 0; c < NUM_CHECKS; c++)
+					if (pixs[s].errors[r] & (1 << c))
+						fprintf(stdout, " [%s]",
+						    check_names[c]);
+				fprintf(stdout, "\n");
+			}
+		}
+		total += pixs[s].count;
+		invalid += sinvalid;
+	}
+
+	/*
+	 * Write the index, one line per record.
+	 */
+	if (indexfn != NULL) {
+		ifp = fopen(indexfn, "w");
+		if (ifp == NULL)
+			OPEN_ERR_EXIT(indexfn);
+		if (sflag) {
+			refs = (struct index_ref *)malloc(
+			    total * sizeof(struct index_ref));
+			if ((refs == NULL) && (total != 0))
+				ALLOC_ERR_EXIT("Index sort array");
+			c = 0;
+			for (s = 0; s < nstores; s++)
+				for (r = 0; r < pixs[s].count; r++) {
+					refs[c].pix = &pixs[s];
+					refs[c].store = s;
+					refs[c].rec = r;
+					c++;
+				}
+			qsort(refs, total, sizeof(struct index_ref),
+			    compare_fascn);
+			for (c = 0; c < total; c++)
+				print_index_entry(ifp,
+				    argv[optind + refs[c].store],
+				    refs[c].pix, refs[c].rec);
+			free(refs);
+		} else {
+			for (s = 0; s < nstores; s++)
+				for (r = 0; r < pixs[s].count; r++)
+					print_index_entry(ifp,
+					    argv[optind + s], &pixs[s], r);
+		}
+		if (fclose(ifp) != 0) {
+			ERRP("Could not write %s: %s", indexfn,
+			    strerror(errno));
+			exit_code = EXIT_FAILURE;
+		}
+	}
+
+	/*
+	 * Summarize the verification of all the records.
+	 */
+	fprintf(stdout, "%u records in %d stores, %u valid, %u invalid\n",
+	    total, nstores, total - invalid, invalid);
+	for (c = 0; c < NUM_CHECKS; c++)
+		if (checkfails[c] != 0)
+			fprintf(stdout, "\t%-24s %u\n", check_names[c],
+			    checkfails[c]);
+	if (invalid != 0)
+		exit_code = EXIT_FAILURE;
+
+	for (s = 0; s < nstores; s++)
+		piv_free_pcr_index(&pixs[s]);
+	free(pixs);
+	exit (exit_code);
+}
@@ -35,7 +35,7 @@
 static void
 usage()
 {
-	fprintf(stderr, "Usage: pivprobe\n");
+	fprintf(stderr, "Usage: pivprobe [-s snapshot | -r snapshot]\n");
 	exit (EXIT_FAILURE);
 }
 
@@ -94,16 +94,36 @@ main(int argc, char *argv[])
 	uint8_t sw1, sw2;
 	int exitcode;
 	uint8_t pin[PIV_PIN_LENGTH];
-	char ch;
+	int ch;
 	struct piv_fmd *pfmd;
 	int i, m;
+	char *snapfile, *replayfile;
 
-	if (argc != 1)
+	snapfile = replayfile = NULL;
+	while ((ch = getopt(argc, argv, "s:r:")) != -1) {
+		switch (ch) {
+			case 's':
+				snapfile = optarg;
+				break;
+			case 'r':
+				replayfile = optarg;
+				break;
+			default:
+				usage();
+				break;
+		}
+	}
+	if ((argc != optind) || ((snapfile != NULL) && (replayfile != NULL)))
 		usage();
 
 	exitcode = EXIT_FAILURE;	/* always the pessimist */
-	if (pivCardConnect(&card) != 0)
-		ERR_EXIT("Could not attach to PIV card");
+	if (replayfile != NULL) {
+		if (pivCardOpenSnapshot(replayfile, &card) != 0)
+			ERR_EXIT("Could not open PIV card snapshot");
+	} else {
+		if (pivCardConnect(&card) != 0)
+			ERR_EXIT("Could not attach to PIV card");
+	}
 
 	cardbuf = malloc(PIV_MAX_OBJECT_SIZE);
 	if (cardbuf == NULL)
@@ -221,6 +241,12 @@ main(int argc, char *argv[])
 	pivCardSaveContainer(card, PIVPRINTEDINFOTAG_DO, "printedinfo.raw");
 	pivCardSaveContainer(card, PIVFACETAG_DO, "facialimage.raw");
 
+	if (snapfile != NULL) {
+		ret = pivCardSaveSnapshot(card, snapfile);
+		if (ret != 0)
+			ERRP("Error saving card snapshot: %u.\n", ret);
+	}
+
 	ret = pivCardDisconnect(card);
 	if (ret != 0)
 		ERRP("Could not disconnect from card");
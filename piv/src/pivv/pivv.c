@@ -14,18 +14,25 @@
 /* 381-2004 specifications. The additional constraints of the NIST            */
 /* SP-800-76 PIV specification are verified within this program.              */
 /*                                                                            */
+/* In batch mode, a set of files given by a manifest or directory is mapped   */
+/* into memory and validated by a pool of threads, and a compact table of     */
+/* results is printed.                                                        */
+/*                                                                            */
 /******************************************************************************/
 
 /* Needed by the GNU C libraries for Posix and other extensions */
-#define _XOPEN_SOURCE	1
+#define _XOPEN_SOURCE	500
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/queue.h>
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -41,6 +48,42 @@
 #define RECERR_EXIT	-2
 #define OTHERR_EXIT	-3
 
+#define MAX_BATCH_THREADS	256
+
+/*
+ * In batch mode, each worker keeps the name of the file it is validating,
+ * so that the messages printed for the records of the file name it.
+ */
+static pthread_key_t batch_file_key;
+static int batch_file_key_set = 0;
+
+static const char *
+batch_file_name(void)
+{
+	if (!batch_file_key_set)
+		return (NULL);
+	return ((const char *)pthread_getspecific(batch_file_key));
+}
+
+/*
+ * Print an error message, prefixed with the name of the file in batch
+ * mode. The stream is locked so that the message is not broken up by
+ * those of other workers. This replaces the macro used by the checks
+ * below, including CSR() and NCSR().
+ */
+#undef ERRP
+#define ERRP(...)							\
+	do {								\
+		const char *__fn = batch_file_name();			\
+		flockfile(stderr);					\
+		if (__fn != NULL)					\
+			fprintf(stderr, "%s: ", __fn);			\
+		fprintf(stderr, "ERROR: ");				\
+		fprintf(stderr, __VA_ARGS__);				\
+		fprintf(stderr, ".\n");					\
+		funlockfile(stderr);					\
+	} while (0)
+
 static int
 piv_verify_fmr(struct finger_minutiae_record *fmr)
 {
@@ -144,8 +187,8 @@ process_fmr(FILE *infp, int pflag, int vflag)
 		else
 			fprintf(stdout, "\tDoes NOT pass PIV criteria.\n");
 	}
-	free_fmr(fmr);
 	ret = fmr->record_length;
+	free_fmr(fmr);
 	return (ret);
 }
 
@@ -251,30 +294,447 @@ process_fir(FILE *infp, int pflag, int vflag)
 	return (ret);
 }
 
+/*
+ * Results of validating one file in batch mode.
+ */
+struct batch_result {
+	int	entries;	/* Number of biometric entries read */
+	int	cbeff_fail;	/* Entries failing the CBEFF checks */
+	int	bdb_fail;	/* Entries failing the record checks */
+	int	status;		/* 0, IOERR_EXIT, or RECERR_EXIT */
+};
+
+/*
+ * The shared state of the batch thread pool. Each worker takes the next
+ * unprocessed file from the list, so the load balances itself when file
+ * sizes vary.
+ */
+struct batch_job {
+	char			**files;
+	struct batch_result	*results;
+	int			count;
+	int			next;
+	int			cflag;
+	int			bflag;
+	pthread_mutex_t		lock;
+};
+
+/*
+ * Scan and validate a record from a memory buffer. Returns the record
+ * length, or -1 if the record could not be scanned. The messages of the
+ * library checks can't be prefixed with the file name, so the stream is
+ * held while they run and a line naming the file follows them.
+ */
+static int
+scan_verify_fmr(BDB *bdb, int bflag, int entry, int *valid)
+{
+	struct finger_minutiae_record *fmr;
+	int ret;
+
+	if (new_fmr(FMR_STD_ANSI, &fmr) < 0)
+		return (-1);
+	if (scan_fmr(bdb, fmr) != READ_OK) {
+		free_fmr(fmr);
+		return (-1);
+	}
+	if (bflag) {
+		flockfile(stderr);
+		*valid = (validate_fmr(fmr) == VALIDATE_OK);
+		if (!*valid)
+			ERRP("Entry %d does not pass INCITS-378 criteria",
+			    entry);
+		funlockfile(stderr);
+		if (piv_verify_fmr(fmr) != VALIDATE_OK)
+			*valid = 0;
+	}
+	ret = fmr->record_length;
+	free_fmr(fmr);
+	return (ret);
+}
+
+static int
+scan_verify_fir(BDB *bdb, int bflag, int entry, int *valid)
+{
+	struct finger_image_record *fir;
+	int ret;
+
+	if (new_fir(FIR_STD_ANSI, &fir) < 0)
+		return (-1);
+	if (scan_fir(bdb, fir) != READ_OK) {
+		free_fir(fir);
+		return (-1);
+	}
+	if (bflag) {
+		flockfile(stderr);
+		*valid = (validate_fir(fir) == VALIDATE_OK);
+		if (!*valid)
+			ERRP("Entry %d does not pass INCITS-381 criteria",
+			    entry);
+		funlockfile(stderr);
+		if (piv_verify_fir(fir) != VALIDATE_OK)
+			*valid = 0;
+	}
+	ret = fir->record_length;
+	free_fir(fir);
+	return (ret);
+}
+
+/*
+ * Validate all the biometric entries in a memory-mapped file. Each entry
+ * is bounded by the lengths given in its CBEFF header, so a bad record
+ * cannot cause the scan of the next entry to start in the wrong place.
+ * A record that can't be parsed, or is of an unknown type, makes the
+ * file an error; the following entries are still checked.
+ */
+static void
+batch_validate_buffer(uint8_t *buf, size_t buflen, int cflag, int bflag,
+    struct batch_result *res)
+{
+	struct piv_cbeff_record pcr;
+	BDB bdb, rbdb;
+	int len, type, valid;
+
+	INIT_BDB(&bdb, buf, buflen);
+	while (bdb.bdb_current < bdb.bdb_end) {
+		if (piv_scan_pcr(&bdb, &pcr) != READ_OK) {
+			ERRP("Could not read CBEFF header of entry %d",
+			    res->entries + 1);
+			res->status = RECERR_EXIT;
+			return;
+		}
+		res->entries++;
+		if (pcr.bdb_length >
+		    (uint32_t)(bdb.bdb_end - bdb.bdb_current)) {
+			ERRP("Entry %d is longer than the file", res->entries);
+			res->status = RECERR_EXIT;
+			return;
+		}
+		INIT_BDB(&rbdb, bdb.bdb_current, pcr.bdb_length);
+		valid = 1;
+		switch (pcr.bdb_format_type) {
+			case PIV_FORMAT_TYPE_FINGER_MINUTIAE:
+				len = scan_verify_fmr(&rbdb, bflag,
+				    res->entries, &valid);
+				type = PIVFMR;
+				break;
+			case PIV_FORMAT_TYPE_FINGER_IMAGE:
+				len = scan_verify_fir(&rbdb, bflag,
+				    res->entries, &valid);
+				type = PIVFIR;
+				break;
+			case PIV_FORMAT_TYPE_FACE_IMAGE:
+				len = pcr.bdb_length;
+				type = PIVFRF;
+				break;
+			default:
+				ERRP("Entry %d has unsupported format type "
+				    "0x%04X", res->entries,
+				    pcr.bdb_format_type);
+				len = -1;
+				type = 0;
+				break;
+		}
+		if (len < 0) {
+			if (type != 0)
+				ERRP("Could not parse the record of entry %d",
+				    res->entries);
+			res->status = RECERR_EXIT;
+		} else if (valid == 0) {
+			res->bdb_fail++;
+		}
+		if (cflag) {
+			flockfile(stderr);
+			if (piv_verify_pcr(&pcr, len, type) != VALIDATE_OK) {
+				ERRP("Entry %d does not pass the CBEFF header "
+				    "checks", res->entries);
+				res->cbeff_fail++;
+			}
+			funlockfile(stderr);
+		}
+
+		/* Skip over the biometric data and signature blocks */
+		bdb.bdb_current += pcr.bdb_length;
+		if (pcr.sb_length > (uint32_t)(bdb.bdb_end - bdb.bdb_current)) {
+			ERRP("Signature block of entry %d is longer than the "
+			    "file", res->entries);
+			res->status = RECERR_EXIT;
+			return;
+		}
+		bdb.bdb_current += pcr.sb_length;
+	}
+	if (res->entries == 0)
+		res->status = RECERR_EXIT;
+}
+
+static void
+batch_validate_file(char *file, int cflag, int bflag,
+    struct batch_result *res)
+{
+	struct stat sb;
+	void *addr;
+	int fd;
+
+	memset(res, 0, sizeof(struct batch_result));
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		ERRP("Open failed: %s", strerror(errno));
+		res->status = IOERR_EXIT;
+		return;
+	}
+	if (fstat(fd, &sb) != 0) {
+		ERRP("Could not get stats: %s", strerror(errno));
+		res->status = IOERR_EXIT;
+		close(fd);
+		return;
+	}
+	if (sb.st_size == 0) {
+		ERRP("File is empty");
+		res->status = RECERR_EXIT;
+		close(fd);
+		return;
+	}
+	addr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		ERRP("Could not map file: %s", strerror(errno));
+		res->status = IOERR_EXIT;
+		return;
+	}
+	batch_validate_buffer((uint8_t *)addr, sb.st_size, cflag, bflag, res);
+	munmap(addr, sb.st_size);
+}
+
+static void *
+batch_worker(void *arg)
+{
+	struct batch_job *job = (struct batch_job *)arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= job->count)
+			break;
+		pthread_setspecific(batch_file_key, job->files[i]);
+		batch_validate_file(job->files[i], job->cflag, job->bflag,
+		    &job->results[i]);
+	}
+	return (NULL);
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+	return (strcmp(*(char * const *)a, *(char * const *)b));
+}
+
+/*
+ * Add a file name to a dynamically grown list of names.
+ */
+static int
+add_batch_file(char *name, char ***files, int *count, int *size)
+{
+	char **newfiles;
+
+	if (*count == *size) {
+		*size = (*size == 0) ? 1024 : *size * 2;
+		newfiles = (char **)realloc(*files, *size * sizeof(char *));
+		if (newfiles == NULL)
+			return (-1);
+		*files = newfiles;
+	}
+	(*files)[*count] = (char *)malloc(strlen(name) + 1);
+	if ((*files)[*count] == NULL)
+		return (-1);
+	strcpy((*files)[*count], name);
+	(*count)++;
+	return (0);
+}
+
+/*
+ * Build the list of files to validate from either a directory, in which
+ * case all regular files are taken in name order, or a manifest file
+ * containing one file name per line. Blank lines and lines starting with
+ * '#' in the manifest are ignored.
+ */
+static int
+get_batch_files(char *path, char ***files, int *count)
+{
+	struct stat sb;
+	struct dirent *dp;
+	DIR *dirp;
+	FILE *fp;
+	char name[FILENAME_MAX];
+	char *cp;
+	int size;
+
+	*files = NULL;
+	*count = 0;
+	size = 0;
+	if (stat(path, &sb) != 0)
+		ERR_OUT("Could not stat %s: %s", path, strerror(errno));
+	if (S_ISDIR(sb.st_mode)) {
+		dirp = opendir(path);
+		if (dirp == NULL)
+			ERR_OUT("Could not open directory %s: %s", path,
+			    strerror(errno));
+		while ((dp = readdir(dirp)) != NULL) {
+			snprintf(name, sizeof(name), "%s/%s", path,
+			    dp->d_name);
+			if ((stat(name, &sb) != 0) || !S_ISREG(sb.st_mode))
+				continue;
+			if (add_batch_file(name, files, count, &size) != 0) {
+				closedir(dirp);
+				ALLOC_ERR_OUT("File list");
+			}
+		}
+		closedir(dirp);
+		qsort(*files, *count, sizeof(char *), compare_names);
+	} else {
+		fp = fopen(path, "r");
+		if (fp == NULL)
+			ERR_OUT("Could not open manifest %s: %s", path,
+			    strerror(errno));
+		while (fgets(name, sizeof(name), fp) != NULL) {
+			cp = strchr(name, '\n');
+			if (cp != NULL)
+				*cp = '\0';
+			if ((name[0] == '\0') || (name[0] == '#'))
+				continue;
+			if (add_batch_file(name, files, count, &size) != 0) {
+				fclose(fp);
+				ALLOC_ERR_OUT("File list");
+			}
+		}
+		fclose(fp);
+	}
+	return (0);
+err_out:
+	return (-1);
+}
+
+/*
+ * Validate a set of files on a pool of threads, then print one line of
+ * results per file, in list order, followed by the aggregate counts.
+ */
+static int
+batch_main(char *path, int nthreads, int cflag, int bflag)
+{
+	struct batch_job job;
+	struct batch_result *res;
+	pthread_t *threads;
+	char *result;
+	int passed, failed, errors, entries, cbeff_fail, bdb_fail;
+	int exit_code;
+	int i, started;
+
+	exit_code = EXIT_FAILURE;
+	threads = NULL;
+	memset(&job, 0, sizeof(job));
+	if (get_batch_files(path, &job.files, &job.count) != 0)
+		return (EXIT_FAILURE);
+	if (job.count == 0) {
+		ERRP("No files found in %s", path);
+		goto err_out;
+	}
+	job.results = (struct batch_result *)calloc(job.count,
+	    sizeof(struct batch_result));
+	if (job.results == NULL)
+		ALLOC_ERR_OUT("Result table");
+	job.cflag = cflag;
+	job.bflag = bflag;
+	pthread_mutex_init(&job.lock, NULL);
+	if (pthread_key_create(&batch_file_key, NULL) == 0)
+		batch_file_key_set = 1;
+
+	if (nthreads > job.count)
+		nthreads = job.count;
+	threads = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+	if (threads == NULL)
+		ALLOC_ERR_OUT("Thread table");
+	for (started = 0; started < nthreads; started++)
+		if (pthread_create(&threads[started], NULL, batch_worker,
+		    &job) != 0)
+			break;
+	if (started == 0) {
+		/* No threads could be created; do the work here */
+		batch_worker(&job);
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&job.lock);
+
+	passed = failed = errors = entries = cbeff_fail = bdb_fail = 0;
+	fprintf(stdout, "%-6s %7s %5s %5s %s\n", "RESULT", "ENTRIES", "CBEFF",
+	    "BDB", "FILE");
+	for (i = 0; i < job.count; i++) {
+		res = &job.results[i];
+		if (res->status != 0) {
+			result = "ERROR";
+			errors++;
+		} else if ((res->cbeff_fail != 0) || (res->bdb_fail != 0)) {
+			result = "FAIL";
+			failed++;
+		} else {
+			result = "PASS";
+			passed++;
+		}
+		entries += res->entries;
+		cbeff_fail += res->cbeff_fail;
+		bdb_fail += res->bdb_fail;
+		fprintf(stdout, "%-6s %7d %5d %5d %s\n", result, res->entries,
+		    res->cbeff_fail, res->bdb_fail, job.files[i]);
+	}
+	fprintf(stdout, "Files: %d; Passed: %d; Failed: %d; Errors: %d\n",
+	    job.count, passed, failed, errors);
+	fprintf(stdout, "Entries: %d; CBEFF failures: %d; "
+	    "Record failures: %d\n", entries, cbeff_fail, bdb_fail);
+	if ((failed == 0) && (errors == 0))
+		exit_code = EXIT_SUCCESS;
+
+err_out:
+	if (threads != NULL)
+		free(threads);
+	if (job.results != NULL)
+		free(job.results);
+	for (i = 0; i < job.count; i++)
+		free(job.files[i]);
+	if (job.files != NULL)
+		free(job.files);
+	return (exit_code);
+}
+
 int
 main(int argc, char *argv[])
 {
 	char *usage = "usage: pivv [-p] [-c] [-b] <datafile>\n"
+	    "       pivv -m [-t threads] [-c] [-b] <manifest | directory>\n"
 	    "\t -p Print the record\n"
 	    "\t -c Validate the CBEFF header\n"
-	    "\t -b Validate the Biometric Data Block\n";
+	    "\t -b Validate the Biometric Data Block\n"
+	    "\t -m Batch mode; validate all files in a manifest or directory\n"
+	    "\t -t Number of threads used in batch mode\n";
 	FILE *fp;
 	struct piv_cbeff_record pcr;
 	int ch;
 	int exit_code = EXIT_SUCCESS;
-	int pflag, cflag, bflag;
+	int pflag, cflag, bflag, mflag;
+	long nthreads;
+	char *endp;
 	int ret;
 	int len;
 	int type;
 	int i;
 
-	if ((argc != 2) && (argc != 3)) {
+	if (argc < 2) {
 		fprintf(stderr, "%s\n", usage);
 		exit (EXIT_FAILURE);
 	}
 
-	pflag = cflag = bflag = 0;
-	while ((ch = getopt(argc, argv, "pcb")) != -1) {
+	pflag = cflag = bflag = mflag = 0;
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((ch = getopt(argc, argv, "pcbmt:")) != -1) {
 		switch (ch) {
 			case 'p' :
 				pflag = 1;
@@ -285,6 +745,17 @@ main(int argc, char *argv[])
 			case 'b' :
 				bflag = 1;
 				break;
+			case 'm' :
+				mflag = 1;
+				break;
+			case 't' :
+				nthreads = strtol(optarg, &endp, 10);
+				if ((*endp != '\0') || (nthreads < 1) ||
+				    (nthreads > MAX_BATCH_THREADS)) {
+					printf("%s\n", usage);
+					exit (EXIT_FAILURE);
+				}
+				break;
 			default :
 				printf("%s\n", usage);
 				exit (EXIT_FAILURE);
@@ -292,7 +763,7 @@ main(int argc, char *argv[])
 		}
 	}
 
-	if (argv[optind] == NULL) {
+	if ((argv[optind] == NULL) || (mflag && pflag)) {
 		printf("%s\n", usage);
 		exit (EXIT_FAILURE);
 	}
@@ -300,6 +771,14 @@ main(int argc, char *argv[])
 	if (!cflag && !bflag)
 		cflag = bflag = 1;
 
+	if (mflag) {
+		if (nthreads < 1)
+			nthreads = 1;
+		if (nthreads > MAX_BATCH_THREADS)
+			nthreads = MAX_BATCH_THREADS;
+		exit (batch_main(argv[optind], nthreads, cflag, bflag));
+	}
+
 	fp = fopen(argv[optind], "rb");
 	if (fp == NULL) {
 		ERRP("Open of %s failed: %s.", argv[1], strerror(errno));
@@ -18,6 +18,7 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <termios.h>
 #include <unistd.h>
@@ -170,6 +171,105 @@ print_fmr(stdout, newfmr);
 	free_fmr(fmr);
 }
 
+/*
+ * The contents of FMR_Example, for checking the parsed record handle:
+ * the finger position and minutiae count of each view, and the X and Y
+ * of the first minutia of each view.
+ */
+#define FMR_EXAMPLE_VIEWS	2
+static int FMR_Example_pos[FMR_EXAMPLE_VIEWS] = { 7, 2 };
+static unsigned int FMR_Example_mcount[FMR_EXAMPLE_VIEWS] = { 27, 22 };
+static unsigned short FMR_Example_xy[FMR_EXAMPLE_VIEWS][2] = {
+    { 100, 14 }, { 40, 93 }
+};
+
+static void
+testFMRHandle()
+{
+	PIVFMRHANDLE *pfmr;
+	struct piv_fmd *pfmd;
+	uint8_t *databuf, *subbuf;
+	unsigned int databuf_len, subbuf_len;
+	unsigned int c, c2, v;
+	int pos;
+	int ret;
+
+	ret = pivFMROpen(FMR_Example, FMR_Example_len, &pfmr);
+	if (ret != 0) {
+		printf("Error: pivFMROpen() returns %d.\n", ret);
+		return;
+	}
+	if (pivFMRGetViewCount(pfmr) != FMR_EXAMPLE_VIEWS)
+		printf("Error: Parsed FMR has %u views, not %u.\n",
+		    pivFMRGetViewCount(pfmr), FMR_EXAMPLE_VIEWS);
+	databuf = malloc(PIV_MAX_OBJECT_SIZE);
+	subbuf = malloc(PIV_MAX_OBJECT_SIZE);
+
+	/* Each query against the handle must give the record's contents */
+	for (v = 1; v <= FMR_EXAMPLE_VIEWS; v++) {
+		databuf_len = PIV_MAX_OBJECT_SIZE;
+		ret = pivFMRGetMinutiae(pfmr, v, databuf, &databuf_len, &c);
+		if (ret != 0) {
+			printf("Error: pivFMRGetMinutiae(view %u) returns "
+			    "%d.\n", v, ret);
+		} else {
+			pfmd = (struct piv_fmd *)databuf;
+			if ((c != FMR_Example_mcount[v - 1]) ||
+			    (databuf_len != c * sizeof(struct piv_fmd)))
+				printf("Error: View %u has %u minutiae, not "
+				    "%u.\n", v, c, FMR_Example_mcount[v - 1]);
+			else if ((pfmd->x_coord != FMR_Example_xy[v - 1][0]) ||
+			    (pfmd->y_coord != FMR_Example_xy[v - 1][1]))
+				printf("Error: View %u first minutia is at "
+				    "%u,%u.\n", v, pfmd->x_coord,
+				    pfmd->y_coord);
+
+			/*
+			 * The raw record fast path must give the handle's
+			 * minutiae byte for byte.
+			 */
+			subbuf_len = PIV_MAX_OBJECT_SIZE;
+			ret = pivGetFingerMinutiae(v, FMR_Example,
+			    FMR_Example_len, subbuf, &subbuf_len, &c2);
+			if (ret != 0)
+				printf("Error: pivGetFingerMinutiae(view %u) "
+				    "returns %d.\n", v, ret);
+			else if ((c2 != c) || (subbuf_len != databuf_len) ||
+			    (memcmp(subbuf, databuf, databuf_len) != 0))
+				printf("Error: View %u minutiae differ from "
+				    "the handle's.\n", v);
+		}
+		ret = pivFMRGetFingerPosition(pfmr, v, &pos);
+		if (ret != 0)
+			printf("Error: pivFMRGetFingerPosition(view %u) "
+			    "returns %d.\n", v, ret);
+		else if (pos != FMR_Example_pos[v - 1])
+			printf("Error: View %u is finger %d, not %d.\n", v,
+			    pos, FMR_Example_pos[v - 1]);
+
+		/* The subset holds the header, one view and its minutiae */
+		databuf_len = PIV_MAX_OBJECT_SIZE;
+		ret = pivFMRSubsetRec(pfmr, v, databuf, &databuf_len);
+		if (ret != 0)
+			printf("Error: pivFMRSubsetRec(view %u) returns %d.\n",
+			    v, ret);
+		else if (databuf_len != FMR_ANSI_SMALL_HEADER_LENGTH +
+		    FVMR_HEADER_LENGTH + FMR_Example_mcount[v - 1] *
+		    FMD_DATA_LENGTH + FEDB_HEADER_LENGTH)
+			printf("Error: View %u subset record is %u bytes.\n",
+			    v, databuf_len);
+	}
+	databuf_len = PIV_MAX_OBJECT_SIZE;
+	ret = pivFMRGetMinutiae(pfmr, v, databuf, &databuf_len, &c);
+	if (ret != PIV_PARMERR)
+		printf("Error: pivFMRGetMinutiae(view %u) returns %d, not "
+		    "PIV_PARMERR.\n", v, ret);
+
+	free(databuf);
+	free(subbuf);
+	pivFMRClose(pfmr);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -181,5 +281,7 @@ main(int argc, char *argv[])
 
 	testFMROps();
 
+	testFMRHandle();
+
 	exit(EXIT_SUCCESS);
 }
@@ -73,6 +73,12 @@ add_data_to_apdu(uint8_t *data, uint16_t len, APDU *apdu);
 /*             from the card on success. This can be NULL, meaning the caller */
 /*             is not interested in the card's response. The response data    */
 /*             will not include the status words.                             */
+/*             If the BDB has no buffer (bdb_start is NULL), the response     */
+/*             must be a single BER-TLV object. The object's tag and length   */
+/*             are read from the first block of the response, and a buffer   */
+/*             of exactly the encoded object size is allocated before the     */
+/*             remainder is retrieved. The caller must free bdb_start; on     */
+/*             failure, the buffer is free'd by this function.                */
 /*   sw1       Pointer to the first status word returned from the card.       */
 /*   sw2       Pointer to the second status word returned from the card.      */
 /*                                                                            */
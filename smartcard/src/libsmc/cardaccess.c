@@ -19,11 +19,13 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/queue.h>
 #include <PCSC/winscard.h>
 #include <PCSC/wintypes.h>
 
 #include <biomdimacro.h>
 #include <nistapdu.h>
+#include <tlv.h>
 
 #include <cardaccess.h>
 
@@ -34,6 +36,79 @@ add_data_to_apdu(uint8_t *data, uint16_t len, APDU *apdu)
 	apdu->apdu_lc = len;
 }
 
+/*
+ * Compute the total encoded size of the BER-TLV object whose tag and length
+ * fields start the buffer. Returns -1 if the buffer is too short to hold
+ * the tag and length fields, or the length field is invalid.
+ */
+static int
+get_bertlv_size(uint8_t *buf, DWORD len, uint32_t *size)
+{
+	DWORD idx;
+	uint32_t vlen;
+	int lcount;
+
+	if (len < 2)
+		return (-1);
+	idx = 1;
+	if ((buf[0] & BERTLV_SB_MB_TAGNUM_MASK) == BERTLV_MB_TAGNUM_INDICATOR) {
+		while ((idx < len) &&
+		    (buf[idx] & BERTLV_MB_TAGNUM_TERMINATOR_MASK))
+			idx++;
+		idx++;
+	}
+	if (idx >= len)
+		return (-1);
+	if (buf[idx] <= BERTLV_SB_MAX_VALUE) {
+		vlen = buf[idx];
+		idx++;
+	} else {
+		lcount = buf[idx] & BERTLV_SB_MAX_VALUE;
+		if ((lcount < 1) || (lcount > 4))
+			return (-1);
+		idx++;
+		if (idx + lcount > len)
+			return (-1);
+		vlen = 0;
+		for (; lcount > 0; lcount--)
+			vlen = (vlen << 8) | buf[idx++];
+	}
+	if (vlen > UINT32_MAX - idx)
+		return (-1);
+	*size = idx + vlen;
+	return (0);
+}
+
+/*
+ * Add a block of response data to the response data block. When the
+ * caller has not supplied a buffer, the first block of data must start
+ * with a BER-TLV tag and length, and a buffer is allocated that holds
+ * exactly that TLV object.
+ */
+static int
+push_response(uint8_t *buf, DWORD len, BDB *respBDB)
+{
+	uint32_t size;
+	uint8_t *ptr;
+
+	if (len == 0)
+		return (0);
+	if (respBDB->bdb_start == NULL) {
+		if (get_bertlv_size(buf, len, &size) != 0)
+			ERR_OUT("Response does not begin with a BER-TLV header");
+		if (size < len)
+			size = len;
+		ptr = (uint8_t *)malloc(size);
+		if (ptr == NULL)
+			ALLOC_ERR_OUT("Response buffer");
+		INIT_BDB(respBDB, ptr, size);
+	}
+	OPUSH(buf, len, respBDB);
+	return (0);
+err_out:
+	return (-1);
+}
+
 static inline LONG
 internal_get_response(SCARDHANDLE hCard,
     SCARD_IO_REQUEST pioSendPci, 
@@ -51,8 +126,12 @@ internal_get_response(SCARDHANDLE hCard,
 	/* Handle response chaining */
 	lRecvLen = recvLen;
 	while (lsw1 == APDU_NORMAL_CHAINING) {
-		if (respBDB != NULL)
-			OPUSH(recvBuf, lRecvLen - 2, respBDB);
+		if (respBDB != NULL) {
+			if (push_response(recvBuf, lRecvLen - 2, respBDB) != 0) {
+				rc = SCARD_E_INSUFFICIENT_BUFFER;
+				goto err_out;
+			}
+		}
 		bGetRes[4] = lsw2;	/* The Le field */
 		lRecvLen = (0 == lsw2) ? 256 : lsw2;
 		lRecvLen += 2;	/* Account for the SW */
@@ -68,8 +147,12 @@ internal_get_response(SCARDHANDLE hCard,
 	}
 	*sw1 = lsw1;
 	*sw2 = lsw2;
-	if (respBDB != NULL)
-		OPUSH(recvBuf, lRecvLen - 2, respBDB);
+	if (respBDB != NULL) {
+		if (push_response(recvBuf, lRecvLen - 2, respBDB) != 0) {
+			rc = SCARD_E_INSUFFICIENT_BUFFER;
+			goto err_out;
+		}
+	}
 	return (SCARD_S_SUCCESS);
 err_out:
 	return (rc);
@@ -296,10 +379,12 @@ sendAPDU(SCARDHANDLE hCard, APDU *apdu, int dryrun, BDB *response, uint8_t *sw1,
  	SCARD_IO_REQUEST pioSendPci;
 	DWORD dwActiveProtocol;
 	int endtransaction;
+	int allocated;
 	int status;
 
 	status = -1;
 	endtransaction = 0;
+	allocated = ((response != NULL) && (response->bdb_start == NULL));
 
 	/* connect to a reader (even without a card) */
 	dwActiveProtocol = -1;
@@ -350,5 +435,9 @@ err_out:
 			    pcsc_stringify_error(rc));
 		}
 	}
+	if ((status != 0) && allocated && (response->bdb_start != NULL)) {
+		free(response->bdb_start);
+		INIT_BDB(response, NULL, 0);
+	}
 	return (status);
 }
@@ -88,7 +88,9 @@ getReaders(SCARDCONTEXT context, char ***readerPtr, int *count)
 	numReaders = 0;
 	ptr = mszReaders;
 	while (*ptr != '\0') {
-		readers[numReaders] = (char *)malloc(strlen(ptr));
+		readers[numReaders] = (char *)malloc(strlen(ptr) + 1);
+		if (readers[numReaders] == NULL)
+			ALLOC_ERR_OUT("Reader name");
 		strcpy(readers[numReaders], ptr);
 		ptr += strlen(ptr)+1;
 		numReaders++;